@@ -0,0 +1,592 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "layer.h"
+#include "mapped_file.h"
+#include "mlp.h"
+#include "mnist.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "simd.h"
+#include "utils.h"
+
+// Benchmark suite over the kernels, the layers and end-to-end training:
+// Mat2D::dot_product over a sweep of shapes, broadcast elementwise ops,
+// softmax, dense layer forward and backward, MLP::train steps, the csv
+// parser and read_mnist_csv (against the line parser it replaced) and a
+// training epoch over a synthetic MNIST shaped dataset, which is generated
+// locally. Every case reports the median time per iteration and, where they
+// apply, GFLOP/s, GB/s (a lower bound of the memory traffic) and
+// samples/sec.
+// --json writes the results to a file to track them across commits.
+
+// One measured case. flops, bytes and samples are the work of a single
+// iteration, zero where a rate makes no sense. memory is what the case
+// holds, e.g. the buffers of a training step, zero if not reported.
+struct Result {
+  std::string group;
+  std::string name;
+  double seconds;
+  size_t iterations;
+  double flops;
+  double bytes;
+  double samples;
+  double memory;
+};
+
+struct Options {
+  std::string filter;
+  std::string json_path;
+  // time spent per case, split across the repetitions
+  double min_seconds = 0.5;
+  // samples of the synthetic dataset
+  size_t num_samples = 10000;
+};
+
+class Suite {
+ public:
+  explicit Suite(const Options& options) : options(options) {}
+
+  // Times run and records it, if group/name passes the filter. The median
+  // over repetitions of enough iterations each is robust against a noisy
+  // machine.
+  template <typename F>
+  void run(const std::string& group, const std::string& name, F&& run,
+           const double flops, const double bytes, const double samples,
+           const double memory = 0.0) {
+    if ((group + "/" + name).find(options.filter) == std::string::npos) {
+      return;
+    }
+    constexpr size_t REPETITIONS = 5;
+    const double rep_seconds = options.min_seconds / REPETITIONS;
+    // the first call warms up the caches, buffers and the thread pool
+    const double first = seconds([&]() { run(); }, 1);
+    size_t iterations = 1;
+    if (first < rep_seconds) {
+      const size_t estimate = static_cast<size_t>(
+          rep_seconds / std::max(first, 1.e-9));
+      iterations = std::max<size_t>(
+          1, static_cast<size_t>(
+                 rep_seconds / (seconds([&]() { run(); }, estimate) /
+                                static_cast<double>(estimate))));
+    }
+    std::vector<double> times;
+    for (size_t rep = 0; rep < REPETITIONS; ++rep) {
+      times.push_back(seconds([&]() { run(); }, iterations) /
+                      static_cast<double>(iterations));
+    }
+    std::sort(times.begin(), times.end());
+    results.push_back({group, name, times[REPETITIONS / 2], iterations, flops,
+                       bytes, samples, memory});
+    print(results.back());
+  }
+
+  void write_json(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file) {
+      throw std::runtime_error("bench: Cannot write " + filename + ".");
+    }
+    file << std::setprecision(6) << "{\n  \"context\": {\"isa\": \""
+         << cpu::isa_name(cpu::active_isa())
+         << "\", \"threads\": " << parallel::num_threads()
+         << ", \"min_time_s\": " << options.min_seconds
+         << ", \"synthetic_samples\": " << options.num_samples
+         << "},\n  \"benchmarks\": [";
+    for (size_t idx = 0; idx < results.size(); ++idx) {
+      const auto& result = results[idx];
+      file << (idx == 0 ? "\n" : ",\n") << "    {\"group\": \""
+           << result.group << "\", \"name\": \"" << result.name
+           << "\", \"time_us\": " << 1.e6 * result.seconds
+           << ", \"iterations\": " << result.iterations
+           << ", \"gflops\": " << rate(result.flops * 1.e-9, result.seconds)
+           << ", \"gbytes_per_s\": "
+           << rate(result.bytes * 1.e-9, result.seconds)
+           << ", \"samples_per_s\": " << rate(result.samples, result.seconds)
+           << ", \"memory_mb\": " << rate(result.memory / 1048576.0, 1.0)
+           << "}";
+    }
+    file << "\n  ]\n}\n";
+  }
+
+ private:
+  template <typename F>
+  static double seconds(F&& run, const size_t iterations) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t iteration = 0; iteration < iterations; ++iteration) {
+      run();
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  // value per second as JSON, null where it does not apply
+  static std::string rate(const double value, const double seconds) {
+    if (value <= 0.0) {
+      return "null";
+    }
+    std::ostringstream stream;
+    stream << std::setprecision(6) << value / seconds;
+    return stream.str();
+  }
+
+  static void print(const Result& result) {
+    const auto column = [&](const double value, const int precision) {
+      std::cout << std::setw(12);
+      if (value > 0.0) {
+        std::cout << std::fixed << std::setprecision(precision)
+                  << value / result.seconds;
+      } else {
+        std::cout << "-";
+      }
+    };
+    std::cout << std::left << std::setw(44)
+              << result.group + "/" + result.name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(2)
+              << 1.e6 * result.seconds;
+    column(result.flops * 1.e-9, 2);
+    column(result.bytes * 1.e-9, 2);
+    column(result.samples, 0);
+    std::cout << std::setw(12);
+    if (result.memory > 0.0) {
+      std::cout << std::setprecision(1) << result.memory / 1048576.0;
+    } else {
+      std::cout << "-";
+    }
+    std::cout << std::endl;
+  }
+
+  const Options& options;
+  std::vector<Result> results;
+};
+
+std::string shape_name(const std::vector<size_t>& dims) {
+  std::string name;
+  for (const size_t dim : dims) {
+    name += (name.empty() ? "" : "x") + std::to_string(dim);
+  }
+  return name;
+}
+
+// MNIST shaped samples: every class draws its pixels from a few strokes of
+// its own, so about a fifth of the pixels are ink like in the real images.
+// Written as "label,pixel,...,pixel" lines after a header, like the csv
+// files main reads.
+void write_synthetic_mnist_csv(const std::string& filename,
+                               const size_t num_samples) {
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> coordinate(4, 23);
+  std::uniform_int_distribution<int> intensity(64, 255);
+  std::vector<std::vector<size_t>> strokes(10);
+  for (auto& pixels : strokes) {
+    for (size_t stroke = 0; stroke < 4; ++stroke) {
+      // a thick line between two random points
+      const int x0 = coordinate(generator), y0 = coordinate(generator);
+      const int x1 = coordinate(generator), y1 = coordinate(generator);
+      for (int step = 0; step <= 20; ++step) {
+        const int x = x0 + (x1 - x0) * step / 20;
+        const int y = y0 + (y1 - y0) * step / 20;
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dx = -1; dx <= 1; ++dx) {
+            pixels.push_back(static_cast<size_t>((y + dy) * 28 + x + dx));
+          }
+        }
+      }
+    }
+  }
+  std::ofstream file(filename);
+  file << "label";
+  for (size_t pixel = 0; pixel < 784; ++pixel) {
+    file << "," << pixel / 28 + 1 << "x" << pixel % 28 + 1;
+  }
+  file << "\n";
+  std::vector<int> image(784);
+  for (size_t sample = 0; sample < num_samples; ++sample) {
+    const size_t label = generator() % 10;
+    std::fill(image.begin(), image.end(), 0);
+    for (const size_t pixel : strokes[label]) {
+      image[pixel] = intensity(generator);
+    }
+    file << label;
+    for (const int value : image) {
+      file << "," << value;
+    }
+    file << "\n";
+  }
+}
+
+void bench_gemm(Suite& suite) {
+  const std::vector<std::vector<size_t>> shapes = {
+      {64, 784, 50},    {64, 50, 25},     {64, 25, 10},
+      {1, 784, 50},     {128, 128, 128},  {256, 256, 256},
+      {512, 512, 512},  {1024, 784, 512}};
+  for (const auto& shape : shapes) {
+    const size_t m = shape[0], k = shape[1], n = shape[2];
+    const auto a = Mat2D<float>(m, k, RANDOM_UNIFORM);
+    const auto b = Mat2D<float>(k, n, RANDOM_UNIFORM);
+    Mat2D<float> c(m, n);
+    suite.run(
+        "gemm", "dot_product " + shape_name(shape),
+        [&]() { a.dot_product_into(b, c); }, 2.0 * m * n * k,
+        4.0 * (m * k + k * n + m * n), 0.0);
+  }
+}
+
+void bench_elementwise(Suite& suite) {
+  for (const auto& [rows, cols] : std::vector<std::pair<size_t, size_t>>{
+           {64, 784}, {1024, 1024}}) {
+    const auto a = Mat2D<float>(rows, cols, RANDOM_UNIFORM);
+    const auto row = Mat2D<float>(1, cols, RANDOM_UNIFORM);
+    const auto column = Mat2D<float>(rows, 1, RANDOM_UNIFORM);
+    Mat2D<float> out(rows, cols);
+    const std::string shape = shape_name({rows, cols});
+    // read a, write out
+    const double bytes = 8.0 * rows * cols;
+    suite.run(
+        "elementwise", "add row " + shape,
+        [&]() { a.add_into(row, out); }, 1.0 * rows * cols, bytes, 0.0);
+    suite.run(
+        "elementwise", "minus column " + shape,
+        [&]() { a.minus_into(column, out); }, 1.0 * rows * cols, bytes, 0.0);
+    suite.run(
+        "elementwise", "hadamard row " + shape,
+        [&]() { a.hadamard_product_into(row, out); }, 1.0 * rows * cols,
+        bytes, 0.0);
+    suite.run(
+        "elementwise", "add " + shape, [&]() { a.add_into(a, out); },
+        1.0 * rows * cols, bytes, 0.0);
+  }
+}
+
+void bench_softmax(Suite& suite) {
+  for (const auto& [rows, cols] : std::vector<std::pair<size_t, size_t>>{
+           {64, 10}, {1024, 1000}}) {
+    const auto logits = Mat2D<float>(rows, cols, RANDOM_UNIFORM);
+    Mat2D<float> probs(rows, cols);
+    suite.run(
+        "softmax", "softmax " + shape_name({rows, cols}),
+        [&]() { softmax_into(logits, probs); }, 0.0, 8.0 * rows * cols,
+        1.0 * rows);
+  }
+}
+
+void bench_layers(Suite& suite) {
+  const size_t batch = 64;
+  for (const auto& [inputs, neurons] : std::vector<std::pair<size_t, size_t>>{
+           {784, 50}, {50, 25}, {1024, 1024}}) {
+    const std::string shape = shape_name({batch, inputs, neurons});
+    const double flops = 2.0 * batch * inputs * neurons;
+    const double bytes = 4.0 * (batch * inputs + inputs * neurons +
+                                batch * neurons);
+    const auto input = Mat2D<float>(batch, inputs, RANDOM_UNIFORM);
+    const auto gradients_output = Mat2D<float>(batch, neurons, RANDOM_UNIFORM);
+    Mat2D<float> output(0, 0);
+    Mat2D<float> gradients_input(0, 0);
+
+    std::cout.setstate(std::ios::failbit);
+    DenseLayer dense(inputs, neurons);
+    FusedDenseLayer fused(inputs, neurons, simd::Activation::LEAKY_RELU,
+                          MLP::leaky_relu_alpha);
+    std::cout.clear();
+    suite.run(
+        "layer", "DenseLayer::forward " + shape,
+        [&]() { dense.forward_into(input, output); }, flops, bytes,
+        1.0 * batch);
+    // the input and weight gradient GEMMs
+    suite.run(
+        "layer", "DenseLayer::backward " + shape,
+        [&]() {
+          dense.compute_gradients_into(input, gradients_output,
+                                       gradients_input);
+        },
+        2.0 * flops, 2.0 * bytes, 1.0 * batch);
+    suite.run(
+        "layer", "FusedDenseLayer::forward " + shape,
+        [&]() { fused.forward_into(input, output); }, flops, bytes,
+        1.0 * batch);
+    fused.forward_into(input, output);
+    suite.run(
+        "layer", "FusedDenseLayer::backward " + shape,
+        [&]() {
+          fused.compute_gradients_with_output_into(
+              input, output, gradients_output, gradients_input);
+        },
+        2.0 * flops, 2.0 * bytes, 1.0 * batch);
+  }
+}
+
+// Floating point operations of forward and backward of one training step:
+// three GEMMs per layer (forward, input and weight gradients) at two flops
+// per multiply-add.
+double train_flops(const std::vector<size_t>& sizes, const size_t batch) {
+  double flops = 0.0;
+  for (size_t idx = 0; idx + 1 < sizes.size(); ++idx) {
+    flops += 6.0 * batch * sizes[idx] * sizes[idx + 1];
+  }
+  return flops;
+}
+
+void bench_train(Suite& suite, const MnistDataset& dataset) {
+  const size_t batch = 64;
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  Mat2D<float> images(batch, 784);
+  Mat2D<int32_t> labels(batch, 1);
+  std::vector<size_t> indices(batch);
+  for (size_t idx = 0; idx < batch; ++idx) {
+    indices[idx] = idx;
+  }
+  dataset.fill_batch(indices.data(), batch, images, labels);
+  const auto dense_images = Mat2D<float>(batch, 784, RANDOM_UNIFORM);
+
+  for (const auto& hidden : std::vector<std::vector<size_t>>{
+           {50, 25}, {512, 256}}) {
+    std::vector<size_t> sizes = {784};
+    sizes.insert(sizes.end(), hidden.begin(), hidden.end());
+    sizes.push_back(10);
+    const std::string shape = shape_name(sizes);
+    std::cout.setstate(std::ios::failbit);
+    auto mlp = MLP(hidden, 784, 10);
+    std::cout.clear();
+    AdamOptimizer optimizer(0.001f);
+    // the MNIST like batch takes the sparse input path, the random one not
+    suite.run(
+        "train", "MLP::train " + shape + " mnist",
+        [&]() { mlp.train(images, labels, loss_obj, optimizer); },
+        train_flops(sizes, batch), 0.0, 1.0 * batch);
+    suite.run(
+        "train", "MLP::train " + shape + " dense",
+        [&]() { mlp.train(dense_images, labels, loss_obj, optimizer); },
+        train_flops(sizes, batch), 0.0, 1.0 * batch);
+  }
+}
+
+// A deep network with and without gradient checkpointing, the memory column
+// is the peak of the buffers the training step keeps (MLP::activation_bytes).
+void bench_checkpointing(Suite& suite) {
+  const size_t batch = 256;
+  const std::vector<size_t> hidden(8, 512);
+  std::vector<size_t> sizes = {784};
+  sizes.insert(sizes.end(), hidden.begin(), hidden.end());
+  sizes.push_back(10);
+  const auto input = Mat2D<float>(batch, 784, RANDOM_UNIFORM);
+  Mat2D<int32_t> labels(batch, 1);
+  for (size_t row = 0; row < batch; ++row) {
+    labels(row, 0) = static_cast<int32_t>(row % 10);
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  for (const size_t interval : {0, 2, 3}) {
+    std::cout.setstate(std::ios::failbit);
+    auto mlp = MLP(hidden, 784, 10);
+    std::cout.clear();
+    mlp.set_checkpoint_interval(interval);
+    AdamOptimizer optimizer(0.001f);
+    // the first step sizes the buffers
+    mlp.train(input, labels, loss_obj, optimizer);
+    suite.run(
+        "checkpoint",
+        "MLP::train 8x512 batch 256 interval " + std::to_string(interval),
+        [&]() { mlp.train(input, labels, loss_obj, optimizer); },
+        train_flops(sizes, batch), 0.0, 1.0 * batch,
+        static_cast<double>(mlp.activation_bytes()));
+  }
+}
+
+void bench_micro_batches(Suite& suite) {
+  const size_t batch = 1024;
+  const std::vector<size_t> sizes = {784, 512, 256, 10};
+  const auto input = Mat2D<float>(batch, 784, RANDOM_UNIFORM);
+  Mat2D<int32_t> labels(batch, 1);
+  for (size_t row = 0; row < batch; ++row) {
+    labels(row, 0) = static_cast<int32_t>(row % 10);
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  for (const size_t micro_batch_size : {0, 256, 64}) {
+    std::cout.setstate(std::ios::failbit);
+    auto mlp = MLP({512, 256}, 784, 10);
+    std::cout.clear();
+    mlp.set_micro_batch_size(micro_batch_size);
+    AdamOptimizer optimizer(0.001f);
+    // the first step sizes the buffers
+    mlp.train(input, labels, loss_obj, optimizer);
+    suite.run(
+        "micro_batch",
+        "MLP::train batch 1024 micro-batch " +
+            std::to_string(micro_batch_size),
+        [&]() { mlp.train(input, labels, loss_obj, optimizer); },
+        train_flops(sizes, batch), 0.0, 1.0 * batch,
+        static_cast<double>(mlp.activation_bytes()));
+  }
+}
+
+// The line by line parser read_mnist_csv had before the chunked one
+// (std::getline, std::stringstream and std::stof per value), to compare
+// against. Unlike the original it skips the header line and does not read
+// past the 784 pixels.
+std::vector<std::pair<Mat2D<float>, Mat2D<float>>> read_mnist_csv_by_line(
+    const std::string& csv_filename, const size_t batch_size) {
+  std::vector<std::pair<Mat2D<float>, Mat2D<float>>> dataset;
+  std::ifstream ds_file(csv_filename);
+  std::string line;
+  std::getline(ds_file, line);
+  size_t batch_idx = 0;
+  Mat2D<float> flat_images(batch_size, 784, Initializer::ZEROS);
+  Mat2D<float> labels_one_hot(batch_size, 10, Initializer::ZEROS);
+  while (std::getline(ds_file, line)) {
+    std::vector<std::string> line_split;
+    std::stringstream ss(line);
+    while (ss.good()) {
+      std::string substr;
+      std::getline(ss, substr, ',');
+      line_split.push_back(substr);
+    }
+    const auto label = static_cast<size_t>(std::stoul(line_split[0]));
+    labels_one_hot(batch_idx, label) = 1.0;
+    std::vector<float> image_vector(line_split.size() - 1);
+    std::transform(line_split.begin() + 1, line_split.end(),
+                   image_vector.begin(),
+                   [](const std::string& val) { return std::stof(val); });
+    for (size_t pixel_idx = 0; pixel_idx < 784; ++pixel_idx) {
+      flat_images(batch_idx, pixel_idx) = image_vector[pixel_idx] / 256.0 - 0.5;
+    }
+    if (++batch_idx == batch_size) {
+      dataset.emplace_back(flat_images, labels_one_hot);
+      flat_images = Mat2D<float>(batch_size, 784, Initializer::ZEROS);
+      labels_one_hot = Mat2D<float>(batch_size, 10, Initializer::ZEROS);
+      batch_idx = 0;
+    }
+  }
+  return dataset;
+}
+
+// simd::parse_csv_bytes times the parser alone on one thread, into rows
+// allocated beforehand. write_mnist_binary and read_mnist_csv both parse the
+// whole csv with it on every run, the first to the binary cache and the
+// second to batches. The line parser times the same file with the parser
+// read_mnist_csv replaced.
+void bench_mnist(Suite& suite, const std::string& csv_filename,
+                 const size_t num_samples) {
+  const double csv_bytes =
+      static_cast<double>(std::filesystem::file_size(csv_filename));
+  {
+    constexpr size_t COLUMNS = 1 + 784;
+    const MappedFile file(csv_filename);
+    std::vector<uint8_t> rows((file.size() / (2 * COLUMNS - 1) + 1) *
+                              COLUMNS);
+    suite.run(
+        "mnist", "simd::parse_csv_bytes",
+        [&]() {
+          size_t num_rows = 0;
+          if (!simd::parse_csv_bytes(
+                  file.size(), reinterpret_cast<const char*>(file.data()),
+                  COLUMNS, rows.data(), &num_rows)) {
+            throw std::runtime_error("bench: Invalid csv " + csv_filename +
+                                     ".");
+          }
+        },
+        0.0, csv_bytes, 1.0 * num_samples);
+  }
+  const std::string binary_filename = csv_filename + ".parsed.bin";
+  suite.run(
+      "mnist", "write_mnist_binary",
+      [&]() { write_mnist_binary(csv_filename, binary_filename); }, 0.0,
+      csv_bytes, 1.0 * num_samples);
+  std::remove(binary_filename.c_str());
+  // without its "Loading" messages
+  suite.run(
+      "mnist", "read_mnist_csv",
+      [&]() {
+        std::cout.setstate(std::ios::failbit);
+        read_mnist_csv(csv_filename, 64, -1);
+        std::cout.clear();
+      },
+      0.0, csv_bytes, 1.0 * num_samples);
+  suite.run(
+      "mnist", "read_mnist_csv line parser",
+      [&]() { read_mnist_csv_by_line(csv_filename, 64); }, 0.0, csv_bytes,
+      1.0 * num_samples);
+}
+
+// One epoch like main: shuffled batches from the pipeline, Adam, the
+// network 784-50-25-10.
+void bench_epoch(Suite& suite, const MnistDataset& dataset) {
+  const size_t batch = 64;
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  std::cout.setstate(std::ios::failbit);
+  auto mlp = MLP({50, 25}, 784, 10);
+  std::cout.clear();
+  AdamOptimizer optimizer(0.001f);
+  DataPipeline pipeline(dataset, batch, /*num_buffers=*/4);
+  const size_t samples = pipeline.batches_per_epoch() * batch;
+  suite.run(
+      "end_to_end", "epoch 784x50x25x10 synthetic",
+      [&]() {
+        while (const Batch* next = pipeline.next()) {
+          mlp.train(next->images, next->labels, loss_obj, optimizer);
+        }
+      },
+      train_flops({784, 50, 25, 10}, samples), 0.0, 1.0 * samples);
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (int arg = 1; arg < argc; ++arg) {
+    const std::string flag = argv[arg];
+    if (arg + 1 < argc && flag == "--filter") {
+      options.filter = argv[++arg];
+    } else if (arg + 1 < argc && flag == "--json") {
+      options.json_path = argv[++arg];
+    } else if (arg + 1 < argc && flag == "--min-time") {
+      options.min_seconds = std::stod(argv[++arg]);
+    } else if (arg + 1 < argc && flag == "--samples") {
+      options.num_samples = std::stoul(argv[++arg]);
+    } else {
+      std::cout << "Usage:" << std::endl
+                << "./bench [--filter text] [--json path/to/results.json] "
+                   "[--min-time seconds] [--samples num_samples]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  const std::string csv_filename =
+      (std::filesystem::temp_directory_path() / "bench_mnist.csv").string();
+  write_synthetic_mnist_csv(csv_filename, options.num_samples);
+  const auto dataset = open_mnist(csv_filename);
+
+  std::cout << "ISA: " << cpu::isa_name(cpu::active_isa())
+            << ", threads: " << parallel::num_threads() << std::endl;
+  std::cout << std::left << std::setw(44) << "benchmark" << std::right
+            << std::setw(12) << "time us" << std::setw(12) << "GFLOP/s"
+            << std::setw(12) << "GB/s" << std::setw(12) << "samples/s"
+            << std::setw(12) << "memory MB" << std::endl;
+  Suite suite(options);
+  bench_gemm(suite);
+  bench_elementwise(suite);
+  bench_softmax(suite);
+  bench_layers(suite);
+  bench_train(suite, dataset);
+  bench_checkpointing(suite);
+  bench_micro_batches(suite);
+  bench_mnist(suite, csv_filename, options.num_samples);
+  bench_epoch(suite, dataset);
+
+  std::remove(csv_filename.c_str());
+  std::remove((csv_filename + ".bin").c_str());
+  if (!options.json_path.empty()) {
+    suite.write_json(options.json_path);
+    std::cout << "Results written to " << options.json_path << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpu.h"
+#include "inference_session.h"
+#include "mlp.h"
+#include "model_file.h"
+#include "parallel.h"
+#include "quantization.h"
+#include "static_mlp.h"
+#include "utils.h"
+
+// Inference latency of the network of main (784-50-25-10) at small batch
+// sizes, for MLP::forward, an InferenceSession of the float and of the int8
+// quantized model and the compile time shaped StaticMLP with the same
+// weights, followed by single sample latency with several threads serving
+// from one shared model and the cold start from a model file. Reports the
+// median and 99th percentile over many single calls.
+struct Latency {
+  double p50;
+  double p99;
+};
+
+template <typename F>
+Latency latency_us(F&& run, const size_t num_runs) {
+  for (size_t run_idx = 0; run_idx < num_runs / 10; ++run_idx) {
+    run();
+  }
+  std::vector<double> latencies(num_runs);
+  for (auto& latency : latencies) {
+    const auto start = std::chrono::steady_clock::now();
+    run();
+    const std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    latency = elapsed.count();
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return {latencies[num_runs / 2], latencies[num_runs * 99 / 100]};
+}
+
+void print(const std::string& name, const Latency& latency) {
+  std::cout << "  " << std::left << std::setw(18) << name << std::right
+            << std::fixed << std::setprecision(2) << std::setw(9)
+            << latency.p50 << std::setw(9) << latency.p99 << std::endl;
+}
+
+template <size_t Batch, typename Network>
+void report(const MLP& mlp, const Network& network,
+            const QuantizedMLP& quantized, const size_t num_runs) {
+  const auto input = Mat2D<float>(Batch, 784, RANDOM_UNIFORM);
+  std::vector<float> logits(Batch * 10);
+  InferenceSession session(mlp, Batch);
+  InferenceSession quantized_session(quantized, Batch);
+  // keeps the calls from being optimized away
+  volatile float sink = 0.0f;
+  std::cout << "Batch " << Batch << "           p50 us   p99 us" << std::endl;
+  print("MLP::forward",
+        latency_us([&]() { sink = mlp.forward(input).back()(0, 0); },
+                   num_runs));
+  print("InferenceSession",
+        latency_us([&]() { sink = session.logits(input)(0, 0); }, num_runs));
+  print("Session int8",
+        latency_us([&]() { sink = quantized_session.logits(input)(0, 0); },
+                   num_runs));
+  print("StaticMLP", latency_us(
+                         [&]() {
+                           network.template forward<Batch>(
+                               input.matrix_data.data(), logits.data());
+                           sink = logits[0];
+                         },
+                         num_runs));
+}
+
+// Every thread scores single samples through its own session.
+void report_concurrent(const MLP& mlp, const size_t num_threads,
+                       const size_t num_runs) {
+  const auto input = Mat2D<float>(1, 784, RANDOM_UNIFORM);
+  std::vector<Latency> latencies(num_threads);
+  std::vector<std::thread> threads;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t thread = 0; thread < num_threads; ++thread) {
+    threads.emplace_back([&, thread]() {
+      InferenceSession session(mlp);
+      volatile size_t sink = 0;
+      latencies[thread] = latency_us(
+          [&]() { sink = session.predict(input.matrix_data.data()); },
+          num_runs);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  Latency worst{0.0, 0.0};
+  for (const auto& latency : latencies) {
+    worst.p50 = std::max(worst.p50, latency.p50);
+    worst.p99 = std::max(worst.p99, latency.p99);
+  }
+  std::cout << num_threads << " threads, one shared MLP (slowest thread), "
+            << std::setprecision(0)
+            << num_threads * (num_runs + num_runs / 10) / elapsed.count()
+            << " samples/s" << std::endl;
+  print("InferenceSession", worst);
+}
+
+// Time from a model file on disk to the first logits, copying the weights
+// into an MLP (MLP::load) against running them in place from the mapping
+// (ModelFile). The file is in the page cache, as for a restarted process.
+void report_load(const std::vector<size_t>& layer_sizes) {
+  const std::string filename =
+      (std::filesystem::temp_directory_path() / "inference_benchmark.bin")
+          .string();
+  const auto input = Mat2D<float>(1, 784, RANDOM_UNIFORM);
+  const size_t num_runs = 20;
+  volatile float sink = 0.0f;
+  // MLP prints its layers on construction
+  std::cout.setstate(std::ios::failbit);
+  MLP(layer_sizes, 784, 10, RANDOM_UNIFORM, RANDOM_UNIFORM, 1).save(filename);
+  const Latency copied = latency_us(
+      [&]() {
+        const auto mlp = MLP::load(filename);
+        sink = InferenceSession(mlp).logits(input)(0, 0);
+      },
+      num_runs);
+  const Latency mapped = latency_us(
+      [&]() {
+        const ModelFile model(filename);
+        sink = InferenceSession(model).logits(input)(0, 0);
+      },
+      num_runs);
+  std::cout.clear();
+  std::cout << "Load + first sample, 784";
+  for (const size_t size : layer_sizes) {
+    std::cout << "-" << size;
+  }
+  std::cout << "-10 (" << std::filesystem::file_size(filename) / 1024
+            << " KB)" << std::endl;
+  print("MLP::load", copied);
+  print("ModelFile", mapped);
+  std::remove(filename.c_str());
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    std::cout << "Usage:" << std::endl
+              << "./inference_benchmark [num_runs]" << std::endl;
+    return 1;
+  }
+  const size_t num_runs = argc == 2 ? std::stoul(argv[1]) : 20000;
+  // latency of one caller, the pool would only add hand-off overhead
+  parallel::set_num_threads(1);
+  std::cout << "ISA: " << cpu::isa_name(cpu::active_isa()) << std::endl;
+
+  const auto mlp = MLP({50, 25}, /*num_inputs=*/784, /*num_classes=*/10,
+                       RANDOM_UNIFORM, RANDOM_UNIFORM, 1);
+  const auto network = std::make_unique<StaticMLP<784, 50, 25, 10>>(mlp);
+  const QuantizedMLP quantized(mlp, Mat2D<float>(256, 784, RANDOM_UNIFORM));
+  report<1>(mlp, *network, quantized, num_runs);
+  report<8>(mlp, *network, quantized, num_runs);
+  report<32>(mlp, *network, quantized, num_runs);
+  const size_t num_threads =
+      std::max<size_t>(2, std::thread::hardware_concurrency());
+  report_concurrent(mlp, num_threads, num_runs);
+  report_load({50, 25});
+  report_load({2048, 2048});
+  return 0;
+}
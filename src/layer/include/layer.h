@@ -1,7 +1,9 @@
 #pragma once
+#include <memory>
 #include <numeric>
 #include <vector>
 
+#include "sparse.h"
 #include "utils.h"
 
 class Layer {
@@ -10,6 +12,34 @@ class Layer {
   virtual Mat2D<float> backward(const Mat2D<float>& input,
                                 const Mat2D<float>& gradients_output,
                                 float learning_rate) = 0;
+  // Like backward, but only stores the gradients of the trainable variables
+  // (see gradients()) instead of applying them. The default is meant for
+  // layers without trainable variables and calls backward with a learning
+  // rate of 0.
+  virtual Mat2D<float> compute_gradients(const Mat2D<float>& input,
+                                         const Mat2D<float>& gradients_output);
+  // Output parameter versions of forward and compute_gradients, which do not
+  // allocate once output and gradients_input have the memory for the result
+  // (see Mat2D::resize). The defaults call the allocating versions.
+  virtual void forward_into(const Mat2D<float>& input,
+                            Mat2D<float>& output) const;
+  virtual void compute_gradients_into(const Mat2D<float>& input,
+                                      const Mat2D<float>& gradients_output,
+                                      Mat2D<float>& gradients_input);
+  // Like compute_gradients_into, for callers which still hold the output
+  // forward produced for input. Layers which derive their gradients from the
+  // output (see FusedDenseLayer) override this, the default ignores it.
+  virtual void compute_gradients_with_output_into(
+      const Mat2D<float>& input, const Mat2D<float>& output,
+      const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input);
+  // Trainable variables and their gradients from the last compute_gradients
+  // call, in matching order.
+  virtual std::vector<Mat2D<float>*> trainable_variables();
+  virtual std::vector<Mat2D<float>*> gradients();
+  // Plain SGD step with the stored gradients.
+  void apply_gradients(float learning_rate);
+  // Independent copy, e.g. as replica for data parallel training.
+  virtual std::unique_ptr<Layer> clone() const = 0;
   virtual void print_trainable_variables() const = 0;
   Layer();
   virtual ~Layer() = 0;
@@ -17,6 +47,20 @@ class Layer {
  private:
 };
 
+// Read-only weights of a dense layer and the activation that follows it, e.g.
+// of an MLP or a memory mapped model file (see model_file.h). Both views are
+// contiguous.
+struct DenseLayerView {
+  MatView<const float> weights;  // inputs x neurons
+  MatView<const float> biases;   // 1 x neurons
+  simd::Activation activation;
+  float alpha;  // slope of LEAKY_RELU
+};
+
+// Format of the weights a DenseLayer multiplies with, see
+// DenseLayer::set_precision and MLP::set_precision.
+enum class Precision { FP32, BF16, FP16 };
+
 class DenseLayer : public Layer {
  public:
   DenseLayer(size_t number_of_inputs, size_t number_of_neurons,
@@ -27,12 +71,157 @@ class DenseLayer : public Layer {
   Mat2D<float> backward(const Mat2D<float>& input,
                         const Mat2D<float>& gradients_output,
                         const float learning_rate) override;
+  Mat2D<float> compute_gradients(
+      const Mat2D<float>& input,
+      const Mat2D<float>& gradients_output) override;
+  void forward_into(const Mat2D<float>& input,
+                    Mat2D<float>& output) const override;
+  void compute_gradients_into(const Mat2D<float>& input,
+                              const Mat2D<float>& gradients_output,
+                              Mat2D<float>& gradients_input) override;
+  std::vector<Mat2D<float>*> trainable_variables() override;
+  std::vector<Mat2D<float>*> gradients() override;
+  std::unique_ptr<Layer> clone() const override;
   void print_trainable_variables() const override;
+  // Valid as long as the layer is alive and not resized.
+  virtual DenseLayerView view() const;
+
+  // Mixed precision: with BF16 or FP16 forward and backward multiply with a
+  // 16 bit copy of the weights (see half.h), half the memory traffic of the
+  // float ones, while the sums stay float. weights remains the float master
+  // copy which optimizers update, sync_weights() rounds it into the 16 bit
+  // copy again afterwards. FP32, the default, drops the copy.
+  void set_precision(Precision precision);
+  Precision get_precision() const;
+  void sync_weights();
+  // While set, the gradient computations add to grad_weights and
+  // grad_biases instead of overwriting them: the weight gradient GEMM runs
+  // with beta = 1 and the bias sums continue from the current values.
+  // MLP::train accumulates the micro-batches of a batch this way.
+  void set_accumulate_gradients(bool accumulate);
+  // compute_gradients_with_output_into for callers which are done with
+  // gradients_output: the pre-activation gradients overwrite it instead of
+  // a scratch buffer of the layer, so the layers of a network do not each
+  // keep a batch sized buffer. MLP::train uses it.
+  void compute_gradients_in_place(MatView<const float> input,
+                                  const Mat2D<float>& output,
+                                  Mat2D<float>& gradients_output,
+                                  Mat2D<float>& gradients_input);
+  // forward_into and compute_gradients_with_output_into for an input and
+  // gradients_output given as contiguous views, e.g. row slices of a batch,
+  // which the GEMMs read in place instead of a copy. A FusedDenseLayer
+  // applies its activation. MLP::train_data_parallel passes its shards.
+  void forward_view_into(MatView<const float> input,
+                         Mat2D<float>& output) const;
+  void compute_gradients_view_into(MatView<const float> input,
+                                   const Mat2D<float>& output,
+                                   MatView<const float> gradients_output,
+                                   Mat2D<float>& gradients_input);
+  // forward_into and compute_gradients_with_output_into for an input and
+  // output stored in 16 bits, Half being bfloat16 or float16. It must be the
+  // format of the weights, or they must be FP32. output is only read for an
+  // activation other than NONE.
+  template <typename Half>
+  void forward_half_into(const Mat2D<Half>& input,
+                         Mat2D<float>& output) const;
+  template <typename Half>
+  void compute_gradients_half_into(const Mat2D<Half>& input,
+                                   const Mat2D<Half>& output,
+                                   const Mat2D<float>& gradients_output,
+                                   Mat2D<float>& gradients_input);
+
+  // Sparse input path, for the first layer of a network whose input is
+  // mostly background, e.g. MNIST (see sparse.h). Forward and the weight
+  // gradients only multiply with the stored entries, the background is
+  // folded into the bias resp. added to the weight gradients. The input
+  // gradient is not computed, nothing precedes the first layer.
+  // input_transposed is the transpose of the input of the forward pass.
+  // FP32 precision only.
+  void forward_sparse_into(const CsrMatrix& input, Mat2D<float>& output);
+  void compute_gradients_sparse(const CsrMatrix& input_transposed,
+                                const Mat2D<float>& output,
+                                const Mat2D<float>& gradients_output);
 
   Mat2D<float> weights;
   Mat2D<float> biases;
+  Mat2D<float> grad_weights;
+  Mat2D<float> grad_biases;
+
+ protected:
+  // Calls f with the weights to multiply with, weights or the 16 bit copy.
+  template <typename F>
+  void with_weights(F&& f) const;
+  // dL/dX = dL/dZ * W^T and dL/dW = X^T * dL/dZ (added to dL/dW while
+  // accumulating), X stored as float or in 16 bits
+  template <typename In>
+  void multiply_gradients(MatView<const In> input,
+                          const Mat2D<float>& pre_activation_gradients,
+                          Mat2D<float>& gradients_input);
+  // the bias gradient, the column sums of dL/dZ
+  void sum_bias_gradients(const Mat2D<float>& pre_activation_gradients);
+
+  // scratch of the gradient computation
+  Mat2D<float> pre_activation_gradients = Mat2D<float>(0, 0);
+  // scratch of the sparse path, the bias resp. weight gradient row the
+  // background contributes
+  Mat2D<float> background_row = Mat2D<float>(0, 0);
+  bool accumulate_gradients = false;
+
+ private:
+  Precision precision = Precision::FP32;
+  // the 16 bit copy of weights for BF16 resp. FP16, empty otherwise
+  Mat2D<bfloat16> bf16_weights = Mat2D<bfloat16>(0, 0);
+  Mat2D<float16> fp16_weights = Mat2D<float16>(0, 0);
+};
+
+// A DenseLayer and an activation in one, computing the same as a DenseLayer
+// followed by a LeakyRELUActivationLayer or SigmoidActivationLayer. Bias and
+// activation are applied in the GEMM epilogue (gemm::matmul_bias_activation),
+// so the pre-activation values never reach memory. The backward pass derives
+// the activation gradient from the layer output and sums up the bias gradient
+// in the same sweep (simd::activation_backward). MLP builds its hidden layers
+// this way.
+class FusedDenseLayer : public DenseLayer {
+ public:
+  // alpha is the slope of LEAKY_RELU and must not be negative.
+  FusedDenseLayer(size_t number_of_inputs, size_t number_of_neurons,
+                  simd::Activation activation, float alpha = 0.0f,
+                  Initializer weight_init = RANDOM_UNIFORM,
+                  Initializer bias_init = ZEROS);
+  ~FusedDenseLayer() override;
+  void forward_into(const Mat2D<float>& input,
+                    Mat2D<float>& output) const override;
+  // Runs the forward pass again to get the output.
+  void compute_gradients_into(const Mat2D<float>& input,
+                              const Mat2D<float>& gradients_output,
+                              Mat2D<float>& gradients_input) override;
+  void compute_gradients_with_output_into(
+      const Mat2D<float>& input, const Mat2D<float>& output,
+      const Mat2D<float>& gradients_output,
+      Mat2D<float>& gradients_input) override;
+  std::unique_ptr<Layer> clone() const override;
+  DenseLayerView view() const override;
+
+  simd::Activation activation;
+  float alpha;
 
  private:
+  // scratch of the gradient computation
+  Mat2D<float> output;
+};
+
+// One bit per element of a matrix, set where it is positive. Activation
+// layers keep it for the backward pass instead of their float input, 1/32 of
+// the memory, see LeakyRELUActivationLayer.
+struct PositiveMask {
+  size_t rows = 0;
+  size_t cols = 0;
+  std::vector<uint64_t> bits;
+
+  void assign(const Mat2D<float>& matrix);
+  bool operator[](const size_t idx) const {
+    return (this->bits[idx / 64] >> (idx % 64)) & 1u;
+  }
 };
 
 class LeakyRELUActivationLayer : public Layer {
@@ -43,6 +232,19 @@ class LeakyRELUActivationLayer : public Layer {
   Mat2D<float> backward(const Mat2D<float>& input,
                         const Mat2D<float>& gradients_output,
                         const float learning_rate) override;
+  void forward_into(const Mat2D<float>& input,
+                    Mat2D<float>& output) const override;
+  void compute_gradients_into(const Mat2D<float>& input,
+                              const Mat2D<float>& gradients_output,
+                              Mat2D<float>& gradients_input) override;
+  // forward_into which also records where the input is positive, all the
+  // backward pass needs: the derivative is 1 there and alpha elsewhere.
+  void forward_into(const Mat2D<float>& input, Mat2D<float>& output,
+                    PositiveMask& input_mask) const;
+  void compute_gradients_from_mask_into(const PositiveMask& input_mask,
+                                        const Mat2D<float>& gradients_output,
+                                        Mat2D<float>& gradients_input) const;
+  std::unique_ptr<Layer> clone() const override;
   void print_trainable_variables() const override;
   float alpha = 0.0;
 
@@ -57,6 +259,12 @@ class SigmoidActivationLayer : public Layer {
   Mat2D<float> backward(const Mat2D<float>& input,
                         const Mat2D<float>& gradients_output,
                         const float learning_rate) override;
+  void forward_into(const Mat2D<float>& input,
+                    Mat2D<float>& output) const override;
+  void compute_gradients_into(const Mat2D<float>& input,
+                              const Mat2D<float>& gradients_output,
+                              Mat2D<float>& gradients_input) override;
+  std::unique_ptr<Layer> clone() const override;
   void print_trainable_variables() const override;
 
  private:
@@ -70,6 +278,7 @@ class SoftmaxActivationLayer : public Layer {
   Mat2D<float> backward(const Mat2D<float>& input,
                         const Mat2D<float>& gradients_output,
                         const float learning_rate) override;
+  std::unique_ptr<Layer> clone() const override;
   void print_trainable_variables() const override;
 
  private:
@@ -81,6 +290,30 @@ class Loss {
                             const Mat2D<float>& labels) const = 0;
   virtual Mat2D<float> loss_grad(const Mat2D<float>& predictions,
                                  const Mat2D<float>& labels) const = 0;
+  // Output parameter versions, see Layer::forward_into. The defaults call
+  // the allocating versions.
+  virtual void loss_into(const Mat2D<float>& predictions,
+                         const Mat2D<float>& labels, Mat2D<float>& loss) const;
+  virtual void loss_grad_into(const Mat2D<float>& predictions,
+                              const Mat2D<float>& labels,
+                              Mat2D<float>& gradient) const;
+  // Loss and gradient in one call, for losses which share work between the
+  // two. The default calls loss_into and loss_grad_into.
+  virtual void loss_and_grad_into(const Mat2D<float>& predictions,
+                                  const Mat2D<float>& labels,
+                                  Mat2D<float>& loss,
+                                  Mat2D<float>& gradient) const;
+  // Same with the labels given as one class index per row (batch x 1)
+  // instead of one hot rows. The default expands them with one_hot, which
+  // allocates on every call, the losses in this file override it.
+  virtual void loss_and_grad_into(const Mat2D<float>& predictions,
+                                  const Mat2D<int32_t>& classes,
+                                  Mat2D<float>& loss,
+                                  Mat2D<float>& gradient) const;
+  // Whether the gradient is the one of the mean over the batch rows rather
+  // than of their sum. Gradient accumulation weights micro-batches by their
+  // share of the batch for such losses (see MLP::set_micro_batch_size).
+  virtual bool mean_over_batch() const;
   Loss();
   ~Loss();
 
@@ -93,6 +326,16 @@ class MSELoss : public Loss {
                     const Mat2D<float>& labels) const override;
   Mat2D<float> loss_grad(const Mat2D<float>& predictions,
                          const Mat2D<float>& labels) const override;
+  void loss_into(const Mat2D<float>& predictions, const Mat2D<float>& labels,
+                 Mat2D<float>& loss) const override;
+  void loss_grad_into(const Mat2D<float>& predictions,
+                      const Mat2D<float>& labels,
+                      Mat2D<float>& gradient) const override;
+  using Loss::loss_and_grad_into;
+  // Reads the classes in place instead of expanding them to one hot rows.
+  void loss_and_grad_into(const Mat2D<float>& predictions,
+                          const Mat2D<int32_t>& classes, Mat2D<float>& loss,
+                          Mat2D<float>& gradient) const override;
   MSELoss();
   ~MSELoss();
 
@@ -105,10 +348,27 @@ class SoftmaxCrossEntropyWithLogitsLoss : public Loss {
                     const Mat2D<float>& labels) const;
   Mat2D<float> loss_grad(const Mat2D<float>& predictions,
                          const Mat2D<float>& labels) const;
+  void loss_into(const Mat2D<float>& predictions, const Mat2D<float>& labels,
+                 Mat2D<float>& loss) const override;
+  void loss_grad_into(const Mat2D<float>& predictions,
+                      const Mat2D<float>& labels,
+                      Mat2D<float>& gradient) const override;
+  // One pass over the logits computes both, see simd::softmax_cross_entropy.
+  void loss_and_grad_into(const Mat2D<float>& predictions,
+                          const Mat2D<float>& labels, Mat2D<float>& loss,
+                          Mat2D<float>& gradient) const override;
+  void loss_and_grad_into(const Mat2D<float>& predictions,
+                          const Mat2D<int32_t>& classes, Mat2D<float>& loss,
+                          Mat2D<float>& gradient) const override;
+  bool mean_over_batch() const override;
   SoftmaxCrossEntropyWithLogitsLoss();
   ~SoftmaxCrossEntropyWithLogitsLoss();
 
  private:
 };
 
-Mat2D<float> softmax(const Mat2D<float>& logits);
\ No newline at end of file
+Mat2D<float> softmax(const Mat2D<float>& logits);
+// probs may be logits.
+void softmax_into(const Mat2D<float>& logits, Mat2D<float>& probs);
+// One hot rows (batch x num_classes) of class indices (batch x 1).
+Mat2D<float> one_hot(const Mat2D<int32_t>& classes, const size_t num_classes);
\ No newline at end of file
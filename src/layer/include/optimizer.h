@@ -0,0 +1,80 @@
+#pragma once
+#include <vector>
+
+#include "utils.h"
+
+// Updates trainable variables from their gradients, see
+// Layer::trainable_variables and Layer::gradients. step() must be called with
+// the same variables in the same order every time, since optimizers with
+// state keep one buffer per variable. The updates run in place through the
+// fused simd::update kernel and allocate nothing after the first step.
+class Optimizer {
+ public:
+  virtual void step(const std::vector<Mat2D<float>*>& variables,
+                    const std::vector<Mat2D<float>*>& gradients) = 0;
+  // e.g. for learning rate decay between epochs
+  void set_learning_rate(const float learning_rate);
+  float get_learning_rate() const;
+  Optimizer(const float learning_rate);
+  virtual ~Optimizer() = 0;
+
+ protected:
+  // Runs the update on every variable. num_state_buffers zero initialized
+  // buffers per variable are allocated on the first call.
+  void apply(const simd::UpdateParams<float>& params,
+             const std::vector<Mat2D<float>*>& variables,
+             const std::vector<Mat2D<float>*>& gradients,
+             const size_t num_state_buffers);
+  float learning_rate;
+
+ private:
+  std::vector<Mat2D<float>> state_0;
+  std::vector<Mat2D<float>> state_1;
+};
+
+// Stochastic gradient descent with optional (Nesterov) momentum and
+// decoupled weight decay.
+class SGDOptimizer : public Optimizer {
+ public:
+  SGDOptimizer(const float learning_rate, const float momentum = 0.0,
+               const bool nesterov = false, const float weight_decay = 0.0);
+  ~SGDOptimizer() override;
+  void step(const std::vector<Mat2D<float>*>& variables,
+            const std::vector<Mat2D<float>*>& gradients) override;
+  float momentum = 0.0;
+  bool nesterov = false;
+  float weight_decay = 0.0;
+
+ private:
+};
+
+// Adam, see Kingma & Ba, "Adam: A Method for Stochastic Optimization".
+class AdamOptimizer : public Optimizer {
+ public:
+  AdamOptimizer(const float learning_rate = 0.001, const float beta_1 = 0.9,
+                const float beta_2 = 0.999, const float epsilon = 1e-8);
+  ~AdamOptimizer() override;
+  void step(const std::vector<Mat2D<float>*>& variables,
+            const std::vector<Mat2D<float>*>& gradients) override;
+  float beta_1 = 0.9;
+  float beta_2 = 0.999;
+  float epsilon = 1e-8;
+
+ protected:
+  float weight_decay = 0.0;
+
+ private:
+  size_t num_steps = 0;
+};
+
+// Adam with decoupled weight decay, see Loshchilov & Hutter, "Decoupled
+// Weight Decay Regularization".
+class AdamWOptimizer : public AdamOptimizer {
+ public:
+  AdamWOptimizer(const float learning_rate = 0.001,
+                 const float weight_decay = 0.01, const float beta_1 = 0.9,
+                 const float beta_2 = 0.999, const float epsilon = 1e-8);
+  ~AdamWOptimizer() override;
+
+ private:
+};
@@ -3,17 +3,132 @@
 #include <math.h>
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
 
 #include "utils.h"
 
+namespace {
+
+// output = activation(input * weights + biases), input and weights stored as
+// float or in 16 bits
+template <typename In, typename W>
+void dense_forward(const MatView<const In> input, const Mat2D<W>& weights,
+                   const Mat2D<float>& biases, simd::Activation activation,
+                   float alpha, Mat2D<float>& output) {
+  if (input.get_num_cols() != weights.get_num_rows()) {
+    throw std::runtime_error("DenseLayer: Input has " +
+                             std::to_string(input.get_num_cols()) +
+                             " columns, expected " +
+                             std::to_string(weights.get_num_rows()) + ".");
+  }
+  if (!input.is_contiguous()) {
+    throw std::runtime_error("DenseLayer: Input is not contiguous.");
+  }
+  output.resize(input.get_num_rows(), weights.get_num_cols());
+  gemm::matmul_bias_activation(
+      input.get_num_rows(), weights.get_num_cols(), input.get_num_cols(),
+      input.data(), weights.matrix_data.data(), biases.matrix_data.data(),
+      activation, alpha, output.matrix_data.data());
+}
+
+template <typename Half>
+constexpr Precision precision_of();
+template <>
+constexpr Precision precision_of<bfloat16>() {
+  return Precision::BF16;
+}
+template <>
+constexpr Precision precision_of<float16>() {
+  return Precision::FP16;
+}
+
+void check_one_hot_labels(const Mat2D<float>& predictions,
+                          const Mat2D<float>& labels) {
+  if (predictions.get_num_rows() != labels.get_num_rows() ||
+      predictions.get_num_cols() != labels.get_num_cols()) {
+    throw std::runtime_error(
+        "SoftmaxCrossEntropyWithLogitsLoss: Labels dim incompatible.");
+  }
+}
+
+void check_classes(const Mat2D<int32_t>& classes, const size_t rows,
+                   const size_t num_classes) {
+  if (classes.get_num_rows() != rows || classes.get_num_cols() != 1) {
+    throw std::runtime_error("Loss: Class labels must be a " +
+                             std::to_string(rows) + " x 1 matrix.");
+  }
+  for (const int32_t label : classes.matrix_data) {
+    if (label < 0 || static_cast<size_t>(label) >= num_classes) {
+      throw std::runtime_error("Loss: Class label " + std::to_string(label) +
+                               " out of range for " +
+                               std::to_string(num_classes) + " classes.");
+    }
+  }
+}
+
+// Mean over the batch of the gradient, like the one hot version always had.
+// loss and gradient have the right shape or are nullptr if not needed.
+void softmax_cross_entropy(const Mat2D<float>& logits, const float* one_hot,
+                           const int32_t* classes, Mat2D<float>* loss,
+                           Mat2D<float>* gradient) {
+  const size_t rows = logits.get_num_rows();
+  simd::softmax_cross_entropy(
+      rows, logits.get_num_cols(), logits.matrix_data.data(), one_hot,
+      classes, 1.0f / static_cast<float>(std::max<size_t>(rows, 1)),
+      loss != nullptr ? loss->matrix_data.data() : nullptr,
+      gradient != nullptr ? gradient->matrix_data.data() : nullptr);
+}
+
+}  // namespace
+
 Layer::Layer() {}
 Layer::~Layer() {}
 
+Mat2D<float> Layer::compute_gradients(const Mat2D<float>& input,
+                                      const Mat2D<float>& gradients_output) {
+  return this->backward(input, gradients_output, 0.0f);
+}
+
+void Layer::forward_into(const Mat2D<float>& input,
+                         Mat2D<float>& output) const {
+  output = this->forward(input);
+}
+
+void Layer::compute_gradients_into(const Mat2D<float>& input,
+                                   const Mat2D<float>& gradients_output,
+                                   Mat2D<float>& gradients_input) {
+  gradients_input = this->compute_gradients(input, gradients_output);
+}
+
+void Layer::compute_gradients_with_output_into(
+    const Mat2D<float>& input, const Mat2D<float>& output,
+    const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input) {
+  std::ignore = output;
+  this->compute_gradients_into(input, gradients_output, gradients_input);
+}
+
+std::vector<Mat2D<float>*> Layer::trainable_variables() { return {}; }
+
+std::vector<Mat2D<float>*> Layer::gradients() { return {}; }
+
+void Layer::apply_gradients(const float learning_rate) {
+  const auto variables = this->trainable_variables();
+  const auto grads = this->gradients();
+  for (size_t i = 0; i < variables.size(); ++i) {
+    variables[i]->axpy(-learning_rate, *grads[i]);
+  }
+}
+
 DenseLayer::DenseLayer(size_t number_of_inputs, size_t number_of_neurons,
                        Initializer weight_init, Initializer bias_init)
     : weights(number_of_inputs, number_of_neurons, weight_init),
-      biases(1, number_of_neurons, bias_init) {
+      biases(1, number_of_neurons, bias_init),
+      grad_weights(number_of_inputs, number_of_neurons),
+      grad_biases(1, number_of_neurons) {
   std::cout << "DenseLayer: #inputs: " << number_of_inputs
             << " #neurons: " << number_of_neurons << std::endl;
 }
@@ -21,27 +136,354 @@ DenseLayer::DenseLayer(size_t number_of_inputs, size_t number_of_neurons,
 DenseLayer::~DenseLayer() {}
 
 Mat2D<float> DenseLayer::forward(const Mat2D<float>& input) const {
-  const auto dot_prod = input.dot_product(weights);
-  const auto result = dot_prod.add(biases);
+  Mat2D<float> result(0, 0);
+  this->forward_into(input, result);
   return result;
 }
 
+void DenseLayer::forward_into(const Mat2D<float>& input,
+                              Mat2D<float>& output) const {
+  this->with_weights([&](const auto& weights) {
+    dense_forward(input.view(), weights, this->biases, simd::Activation::NONE,
+                  0.0f, output);
+  });
+}
+
 Mat2D<float> DenseLayer::backward(const Mat2D<float>& input,
                                   const Mat2D<float>& gradients_output,
                                   const float learning_rate) {
-  const auto grad_input =
-      gradients_output.dot_product(this->weights.transpose());
-  const auto grad_weights = input.transpose().dot_product(gradients_output);
-  const auto grad_biases = gradients_output.reduce_sum_axis(0);
-
-  const auto weight_update = grad_weights.hadamard_product(learning_rate);
-  const auto bias_update = grad_biases.hadamard_product(learning_rate);
-  this->weights = this->weights.minus(weight_update);
-  this->biases = this->biases.minus(bias_update);
+  const auto grad_input = this->compute_gradients(input, gradients_output);
+  this->apply_gradients(learning_rate);
+  return grad_input;
+}
 
+Mat2D<float> DenseLayer::compute_gradients(
+    const Mat2D<float>& input, const Mat2D<float>& gradients_output) {
+  Mat2D<float> grad_input(0, 0);
+  this->compute_gradients_into(input, gradients_output, grad_input);
   return grad_input;
 }
 
+void DenseLayer::compute_gradients_into(const Mat2D<float>& input,
+                                        const Mat2D<float>& gradients_output,
+                                        Mat2D<float>& gradients_input) {
+  this->multiply_gradients(input.view(), gradients_output, gradients_input);
+  this->sum_bias_gradients(gradients_output);
+}
+
+template <typename In>
+void DenseLayer::multiply_gradients(
+    const MatView<const In> input,
+    const Mat2D<float>& pre_activation_gradients,
+    Mat2D<float>& gradients_input) {
+  const size_t rows = pre_activation_gradients.get_num_rows();
+  const size_t cols = pre_activation_gradients.get_num_cols();
+  const size_t inputs = this->weights.get_num_rows();
+  if (input.get_num_rows() != rows || input.get_num_cols() != inputs ||
+      cols != this->weights.get_num_cols()) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  if (!input.is_contiguous()) {
+    throw std::runtime_error("DenseLayer: Input is not contiguous.");
+  }
+  // the transposes are read in place by the GEMM
+  this->with_weights([&](const auto& weights) {
+    gemm::gemm(gemm::Transpose::NO, gemm::Transpose::YES, 1.0f,
+               pre_activation_gradients, weights, 0.0f, gradients_input);
+  });
+  gemm::gemm(gemm::Transpose::YES, gemm::Transpose::NO, inputs, cols, rows,
+             1.0f, input.data(), inputs,
+             pre_activation_gradients.matrix_data.data(), cols,
+             this->accumulate_gradients ? 1.0f : 0.0f,
+             this->grad_weights.matrix_data.data(), cols);
+}
+
+void DenseLayer::sum_bias_gradients(
+    const Mat2D<float>& pre_activation_gradients) {
+  simd::sum_axis(0, pre_activation_gradients.get_num_rows(),
+                 pre_activation_gradients.get_num_cols(),
+                 pre_activation_gradients.matrix_data.data(),
+                 this->grad_biases.matrix_data.data(),
+                 this->accumulate_gradients);
+}
+
+void DenseLayer::forward_view_into(const MatView<const float> input,
+                                   Mat2D<float>& output) const {
+  const auto view = this->view();
+  this->with_weights([&](const auto& weights) {
+    dense_forward(input, weights, this->biases, view.activation, view.alpha,
+                  output);
+  });
+}
+
+void DenseLayer::compute_gradients_view_into(
+    const MatView<const float> input, const Mat2D<float>& output,
+    const MatView<const float> gradients_output,
+    Mat2D<float>& gradients_input) {
+  const auto view = this->view();
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  const size_t inputs = this->weights.get_num_rows();
+  if (output.get_num_rows() != rows || output.get_num_cols() != cols ||
+      input.get_num_rows() != rows || input.get_num_cols() != inputs ||
+      cols != this->biases.get_num_cols()) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  if (!input.is_contiguous() || !gradients_output.is_contiguous()) {
+    throw std::runtime_error("DenseLayer: Gradients are not contiguous.");
+  }
+  // without an activation dL/dZ is gradients_output itself
+  const float* grad_z = gradients_output.data();
+  if (view.activation == simd::Activation::NONE) {
+    simd::sum_axis(0, rows, cols, grad_z,
+                   this->grad_biases.matrix_data.data(),
+                   this->accumulate_gradients);
+  } else {
+    this->pre_activation_gradients.resize(rows, cols);
+    simd::activation_backward(
+        view.activation, rows, cols, output.matrix_data.data(), grad_z,
+        view.alpha, this->pre_activation_gradients.matrix_data.data(),
+        this->grad_biases.matrix_data.data(), this->accumulate_gradients);
+    grad_z = this->pre_activation_gradients.matrix_data.data();
+  }
+  gradients_input.resize(rows, inputs);
+  this->with_weights([&](const auto& weights) {
+    gemm::gemm(gemm::Transpose::NO, gemm::Transpose::YES, rows, inputs, cols,
+               1.0f, grad_z, cols, weights.matrix_data.data(), cols, 0.0f,
+               gradients_input.matrix_data.data(), inputs);
+  });
+  gemm::gemm(gemm::Transpose::YES, gemm::Transpose::NO, inputs, cols, rows,
+             1.0f, input.data(), inputs, grad_z, cols,
+             this->accumulate_gradients ? 1.0f : 0.0f,
+             this->grad_weights.matrix_data.data(), cols);
+}
+
+template <typename F>
+void DenseLayer::with_weights(F&& f) const {
+  switch (this->precision) {
+    case Precision::BF16:
+      f(this->bf16_weights);
+      return;
+    case Precision::FP16:
+      f(this->fp16_weights);
+      return;
+    case Precision::FP32:
+      f(this->weights);
+      return;
+  }
+}
+
+void DenseLayer::set_precision(const Precision precision) {
+  this->precision = precision;
+  this->bf16_weights = Mat2D<bfloat16>(0, 0);
+  this->fp16_weights = Mat2D<float16>(0, 0);
+  this->sync_weights();
+}
+
+Precision DenseLayer::get_precision() const { return this->precision; }
+
+void DenseLayer::set_accumulate_gradients(const bool accumulate) {
+  this->accumulate_gradients = accumulate;
+}
+
+void DenseLayer::sync_weights() {
+  switch (this->precision) {
+    case Precision::BF16:
+      convert_into(this->weights, this->bf16_weights);
+      return;
+    case Precision::FP16:
+      convert_into(this->weights, this->fp16_weights);
+      return;
+    case Precision::FP32:
+      return;
+  }
+}
+
+template <typename Half>
+void DenseLayer::forward_half_into(const Mat2D<Half>& input,
+                                   Mat2D<float>& output) const {
+  const auto view = this->view();
+  if (this->precision == Precision::FP32) {
+    dense_forward(input.view(), this->weights, this->biases, view.activation,
+                  view.alpha, output);
+  } else if (this->precision == precision_of<Half>()) {
+    // there is no GEMM of bfloat16 with float16 operands
+    if constexpr (std::is_same_v<Half, bfloat16>) {
+      dense_forward(input.view(), this->bf16_weights, this->biases,
+                    view.activation, view.alpha, output);
+    } else {
+      dense_forward(input.view(), this->fp16_weights, this->biases,
+                    view.activation, view.alpha, output);
+    }
+  } else {
+    throw std::runtime_error(
+        "DenseLayer: Input in another 16 bit format than the weights.");
+  }
+}
+
+template <typename Half>
+void DenseLayer::compute_gradients_half_into(
+    const Mat2D<Half>& input, const Mat2D<Half>& output,
+    const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input) {
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  if (input.get_num_rows() != rows || cols != this->biases.get_num_cols()) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  const auto view = this->view();
+  if (view.activation == simd::Activation::NONE) {
+    this->multiply_gradients(input.view(), gradients_output,
+                             gradients_input);
+    this->sum_bias_gradients(gradients_output);
+    return;
+  }
+  if (output.get_num_rows() != rows || output.get_num_cols() != cols) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  auto& grad_z = this->pre_activation_gradients;
+  grad_z.resize(rows, cols);
+  simd::activation_backward(view.activation, rows, cols,
+                            output.matrix_data.data(),
+                            gradients_output.matrix_data.data(), view.alpha,
+                            grad_z.matrix_data.data(),
+                            this->grad_biases.matrix_data.data(),
+                            this->accumulate_gradients);
+  this->multiply_gradients(input.view(), grad_z, gradients_input);
+}
+
+void DenseLayer::compute_gradients_in_place(const MatView<const float> input,
+                                            const Mat2D<float>& output,
+                                            Mat2D<float>& gradients_output,
+                                            Mat2D<float>& gradients_input) {
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  if (input.get_num_rows() != rows || cols != this->biases.get_num_cols()) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  const auto view = this->view();
+  if (view.activation == simd::Activation::NONE) {
+    this->sum_bias_gradients(gradients_output);
+  } else {
+    if (output.get_num_rows() != rows || output.get_num_cols() != cols) {
+      throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+    }
+    simd::activation_backward(view.activation, rows, cols,
+                              output.matrix_data.data(),
+                              gradients_output.matrix_data.data(), view.alpha,
+                              gradients_output.matrix_data.data(),
+                              this->grad_biases.matrix_data.data(),
+                              this->accumulate_gradients);
+  }
+  this->multiply_gradients(input, gradients_output, gradients_input);
+}
+
+void DenseLayer::forward_sparse_into(const CsrMatrix& input,
+                                     Mat2D<float>& output) {
+  if (this->precision != Precision::FP32) {
+    throw std::runtime_error("DenseLayer: Sparse input needs FP32 weights.");
+  }
+  if (input.num_cols != this->weights.get_num_rows()) {
+    throw std::runtime_error("DenseLayer: Input has " +
+                             std::to_string(input.num_cols) +
+                             " columns, expected " +
+                             std::to_string(this->weights.get_num_rows()) +
+                             ".");
+  }
+  // x * W + b = (x - background) * W + (b + background * 1^T * W)
+  auto& bias = this->background_row;
+  this->weights.reduce_sum_axis_into(0, bias);
+  bias *= input.background;
+  bias += this->biases;
+  const auto view = this->view();
+  const size_t cols = this->weights.get_num_cols();
+  output.resize(input.num_rows, cols);
+  gemm::sparse_matmul_bias_activation(
+      input.num_rows, cols, input.row_offsets.data(),
+      input.col_indices.data(), input.values.data(),
+      this->weights.matrix_data.data(), bias.matrix_data.data(),
+      view.activation, view.alpha, output.matrix_data.data());
+}
+
+void DenseLayer::compute_gradients_sparse(
+    const CsrMatrix& input_transposed, const Mat2D<float>& output,
+    const Mat2D<float>& gradients_output) {
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  if (input_transposed.num_cols != rows ||
+      input_transposed.num_rows != this->weights.get_num_rows() ||
+      cols != this->biases.get_num_cols()) {
+    throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+  }
+  const auto view = this->view();
+  // the correction below needs the bias gradient of this batch alone, so
+  // while accumulating it is summed up separately
+  auto& correction = this->background_row;
+  float* bias_gradients = this->grad_biases.matrix_data.data();
+  if (this->accumulate_gradients) {
+    correction.resize(1, cols);
+    bias_gradients = correction.matrix_data.data();
+  }
+  const Mat2D<float>* grad_z = &gradients_output;
+  if (view.activation == simd::Activation::NONE) {
+    simd::sum_axis(0, rows, cols, gradients_output.matrix_data.data(),
+                   bias_gradients);
+  } else {
+    if (output.get_num_rows() != rows || output.get_num_cols() != cols) {
+      throw std::runtime_error("DenseLayer: Gradient dim incompatible.");
+    }
+    auto& pre_activation = this->pre_activation_gradients;
+    pre_activation.resize(rows, cols);
+    simd::activation_backward(view.activation, rows, cols,
+                              output.matrix_data.data(),
+                              gradients_output.matrix_data.data(), view.alpha,
+                              pre_activation.matrix_data.data(),
+                              bias_gradients);
+    grad_z = &pre_activation;
+  }
+  // X^T * dL/dZ = (X - background)^T * dL/dZ + background * 1 * 1^T * dL/dZ,
+  // the last term is background * dL/db in every row
+  if (this->accumulate_gradients) {
+    this->grad_biases += correction;
+    correction *= input_transposed.background;
+  } else {
+    correction = this->grad_biases * input_transposed.background;
+  }
+  gemm::sparse_matmul_bias_activation(
+      input_transposed.num_rows, cols, input_transposed.row_offsets.data(),
+      input_transposed.col_indices.data(), input_transposed.values.data(),
+      grad_z->matrix_data.data(), correction.matrix_data.data(),
+      simd::Activation::NONE, 0.0f, this->grad_weights.matrix_data.data(),
+      this->accumulate_gradients ? 1.0f : 0.0f);
+}
+
+template void DenseLayer::forward_half_into(const Mat2D<bfloat16>& input,
+                                            Mat2D<float>& output) const;
+template void DenseLayer::forward_half_into(const Mat2D<float16>& input,
+                                            Mat2D<float>& output) const;
+template void DenseLayer::compute_gradients_half_into(
+    const Mat2D<bfloat16>& input, const Mat2D<bfloat16>& output,
+    const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input);
+template void DenseLayer::compute_gradients_half_into(
+    const Mat2D<float16>& input, const Mat2D<float16>& output,
+    const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input);
+
+std::vector<Mat2D<float>*> DenseLayer::trainable_variables() {
+  return {&this->weights, &this->biases};
+}
+
+std::vector<Mat2D<float>*> DenseLayer::gradients() {
+  return {&this->grad_weights, &this->grad_biases};
+}
+
+std::unique_ptr<Layer> DenseLayer::clone() const {
+  return std::make_unique<DenseLayer>(*this);
+}
+
+DenseLayerView DenseLayer::view() const {
+  return {this->weights.view(), this->biases.view(), simd::Activation::NONE,
+          0.0f};
+}
+
 void DenseLayer::print_trainable_variables() const {
   std::cout << "Weight: " << this->weights.get_num_rows() << "x"
             << this->weights.get_num_cols() << std::endl;
@@ -51,6 +493,79 @@ void DenseLayer::print_trainable_variables() const {
   std::cout << this->biases << std::endl;
 }
 
+FusedDenseLayer::FusedDenseLayer(size_t number_of_inputs,
+                                 size_t number_of_neurons,
+                                 simd::Activation activation, float alpha,
+                                 Initializer weight_init,
+                                 Initializer bias_init)
+    : DenseLayer(number_of_inputs, number_of_neurons, weight_init, bias_init),
+      activation(activation),
+      alpha(alpha),
+      output(0, 0) {
+  if (alpha < 0.0f) {
+    throw std::runtime_error("FusedDenseLayer: alpha must not be negative.");
+  }
+  switch (activation) {
+    case simd::Activation::LEAKY_RELU:
+      std::cout << "  fused with LeakyReLU, alpha: " << alpha << std::endl;
+      break;
+    case simd::Activation::SIGMOID:
+      std::cout << "  fused with Sigmoid" << std::endl;
+      break;
+    case simd::Activation::NONE:
+      break;
+  }
+}
+
+FusedDenseLayer::~FusedDenseLayer() {}
+
+void FusedDenseLayer::forward_into(const Mat2D<float>& input,
+                                   Mat2D<float>& output) const {
+  this->with_weights([&](const auto& weights) {
+    dense_forward(input.view(), weights, this->biases, this->activation,
+                  this->alpha, output);
+  });
+}
+
+void FusedDenseLayer::compute_gradients_into(
+    const Mat2D<float>& input, const Mat2D<float>& gradients_output,
+    Mat2D<float>& gradients_input) {
+  this->forward_into(input, this->output);
+  this->compute_gradients_with_output_into(input, this->output,
+                                           gradients_output, gradients_input);
+}
+
+void FusedDenseLayer::compute_gradients_with_output_into(
+    const Mat2D<float>& input, const Mat2D<float>& output,
+    const Mat2D<float>& gradients_output, Mat2D<float>& gradients_input) {
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  if (output.get_num_rows() != rows || output.get_num_cols() != cols ||
+      input.get_num_rows() != rows || cols != this->biases.get_num_cols()) {
+    throw std::runtime_error("FusedDenseLayer: Gradient dim incompatible.");
+  }
+  // dL/dZ and dL/db in one pass, then dL/dX = dL/dZ * W^T and
+  // dL/dW = X^T * dL/dZ
+  auto& grad_z = this->pre_activation_gradients;
+  grad_z.resize(rows, cols);
+  simd::activation_backward(this->activation, rows, cols,
+                            output.matrix_data.data(),
+                            gradients_output.matrix_data.data(), this->alpha,
+                            grad_z.matrix_data.data(),
+                            this->grad_biases.matrix_data.data(),
+                            this->accumulate_gradients);
+  this->multiply_gradients(input.view(), grad_z, gradients_input);
+}
+
+std::unique_ptr<Layer> FusedDenseLayer::clone() const {
+  return std::make_unique<FusedDenseLayer>(*this);
+}
+
+DenseLayerView FusedDenseLayer::view() const {
+  return {this->weights.view(), this->biases.view(), this->activation,
+          this->alpha};
+}
+
 LeakyRELUActivationLayer::~LeakyRELUActivationLayer() {}
 
 LeakyRELUActivationLayer::LeakyRELUActivationLayer(const float alpha)
@@ -60,11 +575,12 @@ LeakyRELUActivationLayer::LeakyRELUActivationLayer(const float alpha)
 
 Mat2D<float> LeakyRELUActivationLayer::forward(
     const Mat2D<float>& input) const {
-  auto tmp_in = input;
-  Mat2D<float> result = tmp_in.elementwise_operation(
-      [this](float x) { return std::max(this->alpha * x, x); });
-
-  return result;
+  return input.elementwise_operation(simd::UnaryOp::LEAKY_RELU, this->alpha);
+}
+void LeakyRELUActivationLayer::forward_into(const Mat2D<float>& input,
+                                            Mat2D<float>& output) const {
+  input.elementwise_operation_into(simd::UnaryOp::LEAKY_RELU, this->alpha,
+                                   output);
 }
 Mat2D<float> LeakyRELUActivationLayer::backward(
     const Mat2D<float>& input, const Mat2D<float>& gradient_output,
@@ -72,10 +588,58 @@ Mat2D<float> LeakyRELUActivationLayer::backward(
   // learning_rate not used since no trainable parameters - silence warning:
 
   std::ignore = learning_rate;
-  auto tmp_in = input;
-  Mat2D<float> gradient = tmp_in.elementwise_operation(
-      [this](float x) { return (x > 0.0) ? 1.0 : this->alpha; });
-  return gradient_output.hadamard_product(gradient);
+  Mat2D<float> gradient(0, 0);
+  this->compute_gradients_into(input, gradient_output, gradient);
+  return gradient;
+}
+void LeakyRELUActivationLayer::compute_gradients_into(
+    const Mat2D<float>& input, const Mat2D<float>& gradients_output,
+    Mat2D<float>& gradients_input) {
+  input.elementwise_operation_into(simd::UnaryOp::LEAKY_RELU_GRAD, this->alpha,
+                                   gradients_input);
+  gradients_output.hadamard_product_into(gradients_input, gradients_input);
+}
+void PositiveMask::assign(const Mat2D<float>& matrix) {
+  this->rows = matrix.get_num_rows();
+  this->cols = matrix.get_num_cols();
+  const size_t size = matrix.matrix_data.size();
+  const float* data = matrix.matrix_data.data();
+  this->bits.resize((size + 63) / 64);
+  for (size_t word = 0; word < this->bits.size(); ++word) {
+    const size_t end = std::min(size, 64 * word + 64);
+    uint64_t bits = 0;
+    for (size_t idx = 64 * word; idx < end; ++idx) {
+      bits |= static_cast<uint64_t>(data[idx] > 0.0f) << (idx % 64);
+    }
+    this->bits[word] = bits;
+  }
+}
+
+void LeakyRELUActivationLayer::forward_into(const Mat2D<float>& input,
+                                            Mat2D<float>& output,
+                                            PositiveMask& input_mask) const {
+  input_mask.assign(input);
+  this->forward_into(input, output);
+}
+void LeakyRELUActivationLayer::compute_gradients_from_mask_into(
+    const PositiveMask& input_mask, const Mat2D<float>& gradients_output,
+    Mat2D<float>& gradients_input) const {
+  const size_t rows = gradients_output.get_num_rows();
+  const size_t cols = gradients_output.get_num_cols();
+  if (input_mask.rows != rows || input_mask.cols != cols) {
+    throw std::runtime_error(
+        "LeakyRELUActivationLayer: Gradient dim incompatible.");
+  }
+  gradients_input.resize(rows, cols);
+  const float* grad_out = gradients_output.matrix_data.data();
+  float* grad_in = gradients_input.matrix_data.data();
+  for (size_t idx = 0; idx < rows * cols; ++idx) {
+    const float slope = input_mask[idx] ? 1.0f : this->alpha;
+    grad_in[idx] = grad_out[idx] * slope;
+  }
+}
+std::unique_ptr<Layer> LeakyRELUActivationLayer::clone() const {
+  return std::make_unique<LeakyRELUActivationLayer>(*this);
 }
 void LeakyRELUActivationLayer::print_trainable_variables() const {}
 
@@ -86,11 +650,11 @@ SigmoidActivationLayer::SigmoidActivationLayer() {
 }
 
 Mat2D<float> SigmoidActivationLayer::forward(const Mat2D<float>& input) const {
-  auto tmp_in = input;
-  Mat2D<float> result = tmp_in.elementwise_operation(
-      [](float x) { return 1.0 / (1 + std::exp(-x)); });
-
-  return result;
+  return input.elementwise_operation(simd::UnaryOp::SIGMOID);
+}
+void SigmoidActivationLayer::forward_into(const Mat2D<float>& input,
+                                          Mat2D<float>& output) const {
+  input.elementwise_operation_into(simd::UnaryOp::SIGMOID, 0.0f, output);
 }
 Mat2D<float> SigmoidActivationLayer::backward(
     const Mat2D<float>& input, const Mat2D<float>& gradient_output,
@@ -98,9 +662,21 @@ Mat2D<float> SigmoidActivationLayer::backward(
   // learning_rate not used since no trainable parameters - silence warning:
   std::ignore = learning_rate;
 
-  const auto gradient =
-      input.hadamard_product(Mat2D<float>(1, 1, {1.0}).minus(input));
-  return gradient_output.hadamard_product(gradient);
+  Mat2D<float> gradient(0, 0);
+  this->compute_gradients_into(input, gradient_output, gradient);
+  return gradient;
+}
+void SigmoidActivationLayer::compute_gradients_into(
+    const Mat2D<float>& input, const Mat2D<float>& gradients_output,
+    Mat2D<float>& gradients_input) {
+  // sigmoid'(x) = sigmoid(x) * (1 - sigmoid(x)), input is x
+  input.elementwise_operation_into(simd::UnaryOp::SIGMOID, 0.0f,
+                                   gradients_input);
+  gradients_input =
+      gradients_output * gradients_input * (1.0f - gradients_input);
+}
+std::unique_ptr<Layer> SigmoidActivationLayer::clone() const {
+  return std::make_unique<SigmoidActivationLayer>(*this);
 }
 void SigmoidActivationLayer::print_trainable_variables() const {}
 
@@ -108,14 +684,43 @@ Loss::~Loss() {}
 
 Loss::Loss() {}
 
+void Loss::loss_into(const Mat2D<float>& predictions,
+                     const Mat2D<float>& labels, Mat2D<float>& loss) const {
+  loss = this->loss(predictions, labels);
+}
+
+void Loss::loss_grad_into(const Mat2D<float>& predictions,
+                          const Mat2D<float>& labels,
+                          Mat2D<float>& gradient) const {
+  gradient = this->loss_grad(predictions, labels);
+}
+
+void Loss::loss_and_grad_into(const Mat2D<float>& predictions,
+                              const Mat2D<float>& labels, Mat2D<float>& loss,
+                              Mat2D<float>& gradient) const {
+  this->loss_into(predictions, labels, loss);
+  this->loss_grad_into(predictions, labels, gradient);
+}
+
+void Loss::loss_and_grad_into(const Mat2D<float>& predictions,
+                              const Mat2D<int32_t>& classes,
+                              Mat2D<float>& loss,
+                              Mat2D<float>& gradient) const {
+  this->loss_and_grad_into(
+      predictions, one_hot(classes, predictions.get_num_cols()), loss,
+      gradient);
+}
+
+bool Loss::mean_over_batch() const { return false; }
+
 MSELoss::~MSELoss() {}
 
 MSELoss::MSELoss() {}
 
 Mat2D<float> MSELoss::loss(const Mat2D<float>& predictions,
                            const Mat2D<float>& labels) const {
-  const auto diff = predictions.minus(labels);
-  const auto loss = diff.hadamard_product(diff);
+  Mat2D<float> loss(0, 0);
+  this->loss_into(predictions, labels, loss);
   return loss;
 }
 
@@ -124,43 +729,127 @@ Mat2D<float> MSELoss::loss_grad(const Mat2D<float>& predictions,
   return predictions.minus(labels);
 }
 
-SoftmaxCrossEntropyWithLogitsLoss::~SoftmaxCrossEntropyWithLogitsLoss() {}
+void MSELoss::loss_into(const Mat2D<float>& predictions,
+                        const Mat2D<float>& labels, Mat2D<float>& loss) const {
+  predictions.minus_into(labels, loss);
+  loss.hadamard_product_into(loss, loss);
+}
 
-SoftmaxCrossEntropyWithLogitsLoss::SoftmaxCrossEntropyWithLogitsLoss() {}
+void MSELoss::loss_grad_into(const Mat2D<float>& predictions,
+                             const Mat2D<float>& labels,
+                             Mat2D<float>& gradient) const {
+  predictions.minus_into(labels, gradient);
+}
 
-Mat2D<float> softmax(const Mat2D<float>& logits) {
-  const auto logits_max = logits.reduce_max_axis(1);
-  auto stable_logits = logits;
+void MSELoss::loss_and_grad_into(const Mat2D<float>& predictions,
+                                 const Mat2D<int32_t>& classes,
+                                 Mat2D<float>& loss,
+                                 Mat2D<float>& gradient) const {
+  const size_t rows = predictions.get_num_rows();
+  const size_t cols = predictions.get_num_cols();
+  check_classes(classes, rows, cols);
+  // predictions minus the one hot rows, i.e. minus 1 at the class
+  gradient = predictions;
+  for (size_t row = 0; row < rows; ++row) {
+    gradient(row, classes(row, 0)) -= 1.0f;
+  }
+  gradient.hadamard_product_into(gradient, loss);
+}
 
-  stable_logits = stable_logits.minus(logits_max);
+SoftmaxCrossEntropyWithLogitsLoss::~SoftmaxCrossEntropyWithLogitsLoss() {}
 
-  const auto logits_exp =
-      stable_logits.elementwise_operation([](float x) { return std::exp(x); });
+SoftmaxCrossEntropyWithLogitsLoss::SoftmaxCrossEntropyWithLogitsLoss() {}
 
-  auto logits_exp_sum = logits_exp.reduce_sum_axis(1);
-  auto probs = logits_exp.divide_by(logits_exp_sum);
-  return probs;
+bool SoftmaxCrossEntropyWithLogitsLoss::mean_over_batch() const {
+  return true;
 }
-Mat2D<float> SoftmaxCrossEntropyWithLogitsLoss::loss(
-    const Mat2D<float>& predictions, const Mat2D<float>& labels) const {
-  auto pred_probs = softmax(predictions);
 
-  const auto log_probs =
-      pred_probs.elementwise_operation([](float x) { return std::log(x); });
+Mat2D<float> softmax(const Mat2D<float>& logits) {
+  Mat2D<float> probs(0, 0);
+  softmax_into(logits, probs);
+  return probs;
+}
 
-  const auto ce = -(labels.hadamard_product(log_probs)).reduce_sum_axis(1);
+void softmax_into(const Mat2D<float>& logits, Mat2D<float>& probs) {
+  const size_t cols = logits.get_num_cols();
+  probs.resize(logits.get_num_rows(), cols);
+  for (size_t row = 0; row < logits.get_num_rows(); ++row) {
+    const float* in = logits.matrix_data.data() + row * cols;
+    float* out = probs.matrix_data.data() + row * cols;
+    // NaNs are skipped like in reduce_max_axis
+    float row_max = -std::numeric_limits<float>::infinity();
+    for (size_t col = 0; col < cols; ++col) {
+      row_max = in[col] > row_max ? in[col] : row_max;
+    }
+    for (size_t col = 0; col < cols; ++col) {
+      out[col] = in[col] - row_max;
+    }
+    simd::unary(simd::UnaryOp::EXP, cols, out, out, 0.0f);
+    const float exp_sum = simd::sum(cols, out);
+    for (size_t col = 0; col < cols; ++col) {
+      out[col] /= exp_sum;
+    }
+  }
+}
 
+Mat2D<float> SoftmaxCrossEntropyWithLogitsLoss::loss(
+    const Mat2D<float>& predictions, const Mat2D<float>& labels) const {
+  Mat2D<float> ce(0, 0);
+  this->loss_into(predictions, labels, ce);
   return ce;
 }
 
 Mat2D<float> SoftmaxCrossEntropyWithLogitsLoss::loss_grad(
     const Mat2D<float>& predictions, const Mat2D<float>& labels_one_hot) const {
-  auto pred_tmp = predictions;
-  const auto pred_probs = softmax(pred_tmp);
-  // average gradient over minibatch
-  const auto grad =
-      pred_probs.minus(labels_one_hot)
-          .divide_by(Mat2D<float>(
-              1, 1, {static_cast<float>(predictions.get_num_rows())}));
+  Mat2D<float> grad(0, 0);
+  this->loss_grad_into(predictions, labels_one_hot, grad);
   return grad;
-}
\ No newline at end of file
+}
+
+void SoftmaxCrossEntropyWithLogitsLoss::loss_into(
+    const Mat2D<float>& predictions, const Mat2D<float>& labels,
+    Mat2D<float>& loss) const {
+  check_one_hot_labels(predictions, labels);
+  loss.resize(predictions.get_num_rows(), 1);
+  softmax_cross_entropy(predictions, labels.matrix_data.data(), nullptr,
+                        &loss, nullptr);
+}
+
+void SoftmaxCrossEntropyWithLogitsLoss::loss_grad_into(
+    const Mat2D<float>& predictions, const Mat2D<float>& labels_one_hot,
+    Mat2D<float>& gradient) const {
+  check_one_hot_labels(predictions, labels_one_hot);
+  gradient.resize(predictions.get_num_rows(), predictions.get_num_cols());
+  softmax_cross_entropy(predictions, labels_one_hot.matrix_data.data(),
+                        nullptr, nullptr, &gradient);
+}
+
+void SoftmaxCrossEntropyWithLogitsLoss::loss_and_grad_into(
+    const Mat2D<float>& predictions, const Mat2D<float>& labels,
+    Mat2D<float>& loss, Mat2D<float>& gradient) const {
+  check_one_hot_labels(predictions, labels);
+  loss.resize(predictions.get_num_rows(), 1);
+  gradient.resize(predictions.get_num_rows(), predictions.get_num_cols());
+  softmax_cross_entropy(predictions, labels.matrix_data.data(), nullptr,
+                        &loss, &gradient);
+}
+
+void SoftmaxCrossEntropyWithLogitsLoss::loss_and_grad_into(
+    const Mat2D<float>& predictions, const Mat2D<int32_t>& classes,
+    Mat2D<float>& loss, Mat2D<float>& gradient) const {
+  check_classes(classes, predictions.get_num_rows(),
+                predictions.get_num_cols());
+  loss.resize(predictions.get_num_rows(), 1);
+  gradient.resize(predictions.get_num_rows(), predictions.get_num_cols());
+  softmax_cross_entropy(predictions, nullptr, classes.matrix_data.data(),
+                        &loss, &gradient);
+}
+
+Mat2D<float> one_hot(const Mat2D<int32_t>& classes, const size_t num_classes) {
+  check_classes(classes, classes.get_num_rows(), num_classes);
+  Mat2D<float> labels(classes.get_num_rows(), num_classes, ZEROS);
+  for (size_t row = 0; row < classes.get_num_rows(); ++row) {
+    labels(row, classes(row, 0)) = 1.0f;
+  }
+  return labels;
+}
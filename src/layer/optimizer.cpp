@@ -0,0 +1,130 @@
+#include "optimizer.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#include "utils.h"
+
+Optimizer::Optimizer(const float learning_rate)
+    : learning_rate(learning_rate) {}
+
+Optimizer::~Optimizer() {}
+
+void Optimizer::set_learning_rate(const float learning_rate) {
+  this->learning_rate = learning_rate;
+}
+
+float Optimizer::get_learning_rate() const { return this->learning_rate; }
+
+void Optimizer::apply(const simd::UpdateParams<float>& params,
+                      const std::vector<Mat2D<float>*>& variables,
+                      const std::vector<Mat2D<float>*>& gradients,
+                      const size_t num_state_buffers) {
+  if (variables.size() != gradients.size()) {
+    throw std::runtime_error(
+        "Optimizer: Number of variables and gradients differ.");
+  }
+  std::vector<Mat2D<float>>* states[] = {&this->state_0, &this->state_1};
+  for (size_t buffer = 0; buffer < num_state_buffers; ++buffer) {
+    auto& state = *states[buffer];
+    if (state.empty()) {
+      for (const auto* variable : variables) {
+        state.emplace_back(variable->get_num_rows(), variable->get_num_cols());
+      }
+    }
+    if (state.size() != variables.size()) {
+      throw std::runtime_error(
+          "Optimizer: Variables differ from the ones of the previous step.");
+    }
+  }
+
+  for (size_t idx = 0; idx < variables.size(); ++idx) {
+    auto& variable = *variables[idx];
+    const auto& gradient = *gradients[idx];
+    if (variable.get_num_rows() != gradient.get_num_rows() ||
+        variable.get_num_cols() != gradient.get_num_cols()) {
+      throw std::runtime_error(
+          "Optimizer: Variable and gradient dim incompatible.");
+    }
+    for (size_t buffer = 0; buffer < num_state_buffers; ++buffer) {
+      if ((*states[buffer])[idx].matrix_data.size() !=
+          variable.matrix_data.size()) {
+        throw std::runtime_error(
+            "Optimizer: Variables differ from the ones of the previous "
+            "step.");
+      }
+    }
+    simd::update(
+        params, variable.matrix_data.size(), variable.matrix_data.data(),
+        gradient.matrix_data.data(),
+        num_state_buffers > 0 ? this->state_0[idx].matrix_data.data()
+                              : nullptr,
+        num_state_buffers > 1 ? this->state_1[idx].matrix_data.data()
+                              : nullptr);
+  }
+}
+
+SGDOptimizer::SGDOptimizer(const float learning_rate, const float momentum,
+                           const bool nesterov, const float weight_decay)
+    : Optimizer(learning_rate),
+      momentum(momentum),
+      nesterov(nesterov),
+      weight_decay(weight_decay) {}
+
+SGDOptimizer::~SGDOptimizer() {}
+
+void SGDOptimizer::step(const std::vector<Mat2D<float>*>& variables,
+                        const std::vector<Mat2D<float>*>& gradients) {
+  simd::UpdateParams<float> params{};
+  params.learning_rate = this->learning_rate;
+  params.momentum = this->momentum;
+  params.weight_decay = this->weight_decay;
+  if (this->momentum == 0.0f) {
+    params.rule = simd::UpdateRule::SGD;
+  } else {
+    params.rule = this->nesterov ? simd::UpdateRule::NESTEROV
+                                 : simd::UpdateRule::MOMENTUM;
+  }
+  this->apply(params, variables, gradients,
+              params.rule == simd::UpdateRule::SGD ? 0 : 1);
+}
+
+AdamOptimizer::AdamOptimizer(const float learning_rate, const float beta_1,
+                             const float beta_2, const float epsilon)
+    : Optimizer(learning_rate),
+      beta_1(beta_1),
+      beta_2(beta_2),
+      epsilon(epsilon) {}
+
+AdamOptimizer::~AdamOptimizer() {}
+
+void AdamOptimizer::step(const std::vector<Mat2D<float>*>& variables,
+                         const std::vector<Mat2D<float>*>& gradients) {
+  this->num_steps++;
+  const double bias_correction_1 =
+      1.0 - std::pow(static_cast<double>(this->beta_1), this->num_steps);
+  const double bias_correction_2 =
+      1.0 - std::pow(static_cast<double>(this->beta_2), this->num_steps);
+
+  simd::UpdateParams<float> params{};
+  params.rule = simd::UpdateRule::ADAM;
+  params.learning_rate = this->learning_rate;
+  params.momentum = this->beta_1;
+  params.beta_2 = this->beta_2;
+  params.epsilon = this->epsilon;
+  params.weight_decay = this->weight_decay;
+  params.step_size =
+      static_cast<float>(this->learning_rate / bias_correction_1);
+  params.inv_sqrt_bias_correction_2 =
+      static_cast<float>(1.0 / std::sqrt(bias_correction_2));
+  this->apply(params, variables, gradients, 2);
+}
+
+AdamWOptimizer::AdamWOptimizer(const float learning_rate,
+                               const float weight_decay, const float beta_1,
+                               const float beta_2, const float epsilon)
+    : AdamOptimizer(learning_rate, beta_1, beta_2, epsilon) {
+  this->weight_decay = weight_decay;
+}
+
+AdamWOptimizer::~AdamWOptimizer() {}
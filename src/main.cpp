@@ -1,21 +1,30 @@
 #include <iomanip>
 #include <iostream>
 #include "layer.h"
+#include "inference_session.h"
 #include "mlp.h"
 #include "mnist.h"
+#include "optimizer.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "quantization.h"
 #include "utils.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <random>
 
 float progress(const size_t counter, const size_t ds_size) {
   return static_cast<float>(counter) / static_cast<float>(ds_size);
 }
 
+// network is an MLP or an InferenceSession
+template <typename Network>
 float run_validation(
-    const MLP& network,
+    Network& network,
     const std::vector<std::pair<Mat2D<float>, Mat2D<float>>>& dataset,
     const size_t num_val_steps) {
+  profile::Scope scope("validation");
   size_t val_it_counter = 0;
   size_t num_correct_predictions = 0;
   size_t num_classified_samples = 0;
@@ -46,19 +55,69 @@ float run_validation(
          static_cast<float>(num_classified_samples);
 }
 
+// the pipeline's next batch, timed as data loading
+const Batch* next_batch(DataPipeline& pipeline) {
+  profile::Scope scope("data loading");
+  return pipeline.next();
+}
+
 void log_metric(const float metric, std::string metric_description,
                 const size_t global_step) {
   std::cout << "Step: " << std::setw(3) << std::setprecision(3) << global_step
             << " - " << metric_description << ": " << metric << std::endl;
 }
 
+[[noreturn]] void configuration_error(const std::string& message) {
+  std::cerr << message << std::endl;
+  std::exit(1);
+}
+
+// the value of environment variable name, which must be a positive integer,
+// default_value if it is unset
+size_t env_size(const char* name, const size_t default_value) {
+  const char* value = std::getenv(name);
+  if (value == nullptr) {
+    return default_value;
+  }
+  const std::string text(value);
+  // at most 18 digits always fit
+  if (text.empty() || text.size() > 18 ||
+      text.find_first_not_of("0123456789") != std::string::npos ||
+      std::stoull(text) == 0) {
+    configuration_error(std::string(name) + "=" + text +
+                        " is no positive integer.");
+  }
+  return std::stoull(text);
+}
+
+// the precision MLP_PRECISION names, fp32, bf16 or fp16, fp32 if it is unset
+Precision env_precision() {
+  const char* value = std::getenv("MLP_PRECISION");
+  if (value == nullptr) {
+    return Precision::FP32;
+  }
+  const std::string text(value);
+  if (text == "fp32") {
+    return Precision::FP32;
+  } else if (text == "bf16") {
+    return Precision::BF16;
+  } else if (text == "fp16") {
+    return Precision::FP16;
+  }
+  configuration_error("MLP_PRECISION=" + text +
+                      " is none of fp32, bf16 and fp16.");
+}
+
 int main(int argc, char* argv[]) {
   std::string mnist_train_ds_path = "";
   std::string mnist_test_ds_path = "";
-  if (argc != 3) {
+  // the trained weights are written here, if given
+  std::string model_path = "";
+  if (argc != 3 && argc != 4) {
     std::cout << std::endl << "No paths to dataset given!" << std::endl;
     std::cout << "Usage:" << std::endl
-              << "./main path/to/tain.csv path/to/test.csv" << std::endl
+              << "./main path/to/tain.csv path/to/test.csv [path/to/model.bin]"
+              << std::endl
               << std::endl;
     return 1;
   } else {
@@ -68,45 +127,75 @@ int main(int argc, char* argv[]) {
     mnist_test_ds_path = static_cast<std::string>(argv[2]);
     std::cout << "Using mnist csv test dataset " << mnist_test_ds_path
               << std::endl;
+    if (argc == 4) {
+      model_path = static_cast<std::string>(argv[3]);
+    }
   }
   std::vector<size_t> layer_sizes = {50, 25};
 
-  const size_t batch_size = 64;
-  const float learning_rate = 0.05;
-  const size_t num_train_epochs = 10;
+  // MLP_BATCH_SIZE takes one optimizer step per that many samples,
+  // MLP_MICRO_BATCH_SIZE runs them through the network in parts of that many
+  const size_t batch_size = env_size("MLP_BATCH_SIZE", 64);
+  const size_t micro_batch_size = env_size("MLP_MICRO_BATCH_SIZE", 0);
+  if (micro_batch_size > batch_size) {
+    configuration_error("MLP_MICRO_BATCH_SIZE=" +
+                        std::to_string(micro_batch_size) +
+                        " exceeds the batch size " +
+                        std::to_string(batch_size) + ".");
+  }
+  // Adam at 1e-3 passes the test accuracy 10 epochs of plain SGD at 0.05
+  // reached within 3 epochs, on a synthetic 784 pixel csv of 10 shifted
+  // stroke patterns: 0.82 to 0.86 against 0.79 to 0.80 over three runs.
+  const float learning_rate = 0.001;
+  const size_t num_train_epochs = 3;
 
   const size_t num_online_val_steps = 20;
   const size_t log_loss_every_n_steps = 100;
 
   auto mlp = MLP(layer_sizes, /*num_inputs=*/784, /*num_classes=*/10);
+  // MLP_PRECISION=bf16 or fp16 trains in mixed precision
+  mlp.set_precision(env_precision());
+  mlp.set_micro_batch_size(micro_batch_size);
   const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
-  const auto full_train_data =
-      read_mnist_csv(mnist_train_ds_path, batch_size, -1);
-  std::vector<std::pair<Mat2D<float>, Mat2D<float>>> train_ds(
-      full_train_data.begin(),
-      full_train_data.begin() + full_train_data.size() - num_online_val_steps);
-  std::vector<std::pair<Mat2D<float>, Mat2D<float>>> online_val_ds(
-      full_train_data.begin() + full_train_data.size() - num_online_val_steps,
-      full_train_data.end());
-
-  const auto test_ds = read_mnist_csv(mnist_test_ds_path, 20, -1);
+  auto optimizer = AdamOptimizer(learning_rate);
+  std::cout << "Loading MNIST dataset from " << mnist_train_ds_path
+            << std::endl;
+  const auto train_data = open_mnist(mnist_train_ds_path);
+  // the last samples are held out for online validation, at least one batch
+  // must remain for training
+  if (batch_size > train_data.size() / (num_online_val_steps + 1)) {
+    configuration_error(
+        "MLP_BATCH_SIZE=" + std::to_string(batch_size) +
+        " is too large, the " + std::to_string(num_online_val_steps) +
+        " validation batches and one training batch need more than the " +
+        std::to_string(train_data.size()) + " training samples.");
+  }
+  const size_t num_train_samples =
+      train_data.size() - num_online_val_steps * batch_size;
+  const auto online_val_ds = train_data.to_batches(
+      batch_size, num_online_val_steps, num_train_samples);
+  const auto online_train_ds =
+      train_data.to_batches(batch_size, num_online_val_steps);
+  // reshuffled every epoch, assembled in the background
+  DataPipeline train_pipeline(train_data, batch_size, /*num_buffers=*/4,
+                              /*first_sample=*/0, num_train_samples);
+
+  const auto test_ds = read_mnist(mnist_test_ds_path, 20, -1);
 
   size_t global_step = 0;
   for (size_t epoch = 0; epoch < num_train_epochs; ++epoch) {
-    const auto learning_rate_decayed =
-        learning_rate * static_cast<float>(std::pow(0.775, epoch));
-
-    for (const auto& mnist_el : train_ds) {
-      const auto [training_input, target_label] = mnist_el;
+    optimizer.set_learning_rate(learning_rate *
+                                static_cast<float>(std::pow(0.775, epoch)));
 
-      const auto loss = mlp.train(training_input, target_label, loss_obj,
-                                  learning_rate_decayed);
+    while (const Batch* batch = next_batch(train_pipeline)) {
+      const auto loss =
+          mlp.train(batch->images, batch->labels, loss_obj, optimizer);
 
       if (global_step % log_loss_every_n_steps == 0) {
         log_metric(loss, "Loss", global_step);
         log_metric(run_validation(mlp, online_val_ds, online_val_ds.size()),
                    "Online VAL Accuracy", global_step);
-        log_metric(run_validation(mlp, train_ds, num_online_val_steps),
+        log_metric(run_validation(mlp, online_train_ds, num_online_val_steps),
                    "Online VAL ON TRAIN Accuracy", global_step);
       }
       global_step++;
@@ -116,5 +205,25 @@ int main(int argc, char* argv[]) {
   }
   log_metric(run_validation(mlp, test_ds, test_ds.size()), "Test Accuracy",
              global_step);
+  // post-training int8 quantization, calibrated on training samples
+  const QuantizedMLP quantized(
+      mlp, train_data.to_batches(/*batch_size=*/512, 1).front().first);
+  InferenceSession quantized_session(quantized, /*max_batch_size=*/20);
+  log_metric(run_validation(quantized_session, test_ds, test_ds.size()),
+             "Quantized int8 Test Accuracy", global_step);
+  if (!model_path.empty()) {
+    mlp.save(model_path);
+    std::cout << "Saved model to " << model_path << std::endl;
+  }
+  // in builds with -DMLP_PROFILE=ON, MLP_TRACE=trace.json also writes the
+  // timeline
+  if constexpr (profile::enabled) {
+    profile::print_summary(std::cout);
+    const char* trace_path = std::getenv("MLP_TRACE");
+    if (trace_path != nullptr) {
+      profile::write_chrome_trace(trace_path);
+      std::cout << "Wrote trace to " << trace_path << std::endl;
+    }
+  }
   return 0;
 }
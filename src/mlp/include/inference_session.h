@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "layer.h"
+#include "mlp.h"
+#include "model_file.h"
+#include "quantization.h"
+#include "utils.h"
+
+// Forward passes of a trained MLP for serving. MLP::forward keeps the output
+// of every layer, inference only needs the logits: a session runs the layers
+// through two preallocated buffers in turn, each sized to the widest layer
+// times the batch size, so steady state calls do not allocate. A single
+// sample goes through the GEMV path of the GEMM (see gemm.h).
+//
+// The model, an MLP, a memory mapped ModelFile or a QuantizedMLP, is only
+// read, so any number of sessions, e.g. one per serving thread, may run
+// against it at the same time. A session itself is not thread safe, and the
+// model must outlive it and not be trained meanwhile.
+class InferenceSession {
+ public:
+  // Buffers for batches of up to max_batch_size samples, larger ones grow
+  // them on first use.
+  explicit InferenceSession(const MLP& mlp, const size_t max_batch_size = 1);
+  // Runs the weights in place in the mapping.
+  explicit InferenceSession(const ModelFile& model,
+                            const size_t max_batch_size = 1);
+  // Runs the int8 layers, quantizing the input of each on the fly.
+  explicit InferenceSession(const QuantizedMLP& model,
+                            const size_t max_batch_size = 1);
+
+  size_t num_inputs() const { return this->input_size; }
+  size_t num_outputs() const { return this->output_size; }
+
+  // Logits (batch x num_outputs()) of input (batch x num_inputs()). The
+  // result lives in the session and is overwritten by the next call.
+  const Mat2D<float>& logits(const Mat2D<float>& input);
+  // Same for one sample of num_inputs() values (1 x num_outputs()).
+  const Mat2D<float>& logits(const float* sample);
+  // Index of the largest logit per sample, see MLP::predict.
+  Mat2D<size_t> predict(const Mat2D<float>& input);
+  size_t predict(const float* sample);
+
+ private:
+  InferenceSession(std::vector<DenseLayerView> layers,
+                   const size_t max_batch_size);
+  // Sizes the buffers for layers with the given numbers of inputs and
+  // neurons.
+  void allocate(const std::vector<size_t>& layer_sizes,
+                const size_t max_batch_size);
+
+  // the float layers, or the int8 ones if quantized is set
+  std::vector<DenseLayerView> layers;
+  const QuantizedMLP* quantized = nullptr;
+  size_t input_size = 0;
+  size_t output_size = 0;
+  // a copy of the sample for the pointer versions, then the layer outputs
+  Mat2D<float> sample_input = Mat2D<float>(0, 0);
+  Mat2D<float> buffers[2] = {Mat2D<float>(0, 0), Mat2D<float>(0, 0)};
+  // the quantized input of the current int8 layer
+  std::vector<uint8_t> quantized_input;
+};
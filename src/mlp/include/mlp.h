@@ -1,23 +1,164 @@
 #pragma once
 #include <memory>
 #include <numeric>
+#include <string>
 #include <vector>
 #include "layer.h"
 #include "mlp.h"
+#include "optimizer.h"
 #include "utils.h"
 class MLP {
  public:
+  // alpha of the LeakyReLU activation of the hidden layers
+  static constexpr float leaky_relu_alpha = 0.1f;
+  // In train(), batches with at most this fraction of entries other than
+  // their smallest value take the sparse input path of the first layer (see
+  // DenseLayer::forward_sparse_into), e.g. MNIST images, of which about a
+  // fifth differs from the background. Below it the sparse product is the
+  // faster one.
+  static constexpr float default_max_input_density = 0.3f;
+
   MLP(const std::vector<size_t> layer_sizes, const size_t number_of_inputs,
       const size_t number_of_targets,
       const Initializer weight_init = RANDOM_UNIFORM,
-      const Initializer bias_init = ZEROS);
+      const Initializer bias_init = ZEROS, const size_t num_threads = 0);
   std::vector<Mat2D<float>> forward(const Mat2D<float>& input) const;
   float train(const Mat2D<float>& input, const Mat2D<float>& target,
               const Loss& loss_obj, const float learning_rate);
+  // One step with the given optimizer, the learning rate version above uses
+  // plain SGD.
+  // Forward and backward run through the buffers of a per model workspace,
+  // which grow to the largest batch seen. After that first step train() does
+  // not allocate (with an optimizer whose state exists).
+  float train(const Mat2D<float>& input, const Mat2D<float>& target,
+              const Loss& loss_obj, Optimizer& optimizer);
+  // Same with one class index per sample (batch x 1) as target, see
+  // Loss::loss_and_grad_into.
+  float train(const Mat2D<float>& input, const Mat2D<int32_t>& target_classes,
+              const Loss& loss_obj, Optimizer& optimizer);
+  // Synchronous data parallel version of train: the batch is split into
+  // num_workers row shards, each worker runs forward and backward on its shard
+  // with its own copy of the model, the gradients are summed with a tree
+  // reduction and after one optimizer step all copies are updated. The result
+  // matches train up to float rounding. Weights changed from outside between
+  // calls are not seen by the copies, train() and the constructor are.
+  float train_data_parallel(const Mat2D<float>& input,
+                            const Mat2D<float>& target, const Loss& loss_obj,
+                            const float learning_rate,
+                            const size_t num_workers);
+  float train_data_parallel(const Mat2D<float>& input,
+                            const Mat2D<float>& target, const Loss& loss_obj,
+                            Optimizer& optimizer, const size_t num_workers);
+  float train_data_parallel(const Mat2D<float>& input,
+                            const Mat2D<int32_t>& target_classes,
+                            const Loss& loss_obj, Optimizer& optimizer,
+                            const size_t num_workers);
+  // Mixed precision. With BF16 or FP16 every layer multiplies with a 16 bit
+  // copy of its weights (see DenseLayer::set_precision), in forward, predict
+  // and training, and train() keeps the input and the hidden layer outputs
+  // for the backward pass in that format, half the memory of float
+  // activations. Sums, gradients and the optimizer state stay float and the
+  // optimizer updates the float master weights, whose copies are rounded
+  // again after every step, so small updates are not lost. As the gradients
+  // never are 16 bit values no loss scaling is needed. FP32, the default,
+  // switches back. Weights changed from outside need another call.
+  void set_precision(Precision precision);
+  Precision get_precision() const;
+  // Gradient checkpointing: with an interval k > 1, train() keeps only the
+  // output of every k-th layer and the logits for the backward pass, which
+  // recomputes the outputs in between, one segment of k - 1 layers at a
+  // time, from the kept output before them. About layers / k + k - 1
+  // outputs stay in memory instead of one per layer, for up to one more
+  // forward pass per step. 0 and 1 keep all outputs, the default. Mixed
+  // precision and train_data_parallel always keep all outputs.
+  void set_checkpoint_interval(size_t interval);
+  // Gradient accumulation: train() splits batches of more than rows rows
+  // into micro-batches of that many, runs forward and backward on one after
+  // the other, sums up their gradients and takes one optimizer step for the
+  // whole batch. The result matches a step on the whole batch up to float
+  // rounding (for losses whose gradient is a mean over the batch,
+  // Loss::mean_over_batch, or a sum), while the activations only take the
+  // memory of a micro-batch, so the optimization batch size can grow without
+  // leaving the caches. 0, the default, runs whole batches at once.
+  // train_data_parallel splits batches by worker instead.
+  void set_micro_batch_size(size_t rows);
+  // Bytes of the buffers train() holds for the backward pass (layer outputs,
+  // sparse input, loss and gradients, with micro-batches also their copy and
+  // the gradient sums), their peak once the largest batch was seen.
+  size_t activation_bytes() const;
+  // Density threshold of the sparse input path, 0 disables it.
+  void set_max_input_density(float max_density);
   Mat2D<size_t> predict(const Mat2D<float>& input) const;
+  // Weights (inputs x neurons) and biases (1 x neurons) of every layer, in
+  // order.
+  std::vector<const Mat2D<float>*> trainable_variables() const;
+  // Weights and activation of every layer, valid while the MLP is alive.
+  std::vector<DenseLayerView> layer_views() const;
+  // Writes the weights to a model file (see model_file.h), and reads them
+  // back into a new MLP. load throws if the file cannot be read or does not
+  // describe an MLP, i.e. LeakyReLU hidden layers with leaky_relu_alpha and
+  // no activation on the last one.
+  void save(const std::string& filename) const;
+  static MLP load(const std::string& filename, const size_t num_threads = 0);
   void print_debug_information(
       const std::vector<Mat2D<float>>& activations) const;
 
  private:
+  // Implementations of train and train_data_parallel for both label types.
+  template <typename Labels>
+  float train_step(const Mat2D<float>& input, const Labels& target,
+                   const Loss& loss_obj, Optimizer& optimizer);
+  // Forward and backward pass of train_step over one (micro-)batch, whose
+  // input is read in place: leaves its gradients times gradient_scale in
+  // the layers, or adds them while they accumulate, and returns the mean
+  // loss.
+  template <typename Labels>
+  float forward_backward(MatView<const float> input, const Labels& target,
+                         const Loss& loss_obj, float gradient_scale);
+  template <typename Half, typename Labels>
+  float mixed_precision_forward_backward(MatView<const float> input,
+                                         const Labels& target,
+                                         const Loss& loss_obj,
+                                         float gradient_scale);
+  template <typename Labels>
+  float train_data_parallel_step(const Mat2D<float>& input,
+                                 const Labels& target, const Loss& loss_obj,
+                                 Optimizer& optimizer,
+                                 const size_t num_workers);
+
   std::vector<std::unique_ptr<Layer>> layers;
+  // trainable variables and gradients of all layers, in matching order
+  std::vector<Mat2D<float>*> variables;
+  std::vector<Mat2D<float>*> gradients;
+  Precision precision = Precision::FP32;
+  float max_input_density = default_max_input_density;
+  size_t checkpoint_interval = 0;
+  size_t micro_batch_size = 0;
+  // Buffers of train(), planned by the first step and reused by all later
+  // ones: the output of every layer, the per sample loss and two gradient
+  // buffers the backward pass alternates between. In mixed precision only
+  // the last output is float, the input and the hidden layer outputs are
+  // kept in 16 bits, with one float buffer for the layer being computed. A
+  // sparse input is also kept in CSR form. With checkpointing, activations
+  // only holds the kept outputs and recomputed the outputs of one segment.
+  struct Workspace {
+    std::vector<Mat2D<float>> activations;
+    std::vector<Mat2D<float>> recomputed;
+    std::vector<Mat2D<bfloat16>> bf16_activations;
+    std::vector<Mat2D<float16>> fp16_activations;
+    Mat2D<float> layer_output = Mat2D<float>(0, 0);
+    // the input of a sparse batch and its transpose
+    CsrMatrix sparse_input;
+    CsrMatrix sparse_input_transposed;
+    Mat2D<float> loss = Mat2D<float>(0, 0);
+    Mat2D<float> gradient = Mat2D<float>(0, 0);
+    Mat2D<float> next_gradient = Mat2D<float>(0, 0);
+    // with micro-batches, the labels of the current one
+    Mat2D<float> micro_targets = Mat2D<float>(0, 0);
+    Mat2D<int32_t> micro_classes = Mat2D<int32_t>(0, 0);
+  };
+  Workspace workspace;
+  // model copies for workers 1.. of train_data_parallel, worker 0 uses layers
+  std::vector<std::vector<std::unique_ptr<Layer>>> replicas;
+  bool replicas_stale = true;
 };
\ No newline at end of file
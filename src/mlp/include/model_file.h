@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "layer.h"
+#include "mapped_file.h"
+
+// Versioned binary weight file of a stack of dense layers, e.g. an MLP (see
+// MLP::save). All numbers are little endian:
+//
+//   "MLPMODEL", uint64 version, uint64 number of layers
+//   per layer: uint64 inputs, uint64 neurons, uint64 activation (0 none,
+//     1 LeakyReLU, 2 sigmoid), float32 alpha, 4 zero bytes, uint64 offsets
+//     of the weights and of the biases
+//   the weights (inputs x neurons, row-major) and biases (neurons) of every
+//     layer as float32 blocks, each starting at a multiple of 64 bytes
+//
+// The aligned blocks let a reader map the file and use the weights in place.
+// The file is written as filename.tmp and renamed when complete, so readers
+// never see it half written.
+void write_model_file(const std::vector<DenseLayerView>& layers,
+                      const std::string& filename);
+
+// Memory mapped model file. Opening it only checks the header and the bounds
+// of the blocks, after that the layer views point straight into the mapping:
+// nothing is parsed or copied, and the weights are paged in on first use. A
+// process serving a model this way starts right away, and all processes
+// mapping the same file share its pages. See InferenceSession for running it.
+class ModelFile {
+ public:
+  // Throws std::runtime_error if the file has another format or version, or
+  // is truncated.
+  explicit ModelFile(const std::string& filename);
+
+  // Valid as long as the ModelFile is alive, also after moving it.
+  const std::vector<DenseLayerView>& layers() const {
+    return this->layer_views;
+  }
+
+ private:
+  MappedFile file;
+  std::vector<DenseLayerView> layer_views;
+};
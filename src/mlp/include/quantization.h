@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "layer.h"
+#include "mlp.h"
+#include "utils.h"
+
+// A dense layer with int8 weights, in the form gemm::matmul_u8s8 runs it.
+struct QuantizedDenseLayer {
+  size_t inputs;
+  size_t neurons;
+  // an input value x is stored as round(x / input_scale) + input_zero_point
+  float input_scale;
+  int32_t input_zero_point;
+  // int8 weights, packed by gemm::pack_int8
+  std::vector<int8_t> weights;
+  // Dequantization of the int32 sums, the input scale times the weight scale
+  // of every neuron, and the bias minus the zero point correction. Padded to
+  // gemm::int8_width(neurons) values.
+  std::vector<float> scale;
+  std::vector<float> offset;
+  simd::Activation activation;
+  float alpha;
+};
+
+// Post-training int8 quantization of a trained model for inference, e.g.
+//
+//   const QuantizedMLP quantized(mlp, calibration_images);
+//   InferenceSession session(quantized);
+//
+// The weights of every neuron (output channel) get their own symmetric scale,
+// max |w| / 127. The inputs of every layer get one asymmetric uint8 range,
+// calibrated on the smallest and largest value the float model produces for
+// a set of calibration inputs, e.g. a few hundred training samples. Values
+// outside the calibrated range are clamped.
+//
+// Products are summed exactly in int32, the dequantization, bias and
+// activation are applied in the epilogue of the int8 GEMM. The model is only
+// read after construction, like an MLP it can be shared between sessions.
+class QuantizedMLP {
+ public:
+  // calibration_inputs is batch x inputs of the first layer.
+  QuantizedMLP(const std::vector<DenseLayerView>& layers,
+               const Mat2D<float>& calibration_inputs);
+  QuantizedMLP(const MLP& mlp, const Mat2D<float>& calibration_inputs);
+
+  const std::vector<QuantizedDenseLayer>& layers() const {
+    return this->quantized_layers;
+  }
+
+ private:
+  std::vector<QuantizedDenseLayer> quantized_layers;
+};
@@ -0,0 +1,292 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cpu.h"
+#include "mlp.h"
+#include "utils.h"
+
+// Dense layer with its shape fixed at compile time, the building block of
+// StaticMLP. All loop bounds are constexpr, so the kernel unrolls completely
+// and the accumulators of a tile of rows and columns stay in vector
+// registers. Weight rows are zero padded to whole 64 byte vectors, so no
+// kernel needs a remainder loop over the columns.
+//
+// Like the library kernels there is one version per instruction set (see
+// cpu.h), chosen at runtime. The AVX2 and AVX-512 ones are compiled through
+// target attributes, so the including file needs no extra flags.
+template <size_t In, size_t Out>
+class StaticDenseLayer {
+ public:
+  static_assert(In > 0 && Out > 0, "StaticDenseLayer: Empty shape.");
+  static constexpr size_t num_inputs = In;
+  static constexpr size_t num_outputs = Out;
+
+  // Copies the weights (In x Out) and biases (1 x Out) of a DenseLayer.
+  void load(const Mat2D<float>& weights, const Mat2D<float>& biases) {
+    if (weights.get_num_rows() != In || weights.get_num_cols() != Out ||
+        biases.get_num_rows() != 1 || biases.get_num_cols() != Out) {
+      throw std::runtime_error(
+          "StaticDenseLayer: Expected weights of shape " +
+          std::to_string(In) + " x " + std::to_string(Out) + ", got " +
+          std::to_string(weights.get_num_rows()) + " x " +
+          std::to_string(weights.get_num_cols()) + ".");
+    }
+    for (size_t row = 0; row < In; ++row) {
+      std::memcpy(this->weights.data() + row * padded_outputs,
+                  weights.matrix_data.data() + row * Out,
+                  Out * sizeof(float));
+    }
+    std::memcpy(this->biases.data(), biases.matrix_data.data(),
+                Out * sizeof(float));
+  }
+
+  // output (Batch x Out) = input (Batch x In) * weights + biases, followed by
+  // a LeakyReLU with alpha if leaky_relu is set. Both are dense and must not
+  // overlap.
+  template <size_t Batch>
+  void forward(const float* input, float* output, bool leaky_relu,
+               float alpha) const {
+    switch (cpu::active_isa()) {
+#if defined(__x86_64__) || defined(__i386__)
+      case cpu::Isa::AVX512:
+        this->forward_avx512<Batch>(input, output, leaky_relu, alpha);
+        return;
+      case cpu::Isa::AVX2:
+        this->forward_avx2<Batch>(input, output, leaky_relu, alpha);
+        return;
+#endif
+      case cpu::Isa::SCALAR:
+        this->forward_kernel<sizeof(float), 16, Batch>(input, output,
+                                                       leaky_relu, alpha);
+        return;
+      default:
+        this->forward_kernel<16, 16, Batch>(input, output, leaky_relu,
+                                            alpha);
+        return;
+    }
+  }
+
+ private:
+  static constexpr size_t padded_outputs = (Out + 15) / 16 * 16;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // flatten inlines the kernel, so it is compiled for the target as well
+  template <size_t Batch>
+  __attribute__((target("avx512f,fma"), flatten)) void forward_avx512(
+      const float* input, float* output, bool leaky_relu, float alpha) const {
+    this->forward_kernel<64, 32, Batch>(input, output, leaky_relu, alpha);
+  }
+  template <size_t Batch>
+  __attribute__((target("avx2,fma"), flatten)) void forward_avx2(
+      const float* input, float* output, bool leaky_relu, float alpha) const {
+    this->forward_kernel<32, 16, Batch>(input, output, leaky_relu, alpha);
+  }
+#endif
+
+  struct TileShape {
+    size_t rows;
+    size_t vectors;
+  };
+  // The register tile with the most multiply-adds per load, among those
+  // whose accumulators, one weight vector and the broadcast inputs fit into
+  // the registers. A single row gets as many vectors as possible.
+  static constexpr TileShape tile_shape(size_t registers, size_t vectors,
+                                        size_t batch) {
+    TileShape best{1, 1};
+    for (size_t v = 1; v <= vectors && v + 3 <= registers; ++v) {
+      const size_t fitting_rows = (registers - 2) / (v + 1);
+      const size_t r = fitting_rows < batch ? fitting_rows : batch;
+      if (r * v * (best.rows + best.vectors) >=
+          best.rows * best.vectors * (r + v)) {
+        best = {r, v};
+      }
+    }
+    return best;
+  }
+
+  // Vectors of Bytes and a register file of Registers vectors.
+  template <size_t Bytes, size_t Registers, size_t Batch>
+  void forward_kernel(const float* input, float* output, bool leaky_relu,
+                      float alpha) const {
+    constexpr size_t lanes = Bytes / sizeof(float);
+    constexpr size_t vectors = (Out + lanes - 1) / lanes;
+    constexpr TileShape shape = tile_shape(Registers, vectors, Batch);
+    this->column_blocks<Bytes, shape.rows, shape.vectors, 0, vectors, Batch>(
+        input, output, leaky_relu, alpha);
+  }
+
+  template <size_t Bytes, size_t BlockRows, size_t BlockVectors,
+            size_t FirstVector, size_t Vectors, size_t Batch>
+  void column_blocks(const float* input, float* output, bool leaky_relu,
+                     float alpha) const {
+    constexpr size_t num_vectors = FirstVector + BlockVectors < Vectors
+                                       ? BlockVectors
+                                       : Vectors - FirstVector;
+    size_t row = 0;
+    for (; row + BlockRows <= Batch; row += BlockRows) {
+      this->tile<Bytes, BlockRows, FirstVector, num_vectors>(
+          input + row * In, output + row * Out, leaky_relu, alpha);
+    }
+    if constexpr (Batch % BlockRows != 0) {
+      this->tile<Bytes, Batch % BlockRows, FirstVector, num_vectors>(
+          input + row * In, output + row * Out, leaky_relu, alpha);
+    }
+    if constexpr (FirstVector + num_vectors < Vectors) {
+      this->column_blocks<Bytes, BlockRows, BlockVectors,
+                          FirstVector + num_vectors, Vectors, Batch>(
+          input, output, leaky_relu, alpha);
+    }
+  }
+
+  // Rows x (NumVectors vectors) of the output starting at column vector
+  // FirstVector.
+  template <size_t Bytes, size_t Rows, size_t FirstVector, size_t NumVectors>
+  void tile(const float* input, float* output, bool leaky_relu,
+            float alpha) const {
+    typedef float Vec __attribute__((vector_size(Bytes)));
+    constexpr size_t lanes = Bytes / sizeof(float);
+    constexpr size_t first_col = FirstVector * lanes;
+
+    Vec acc[Rows][NumVectors];
+    for (size_t v = 0; v < NumVectors; ++v) {
+      Vec bias;
+      std::memcpy(&bias, this->biases.data() + first_col + v * lanes, Bytes);
+      for (size_t r = 0; r < Rows; ++r) {
+        acc[r][v] = bias;
+      }
+    }
+    for (size_t i = 0; i < In; ++i) {
+      const float* w = this->weights.data() + i * padded_outputs + first_col;
+      for (size_t v = 0; v < NumVectors; ++v) {
+        Vec w_v;
+        std::memcpy(&w_v, w + v * lanes, Bytes);
+        for (size_t r = 0; r < Rows; ++r) {
+          acc[r][v] += input[r * In + i] * w_v;
+        }
+      }
+    }
+    for (size_t r = 0; r < Rows; ++r) {
+      for (size_t v = 0; v < NumVectors; ++v) {
+        Vec y = acc[r][v];
+        if (leaky_relu) {
+          const Vec scaled = y * alpha;
+          y = scaled < y ? y : scaled;
+        }
+        // the padding columns are not stored
+        const size_t col = first_col + v * lanes;
+        const size_t cols = col + lanes <= Out ? lanes : Out - col;
+        std::memcpy(output + r * Out + col, &y, cols * sizeof(float));
+      }
+    }
+  }
+
+  alignas(64) std::array<float, In * padded_outputs> weights{};
+  alignas(64) std::array<float, padded_outputs> biases{};
+};
+
+// MLP with the layer sizes fixed at compile time, for inference with a
+// deployed topology, e.g. StaticMLP<784, 50, 25, 10> for the network of
+// main.cpp. Like MLP the hidden layers use LeakyReLU and the last layer
+// returns the logits. There is no virtual dispatch and nothing is allocated,
+// the activations of a forward call live on the stack (2 * Batch times the
+// widest hidden layer floats), so it is meant for small batches.
+//
+// The weights are held by value, a 784-50-25-10 network takes about 200 KB,
+// so large ones are better put on the heap.
+template <size_t... Sizes>
+class StaticMLP {
+  static_assert(sizeof...(Sizes) >= 2,
+                "StaticMLP needs at least an input and an output size.");
+  static constexpr std::array<size_t, sizeof...(Sizes)> sizes = {Sizes...};
+
+ public:
+  static constexpr size_t num_layers = sizeof...(Sizes) - 1;
+  static constexpr size_t num_inputs = sizes.front();
+  static constexpr size_t num_outputs = sizes.back();
+
+  // All weights and biases zero.
+  StaticMLP() = default;
+  // Copies the weights of an MLP with the same layer sizes.
+  explicit StaticMLP(const MLP& mlp) { this->load(mlp); }
+
+  // Throws if the layer sizes of mlp differ.
+  void load(const MLP& mlp) {
+    const auto variables = mlp.trainable_variables();
+    if (variables.size() != 2 * num_layers) {
+      throw std::runtime_error("StaticMLP: Expected " +
+                               std::to_string(num_layers) + " layers, got " +
+                               std::to_string(variables.size() / 2) + ".");
+    }
+    this->load_layers(variables, std::make_index_sequence<num_layers>{});
+  }
+
+  // Logits (Batch x num_outputs) of a batch of inputs (Batch x num_inputs),
+  // both dense.
+  template <size_t Batch = 1>
+  void forward(const float* input, float* logits) const {
+    static_assert(Batch > 0, "StaticMLP: Empty batch.");
+    alignas(64) float buffers[2][Batch * max_hidden_size()];
+    this->forward_layers<0, Batch>(input, logits, buffers);
+  }
+  std::array<float, num_outputs> forward(const float* input) const {
+    std::array<float, num_outputs> logits;
+    this->forward<1>(input, logits.data());
+    return logits;
+  }
+  // Index of the largest logit of one input, the first one on ties.
+  size_t predict(const float* input) const {
+    const auto logits = this->forward(input);
+    size_t best = 0;
+    for (size_t idx = 1; idx < num_outputs; ++idx) {
+      best = logits[idx] > logits[best] ? idx : best;
+    }
+    return best;
+  }
+
+ private:
+  template <size_t... I>
+  static std::tuple<StaticDenseLayer<sizes[I], sizes[I + 1]>...> make_layers(
+      std::index_sequence<I...>);
+  using Layers =
+      decltype(make_layers(std::make_index_sequence<num_layers>{}));
+
+  static constexpr size_t max_hidden_size() {
+    size_t size = 1;
+    for (size_t idx = 1; idx + 1 < sizes.size(); ++idx) {
+      size = sizes[idx] > size ? sizes[idx] : size;
+    }
+    return size;
+  }
+
+  template <size_t... I>
+  void load_layers(const std::vector<const Mat2D<float>*>& variables,
+                   std::index_sequence<I...>) {
+    (std::get<I>(this->layers).load(*variables[2 * I], *variables[2 * I + 1]),
+     ...);
+  }
+
+  // Layer I reads input and writes into one of the buffers, alternating,
+  // the last one into logits.
+  template <size_t I, size_t Batch, typename Buffers>
+  void forward_layers(const float* input, float* logits,
+                      Buffers& buffers) const {
+    if constexpr (I + 1 == num_layers) {
+      std::get<I>(this->layers).template forward<Batch>(input, logits, false,
+                                                        0.0f);
+    } else {
+      float* output = buffers[I % 2];
+      std::get<I>(this->layers).template forward<Batch>(
+          input, output, true, MLP::leaky_relu_alpha);
+      this->forward_layers<I + 1, Batch>(output, logits, buffers);
+    }
+  }
+
+  Layers layers;
+};
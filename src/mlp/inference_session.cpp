@@ -0,0 +1,111 @@
+#include "inference_session.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "gemm.h"
+
+InferenceSession::InferenceSession(const MLP& mlp, const size_t max_batch_size)
+    : InferenceSession(mlp.layer_views(), max_batch_size) {}
+
+InferenceSession::InferenceSession(const ModelFile& model,
+                                   const size_t max_batch_size)
+    : InferenceSession(model.layers(), max_batch_size) {}
+
+InferenceSession::InferenceSession(std::vector<DenseLayerView> layers,
+                                   const size_t max_batch_size)
+    : layers(std::move(layers)) {
+  std::vector<size_t> layer_sizes = {this->layers.front().weights.rows()};
+  for (const auto& layer : this->layers) {
+    layer_sizes.push_back(layer.weights.cols());
+  }
+  this->allocate(layer_sizes, max_batch_size);
+}
+
+InferenceSession::InferenceSession(const QuantizedMLP& model,
+                                   const size_t max_batch_size)
+    : quantized(&model) {
+  std::vector<size_t> layer_sizes = {model.layers().front().inputs};
+  size_t widest_input = 0;
+  for (const auto& layer : model.layers()) {
+    layer_sizes.push_back(layer.neurons);
+    widest_input = std::max(widest_input, gemm::int8_depth(layer.inputs));
+  }
+  this->allocate(layer_sizes, max_batch_size);
+  this->quantized_input.resize(max_batch_size * widest_input);
+}
+
+void InferenceSession::allocate(const std::vector<size_t>& layer_sizes,
+                                const size_t max_batch_size) {
+  this->input_size = layer_sizes.front();
+  this->output_size = layer_sizes.back();
+  const size_t widest =
+      *std::max_element(layer_sizes.begin() + 1, layer_sizes.end());
+  this->sample_input.resize(1, this->input_size);
+  // resized to the output of each layer, which never reallocates
+  for (auto& buffer : this->buffers) {
+    buffer.resize(max_batch_size, widest);
+  }
+}
+
+const Mat2D<float>& InferenceSession::logits(const Mat2D<float>& input) {
+  if (input.get_num_cols() != this->input_size) {
+    throw std::runtime_error("InferenceSession: Input has " +
+                             std::to_string(input.get_num_cols()) +
+                             " columns, expected " +
+                             std::to_string(this->input_size) + ".");
+  }
+  const size_t rows = input.get_num_rows();
+  const float* layer_input = input.matrix_data.data();
+  Mat2D<float>* output = nullptr;
+  if (this->quantized != nullptr) {
+    const auto& layers = this->quantized->layers();
+    for (size_t idx = 0; idx < layers.size(); ++idx) {
+      const auto& layer = layers[idx];
+      output = &this->buffers[idx % 2];
+      output->resize(rows, layer.neurons);
+      this->quantized_input.resize(
+          std::max(this->quantized_input.size(),
+                   rows * gemm::int8_depth(layer.inputs)));
+      gemm::quantize_u8(rows, layer.inputs, layer_input, layer.input_scale,
+                        layer.input_zero_point, this->quantized_input.data());
+      gemm::matmul_u8s8(rows, layer.neurons, layer.inputs,
+                        this->quantized_input.data(), layer.weights.data(),
+                        layer.scale.data(), layer.offset.data(),
+                        layer.activation, layer.alpha,
+                        output->matrix_data.data());
+      layer_input = output->matrix_data.data();
+    }
+    return *output;
+  }
+  for (size_t idx = 0; idx < this->layers.size(); ++idx) {
+    const auto& layer = this->layers[idx];
+    output = &this->buffers[idx % 2];
+    output->resize(rows, layer.weights.cols());
+    gemm::matmul_bias_activation(
+        rows, layer.weights.cols(), layer.weights.rows(), layer_input,
+        layer.weights.data(), layer.biases.data(), layer.activation,
+        layer.alpha, output->matrix_data.data());
+    layer_input = output->matrix_data.data();
+  }
+  return *output;
+}
+
+const Mat2D<float>& InferenceSession::logits(const float* sample) {
+  std::memcpy(this->sample_input.matrix_data.data(), sample,
+              this->input_size * sizeof(float));
+  return this->logits(this->sample_input);
+}
+
+Mat2D<size_t> InferenceSession::predict(const Mat2D<float>& input) {
+  return this->logits(input).argmax(1);
+}
+
+size_t InferenceSession::predict(const float* sample) {
+  const float* row = this->logits(sample).matrix_data.data();
+  return static_cast<size_t>(std::max_element(row, row + this->output_size) -
+                             row);
+}
@@ -2,31 +2,208 @@
 
 #include <math.h>
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #include "layer.h"
+#include "model_file.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "profile.h"
 #include "utils.h"
 
+namespace {
+
+// Floating point operations of the forward pass of a dense layer over
+// batch_size rows, for the profile scopes, backward does twice as many. 0
+// unless profiling.
+double forward_flops(const Layer& layer, const size_t batch_size) {
+  if constexpr (!profile::enabled) {
+    return 0.0;
+  }
+  // the constructor only builds dense layers
+  const auto& weights = static_cast<const DenseLayer&>(layer).weights;
+  return 2.0 * static_cast<double>(batch_size * weights.get_num_rows() *
+                                   weights.get_num_cols());
+}
+
+// Same for a product of a sparse input with the weights.
+double sparse_flops(const Layer& layer, const CsrMatrix& input) {
+  if constexpr (!profile::enabled) {
+    return 0.0;
+  }
+  const auto& weights = static_cast<const DenseLayer&>(layer).weights;
+  return 2.0 * static_cast<double>(input.row_offsets.back() *
+                                   weights.get_num_cols());
+}
+
+// The outputs of all layers for an input read in place, e.g. one shard of a
+// batch.
+std::vector<Mat2D<float>> forward_layers(
+    const std::vector<std::unique_ptr<Layer>>& layers,
+    const MatView<const float> input) {
+  std::vector<Mat2D<float>> outputs(layers.size(), Mat2D<float>(0, 0));
+  for (size_t layer_idx = 0; layer_idx < layers.size(); ++layer_idx) {
+    profile::Scope scope("forward", layer_idx,
+                         forward_flops(*layers[layer_idx], input.rows()));
+    static_cast<const DenseLayer&>(*layers[layer_idx])
+        .forward_view_into(
+            layer_idx == 0 ? input : outputs[layer_idx - 1].view(),
+            outputs[layer_idx]);
+  }
+  return outputs;
+}
+
+// Input followed by the layer outputs, the layout print_debug_information
+// expects.
+std::vector<Mat2D<float>> with_input(const MatView<const float> input,
+                                     const std::vector<Mat2D<float>>& outputs) {
+  std::vector<Mat2D<float>> activations{Mat2D<float>(input)};
+  activations.insert(activations.end(), outputs.begin(), outputs.end());
+  return activations;
+}
+
+// The 16 bit activations of a workspace, for Half bfloat16 or float16.
+template <typename Half, typename Workspace>
+std::vector<Mat2D<Half>>& half_activations(Workspace& workspace) {
+  if constexpr (std::is_same_v<Half, bfloat16>) {
+    return workspace.bf16_activations;
+  } else {
+    return workspace.fp16_activations;
+  }
+}
+
+// The 16 bit activations widened to float, followed by the logits, for
+// print_debug_information. The first one is the input as the layers saw it.
+template <typename Half>
+std::vector<Mat2D<float>> widened_activations(
+    const std::vector<Mat2D<Half>>& stored, const Mat2D<float>& logits) {
+  std::vector<Mat2D<float>> activations(stored.size() + 1,
+                                        Mat2D<float>(0, 0));
+  for (size_t idx = 0; idx < stored.size(); ++idx) {
+    convert_into(stored[idx], activations[idx]);
+  }
+  activations.back() = logits;
+  return activations;
+}
+
+// The buffer of a workspace for the labels of a micro-batch, one hot rows or
+// class indices.
+template <typename Labels, typename Workspace>
+Labels& micro_batch_labels(Workspace& workspace) {
+  if constexpr (std::is_same_v<Labels, Mat2D<int32_t>>) {
+    return workspace.micro_classes;
+  } else {
+    return workspace.micro_targets;
+  }
+}
+
+// Copies rows [begin, end) of matrix into rows, which only allocates if it
+// is too small.
+template <typename T>
+void copy_rows(const Mat2D<T>& matrix, const size_t begin, const size_t end,
+               Mat2D<T>& rows) {
+  const size_t cols = matrix.get_num_cols();
+  rows.resize(end - begin, cols);
+  std::copy(matrix.matrix_data.begin() + begin * cols,
+            matrix.matrix_data.begin() + end * cols,
+            rows.matrix_data.begin());
+}
+
+// Switches the layers between overwriting and adding to their gradients,
+// see DenseLayer::set_accumulate_gradients.
+void set_accumulate_gradients(
+    const std::vector<std::unique_ptr<Layer>>& layers, const bool accumulate) {
+  for (const auto& layer : layers) {
+    static_cast<DenseLayer&>(*layer).set_accumulate_gradients(accumulate);
+  }
+}
+
+// Rounds the float weights into the 16 bit copies, after they changed.
+void sync_weights(const std::vector<std::unique_ptr<Layer>>& layers) {
+  for (const auto& layer : layers) {
+    // the constructor only builds dense layers
+    static_cast<DenseLayer&>(*layer).sync_weights();
+  }
+}
+
+// Sums buffers[0..n) element wise into buffers[0]. The pairwise tree always
+// adds in the same order, so the result does not depend on how the elements
+// are split across threads.
+void tree_reduce(const std::vector<Mat2D<float>*>& buffers) {
+  const size_t size = buffers.front()->matrix_data.size();
+  parallel::parallel_for(size, 4096, [&](size_t begin, size_t end) {
+    for (size_t stride = 1; stride < buffers.size(); stride *= 2) {
+      for (size_t dst = 0; dst + stride < buffers.size(); dst += 2 * stride) {
+        float* out = buffers[dst]->matrix_data.data();
+        const float* in = buffers[dst + stride]->matrix_data.data();
+        for (size_t idx = begin; idx < end; ++idx) {
+          out[idx] += in[idx];
+        }
+      }
+    }
+  });
+}
+
+// Runs func(worker) for every worker on the thread pool. parallel_for bodies
+// must not throw, so the first exception is passed on to the caller.
+template <typename F>
+void for_each_worker(const size_t workers, F func) {
+  std::vector<std::exception_ptr> errors(workers);
+  parallel::parallel_for(workers, 1, [&](size_t begin, size_t end) {
+    for (size_t worker = begin; worker < end; ++worker) {
+      try {
+        func(worker);
+      } catch (...) {
+        errors[worker] = std::current_exception();
+      }
+    }
+  });
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+}  // namespace
+
 MLP::MLP(const std::vector<size_t> layer_sizes, const size_t number_of_inputs,
          const size_t number_of_targets, const Initializer weight_init,
-         const Initializer bias_init) {
+         const Initializer bias_init, const size_t num_threads) {
+  // the thread pool is shared by all kernels, 0 keeps the current setting
+  if (num_threads > 0) {
+    parallel::set_num_threads(num_threads);
+  }
   size_t input_size = number_of_inputs;
   size_t layer_idx = 0;
   for (const size_t layer_size : layer_sizes) {
     std::cout << "Layer " << layer_idx << ": ";
-    layers.push_back(std::make_unique<DenseLayer>(input_size, layer_size,
-                                                  weight_init, bias_init));
+    // dense layer and LeakyReLU in one, see FusedDenseLayer
+    layers.push_back(std::make_unique<FusedDenseLayer>(
+        input_size, layer_size, simd::Activation::LEAKY_RELU,
+        leaky_relu_alpha, weight_init, bias_init));
     input_size = layer_size;  // for the next layer
     layer_idx++;
-    std::cout << "Layer " << layer_idx << ": ";
-    layers.push_back(std::make_unique<LeakyRELUActivationLayer>(0.1));
   }
   std::cout << "Layer " << layer_idx << ": ";
   layers.push_back(std::make_unique<DenseLayer>(input_size, number_of_targets));
   layer_idx++;
+
+  this->workspace.activations.assign(this->layers.size(), Mat2D<float>(0, 0));
+  for (const auto& layer : layers) {
+    for (auto* variable : layer->trainable_variables()) {
+      this->variables.push_back(variable);
+    }
+    for (auto* gradient : layer->gradients()) {
+      this->gradients.push_back(gradient);
+    }
+  }
 }
 
 std::vector<Mat2D<float>> MLP::forward(const Mat2D<float>& input) const {
@@ -35,8 +212,8 @@ std::vector<Mat2D<float>> MLP::forward(const Mat2D<float>& input) const {
   activations.push_back(input);
   size_t layer_idx = 0;
   for (const auto& layer : layers) {
-    const auto tmp_out = layer->forward(activations.back());
-    activations.push_back(tmp_out);
+    // no reallocation, so the argument stays valid
+    activations.push_back(layer->forward(activations.back()));
 
     layer_idx++;
   }
@@ -45,29 +222,400 @@ std::vector<Mat2D<float>> MLP::forward(const Mat2D<float>& input) const {
 
 float MLP::train(const Mat2D<float>& input, const Mat2D<float>& target_label,
                  const Loss& loss_obj, const float learning_rate) {
-  const auto activations = this->forward(input);
-  const auto logits = activations.back();
-  const auto loss = loss_obj.loss(logits, target_label);
+  SGDOptimizer optimizer(learning_rate);
+  return this->train(input, target_label, loss_obj, optimizer);
+}
+
+float MLP::train(const Mat2D<float>& input, const Mat2D<float>& target_label,
+                 const Loss& loss_obj, Optimizer& optimizer) {
+  return this->train_step(input, target_label, loss_obj, optimizer);
+}
+
+float MLP::train(const Mat2D<float>& input,
+                 const Mat2D<int32_t>& target_classes, const Loss& loss_obj,
+                 Optimizer& optimizer) {
+  return this->train_step(input, target_classes, loss_obj, optimizer);
+}
+
+template <typename Labels>
+float MLP::train_step(const Mat2D<float>& input, const Labels& target_label,
+                      const Loss& loss_obj, Optimizer& optimizer) {
+  profile::Scope step_scope("train step");
+  this->replicas_stale = true;
+  const size_t batch_size = input.get_num_rows();
+  const size_t micro_batch_size =
+      this->micro_batch_size > 0 ? this->micro_batch_size : batch_size;
+  float avg_loss = 0.0f;
+  if (micro_batch_size >= batch_size) {
+    avg_loss =
+        this->forward_backward(input.view(), target_label, loss_obj, 1.0f);
+  } else {
+    // The input rows are read in place. The labels, a tenth of the input or
+    // less, are copied, the losses take whole matrices.
+    auto& micro_target = micro_batch_labels<Labels>(this->workspace);
+    try {
+      for (size_t begin = 0; begin < batch_size; begin += micro_batch_size) {
+        const size_t end = std::min(begin + micro_batch_size, batch_size);
+        const float share =
+            static_cast<float>(end - begin) / static_cast<float>(batch_size);
+        copy_rows(target_label, begin, end, micro_target);
+        // the first micro-batch writes the gradients, the others add to them
+        set_accumulate_gradients(this->layers, begin > 0);
+        // the gradient of a mean over the micro-batch counts with its share
+        // of the batch, the one of a sum as it is
+        avg_loss += share * this->forward_backward(
+                                input.row_slice(begin, end), micro_target,
+                                loss_obj,
+                                loss_obj.mean_over_batch() ? share : 1.0f);
+      }
+    } catch (...) {
+      set_accumulate_gradients(this->layers, false);
+      throw;
+    }
+    set_accumulate_gradients(this->layers, false);
+  }
+  {
+    profile::Scope scope("optimizer step");
+    optimizer.step(this->variables, this->gradients);
+    if (this->precision != Precision::FP32) {
+      sync_weights(this->layers);
+    }
+  }
+  return avg_loss;
+}
+
+template <typename Labels>
+float MLP::forward_backward(const MatView<const float> input,
+                            const Labels& target_label, const Loss& loss_obj,
+                            const float gradient_scale) {
+  switch (this->precision) {
+    case Precision::BF16:
+      return this->mixed_precision_forward_backward<bfloat16>(
+          input, target_label, loss_obj, gradient_scale);
+    case Precision::FP16:
+      return this->mixed_precision_forward_backward<float16>(
+          input, target_label, loss_obj, gradient_scale);
+    case Precision::FP32:
+      break;
+  }
+  auto& activations = this->workspace.activations;
+  const size_t num_layers = this->layers.size();
+  // with checkpointing only the output of every interval-th layer and the
+  // logits are kept, the others go to the buffer of their position in the
+  // segment
+  const size_t interval = this->checkpoint_interval;
+  const auto output = [&](size_t layer_idx) -> Mat2D<float>& {
+    return interval <= 1 || (layer_idx + 1) % interval == 0 ||
+                   layer_idx + 1 == num_layers
+               ? activations[layer_idx]
+               : this->workspace.recomputed[layer_idx % interval];
+  };
+  const auto layer_input = [&](size_t layer_idx) -> MatView<const float> {
+    return layer_idx == 0 ? input : output(layer_idx - 1).view();
+  };
+  // the constructor only builds dense layers
+  const auto layer = [this](size_t layer_idx) -> DenseLayer& {
+    return static_cast<DenseLayer&>(*this->layers[layer_idx]);
+  };
+  const size_t batch_size = input.get_num_rows();
+  bool sparse = false;
+  if (this->max_input_density > 0.0f) {
+    profile::Scope scope("sparse input");
+    sparse = to_sparse(input, this->max_input_density,
+                       this->workspace.sparse_input);
+  }
+  const auto forward = [&](size_t layer_idx) {
+    if (layer_idx == 0 && sparse) {
+      profile::Scope scope("forward", layer_idx,
+                           sparse_flops(layer(0),
+                                        this->workspace.sparse_input));
+      layer(0).forward_sparse_into(this->workspace.sparse_input, output(0));
+    } else {
+      profile::Scope scope("forward", layer_idx,
+                           forward_flops(layer(layer_idx), batch_size));
+      layer(layer_idx).forward_view_into(layer_input(layer_idx),
+                                         output(layer_idx));
+    }
+  };
+  for (size_t layer_idx = 0; layer_idx < num_layers; ++layer_idx) {
+    forward(layer_idx);
+  }
+  auto* grad = &this->workspace.gradient;
+  auto* next_grad = &this->workspace.next_gradient;
+  {
+    profile::Scope scope("loss");
+    loss_obj.loss_and_grad_into(activations.back(), target_label,
+                                this->workspace.loss, *grad);
+    if (gradient_scale != 1.0f) {
+      *grad *= gradient_scale;
+    }
+  }
+  if (std::isnan(grad->reduce_mean())) {
+    this->print_debug_information(with_input(input, activations));
+    std::cout.flush();
+    throw std::runtime_error(
+        "Encountered NAN in Gradient, we are doomed! "
+        "Maybe try lowering the learning rate.");
+  }
 
-  auto grad = loss_obj.loss_grad(logits, target_label);
+  // The gradient buffers are not needed after a layer used them, so the
+  // layers compute their pre-activation gradients in place.
+  const size_t last_dense_layer = sparse ? 1 : 0;
+  for (size_t layer_idx = num_layers; layer_idx-- > last_dense_layer;) {
+    // Entering a segment other than the last one, whose outputs are still
+    // there: recompute it from the kept output before it.
+    if (interval > 1 && (layer_idx + 1) % interval == 0 &&
+        layer_idx + 1 < num_layers) {
+      profile::Scope scope("recompute");
+      for (size_t idx = layer_idx + 1 - interval; idx < layer_idx; ++idx) {
+        forward(idx);
+      }
+    }
+    profile::Scope scope("backward", layer_idx,
+                         2.0 * forward_flops(layer(layer_idx), batch_size));
+    layer(layer_idx).compute_gradients_in_place(
+        layer_input(layer_idx), output(layer_idx), *grad, *next_grad);
+    std::swap(grad, next_grad);
+  }
+  if (sparse) {
+    // no input gradient, only the weight gradient product
+    profile::Scope scope("backward", 0,
+                         sparse_flops(layer(0), this->workspace.sparse_input));
+    transpose_into(this->workspace.sparse_input,
+                   this->workspace.sparse_input_transposed);
+    layer(0).compute_gradients_sparse(this->workspace.sparse_input_transposed,
+                                      output(0), *grad);
+  }
+  const auto avg_loss = this->workspace.loss.reduce_mean();
+
+  if (std::isnan(avg_loss)) {
+    this->print_debug_information(with_input(input, activations));
+    std::cout.flush();
+    throw std::runtime_error(
+        "Encountered NAN in loss! Maybe try lowering the learning rate.");
+  }
+  return avg_loss;
+}
+
+template <typename Half, typename Labels>
+float MLP::mixed_precision_forward_backward(const MatView<const float> input,
+                                            const Labels& target_label,
+                                            const Loss& loss_obj,
+                                            const float gradient_scale) {
+  // stored[0] is the input, stored[l] the output of layer l - 1, only the
+  // logits stay float
+  auto& stored = half_activations<Half>(this->workspace);
+  auto& logits = this->workspace.activations.back();
+  const size_t last = this->layers.size() - 1;
+  const auto layer = [this](size_t layer_idx) -> DenseLayer& {
+    return static_cast<DenseLayer&>(*this->layers[layer_idx]);
+  };
+  const size_t batch_size = input.get_num_rows();
+  convert_into(input, stored[0]);
+  for (size_t layer_idx = 0; layer_idx < last; ++layer_idx) {
+    profile::Scope scope("forward", layer_idx,
+                         forward_flops(layer(layer_idx), batch_size));
+    layer(layer_idx).forward_half_into(stored[layer_idx],
+                                       this->workspace.layer_output);
+    convert_into(this->workspace.layer_output, stored[layer_idx + 1]);
+  }
+  {
+    profile::Scope scope("forward", last,
+                         forward_flops(layer(last), batch_size));
+    layer(last).forward_half_into(stored[last], logits);
+  }
+
+  auto* grad = &this->workspace.gradient;
+  auto* next_grad = &this->workspace.next_gradient;
+  {
+    profile::Scope scope("loss");
+    loss_obj.loss_and_grad_into(logits, target_label, this->workspace.loss,
+                                *grad);
+    if (gradient_scale != 1.0f) {
+      *grad *= gradient_scale;
+    }
+  }
+  if (std::isnan(grad->reduce_mean())) {
+    this->print_debug_information(widened_activations(stored, logits));
+    std::cout.flush();
+    throw std::runtime_error(
+        "Encountered NAN in Gradient, we are doomed! "
+        "Maybe try lowering the learning rate.");
+  }
+
+  // the last layer has no activation, so it does not read its output
+  const Mat2D<Half> no_output(0, 0);
+  for (int32_t layer_idx = last; layer_idx >= 0; --layer_idx) {
+    profile::Scope scope("backward", layer_idx,
+                         2.0 * forward_flops(layer(layer_idx), batch_size));
+    const auto& output =
+        static_cast<size_t>(layer_idx) == last ? no_output
+                                               : stored[layer_idx + 1];
+    layer(layer_idx).compute_gradients_half_into(stored[layer_idx], output,
+                                                 *grad, *next_grad);
+    std::swap(grad, next_grad);
+  }
+  const auto avg_loss = this->workspace.loss.reduce_mean();
+
+  if (std::isnan(avg_loss)) {
+    this->print_debug_information(widened_activations(stored, logits));
+    std::cout.flush();
+    throw std::runtime_error(
+        "Encountered NAN in loss! Maybe try lowering the learning rate.");
+  }
+  return avg_loss;
+}
+
+float MLP::train_data_parallel(const Mat2D<float>& input,
+                               const Mat2D<float>& target_label,
+                               const Loss& loss_obj, const float learning_rate,
+                               const size_t num_workers) {
+  SGDOptimizer optimizer(learning_rate);
+  return this->train_data_parallel(input, target_label, loss_obj, optimizer,
+                                   num_workers);
+}
+
+float MLP::train_data_parallel(const Mat2D<float>& input,
+                               const Mat2D<float>& target_label,
+                               const Loss& loss_obj, Optimizer& optimizer,
+                               const size_t num_workers) {
+  return this->train_data_parallel_step(input, target_label, loss_obj,
+                                        optimizer, num_workers);
+}
+
+float MLP::train_data_parallel(const Mat2D<float>& input,
+                               const Mat2D<int32_t>& target_classes,
+                               const Loss& loss_obj, Optimizer& optimizer,
+                               const size_t num_workers) {
+  return this->train_data_parallel_step(input, target_classes, loss_obj,
+                                        optimizer, num_workers);
+}
+
+template <typename Labels>
+float MLP::train_data_parallel_step(const Mat2D<float>& input,
+                                    const Labels& target_label,
+                                    const Loss& loss_obj,
+                                    Optimizer& optimizer,
+                                    const size_t num_workers) {
+  const size_t batch_size = input.get_num_rows();
+  const size_t workers = std::max<size_t>(
+      1, std::min<size_t>(num_workers, batch_size));
+  if (workers == 1) {
+    return this->train(input, target_label, loss_obj, optimizer);
+  }
+  profile::Scope step_scope("train step");
+  if (this->replicas_stale || this->replicas.size() < workers - 1) {
+    this->replicas.clear();
+    for (size_t worker = 1; worker < workers; ++worker) {
+      std::vector<std::unique_ptr<Layer>> replica;
+      for (const auto& layer : this->layers) {
+        replica.push_back(layer->clone());
+      }
+      this->replicas.push_back(std::move(replica));
+    }
+    this->replicas_stale = false;
+  }
+  const auto model = [this](size_t worker)
+      -> std::vector<std::unique_ptr<Layer>>& {
+    return worker == 0 ? this->layers : this->replicas[worker - 1];
+  };
+  const auto shard_begin = [&](size_t worker) {
+    return worker * batch_size / workers;
+  };
+
+  const auto shard = [&](size_t worker) {
+    return input.row_slice(shard_begin(worker), shard_begin(worker + 1));
+  };
+
+  // the layer outputs of every worker, the shards are read in place
+  std::vector<std::vector<Mat2D<float>>> activations(workers);
+  for_each_worker(workers, [&](size_t worker) {
+    activations[worker] = forward_layers(model(worker), shard(worker));
+  });
+
+  // the loss sees the whole batch, so its normalization matches train()
+  Mat2D<float> logits(batch_size,
+                      activations.front().back().get_num_cols());
+  for (size_t worker = 0; worker < workers; ++worker) {
+    logits.row_slice(shard_begin(worker), shard_begin(worker + 1))
+        .copy_from(activations[worker].back());
+  }
+  Mat2D<float> loss(0, 0);
+  Mat2D<float> grad(0, 0);
+  {
+    profile::Scope scope("loss");
+    loss_obj.loss_and_grad_into(logits, target_label, loss, grad);
+  }
   if (std::isnan(grad.reduce_mean())) {
-    this->print_debug_information(activations);
+    this->print_debug_information(
+        with_input(shard(0), activations.front()));
     std::cout.flush();
     throw std::runtime_error(
         "Encountered NAN in Gradient, we are doomed! "
         "Maybe try lowering the learning rate.");
   }
 
-  for (int32_t layer_idx = this->layers.size() - 1; layer_idx >= 0;
-       --layer_idx) {
-    const auto layer_input = activations[layer_idx];
+  // starting from the worker's rows of the loss gradient, read in place,
+  // the input gradients alternate between two buffers
+  for_each_worker(workers, [&](size_t worker) {
+    auto& layers = model(worker);
+    const auto& outputs = activations[worker];
+    MatView<const float> shard_grad =
+        grad.row_slice(shard_begin(worker), shard_begin(worker + 1));
+    Mat2D<float> input_grads[2] = {Mat2D<float>(0, 0), Mat2D<float>(0, 0)};
+    for (size_t layer_idx = layers.size(); layer_idx-- > 0;) {
+      profile::Scope scope("backward", layer_idx,
+                           2.0 * forward_flops(*layers[layer_idx],
+                                               shard_grad.get_num_rows()));
+      auto& input_grad = input_grads[layer_idx % 2];
+      static_cast<DenseLayer&>(*layers[layer_idx])
+          .compute_gradients_view_into(
+              layer_idx == 0 ? shard(worker) : outputs[layer_idx - 1].view(),
+              outputs[layer_idx], shard_grad, input_grad);
+      shard_grad = input_grad.view();
+    }
+  });
 
-    grad = this->layers[layer_idx]->backward(layer_input, grad, learning_rate);
+  {
+    profile::Scope scope("gradient reduction");
+    for (size_t layer_idx = 0; layer_idx < this->layers.size(); ++layer_idx) {
+      std::vector<std::vector<Mat2D<float>*>> grads;
+      for (size_t worker = 0; worker < workers; ++worker) {
+        grads.push_back(model(worker)[layer_idx]->gradients());
+      }
+      for (size_t grad_idx = 0; grad_idx < grads.front().size(); ++grad_idx) {
+        std::vector<Mat2D<float>*> buffers;
+        for (const auto& worker_grads : grads) {
+          buffers.push_back(worker_grads[grad_idx]);
+        }
+        tree_reduce(buffers);
+      }
+    }
+  }
+
+  // one optimizer step on worker 0, the others copy the new variables
+  {
+    profile::Scope scope("optimizer step");
+    optimizer.step(this->variables, this->gradients);
+    for_each_worker(workers, [&](size_t worker) {
+      if (worker > 0) {
+        for (size_t layer_idx = 0; layer_idx < this->layers.size();
+             ++layer_idx) {
+          const auto source = this->layers[layer_idx]->trainable_variables();
+          const auto target = model(worker)[layer_idx]->trainable_variables();
+          for (size_t idx = 0; idx < source.size(); ++idx) {
+            target[idx]->matrix_data = source[idx]->matrix_data;
+          }
+        }
+      }
+      sync_weights(model(worker));
+    });
   }
-  const auto avg_loss = loss.reduce_mean();
 
+  const auto avg_loss = loss.reduce_mean();
   if (std::isnan(avg_loss)) {
-    this->print_debug_information(activations);
+    this->print_debug_information(
+        with_input(shard(0), activations.front()));
     std::cout.flush();
     throw std::runtime_error(
         "Encountered NAN in loss! Maybe try lowering the learning rate.");
@@ -75,11 +623,122 @@ float MLP::train(const Mat2D<float>& input, const Mat2D<float>& target_label,
   return avg_loss;
 }
 
+void MLP::set_precision(const Precision precision) {
+  this->precision = precision;
+  this->replicas_stale = true;
+  for (const auto& layer : this->layers) {
+    static_cast<DenseLayer&>(*layer).set_precision(precision);
+  }
+  // train() keeps the input and the hidden layer outputs in the 16 bit
+  // format of the weights
+  auto& workspace = this->workspace;
+  workspace.bf16_activations.clear();
+  workspace.fp16_activations.clear();
+  if (precision == Precision::BF16) {
+    workspace.bf16_activations.assign(this->layers.size(),
+                                      Mat2D<bfloat16>(0, 0));
+  } else if (precision == Precision::FP16) {
+    workspace.fp16_activations.assign(this->layers.size(),
+                                      Mat2D<float16>(0, 0));
+  }
+}
+
+Precision MLP::get_precision() const { return this->precision; }
+
+void MLP::set_checkpoint_interval(const size_t interval) {
+  this->checkpoint_interval = interval;
+  // drops the outputs which are no longer kept
+  this->workspace.activations.assign(this->layers.size(), Mat2D<float>(0, 0));
+  this->workspace.recomputed.assign(interval > 1 ? interval - 1 : 0,
+                                    Mat2D<float>(0, 0));
+}
+
+size_t MLP::activation_bytes() const {
+  const auto bytes = [](const auto& matrix) {
+    return matrix.matrix_data.capacity() * sizeof(matrix.matrix_data[0]);
+  };
+  const auto csr_bytes = [](const CsrMatrix& csr) {
+    return csr.row_offsets.capacity() * sizeof(csr.row_offsets[0]) +
+           csr.col_indices.capacity() * sizeof(csr.col_indices[0]) +
+           csr.values.capacity() * sizeof(csr.values[0]);
+  };
+  const auto& workspace = this->workspace;
+  size_t total = bytes(workspace.layer_output) + bytes(workspace.loss) +
+                 bytes(workspace.gradient) + bytes(workspace.next_gradient) +
+                 bytes(workspace.micro_targets) +
+                 bytes(workspace.micro_classes) +
+                 csr_bytes(workspace.sparse_input) +
+                 csr_bytes(workspace.sparse_input_transposed);
+  for (const auto& matrix : workspace.activations) {
+    total += bytes(matrix);
+  }
+  for (const auto& matrix : workspace.recomputed) {
+    total += bytes(matrix);
+  }
+  for (const auto& matrix : workspace.bf16_activations) {
+    total += bytes(matrix);
+  }
+  for (const auto& matrix : workspace.fp16_activations) {
+    total += bytes(matrix);
+  }
+  return total;
+}
+
+void MLP::set_micro_batch_size(const size_t rows) {
+  this->micro_batch_size = rows;
+}
+
+void MLP::set_max_input_density(const float max_density) {
+  this->max_input_density = max_density;
+}
+
 Mat2D<size_t> MLP::predict(const Mat2D<float>& input) const {
   const auto activations = this->forward(input);
-  const auto logits = activations.back();
-  const auto argmax_indices = logits.argmax(1);
-  return argmax_indices;
+  return activations.back().argmax(1);
+}
+
+std::vector<const Mat2D<float>*> MLP::trainable_variables() const {
+  return {this->variables.begin(), this->variables.end()};
+}
+
+std::vector<DenseLayerView> MLP::layer_views() const {
+  std::vector<DenseLayerView> views;
+  for (const auto& layer : this->layers) {
+    // the constructor only builds dense layers
+    views.push_back(static_cast<const DenseLayer&>(*layer).view());
+  }
+  return views;
+}
+
+void MLP::save(const std::string& filename) const {
+  write_model_file(this->layer_views(), filename);
+}
+
+MLP MLP::load(const std::string& filename, const size_t num_threads) {
+  const ModelFile file(filename);
+  const auto& views = file.layers();
+  std::vector<size_t> layer_sizes;
+  for (size_t idx = 0; idx + 1 < views.size(); ++idx) {
+    if (views[idx].activation != simd::Activation::LEAKY_RELU ||
+        views[idx].alpha != leaky_relu_alpha) {
+      throw std::runtime_error("MLP::load: Hidden layer " +
+                               std::to_string(idx) + " of " + filename +
+                               " is no LeakyReLU layer with alpha " +
+                               std::to_string(leaky_relu_alpha) + ".");
+    }
+    layer_sizes.push_back(views[idx].weights.cols());
+  }
+  if (views.back().activation != simd::Activation::NONE) {
+    throw std::runtime_error("MLP::load: The last layer of " + filename +
+                             " has an activation.");
+  }
+  MLP mlp(layer_sizes, views.front().weights.rows(),
+          views.back().weights.cols(), ZEROS, ZEROS, num_threads);
+  for (size_t idx = 0; idx < views.size(); ++idx) {
+    mlp.variables[2 * idx]->view().copy_from(views[idx].weights);
+    mlp.variables[2 * idx + 1]->view().copy_from(views[idx].biases);
+  }
+  return mlp;
 }
 
 void MLP::print_debug_information(
@@ -0,0 +1,175 @@
+#include "model_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+
+constexpr char MODEL_MAGIC[8] = {'M', 'L', 'P', 'M', 'O', 'D', 'E', 'L'};
+constexpr uint64_t MODEL_VERSION = 1;
+// tensor blocks start at multiples of this, the widest vector loads
+constexpr uint64_t BLOCK_ALIGNMENT = 64;
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "model files are little endian");
+
+struct FileHeader {
+  char magic[8];
+  uint64_t version;
+  uint64_t num_layers;
+};
+
+struct LayerRecord {
+  uint64_t inputs;
+  uint64_t neurons;
+  uint64_t activation;
+  float alpha;
+  uint32_t reserved;
+  uint64_t weights_offset;
+  uint64_t biases_offset;
+};
+
+static_assert(sizeof(FileHeader) == 24 && sizeof(LayerRecord) == 48,
+              "the structs must match the file layout");
+
+uint64_t aligned(const uint64_t offset) {
+  return (offset + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+}
+
+uint64_t activation_code(const simd::Activation activation) {
+  switch (activation) {
+    case simd::Activation::NONE:
+      return 0;
+    case simd::Activation::LEAKY_RELU:
+      return 1;
+    case simd::Activation::SIGMOID:
+      return 2;
+  }
+  throw std::runtime_error("write_model_file: Unknown activation.");
+}
+
+simd::Activation activation_from_code(const uint64_t code) {
+  switch (code) {
+    case 0:
+      return simd::Activation::NONE;
+    case 1:
+      return simd::Activation::LEAKY_RELU;
+    case 2:
+      return simd::Activation::SIGMOID;
+  }
+  throw std::runtime_error("ModelFile: Unknown activation " +
+                           std::to_string(code) + ".");
+}
+
+// The float block of count values at offset lies within the file and is
+// aligned. Written to not overflow on garbage sizes.
+bool valid_block(const uint64_t offset, const uint64_t count,
+                 const uint64_t file_size) {
+  return offset % BLOCK_ALIGNMENT == 0 && offset <= file_size &&
+         count <= (file_size - offset) / sizeof(float);
+}
+
+}  // namespace
+
+void write_model_file(const std::vector<DenseLayerView>& layers,
+                      const std::string& filename) {
+  FileHeader header{};
+  std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+  header.version = MODEL_VERSION;
+  header.num_layers = layers.size();
+
+  std::vector<LayerRecord> records(layers.size());
+  uint64_t offset = aligned(sizeof(FileHeader) +
+                            layers.size() * sizeof(LayerRecord));
+  for (size_t idx = 0; idx < layers.size(); ++idx) {
+    const auto& layer = layers[idx];
+    if (!layer.weights.is_contiguous() || !layer.biases.is_contiguous() ||
+        layer.biases.rows() != 1 ||
+        layer.biases.cols() != layer.weights.cols()) {
+      throw std::runtime_error("write_model_file: Layer " +
+                               std::to_string(idx) + " has invalid weights.");
+    }
+    auto& record = records[idx];
+    record.inputs = layer.weights.rows();
+    record.neurons = layer.weights.cols();
+    record.activation = activation_code(layer.activation);
+    record.alpha = layer.alpha;
+    record.weights_offset = offset;
+    offset = aligned(offset + record.inputs * record.neurons * sizeof(float));
+    record.biases_offset = offset;
+    offset = aligned(offset + record.neurons * sizeof(float));
+  }
+
+  // readers never map a partial file
+  write_file_atomically(filename, [&](std::ostream& out) {
+    const char padding[BLOCK_ALIGNMENT] = {};
+    uint64_t written = 0;
+    const auto write = [&](const void* data, const uint64_t num_bytes) {
+      out.write(static_cast<const char*>(data), num_bytes);
+      written += num_bytes;
+    };
+    const auto pad_to = [&](const uint64_t block_offset) {
+      write(padding, block_offset - written);
+    };
+    write(&header, sizeof(header));
+    write(records.data(), records.size() * sizeof(LayerRecord));
+    for (size_t idx = 0; idx < layers.size(); ++idx) {
+      const auto& record = records[idx];
+      pad_to(record.weights_offset);
+      write(layers[idx].weights.data(),
+            record.inputs * record.neurons * sizeof(float));
+      pad_to(record.biases_offset);
+      write(layers[idx].biases.data(), record.neurons * sizeof(float));
+    }
+    pad_to(offset);
+  });
+}
+
+ModelFile::ModelFile(const std::string& filename) : file(filename) {
+  const uint8_t* bytes = this->file.data();
+  const uint64_t file_size = this->file.size();
+  FileHeader header;
+  if (file_size < sizeof(header) ||
+      std::memcmp(bytes, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) {
+    throw std::runtime_error(filename + " is no model file.");
+  }
+  std::memcpy(&header, bytes, sizeof(header));
+  if (header.version != MODEL_VERSION) {
+    throw std::runtime_error(filename + " has model file version " +
+                             std::to_string(header.version) + ", expected " +
+                             std::to_string(MODEL_VERSION) + ".");
+  }
+  if (header.num_layers == 0 ||
+      header.num_layers > (file_size - sizeof(header)) / sizeof(LayerRecord)) {
+    throw std::runtime_error("ModelFile: " + filename + " is truncated.");
+  }
+
+  for (uint64_t idx = 0; idx < header.num_layers; ++idx) {
+    LayerRecord record;
+    std::memcpy(&record,
+                bytes + sizeof(header) + idx * sizeof(LayerRecord),
+                sizeof(record));
+    const bool valid_shape =
+        record.inputs > 0 && record.neurons > 0 &&
+        record.inputs <= file_size / record.neurons &&
+        (idx == 0 || record.inputs == this->layer_views.back().weights.cols());
+    if (!valid_shape ||
+        !valid_block(record.weights_offset, record.inputs * record.neurons,
+                     file_size) ||
+        !valid_block(record.biases_offset, record.neurons, file_size)) {
+      throw std::runtime_error("ModelFile: Layer " + std::to_string(idx) +
+                               " of " + filename + " is invalid.");
+    }
+    const auto* weights =
+        reinterpret_cast<const float*>(bytes + record.weights_offset);
+    const auto* biases =
+        reinterpret_cast<const float*>(bytes + record.biases_offset);
+    this->layer_views.push_back(
+        {MatView<const float>(weights, record.inputs, record.neurons,
+                              record.neurons),
+         MatView<const float>(biases, 1, record.neurons, record.neurons),
+         activation_from_code(record.activation), record.alpha});
+  }
+}
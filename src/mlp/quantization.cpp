@@ -0,0 +1,101 @@
+#include "quantization.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "gemm.h"
+
+namespace {
+
+// Asymmetric uint8 range of [low, high], which is widened to contain zero,
+// so that zero (e.g. padding or ReLU outputs) is exact.
+void calibrate_input(float low, float high, QuantizedDenseLayer& layer) {
+  low = std::min(low, 0.0f);
+  high = std::max(high, 0.0f);
+  layer.input_scale = high > low ? (high - low) / 255.0f : 1.0f;
+  layer.input_zero_point = static_cast<int32_t>(
+      std::min(std::max(std::nearbyint(-low / layer.input_scale), 0.0f),
+               255.0f));
+}
+
+// Per neuron symmetric int8 weights, then the epilogue that turns the int32
+// sums back into act(x * w + b).
+void quantize_weights(const DenseLayerView& view,
+                      QuantizedDenseLayer& layer) {
+  const size_t inputs = layer.inputs;
+  const size_t neurons = layer.neurons;
+  std::vector<float> weight_scale(neurons, 0.0f);
+  for (size_t p = 0; p < inputs; ++p) {
+    for (size_t j = 0; j < neurons; ++j) {
+      weight_scale[j] = std::max(weight_scale[j], std::abs(view.weights(p, j)));
+    }
+  }
+  for (auto& scale : weight_scale) {
+    scale = scale > 0.0f ? scale / 127.0f : 1.0f;
+  }
+
+  std::vector<int8_t> weights(inputs * neurons);
+  std::vector<int32_t> column_sums(neurons, 0);
+  for (size_t p = 0; p < inputs; ++p) {
+    for (size_t j = 0; j < neurons; ++j) {
+      const auto q = static_cast<int8_t>(
+          std::nearbyint(view.weights(p, j) / weight_scale[j]));
+      weights[p * neurons + j] = q;
+      column_sums[j] += q;
+    }
+  }
+  layer.weights.resize(gemm::int8_packed_size(inputs, neurons));
+  gemm::pack_int8(inputs, neurons, weights.data(), layer.weights.data());
+
+  layer.scale.assign(gemm::int8_width(neurons), 0.0f);
+  layer.offset.assign(gemm::int8_width(neurons), 0.0f);
+  for (size_t j = 0; j < neurons; ++j) {
+    layer.scale[j] = layer.input_scale * weight_scale[j];
+    layer.offset[j] =
+        view.biases(0, j) -
+        layer.scale[j] * static_cast<float>(layer.input_zero_point) *
+            static_cast<float>(column_sums[j]);
+  }
+}
+
+}  // namespace
+
+QuantizedMLP::QuantizedMLP(const std::vector<DenseLayerView>& layers,
+                           const Mat2D<float>& calibration_inputs) {
+  if (layers.empty() || calibration_inputs.get_num_rows() == 0 ||
+      calibration_inputs.get_num_cols() != layers.front().weights.rows()) {
+    throw std::runtime_error(
+        "QuantizedMLP: Calibration inputs do not match the first layer.");
+  }
+  // the float forward pass, whose layer inputs set the ranges
+  const size_t rows = calibration_inputs.get_num_rows();
+  Mat2D<float> input = calibration_inputs;
+  Mat2D<float> output(0, 0);
+  for (const auto& view : layers) {
+    QuantizedDenseLayer layer{};
+    layer.inputs = view.weights.rows();
+    layer.neurons = view.weights.cols();
+    layer.activation = view.activation;
+    layer.alpha = view.alpha;
+    const auto [low, high] = std::minmax_element(input.matrix_data.begin(),
+                                                 input.matrix_data.end());
+    calibrate_input(*low, *high, layer);
+    quantize_weights(view, layer);
+    this->quantized_layers.push_back(std::move(layer));
+
+    output.resize(rows, view.weights.cols());
+    gemm::matmul_bias_activation(rows, view.weights.cols(),
+                                 view.weights.rows(), input.matrix_data.data(),
+                                 view.weights.data(), view.biases.data(),
+                                 view.activation, view.alpha,
+                                 output.matrix_data.data());
+    std::swap(input, output);
+  }
+}
+
+QuantizedMLP::QuantizedMLP(const MLP& mlp,
+                           const Mat2D<float>& calibration_inputs)
+    : QuantizedMLP(mlp.layer_views(), calibration_inputs) {}
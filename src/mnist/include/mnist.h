@@ -1,9 +1,87 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <tuple>
 #include <vector>
+#include "mapped_file.h"
 #include "utils.h"
 
 std::vector<std::pair<Mat2D<float>, Mat2D<float>>> read_mnist_csv(
     const std::string csv_filename, const size_t batch_size,
-    const int64_t num_batches_to_load);
\ No newline at end of file
+    const int64_t num_batches_to_load);
+
+// MNIST samples straight from a memory mapped file, either the native IDX
+// files (train-images-idx3-ubyte and train-labels-idx1-ubyte) or the packed
+// binary cache written by write_mnist_binary. Images are handed out as uint8
+// views into the mapping, fill_batch normalizes them on the fly. A csv whose
+// cache cannot be written is held in memory instead.
+class MnistDataset {
+ public:
+  static MnistDataset open_idx(const std::string& images_filename,
+                               const std::string& labels_filename);
+  static MnistDataset open_binary(const std::string& filename);
+  // Takes over labels and images (num_pixels each) already in memory.
+  static MnistDataset from_memory(std::vector<uint8_t> labels,
+                                  std::vector<uint8_t> images,
+                                  const size_t num_pixels);
+
+  size_t size() const { return num_samples; }
+  size_t image_size() const { return num_pixels; }
+  // image_size() pixels of sample idx
+  const uint8_t* image(const size_t idx) const {
+    return images + idx * num_pixels;
+  }
+  uint8_t label(const size_t idx) const { return labels[idx]; }
+
+  // Writes samples [first_sample, first_sample + batch_size) into the rows of
+  // images (batch_size x image_size()) and labels_one_hot (batch_size x 10),
+  // with pixels scaled to [-0.5, 0.5) like read_mnist_csv.
+  void fill_batch(const size_t first_sample, const size_t batch_size,
+                  Mat2D<float>& images, Mat2D<float>& labels_one_hot) const;
+  // Same, for arbitrary samples, e.g. a shuffled order.
+  void fill_batch(const size_t* sample_indices, const size_t batch_size,
+                  Mat2D<float>& images, Mat2D<float>& labels_one_hot) const;
+  // Same with the labels as class indices (batch_size x 1), a tenth of the
+  // memory of one hot rows. See Loss::loss_and_grad_into.
+  void fill_batch(const size_t* sample_indices, const size_t batch_size,
+                  Mat2D<float>& images, Mat2D<int32_t>& labels) const;
+  // Shuffled full batches of the samples from first_sample on, the same
+  // layout as read_mnist_csv returns.
+  std::vector<std::pair<Mat2D<float>, Mat2D<float>>> to_batches(
+      const size_t batch_size, const int64_t num_batches_to_load,
+      const size_t first_sample = 0) const;
+
+ private:
+  void fill_images(const size_t* sample_indices, const size_t batch_size,
+                   Mat2D<float>& images) const;
+
+  MnistDataset(std::vector<MappedFile> files, const uint8_t* images,
+               const uint8_t* labels, size_t num_samples, size_t num_pixels);
+
+  std::vector<MappedFile> files;
+  // the samples of from_memory, empty for mapped files
+  std::vector<uint8_t> owned_labels;
+  std::vector<uint8_t> owned_images;
+  const uint8_t* images;
+  const uint8_t* labels;
+  size_t num_samples;
+  size_t num_pixels;
+};
+
+// Converts a MNIST csv file into the packed binary cache format. The file is
+// replaced atomically (see write_file_atomically), so concurrent runs may
+// convert the same csv.
+void write_mnist_binary(const std::string& csv_filename,
+                        const std::string& binary_filename);
+
+// Opens a csv (through its binary cache <csv_filename>.bin, which is written
+// on first use and again when the size or modification time of the csv
+// changed), IDX images (the labels file is found by its standard name)
+// or binary cache file. If the cache of a csv cannot be written, e.g. in a
+// read-only directory, the parsed samples are kept in memory.
+MnistDataset open_mnist(const std::string& filename);
+
+// Loads all batches of a file supported by open_mnist.
+std::vector<std::pair<Mat2D<float>, Mat2D<float>>> read_mnist(
+    const std::string& filename, const size_t batch_size,
+    const int64_t num_batches_to_load);
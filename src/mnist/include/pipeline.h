@@ -0,0 +1,68 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "mnist.h"
+#include "utils.h"
+
+struct Batch {
+  Mat2D<float> images;
+  // class index of every image, batch_size x 1
+  Mat2D<int32_t> labels;
+};
+
+// Streams batches of a MnistDataset. A background thread reshuffles the
+// samples every epoch and assembles the batches into a bounded ring of
+// reusable buffers, so at most num_buffers batches are held in memory and
+// the samples themselves are only paged in from the memory mapped file when
+// they are needed. The dataset must outlive the pipeline.
+class DataPipeline {
+ public:
+  // Uses the samples [first_sample, first_sample + num_samples), all samples
+  // by default. The remainder which does not fill a whole batch differs
+  // from epoch to epoch and is dropped.
+  DataPipeline(const MnistDataset& dataset, const size_t batch_size,
+               const size_t num_buffers = 4, const size_t first_sample = 0,
+               const size_t num_samples = SIZE_MAX,
+               const uint64_t seed = std::random_device()());
+  ~DataPipeline();
+  DataPipeline(const DataPipeline&) = delete;
+  DataPipeline& operator=(const DataPipeline&) = delete;
+
+  // The next batch of the current epoch, nullptr once the epoch is done. The
+  // call after that starts the next epoch. The batch stays valid until the
+  // next call. Rethrows an exception of the loader thread once the batches
+  // it queued before are used up.
+  const Batch* next();
+  size_t batches_per_epoch() const;
+
+ private:
+  // Runs load_batches and keeps its exception for next(), an exception
+  // leaving the thread would terminate the program.
+  void loader_loop();
+  void load_batches();
+
+  const MnistDataset& dataset;
+  const size_t batch_size;
+  std::vector<size_t> sample_indices;
+  std::mt19937_64 generator;
+
+  std::vector<Batch> buffers;
+  std::mutex mutex;
+  std::condition_variable buffer_freed;
+  std::condition_variable batch_ready;
+  std::vector<size_t> free_buffers;
+  // buffer indices in order, END_OF_EPOCH marks the end of an epoch
+  std::deque<size_t> ready_buffers;
+  static constexpr size_t END_OF_EPOCH = SIZE_MAX;
+  size_t current_buffer = END_OF_EPOCH;
+  bool stopping = false;
+  std::exception_ptr loader_error;
+  std::thread loader;
+};
@@ -0,0 +1,114 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+DataPipeline::DataPipeline(const MnistDataset& dataset,
+                           const size_t batch_size, const size_t num_buffers,
+                           const size_t first_sample,
+                           const size_t num_samples, const uint64_t seed)
+    : dataset(dataset), batch_size(batch_size), generator(seed) {
+  if (batch_size == 0 || num_buffers == 0) {
+    throw std::runtime_error(
+        "DataPipeline: batch size and number of buffers must be positive.");
+  }
+  if (first_sample > dataset.size()) {
+    throw std::runtime_error("DataPipeline: First sample out of range.");
+  }
+  sample_indices.resize(
+      std::min(num_samples, dataset.size() - first_sample));
+  std::iota(sample_indices.begin(), sample_indices.end(), first_sample);
+  for (size_t idx = 0; idx < num_buffers; ++idx) {
+    buffers.push_back({Mat2D<float>(batch_size, dataset.image_size()),
+                       Mat2D<int32_t>(batch_size, 1)});
+    free_buffers.push_back(idx);
+  }
+  loader = std::thread([this]() { this->loader_loop(); });
+}
+
+DataPipeline::~DataPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  buffer_freed.notify_all();
+  loader.join();
+}
+
+size_t DataPipeline::batches_per_epoch() const {
+  return sample_indices.size() / batch_size;
+}
+
+const Batch* DataPipeline::next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  // the loader waits for a free buffer or for the end of epoch marker to go
+  if (current_buffer != END_OF_EPOCH) {
+    free_buffers.push_back(current_buffer);
+    buffer_freed.notify_one();
+  }
+  batch_ready.wait(
+      lock, [this]() { return !ready_buffers.empty() || loader_error; });
+  if (ready_buffers.empty()) {
+    current_buffer = END_OF_EPOCH;
+    std::rethrow_exception(loader_error);
+  }
+  current_buffer = ready_buffers.front();
+  ready_buffers.pop_front();
+  buffer_freed.notify_one();
+  return current_buffer == END_OF_EPOCH ? nullptr : &buffers[current_buffer];
+}
+
+void DataPipeline::loader_loop() {
+  try {
+    this->load_batches();
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      loader_error = std::current_exception();
+    }
+    batch_ready.notify_one();
+  }
+}
+
+void DataPipeline::load_batches() {
+  while (true) {
+    std::shuffle(sample_indices.begin(), sample_indices.end(), generator);
+    for (size_t batch = 0; batch < batches_per_epoch(); ++batch) {
+      size_t buffer = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        buffer_freed.wait(
+            lock, [this]() { return stopping || !free_buffers.empty(); });
+        if (stopping) {
+          return;
+        }
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+      }
+      // the buffer belongs to this thread until it is queued
+      dataset.fill_batch(sample_indices.data() + batch * batch_size,
+                         batch_size, buffers[buffer].images,
+                         buffers[buffer].labels);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready_buffers.push_back(buffer);
+      }
+      batch_ready.notify_one();
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      // at most one finished epoch ahead, so the queue stays bounded
+      buffer_freed.wait(lock, [this]() {
+        return stopping ||
+               std::find(ready_buffers.begin(), ready_buffers.end(),
+                         END_OF_EPOCH) == ready_buffers.end();
+      });
+      if (stopping) {
+        return;
+      }
+      ready_buffers.push_back(END_OF_EPOCH);
+    }
+    batch_ready.notify_one();
+  }
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "layer.h"
+#include "mlp.h"
+#include "mnist.h"
+#include "parallel.h"
+#include "utils.h"
+
+// Trains the network of main for a fixed number of steps with 1, 2, 4, ...
+// threads and reports the throughput. Without a dataset random batches of
+// the MNIST shape are used.
+std::vector<std::pair<Mat2D<float>, Mat2D<float>>> random_batches(
+    const size_t batch_size, const size_t num_batches) {
+  std::vector<std::pair<Mat2D<float>, Mat2D<float>>> dataset;
+  for (size_t batch_idx = 0; batch_idx < num_batches; ++batch_idx) {
+    Mat2D<float> labels_one_hot(batch_size, 10);
+    for (size_t sample_idx = 0; sample_idx < batch_size; ++sample_idx) {
+      labels_one_hot(sample_idx, (sample_idx + batch_idx) % 10) = 1.0;
+    }
+    dataset.emplace_back(Mat2D<float>(batch_size, 784, RANDOM_UNIFORM),
+                         labels_one_hot);
+  }
+  return dataset;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 3) {
+    std::cout << "Usage:" << std::endl
+              << "./scaling_benchmark [path/to/train.csv|\"\"] [max_threads]"
+              << std::endl;
+    return 1;
+  }
+  const size_t batch_size = 64;
+  const size_t num_steps = 200;
+  const size_t max_threads =
+      argc == 3 ? std::stoul(argv[2])
+                : std::max(1u, std::thread::hardware_concurrency());
+
+  // an empty path selects the random batches as well
+  const bool use_csv = argc >= 2 && std::string(argv[1]).size() > 0;
+  const auto dataset = use_csv
+                           ? read_mnist(argv[1], batch_size, num_steps)
+                           : random_batches(batch_size, num_steps);
+  if (dataset.size() < 5) {
+    std::cout << "Not enough batches in the dataset." << std::endl;
+    return 1;
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+
+  double single_thread_throughput = 0.0;
+  for (size_t num_threads = 1;; num_threads = std::min(2 * num_threads,
+                                                       max_threads)) {
+    auto mlp = MLP({50, 25}, /*num_inputs=*/784, /*num_classes=*/10,
+                   RANDOM_UNIFORM, ZEROS, num_threads);
+    // warm up the pool and the packing buffers
+    for (size_t step = 0; step < 5; ++step) {
+      mlp.train(dataset[step].first, dataset[step].second, loss_obj, 0.01);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& [input, target_label] : dataset) {
+      mlp.train(input, target_label, loss_obj, 0.01);
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double throughput =
+        static_cast<double>(dataset.size() * batch_size) / elapsed.count();
+    if (num_threads == 1) {
+      single_thread_throughput = throughput;
+    }
+    std::cout << "Threads: " << std::setw(3) << num_threads
+              << " - samples/sec: " << std::setw(10) << std::fixed
+              << std::setprecision(0) << throughput
+              << " - speedup: " << std::setprecision(2)
+              << throughput / single_thread_throughput << std::endl;
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include "cpu.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace cpu {
+
+namespace {
+
+constexpr int NOT_FORCED = -1;
+std::atomic<int> forced_isa{NOT_FORCED};
+
+Isa isa_from_name(const std::string& name) {
+  for (const auto isa : {Isa::SCALAR, Isa::BASELINE, Isa::AVX2, Isa::AVX512}) {
+    if (isa_name(isa) == name) {
+      return isa;
+    }
+  }
+  throw std::runtime_error("MLP_FORCE_ISA: unknown instruction set '" + name +
+                           "', expected scalar, baseline, avx2 or avx512.");
+}
+
+Isa default_isa() {
+  static const Isa isa = []() {
+    const char* env = std::getenv("MLP_FORCE_ISA");
+    if (env == nullptr || *env == '\0') {
+      return detected_isa();
+    }
+    const Isa requested = isa_from_name(env);
+    if (!isa_supported(requested)) {
+      throw std::runtime_error("MLP_FORCE_ISA: " + isa_name(requested) +
+                               " is not supported on this machine.");
+    }
+    return requested;
+  }();
+  return isa;
+}
+
+}  // namespace
+
+Isa detected_isa() {
+#if defined(MLP_X86_KERNELS)
+  // the kernels of both convert float16 with F16C, which every CPU with
+  // AVX2 or AVX-512 has
+  if (!__builtin_cpu_supports("f16c")) {
+    return Isa::BASELINE;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    return Isa::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return Isa::AVX2;
+  }
+#endif
+  return Isa::BASELINE;
+}
+
+Isa active_isa() {
+  const int forced = forced_isa.load(std::memory_order_relaxed);
+  if (forced != NOT_FORCED) {
+    return static_cast<Isa>(forced);
+  }
+  return default_isa();
+}
+
+bool isa_supported(Isa isa) {
+  switch (isa) {
+    case Isa::SCALAR:
+    case Isa::BASELINE:
+      return true;
+    case Isa::AVX2:
+      return detected_isa() == Isa::AVX2 || detected_isa() == Isa::AVX512;
+    case Isa::AVX512:
+      return detected_isa() == Isa::AVX512;
+  }
+  return false;
+}
+
+void force_isa(Isa isa) {
+  if (!isa_supported(isa)) {
+    throw std::runtime_error("force_isa: " + isa_name(isa) +
+                             " is not supported on this machine.");
+  }
+  forced_isa.store(static_cast<int>(isa), std::memory_order_relaxed);
+}
+
+void reset_isa() { forced_isa.store(NOT_FORCED, std::memory_order_relaxed); }
+
+std::string isa_name(Isa isa) {
+  switch (isa) {
+    case Isa::SCALAR:
+      return "scalar";
+    case Isa::BASELINE:
+      return "baseline";
+    case Isa::AVX2:
+      return "avx2";
+    case Isa::AVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+bool avx512_vnni_supported() {
+#if defined(MLP_X86_KERNELS)
+  static const bool supported = __builtin_cpu_supports("avx512f") &&
+                                __builtin_cpu_supports("avx512vnni");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+}  // namespace cpu
@@ -0,0 +1,622 @@
+#include "gemm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(MLP_BLAS_MKL)
+#include <mkl_cblas.h>
+#include <mkl_service.h>
+#elif defined(MLP_BLAS_OPENBLAS)
+#include <cblas.h>
+#endif
+
+#include "cpu.h"
+#include "gemm_kernel.h"
+#include "qgemm_kernel.h"
+#include "parallel.h"
+#include "simd.h"
+
+namespace gemm {
+
+template <typename T>
+T* scratch(size_t slot, size_t count) {
+  thread_local std::vector<T> buffers[2];
+  std::vector<T>& buffer = buffers[slot];
+  if (buffer.size() < count) {
+    buffer.resize(count);
+  }
+  return buffer.data();
+}
+
+template float* scratch<float>(size_t slot, size_t count);
+template double* scratch<double>(size_t slot, size_t count);
+
+#if defined(MLP_X86_KERNELS)
+namespace avx2 {
+void gemm(size_t m, size_t n, size_t k, float alpha, const float* a,
+          size_t a_row_stride, size_t a_col_stride, const float* b,
+          size_t b_row_stride, size_t b_col_stride, float beta, float* c,
+          size_t ldc, const Epilogue<float>* epilogue);
+void gemm(size_t m, size_t n, size_t k, double alpha, const double* a,
+          size_t a_row_stride, size_t a_col_stride, const double* b,
+          size_t b_row_stride, size_t b_col_stride, double beta, double* c,
+          size_t ldc, const Epilogue<double>* epilogue);
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc);
+template <typename A, typename B>
+void mixed_gemm(size_t m, size_t n, size_t k, float alpha, const A* a,
+                size_t a_row_stride, size_t a_col_stride, const B* b,
+                size_t b_row_stride, size_t b_col_stride, float beta,
+                float* c, size_t ldc, const Epilogue<float>* epilogue);
+void sparse_matmul(size_t m, size_t n, const uint32_t* row_offsets,
+                   const uint32_t* col_indices, const float* values,
+                   const float* b, size_t ldb, float beta, float* c,
+                   size_t ldc, const Epilogue<float>* epilogue);
+}  // namespace avx2
+namespace avx512 {
+void gemm(size_t m, size_t n, size_t k, float alpha, const float* a,
+          size_t a_row_stride, size_t a_col_stride, const float* b,
+          size_t b_row_stride, size_t b_col_stride, float beta, float* c,
+          size_t ldc, const Epilogue<float>* epilogue);
+void gemm(size_t m, size_t n, size_t k, double alpha, const double* a,
+          size_t a_row_stride, size_t a_col_stride, const double* b,
+          size_t b_row_stride, size_t b_col_stride, double beta, double* c,
+          size_t ldc, const Epilogue<double>* epilogue);
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc);
+template <typename A, typename B>
+void mixed_gemm(size_t m, size_t n, size_t k, float alpha, const A* a,
+                size_t a_row_stride, size_t a_col_stride, const B* b,
+                size_t b_row_stride, size_t b_col_stride, float beta,
+                float* c, size_t ldc, const Epilogue<float>* epilogue);
+void sparse_matmul(size_t m, size_t n, const uint32_t* row_offsets,
+                   const uint32_t* col_indices, const float* values,
+                   const float* b, size_t ldb, float beta, float* c,
+                   size_t ldc, const Epilogue<float>* epilogue);
+}  // namespace avx512
+namespace vnni {
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc);
+}  // namespace vnni
+#endif
+
+namespace {
+
+constexpr int NOT_SET = -1;
+std::atomic<int> selected_backend{NOT_SET};
+
+Backend default_backend() {
+  static const Backend backend = []() {
+    const char* env = std::getenv("MLP_GEMM_BACKEND");
+    if (env == nullptr || *env == '\0') {
+      return Backend::BUILTIN;
+    }
+    for (const auto candidate : {Backend::BUILTIN, Backend::BLAS}) {
+      if (backend_name(candidate) != env) {
+        continue;
+      }
+      if (!blas_available() && candidate == Backend::BLAS) {
+        throw std::runtime_error(
+            "MLP_GEMM_BACKEND: blas requested, but the library was built "
+            "without a BLAS backend (see -DMLP_BLAS).");
+      }
+      return candidate;
+    }
+    throw std::runtime_error("MLP_GEMM_BACKEND: unknown backend '" +
+                             std::string(env) +
+                             "', expected builtin or blas.");
+  }();
+  return backend;
+}
+
+#if defined(MLP_BLAS_MKL) || defined(MLP_BLAS_OPENBLAS)
+CBLAS_TRANSPOSE cblas_transpose(Transpose trans) {
+  return trans == Transpose::YES ? CblasTrans : CblasNoTrans;
+}
+
+// cblas wants leading dimensions of at least 1, even for empty operands
+int leading_dim(size_t ld) { return ld == 0 ? 1 : static_cast<int>(ld); }
+
+// cblas takes sizes and leading dimensions as int.
+bool fits_blas(size_t m, size_t n, size_t k, size_t lda, size_t ldb,
+               size_t ldc) {
+  const size_t limit = static_cast<size_t>(INT_MAX);
+  return m <= limit && n <= limit && k <= limit && lda <= limit &&
+         ldb <= limit && ldc <= limit;
+}
+
+// parallel_gemm splits BLAS calls over the pool like the builtin kernels,
+// threads of the library would only compete with the pool's.
+void limit_blas_threads() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+#if defined(MLP_BLAS_MKL)
+    mkl_set_num_threads(1);
+#else
+    openblas_set_num_threads(1);
+#endif
+  });
+}
+
+void blas_gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n,
+               size_t k, float alpha, const float* a, size_t lda,
+               const float* b, size_t ldb, float beta, float* c, size_t ldc) {
+  cblas_sgemm(CblasRowMajor, cblas_transpose(trans_a),
+              cblas_transpose(trans_b), static_cast<int>(m),
+              static_cast<int>(n), static_cast<int>(k), alpha, a,
+              leading_dim(lda), b, leading_dim(ldb), beta, c, leading_dim(ldc));
+}
+
+void blas_gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n,
+               size_t k, double alpha, const double* a, size_t lda,
+               const double* b, size_t ldb, double beta, double* c,
+               size_t ldc) {
+  cblas_dgemm(CblasRowMajor, cblas_transpose(trans_a),
+              cblas_transpose(trans_b), static_cast<int>(m),
+              static_cast<int>(n), static_cast<int>(k), alpha, a,
+              leading_dim(lda), b, leading_dim(ldb), beta, c, leading_dim(ldc));
+}
+#endif
+
+// Below this many multiply-adds a GEMM runs on one thread.
+constexpr size_t PARALLEL_MIN_FLOPS = 1 << 18;
+// Row and column chunks are multiples of every register tile height and
+// width, so splitting the output does not add partial tiles.
+constexpr size_t ROW_GRAIN = 48;
+constexpr size_t COL_GRAIN = 64;
+// Rows of a sparse product differ in their number of nonzeros, smaller
+// chunks balance the threads better.
+constexpr size_t SPARSE_ROW_GRAIN = 8;
+
+// Whether both operands are stored as T, i.e. no 16 bit storage.
+template <typename T, typename SA, typename SB>
+constexpr bool same_storage_v =
+    std::is_same_v<SA, T> && std::is_same_v<SB, T>;
+
+template <typename T, typename SA, typename SB>
+void dispatch_gemm(size_t m, size_t n, size_t k, T alpha,
+                   const Operand<SA>& a, const Operand<SB>& b, T beta, T* c,
+                   size_t ldc, const Epilogue<T>* epilogue) {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      if constexpr (same_storage_v<T, SA, SB>) {
+        avx512::gemm(m, n, k, alpha, a.data, a.row_stride, a.col_stride,
+                     b.data, b.row_stride, b.col_stride, beta, c, ldc,
+                     epilogue);
+      } else {
+        avx512::mixed_gemm(m, n, k, alpha, a.data, a.row_stride,
+                           a.col_stride, b.data, b.row_stride, b.col_stride,
+                           beta, c, ldc, epilogue);
+      }
+      return;
+    case cpu::Isa::AVX2:
+      if constexpr (same_storage_v<T, SA, SB>) {
+        avx2::gemm(m, n, k, alpha, a.data, a.row_stride, a.col_stride,
+                   b.data, b.row_stride, b.col_stride, beta, c, ldc,
+                   epilogue);
+      } else {
+        avx2::mixed_gemm(m, n, k, alpha, a.data, a.row_stride, a.col_stride,
+                         b.data, b.row_stride, b.col_stride, beta, c, ldc,
+                         epilogue);
+      }
+      return;
+#endif
+    default:
+      gemm_kernel<T>(m, n, k, alpha, a, b, beta, c, ldc, epilogue);
+      return;
+  }
+}
+
+// The epilogue as separate passes over a dense m x n C, for the cases the
+// micro-kernel does not cover.
+template <typename T>
+void apply_epilogue(size_t m, size_t n, const Epilogue<T>& epilogue, T* c) {
+  if (epilogue.bias != nullptr) {
+    simd::binary(simd::BinaryOp::ADD, m, n, {c, n, 1}, {epilogue.bias, 0, 1},
+                 c);
+  }
+  switch (epilogue.activation) {
+    case simd::Activation::LEAKY_RELU:
+      simd::unary(simd::UnaryOp::LEAKY_RELU, m * n, c, c, epilogue.param);
+      return;
+    case simd::Activation::SIGMOID:
+      simd::unary(simd::UnaryOp::SIGMOID, m * n, c, c, T(0));
+      return;
+    case simd::Activation::NONE:
+      return;
+  }
+}
+
+// Threads work on disjoint blocks of rows (or columns) of C. Every element of
+// C is still computed by the same sequence of operations as in a serial run,
+// so the result does not depend on the number of threads. A and B stored in
+// 16 bits always run on the builtin kernels.
+template <typename T, typename SA = T, typename SB = T>
+void parallel_gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n,
+                   size_t k, T alpha, const SA* a, size_t lda, const SB* b,
+                   size_t ldb, T beta, T* c, size_t ldc,
+                   const Epilogue<T>* epilogue) {
+  bool use_blas = false;
+#if defined(MLP_BLAS_MKL) || defined(MLP_BLAS_OPENBLAS)
+  // k == 0 only scales C, which the builtin path handles without BLAS. The
+  // results of the vendor kernels may depend on how a product is split, so
+  // deterministic mode keeps to the builtin ones.
+  use_blas = same_storage_v<T, SA, SB> &&
+             active_backend() == Backend::BLAS && m > 0 && n > 0 && k > 0 &&
+             fits_blas(m, n, k, lda, ldb, ldc) && !parallel::deterministic();
+#endif
+  if (epilogue != nullptr && (use_blas || k == 0)) {
+    parallel_gemm<T>(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta,
+                     c, ldc, nullptr);
+    apply_epilogue(m, n, *epilogue, c);
+    return;
+  }
+#if defined(MLP_BLAS_MKL) || defined(MLP_BLAS_OPENBLAS)
+  if constexpr (same_storage_v<T, SA, SB>) {
+    if (use_blas) {
+      // the same split as below, with the single threaded library per chunk
+      limit_blas_threads();
+      const auto a_rows = [&](size_t begin) {
+        return trans_a == Transpose::YES ? a + begin : a + begin * lda;
+      };
+      const auto b_cols = [&](size_t begin) {
+        return trans_b == Transpose::YES ? b + begin * ldb : b + begin;
+      };
+      if (m * n * k < PARALLEL_MIN_FLOPS || parallel::num_threads() == 1) {
+        blas_gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                  ldc);
+      } else if (m >= n) {
+        parallel::parallel_for(m, ROW_GRAIN, [&](size_t begin, size_t end) {
+          blas_gemm(trans_a, trans_b, end - begin, n, k, alpha, a_rows(begin),
+                    lda, b, ldb, beta, c + begin * ldc, ldc);
+        });
+      } else {
+        parallel::parallel_for(n, COL_GRAIN, [&](size_t begin, size_t end) {
+          blas_gemm(trans_a, trans_b, m, end - begin, k, alpha, a, lda,
+                    b_cols(begin), ldb, beta, c + begin, ldc);
+        });
+      }
+      return;
+    }
+  }
+#endif
+
+  // op(A) and op(B) as strided views of the row-major A and B
+  const Operand<SA> op_a = trans_a == Transpose::YES ? Operand<SA>{a, 1, lda}
+                                                     : Operand<SA>{a, lda, 1};
+  const Operand<SB> op_b = trans_b == Transpose::YES ? Operand<SB>{b, 1, ldb}
+                                                     : Operand<SB>{b, ldb, 1};
+  if (m * n * k < PARALLEL_MIN_FLOPS || parallel::num_threads() == 1) {
+    dispatch_gemm(m, n, k, alpha, op_a, op_b, beta, c, ldc, epilogue);
+  } else if (m >= n) {
+    parallel::parallel_for(m, ROW_GRAIN, [&](size_t begin, size_t end) {
+      const Operand<SA> rows = {op_a.data + begin * op_a.row_stride,
+                                op_a.row_stride, op_a.col_stride};
+      dispatch_gemm(end - begin, n, k, alpha, rows, op_b, beta,
+                    c + begin * ldc, ldc, epilogue);
+    });
+  } else {
+    parallel::parallel_for(n, COL_GRAIN, [&](size_t begin, size_t end) {
+      const Operand<SB> cols = {op_b.data + begin * op_b.col_stride,
+                                op_b.row_stride, op_b.col_stride};
+      Epilogue<T> cols_epilogue{};
+      if (epilogue != nullptr) {
+        cols_epilogue = *epilogue;
+        if (cols_epilogue.bias != nullptr) {
+          cols_epilogue.bias += begin;
+        }
+      }
+      dispatch_gemm(m, end - begin, k, alpha, op_a, cols, beta, c + begin,
+                    ldc, epilogue != nullptr ? &cols_epilogue : nullptr);
+    });
+  }
+}
+
+void dispatch_sparse_matmul(size_t m, size_t n, const uint32_t* row_offsets,
+                            const uint32_t* col_indices, const float* values,
+                            const float* b, size_t ldb, float beta, float* c,
+                            size_t ldc, const Epilogue<float>* epilogue) {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      avx512::sparse_matmul(m, n, row_offsets, col_indices, values, b, ldb,
+                            beta, c, ldc, epilogue);
+      return;
+    case cpu::Isa::AVX2:
+      avx2::sparse_matmul(m, n, row_offsets, col_indices, values, b, ldb,
+                          beta, c, ldc, epilogue);
+      return;
+#endif
+    default:
+      sparse_matmul_kernel<float>(m, n, row_offsets, col_indices, values, b,
+                                  ldb, beta, c, ldc, epilogue);
+      return;
+  }
+}
+
+// Packed int8 B has this many columns per multiple, the int32 lanes of the
+// widest vector.
+constexpr size_t INT8_COLUMN_MULTIPLE = 16;
+
+void dispatch_int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a,
+                          size_t lda, const int8_t* b, size_t ldb,
+                          const float* scale, const float* offset,
+                          simd::Activation activation, float param, float* c,
+                          size_t ldc) {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      if (cpu::avx512_vnni_supported()) {
+        vnni::int8_matmul(m, n, k, a, lda, b, ldb, scale, offset, activation,
+                          param, c, ldc);
+      } else {
+        avx512::int8_matmul(m, n, k, a, lda, b, ldb, scale, offset,
+                            activation, param, c, ldc);
+      }
+      return;
+    case cpu::Isa::AVX2:
+      avx2::int8_matmul(m, n, k, a, lda, b, ldb, scale, offset, activation,
+                        param, c, ldc);
+      return;
+#endif
+    case cpu::Isa::SCALAR:
+      int8_matmul<sizeof(int32_t)>(m, n, k, a, lda, b, ldb, scale, offset,
+                                   activation, param, c, ldc);
+      return;
+    default:
+      int8_matmul<16>(m, n, k, a, lda, b, ldb, scale, offset, activation,
+                      param, c, ldc);
+      return;
+  }
+}
+
+}  // namespace
+
+bool blas_available() {
+#if defined(MLP_BLAS_MKL) || defined(MLP_BLAS_OPENBLAS)
+  return true;
+#else
+  return false;
+#endif
+}
+
+Backend active_backend() {
+  const int selected = selected_backend.load(std::memory_order_relaxed);
+  if (selected != NOT_SET) {
+    return static_cast<Backend>(selected);
+  }
+  return default_backend();
+}
+
+void set_backend(Backend backend) {
+  if (backend == Backend::BLAS && !blas_available()) {
+    throw std::runtime_error(
+        "set_backend: the library was built without a BLAS backend (see "
+        "-DMLP_BLAS).");
+  }
+  selected_backend.store(static_cast<int>(backend), std::memory_order_relaxed);
+}
+
+void reset_backend() {
+  selected_backend.store(NOT_SET, std::memory_order_relaxed);
+}
+
+std::string backend_name(Backend backend) {
+  switch (backend) {
+    case Backend::BUILTIN:
+      return "builtin";
+    case Backend::BLAS:
+      return "blas";
+  }
+  return "unknown";
+}
+
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          float alpha, const float* a, size_t lda, const float* b, size_t ldb,
+          float beta, float* c, size_t ldc) {
+  parallel_gemm<float>(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta,
+                       c, ldc, nullptr);
+}
+
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          double alpha, const double* a, size_t lda, const double* b,
+          size_t ldb, double beta, double* c, size_t ldc) {
+  parallel_gemm<double>(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta,
+                        c, ldc, nullptr);
+}
+
+void matmul_bias_activation(size_t m, size_t n, size_t k, const float* a,
+                            const float* b, const float* bias,
+                            simd::Activation activation, float param,
+                            float* c) {
+  const Epilogue<float> epilogue{bias, activation, param};
+  parallel_gemm(Transpose::NO, Transpose::NO, m, n, k, 1.0f, a, k, b, n, 0.0f,
+                c, n, &epilogue);
+}
+
+void matmul_bias_activation(size_t m, size_t n, size_t k, const double* a,
+                            const double* b, const double* bias,
+                            simd::Activation activation, double param,
+                            double* c) {
+  const Epilogue<double> epilogue{bias, activation, param};
+  parallel_gemm(Transpose::NO, Transpose::NO, m, n, k, 1.0, a, k, b, n, 0.0, c,
+                n, &epilogue);
+}
+
+template <typename A, typename B>
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          float alpha, const A* a, size_t lda, const B* b, size_t ldb,
+          float beta, float* c, size_t ldc) {
+  parallel_gemm<float>(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta,
+                       c, ldc, nullptr);
+}
+
+template <typename A, typename B>
+void matmul_bias_activation(size_t m, size_t n, size_t k, const A* a,
+                            const B* b, const float* bias,
+                            simd::Activation activation, float param,
+                            float* c) {
+  const Epilogue<float> epilogue{bias, activation, param};
+  parallel_gemm(Transpose::NO, Transpose::NO, m, n, k, 1.0f, a, k, b, n, 0.0f,
+                c, n, &epilogue);
+}
+
+// the combinations declared in gemm.h
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const bfloat16*, size_t, const bfloat16*, size_t, float,
+                   float*, size_t);
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const bfloat16*, size_t, const float*, size_t, float,
+                   float*, size_t);
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const float*, size_t, const bfloat16*, size_t, float,
+                   float*, size_t);
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const float16*, size_t, const float16*, size_t, float,
+                   float*, size_t);
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const float16*, size_t, const float*, size_t, float,
+                   float*, size_t);
+template void gemm(Transpose, Transpose, size_t, size_t, size_t, float,
+                   const float*, size_t, const float16*, size_t, float,
+                   float*, size_t);
+template void matmul_bias_activation(size_t, size_t, size_t, const bfloat16*,
+                                     const bfloat16*, const float*,
+                                     simd::Activation, float, float*);
+template void matmul_bias_activation(size_t, size_t, size_t, const bfloat16*,
+                                     const float*, const float*,
+                                     simd::Activation, float, float*);
+template void matmul_bias_activation(size_t, size_t, size_t, const float*,
+                                     const bfloat16*, const float*,
+                                     simd::Activation, float, float*);
+template void matmul_bias_activation(size_t, size_t, size_t, const float16*,
+                                     const float16*, const float*,
+                                     simd::Activation, float, float*);
+template void matmul_bias_activation(size_t, size_t, size_t, const float16*,
+                                     const float*, const float*,
+                                     simd::Activation, float, float*);
+template void matmul_bias_activation(size_t, size_t, size_t, const float*,
+                                     const float16*, const float*,
+                                     simd::Activation, float, float*);
+
+void sparse_matmul_bias_activation(size_t m, size_t n,
+                                   const uint32_t* row_offsets,
+                                   const uint32_t* col_indices,
+                                   const float* values, const float* b,
+                                   const float* bias,
+                                   simd::Activation activation, float param,
+                                   float* c, float beta) {
+  const Epilogue<float> epilogue{bias, activation, param};
+  const size_t nnz = row_offsets[m] - row_offsets[0];
+  if (nnz * n < PARALLEL_MIN_FLOPS || parallel::num_threads() == 1) {
+    dispatch_sparse_matmul(m, n, row_offsets, col_indices, values, b, n, beta,
+                           c, n, &epilogue);
+  } else if (m >= n) {
+    parallel::parallel_for(m, SPARSE_ROW_GRAIN,
+                           [&](size_t begin, size_t end) {
+      dispatch_sparse_matmul(end - begin, n, row_offsets + begin, col_indices,
+                             values, b, n, beta, c + begin * n, n,
+                             &epilogue);
+    });
+  } else {
+    parallel::parallel_for(n, COL_GRAIN, [&](size_t begin, size_t end) {
+      const Epilogue<float> cols_epilogue{
+          bias != nullptr ? bias + begin : nullptr, activation, param};
+      dispatch_sparse_matmul(m, end - begin, row_offsets, col_indices, values,
+                             b + begin, n, beta, c + begin, n,
+                             &cols_epilogue);
+    });
+  }
+}
+
+void matmul(size_t m, size_t n, size_t k, const float* a, const float* b,
+            float* c) {
+  gemm(Transpose::NO, Transpose::NO, m, n, k, 1.0f, a, k, b, n, 0.0f, c, n);
+}
+
+void matmul(size_t m, size_t n, size_t k, const double* a, const double* b,
+            double* c) {
+  gemm(Transpose::NO, Transpose::NO, m, n, k, 1.0, a, k, b, n, 0.0, c, n);
+}
+
+size_t int8_depth(size_t k) { return (k + 3) / 4 * 4; }
+
+size_t int8_width(size_t n) {
+  return (n + INT8_COLUMN_MULTIPLE - 1) / INT8_COLUMN_MULTIPLE *
+         INT8_COLUMN_MULTIPLE;
+}
+
+size_t int8_packed_size(size_t k, size_t n) {
+  return int8_depth(k) * int8_width(n);
+}
+
+void pack_int8(size_t k, size_t n, const int8_t* b, int8_t* packed) {
+  const size_t ldb = 4 * int8_width(n);
+  std::fill(packed, packed + int8_packed_size(k, n), int8_t(0));
+  for (size_t p = 0; p < k; ++p) {
+    int8_t* group = packed + p / 4 * ldb + p % 4;
+    for (size_t j = 0; j < n; ++j) {
+      group[4 * j] = b[p * n + j];
+    }
+  }
+}
+
+void quantize_u8(size_t m, size_t k, const float* x, float scale,
+                 int32_t zero_point, uint8_t* a) {
+  const size_t lda = int8_depth(k);
+  const float inv_scale = 1.0f / scale;
+  const float low = static_cast<float>(-zero_point);
+  const float high = static_cast<float>(255 - zero_point);
+  for (size_t i = 0; i < m; ++i) {
+    const float* x_row = x + i * k;
+    uint8_t* a_row = a + i * lda;
+    for (size_t p = 0; p < k; ++p) {
+      const float q = std::nearbyint(x_row[p] * inv_scale);
+      a_row[p] = static_cast<uint8_t>(std::min(std::max(q, low), high) +
+                                      static_cast<float>(zero_point));
+    }
+    for (size_t p = k; p < lda; ++p) {
+      a_row[p] = 0;
+    }
+  }
+}
+
+void matmul_u8s8(size_t m, size_t n, size_t k, const uint8_t* a,
+                 const int8_t* packed_b, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c) {
+  const size_t lda = int8_depth(k);
+  const size_t ldb = 4 * int8_width(n);
+  if (m * n * k < PARALLEL_MIN_FLOPS || parallel::num_threads() == 1) {
+    dispatch_int8_matmul(m, n, k, a, lda, packed_b, ldb, scale, offset,
+                         activation, param, c, n);
+  } else if (m >= n) {
+    parallel::parallel_for(m, ROW_GRAIN, [&](size_t begin, size_t end) {
+      dispatch_int8_matmul(end - begin, n, k, a + begin * lda, lda, packed_b,
+                           ldb, scale, offset, activation, param,
+                           c + begin * n, n);
+    });
+  } else {
+    parallel::parallel_for(n, COL_GRAIN, [&](size_t begin, size_t end) {
+      dispatch_int8_matmul(m, end - begin, k, a, lda, packed_b + 4 * begin,
+                           ldb, scale + begin, offset + begin, activation,
+                           param, c + begin, n);
+    });
+  }
+}
+
+}  // namespace gemm
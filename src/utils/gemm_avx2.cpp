@@ -0,0 +1,81 @@
+// Compiled with the avx2 flags, see CMakeLists.txt.
+#include "gemm_kernel.h"
+#include "qgemm_kernel.h"
+
+namespace gemm {
+namespace avx2 {
+
+void gemm(size_t m, size_t n, size_t k, float alpha, const float* a,
+          size_t a_row_stride, size_t a_col_stride, const float* b,
+          size_t b_row_stride, size_t b_col_stride, float beta, float* c,
+          size_t ldc, const Epilogue<float>* epilogue) {
+  gemm_kernel<float>(m, n, k, alpha, {a, a_row_stride, a_col_stride},
+                     {b, b_row_stride, b_col_stride}, beta, c, ldc, epilogue);
+}
+
+void gemm(size_t m, size_t n, size_t k, double alpha, const double* a,
+          size_t a_row_stride, size_t a_col_stride, const double* b,
+          size_t b_row_stride, size_t b_col_stride, double beta, double* c,
+          size_t ldc, const Epilogue<double>* epilogue) {
+  gemm_kernel<double>(m, n, k, alpha, {a, a_row_stride, a_col_stride},
+                      {b, b_row_stride, b_col_stride}, beta, c, ldc, epilogue);
+}
+
+template <typename A, typename B>
+void mixed_gemm(size_t m, size_t n, size_t k, float alpha, const A* a,
+                size_t a_row_stride, size_t a_col_stride, const B* b,
+                size_t b_row_stride, size_t b_col_stride, float beta,
+                float* c, size_t ldc, const Epilogue<float>* epilogue) {
+  gemm_kernel<float>(m, n, k, alpha, Operand<A>{a, a_row_stride, a_col_stride},
+                     Operand<B>{b, b_row_stride, b_col_stride}, beta, c, ldc,
+                     epilogue);
+}
+
+template void mixed_gemm<bfloat16, bfloat16>(
+    size_t, size_t, size_t, float, const bfloat16*, size_t, size_t,
+    const bfloat16*, size_t, size_t, float, float*, size_t,
+    const Epilogue<float>*);
+template void mixed_gemm<bfloat16, float>(size_t, size_t, size_t, float,
+                                          const bfloat16*, size_t, size_t,
+                                          const float*, size_t, size_t, float,
+                                          float*, size_t,
+                                          const Epilogue<float>*);
+template void mixed_gemm<float, bfloat16>(size_t, size_t, size_t, float,
+                                          const float*, size_t, size_t,
+                                          const bfloat16*, size_t, size_t,
+                                          float, float*, size_t,
+                                          const Epilogue<float>*);
+template void mixed_gemm<float16, float16>(size_t, size_t, size_t, float,
+                                           const float16*, size_t, size_t,
+                                           const float16*, size_t, size_t,
+                                           float, float*, size_t,
+                                           const Epilogue<float>*);
+template void mixed_gemm<float16, float>(size_t, size_t, size_t, float,
+                                         const float16*, size_t, size_t,
+                                         const float*, size_t, size_t, float,
+                                         float*, size_t,
+                                         const Epilogue<float>*);
+template void mixed_gemm<float, float16>(size_t, size_t, size_t, float,
+                                         const float*, size_t, size_t,
+                                         const float16*, size_t, size_t,
+                                         float, float*, size_t,
+                                         const Epilogue<float>*);
+
+void sparse_matmul(size_t m, size_t n, const uint32_t* row_offsets,
+                   const uint32_t* col_indices, const float* values,
+                   const float* b, size_t ldb, float beta, float* c,
+                   size_t ldc, const Epilogue<float>* epilogue) {
+  sparse_matmul_kernel<float>(m, n, row_offsets, col_indices, values, b, ldb,
+                              beta, c, ldc, epilogue);
+}
+
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc) {
+  gemm::int8_matmul<32>(m, n, k, a, lda, b, ldb, scale, offset, activation,
+                        param, c, ldc);
+}
+
+}  // namespace avx2
+}  // namespace gemm
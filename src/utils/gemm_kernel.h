@@ -0,0 +1,567 @@
+#pragma once
+// Packed GEMM kernel templates. This header is included by one translation
+// unit per instruction set (gemm.cpp, gemm_avx2.cpp, gemm_avx512.cpp), each
+// compiled with the matching -m flags, so the vector width and register tile
+// below follow the compilation target of the including file. Everything lives
+// in an anonymous namespace, i.e. every ISA gets its own private copy.
+//
+// Note: nothing in here may call out-of-line inline functions of the standard
+// library (std::vector, std::min, ...). Their COMDAT copies compiled with
+// e.g. -mavx512f could be picked by the linker for the whole library and
+// crash on older CPUs. Buffers come from gemm::scratch, which lives in the
+// baseline compiled gemm.cpp.
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "simd_kernel.h"
+
+namespace gemm {
+
+// Per-thread packing buffer which only ever grows, so steady state calls do
+// not allocate. slot 0 holds packed A, slot 1 packed B.
+template <typename T>
+T* scratch(size_t slot, size_t count);
+
+// Bias row and activation applied to the finished C, see
+// matmul_bias_activation. bias points to the first column of C, or is
+// nullptr. Plain data, so it can be passed between the ISA specific
+// translation units.
+template <typename T>
+struct Epilogue {
+  const T* bias;
+  simd::Activation activation;
+  T param;
+};
+
+namespace {
+
+inline size_t min_size(size_t a, size_t b) { return a < b ? a : b; }
+
+// Blocking parameters per scalar type. MR x NR is the register tile of the
+// micro-kernel, KC x NR slivers of B stay in L1, MC x KC blocks of A in L2 and
+// KC x NC panels of B in L3. The register tile is sized so that the
+// accumulators plus one row of B fit the vector register file of the target.
+template <typename T>
+struct Blocking;
+
+template <>
+struct Blocking<float> {
+#if defined(__AVX512F__)
+  static constexpr size_t MR = 8;
+  static constexpr size_t NR = 32;
+#elif defined(__AVX__)
+  static constexpr size_t MR = 6;
+  static constexpr size_t NR = 16;
+#else
+  static constexpr size_t MR = 4;
+  static constexpr size_t NR = 8;
+#endif
+  static constexpr size_t KC = 256;
+  static constexpr size_t MC = 96;
+  static constexpr size_t NC = 4096;
+};
+
+template <>
+struct Blocking<double> {
+#if defined(__AVX512F__)
+  static constexpr size_t MR = 8;
+  static constexpr size_t NR = 16;
+#elif defined(__AVX__)
+  static constexpr size_t MR = 6;
+  static constexpr size_t NR = 8;
+#else
+  static constexpr size_t MR = 4;
+  static constexpr size_t NR = 4;
+#endif
+  static constexpr size_t KC = 256;
+  static constexpr size_t MC = 48;
+  static constexpr size_t NC = 2048;
+};
+
+// Native vector type of the compilation target for the micro-kernel.
+template <typename T>
+struct VecOf {
+#if defined(__AVX512F__)
+  typedef T type __attribute__((vector_size(64)));
+#elif defined(__AVX__)
+  typedef T type __attribute__((vector_size(32)));
+#else
+  typedef T type __attribute__((vector_size(16)));
+#endif
+};
+
+// Strided read-only view of an operand, so the same packing routines serve
+// every memory layout. S is the storage type, the computation type T of the
+// GEMM or, for float, one of the 16 bit formats of half.h.
+template <typename S>
+struct Operand {
+  const S* data;
+  size_t row_stride;
+  size_t col_stride;
+  const S& at(size_t row, size_t col) const {
+    return data[row * row_stride + col * col_stride];
+  }
+};
+
+// The value at src as T, widened if it is stored in 16 bits.
+template <typename T, typename S>
+T widen_scalar(const S* src) {
+  if constexpr (std::is_same_v<S, T>) {
+    return *src;
+  } else {
+    return simd::widen<sizeof(float)>(src)[0];
+  }
+}
+
+// Bytes of values from src as a vector of T.
+template <typename T, size_t Bytes, typename S>
+typename simd::VecTraits<T, Bytes>::vec widen_vec(const S* src) {
+  if constexpr (std::is_same_v<S, T>) {
+    return simd::load<typename simd::VecTraits<T, Bytes>::vec>(src);
+  } else {
+    return simd::widen<Bytes>(src);
+  }
+}
+
+// Packs the mc x kc block of A starting at (row0, col0) into MR-row slivers:
+// sliver s holds A[row0 + s*MR + i, col0 + p] at packed[s*MR*kc + p*MR + i].
+// Rows past mc are zero padded so the micro-kernel never needs a remainder.
+// The source is swept along whichever of its dimensions is contiguous, so a
+// transposed operand is read in its natural layout. 16 bit values are
+// widened to T here, the micro-kernel only sees T.
+template <typename T, size_t MR, typename S>
+void pack_a(const Operand<S>& a, size_t row0, size_t col0, size_t mc,
+            size_t kc, T* packed) {
+  for (size_t s = 0; s < mc; s += MR) {
+    const size_t rows = min_size(MR, mc - s);
+    if (a.col_stride == 1 && a.row_stride != 1) {
+      for (size_t i = 0; i < rows; ++i) {
+        const S* src = &a.at(row0 + s + i, col0);
+        for (size_t p = 0; p < kc; ++p) {
+          packed[p * MR + i] = widen_scalar<T>(src + p);
+        }
+      }
+      for (size_t p = 0; p < kc; ++p) {
+        for (size_t i = rows; i < MR; ++i) {
+          packed[p * MR + i] = T(0);
+        }
+      }
+    } else {
+      for (size_t p = 0; p < kc; ++p) {
+        const S* src = &a.at(row0 + s, col0 + p);
+        for (size_t i = 0; i < rows; ++i) {
+          packed[p * MR + i] = widen_scalar<T>(src + i * a.row_stride);
+        }
+        for (size_t i = rows; i < MR; ++i) {
+          packed[p * MR + i] = T(0);
+        }
+      }
+    }
+    packed += MR * kc;
+  }
+}
+
+// The lanes of the low (High false) or high halves of a and b, alternating:
+// a0 b0 a1 b1 ...
+template <bool High, typename Vec, size_t... I>
+Vec interleave(Vec a, Vec b, std::index_sequence<I...>) {
+  constexpr size_t half = sizeof...(I) / 2;
+  return __builtin_shufflevector(a, b,
+                                 (High ? half : 0) + I / 2 +
+                                     (I % 2) * sizeof...(I)...);
+}
+
+// dst[p * ldd + j] = src[j * lds + p] for the vector length L x L block at
+// src, transposed in registers: interleaving row i with row i + L/2, log2(L)
+// times over, leaves column p in vector p.
+template <typename T>
+void transpose_block(const T* src, size_t lds, T* dst, size_t ldd) {
+  using Vec = typename VecOf<T>::type;
+  constexpr size_t L = sizeof(Vec) / sizeof(T);
+  constexpr auto lanes = std::make_index_sequence<L>();
+  Vec rows[L];
+  for (size_t j = 0; j < L; ++j) {
+    std::memcpy(&rows[j], src + j * lds, sizeof(Vec));
+  }
+  for (size_t round = 1; round < L; round *= 2) {
+    Vec next[L];
+    for (size_t i = 0; i < L / 2; ++i) {
+      next[2 * i] = interleave<false>(rows[i], rows[i + L / 2], lanes);
+      next[2 * i + 1] = interleave<true>(rows[i], rows[i + L / 2], lanes);
+    }
+    std::memcpy(rows, next, sizeof(rows));
+  }
+  for (size_t p = 0; p < L; ++p) {
+    std::memcpy(dst + p * ldd, &rows[p], sizeof(Vec));
+  }
+}
+
+// Packs the kc x nc panel of B starting at (row0, col0) into NR-column
+// slivers, zero padding columns past nc. Like pack_a, a transposed B is read
+// along its contiguous rows and 16 bit values are widened. A transposed B of
+// T goes through transpose_block where it can: with few rows in A, e.g.
+// dL/dX = dL/dZ * W^T of a micro-batch, copying it value by value took about
+// half as long as the multiplication.
+template <typename T, size_t NR, typename S>
+void pack_b(const Operand<S>& b, size_t row0, size_t col0, size_t kc,
+            size_t nc, T* packed) {
+  constexpr size_t L = sizeof(typename VecOf<T>::type) / sizeof(T);
+  for (size_t s = 0; s < nc; s += NR) {
+    const size_t cols = min_size(NR, nc - s);
+    if (b.row_stride == 1 && b.col_stride != 1) {
+      size_t p_blocked = 0;
+      if constexpr (std::is_same_v<S, T>) {
+        if (cols == NR) {
+          p_blocked = kc / L * L;
+          for (size_t j = 0; j < NR; j += L) {
+            const T* src = &b.at(row0, col0 + s + j);
+            for (size_t p = 0; p < p_blocked; p += L) {
+              transpose_block(src + p, b.col_stride, packed + p * NR + j, NR);
+            }
+          }
+        }
+      }
+      for (size_t j = 0; j < cols; ++j) {
+        const S* src = &b.at(row0, col0 + s + j);
+        for (size_t p = p_blocked; p < kc; ++p) {
+          packed[p * NR + j] = widen_scalar<T>(src + p);
+        }
+      }
+      for (size_t p = 0; p < kc; ++p) {
+        for (size_t j = cols; j < NR; ++j) {
+          packed[p * NR + j] = T(0);
+        }
+      }
+    } else {
+      for (size_t p = 0; p < kc; ++p) {
+        const S* src = &b.at(row0 + p, col0 + s);
+        for (size_t j = 0; j < cols; ++j) {
+          packed[p * NR + j] = widen_scalar<T>(src + j * b.col_stride);
+        }
+        for (size_t j = cols; j < NR; ++j) {
+          packed[p * NR + j] = T(0);
+        }
+      }
+    }
+    packed += NR * kc;
+  }
+}
+
+// Multiplies an MR x kc sliver of packed A with a kc x NR sliver of B, whose
+// rows are ldb apart: NR when packed, the row stride of B when read in place.
+// The accumulator tile is held in MR * NR / VL vector registers (GCC vector
+// extensions, so the same code maps to SSE, AVX or NEON registers). The
+// tile is written back as C = alpha * AB + beta * C, still in registers, and
+// on the last k-block the epilogue (if any) is applied before the store. The
+// first k-block passes the caller's beta, later ones beta = 1. C is not read
+// when beta is zero, so it may hold garbage (even NaN) then. Only the valid
+// mr x nr part of C is touched, partial tiles go through a buffer.
+template <typename T, size_t MR, size_t NR>
+void micro_kernel(size_t kc, const T* a, const T* b, size_t ldb, T* c,
+                  size_t rsc, size_t mr, size_t nr, T alpha, T beta,
+                  const Epilogue<T>* epilogue) {
+  using Vec = typename VecOf<T>::type;
+  constexpr size_t VL = sizeof(Vec) / sizeof(T);
+  constexpr size_t NV = NR / VL;
+  static_assert(NR % VL == 0, "NR must be a multiple of the vector length");
+
+  Vec acc[MR][NV] = {};
+  for (size_t p = 0; p < kc; ++p) {
+    Vec b_p[NV];
+    for (size_t v = 0; v < NV; ++v) {
+      std::memcpy(&b_p[v], b + v * VL, sizeof(Vec));
+    }
+    for (size_t i = 0; i < MR; ++i) {
+      const Vec a_ip = Vec{} + a[i];
+      for (size_t v = 0; v < NV; ++v) {
+        acc[i][v] += a_ip * b_p[v];
+      }
+    }
+    a += MR;
+    b += ldb;
+  }
+
+  T tile[MR][NR];
+  T* out = c;
+  size_t out_stride = rsc;
+  const bool partial = mr < MR || nr < NR;
+  if (partial) {
+    out = &tile[0][0];
+    out_stride = NR;
+    if (beta != T(0)) {
+      std::memset(tile, 0, sizeof(tile));
+      for (size_t i = 0; i < mr; ++i) {
+        std::memcpy(tile[i], c + i * rsc, nr * sizeof(T));
+      }
+    }
+  }
+  Vec bias[NV] = {};
+  if (epilogue != nullptr && epilogue->bias != nullptr) {
+    std::memcpy(bias, epilogue->bias, nr * sizeof(T));
+  }
+
+  for (size_t i = 0; i < mr; ++i) {
+    T* out_row = out + i * out_stride;
+    for (size_t v = 0; v < NV; ++v) {
+      Vec result = alpha * acc[i][v];
+      if (beta != T(0)) {
+        Vec c_iv;
+        std::memcpy(&c_iv, out_row + v * VL, sizeof(Vec));
+        result += beta * c_iv;
+      }
+      if (epilogue != nullptr) {
+        result = simd::activate<T, sizeof(Vec)>(
+            epilogue->activation, result + bias[v], epilogue->param);
+      }
+      std::memcpy(out_row + v * VL, &result, sizeof(Vec));
+    }
+  }
+
+  if (partial) {
+    for (size_t i = 0; i < mr; ++i) {
+      std::memcpy(c + i * rsc, tile[i], nr * sizeof(T));
+    }
+  }
+}
+
+// C (m x n) = epilogue(alpha * A (m x k) * B (k x n) + beta * C). The
+// epilogue may be nullptr and is only supported for k > 0 and alpha != 0.
+template <typename T, typename SA, typename SB>
+void packed_matmul(size_t m, size_t n, size_t k, T alpha,
+                   const Operand<SA>& a, const Operand<SB>& b, T beta, T* c,
+                   size_t rsc, const Epilogue<T>* epilogue) {
+  using B = Blocking<T>;
+  constexpr size_t MR = B::MR;
+  constexpr size_t NR = B::NR;
+
+  if (k == 0 || alpha == T(0)) {
+    for (size_t i = 0; i < m; ++i) {
+      for (size_t j = 0; j < n; ++j) {
+        T& c_ij = c[i * rsc + j];
+        c_ij = beta == T(0) ? T(0) : beta * c_ij;
+      }
+    }
+    return;
+  }
+
+  const size_t kc_max = min_size(B::KC, k);
+  const size_t mc_max = min_size(B::MC, (m + MR - 1) / MR * MR);
+  const size_t nc_max = min_size(B::NC, (n + NR - 1) / NR * NR);
+  T* const packed_a = scratch<T>(0, mc_max * kc_max);
+  T* const packed_b = scratch<T>(1, kc_max * nc_max);
+
+  // A B of T in rows is packed for the reuse by many row blocks of A. With
+  // a single one, e.g. a micro-batch times the weights, the micro-kernel
+  // reads it in place, except for the last columns if they are no whole NR.
+  bool b_in_place = false;
+  if constexpr (std::is_same_v<SB, T>) {
+    b_in_place = b.col_stride == 1 && m <= B::MC;
+  }
+  for (size_t jc = 0; jc < n; jc += B::NC) {
+    const size_t nc = min_size(B::NC, n - jc);
+    for (size_t pc = 0; pc < k; pc += B::KC) {
+      const size_t kc = min_size(B::KC, k - pc);
+      const size_t nc_in_place = b_in_place ? nc / NR * NR : 0;
+      if (nc_in_place < nc) {
+        pack_b<T, NR>(b, pc, jc + nc_in_place, kc, nc - nc_in_place,
+                      packed_b);
+      }
+
+      for (size_t ic = 0; ic < m; ic += B::MC) {
+        const size_t mc = min_size(B::MC, m - ic);
+        pack_a<T, MR>(a, ic, pc, mc, kc, packed_a);
+
+        for (size_t jr = 0; jr < nc; jr += NR) {
+          const size_t nr = min_size(NR, nc - jr);
+          const T* b_sliver = nullptr;
+          size_t ldb_sliver = NR;
+          if constexpr (std::is_same_v<SB, T>) {
+            if (jr < nc_in_place) {
+              b_sliver = &b.at(pc, jc + jr);
+              ldb_sliver = b.row_stride;
+            }
+          }
+          if (b_sliver == nullptr) {
+            b_sliver = packed_b + (jr - nc_in_place) * kc;
+          }
+          Epilogue<T> tile_epilogue{};
+          const Epilogue<T>* last_block_epilogue = nullptr;
+          if (epilogue != nullptr && pc + kc == k) {
+            tile_epilogue = *epilogue;
+            if (tile_epilogue.bias != nullptr) {
+              tile_epilogue.bias += jc + jr;
+            }
+            last_block_epilogue = &tile_epilogue;
+          }
+          for (size_t ir = 0; ir < mc; ir += MR) {
+            const size_t mr = min_size(MR, mc - ir);
+            const T* a_sliver = packed_a + ir * kc;
+            T* c_tile = c + (ic + ir) * rsc + jc + jr;
+            micro_kernel<T, MR, NR>(kc, a_sliver, b_sliver, ldb_sliver,
+                                    c_tile, rsc, mr, nr, alpha,
+                                    pc == 0 ? beta : T(1),
+                                    last_block_epilogue);
+          }
+        }
+      }
+    }
+  }
+}
+
+// The row of B that multiplies x[p] in the GEMV kernel: row p, or for a
+// sparse x the row at the column index of its p-th nonzero value.
+template <typename SB>
+struct DenseRows {
+  const SB* b;
+  size_t ldb;
+  const SB* operator()(size_t p) const { return b + p * ldb; }
+};
+template <typename T>
+struct IndexedRows {
+  const T* b;
+  size_t ldb;
+  const uint32_t* index;
+  const T* operator()(size_t p) const { return b + index[p] * ldb; }
+};
+
+// Columns [c, c + NV * lanes) of y = epilogue(alpha * x * B + beta * y), in
+// NV vectors of Bytes. The accumulators stay in registers while the k rows of
+// B stream past, U rows at a time into separate accumulators, so the chains
+// of dependent multiply-adds are short even for a single vector. x and B may
+// be stored in 16 bits, they are widened as they are loaded.
+template <typename T, size_t Bytes, size_t NV, typename SX, typename Rows>
+void gemv_columns(size_t c, size_t k, T alpha, const SX* x, size_t incx,
+                  const Rows& rows, T beta, T* y,
+                  const Epilogue<T>* epilogue) {
+  using Vec = typename simd::VecTraits<T, Bytes>::vec;
+  constexpr size_t L = simd::VecTraits<T, Bytes>::lanes;
+  constexpr size_t U = NV <= 2 ? 4 : 2;
+
+  Vec acc[U][NV] = {};
+  size_t p = 0;
+  for (; p + U <= k; p += U) {
+    for (size_t u = 0; u < U; ++u) {
+      const T x_p = widen_scalar<T>(x + (p + u) * incx);
+      const auto* b_row = rows(p + u) + c;
+      for (size_t v = 0; v < NV; ++v) {
+        acc[u][v] += x_p * widen_vec<T, Bytes>(b_row + v * L);
+      }
+    }
+  }
+  for (; p < k; ++p) {
+    const T x_p = widen_scalar<T>(x + p * incx);
+    const auto* b_row = rows(p) + c;
+    for (size_t v = 0; v < NV; ++v) {
+      acc[0][v] += x_p * widen_vec<T, Bytes>(b_row + v * L);
+    }
+  }
+
+  for (size_t v = 0; v < NV; ++v) {
+    T* out = y + c + v * L;
+    Vec result = acc[0][v];
+    for (size_t u = 1; u < U; ++u) {
+      result += acc[u][v];
+    }
+    result *= alpha;
+    if (beta != T(0)) {
+      result += beta * simd::load<Vec>(out);
+    }
+    if (epilogue != nullptr) {
+      if (epilogue->bias != nullptr) {
+        result += simd::load<Vec>(epilogue->bias + c + v * L);
+      }
+      result = simd::activate<T, Bytes>(epilogue->activation, result,
+                                        epilogue->param);
+    }
+    simd::store(out, result);
+  }
+}
+
+// y (n) = epilogue(alpha * x * B (k x n) + beta * y) for a single row x of k
+// values, x[p * incx], and the rows of B with unit column stride (see
+// DenseRows). Nothing is packed, B is read exactly once, in blocks of up to
+// four vectors of columns. The columns left over after the whole vectors run
+// on ever narrower vectors. Unlike packed_matmul, k may be zero with an
+// epilogue, y then is the activated bias.
+template <typename T, typename SX, typename Rows>
+void gemv_rows(size_t n, size_t k, T alpha, const SX* x, size_t incx,
+               const Rows& rows, T beta, T* y, const Epilogue<T>* epilogue) {
+  constexpr size_t Bytes = sizeof(typename VecOf<T>::type);
+  constexpr size_t L = Bytes / sizeof(T);
+  constexpr size_t NV = 4;
+
+  size_t c = 0;
+  for (; c + NV * L <= n; c += NV * L) {
+    gemv_columns<T, Bytes, NV>(c, k, alpha, x, incx, rows, beta, y,
+                               epilogue);
+  }
+  switch ((n - c) / L) {
+    case 3:
+      gemv_columns<T, Bytes, 3>(c, k, alpha, x, incx, rows, beta, y,
+                                epilogue);
+      break;
+    case 2:
+      gemv_columns<T, Bytes, 2>(c, k, alpha, x, incx, rows, beta, y,
+                                epilogue);
+      break;
+    case 1:
+      gemv_columns<T, Bytes, 1>(c, k, alpha, x, incx, rows, beta, y,
+                                epilogue);
+      break;
+  }
+  c += (n - c) / L * L;
+  if constexpr (L > 1) {
+    simd::for_each_vector<T, Bytes / 2>(c, n, [&](size_t col, auto width) {
+      gemv_columns<T, decltype(width)::value, 1>(col, k, alpha, x, incx, rows,
+                                                 beta, y, epilogue);
+    });
+  }
+}
+
+// gemv_rows with every row of B, b (k x n) with row stride ldb.
+template <typename T, typename SX, typename SB>
+void gemv(size_t n, size_t k, T alpha, const SX* x, size_t incx, const SB* b,
+          size_t ldb, T beta, T* y, const Epilogue<T>* epilogue) {
+  gemv_rows<T>(n, k, alpha, x, incx, DenseRows<SB>{b, ldb}, beta, y,
+               epilogue);
+}
+
+// C (m x n) = epilogue(S * B + beta * C) for S in compressed sparse row
+// form, see gemm::sparse_matmul_bias_activation. Each row of C is a GEMV of
+// the nonzero values of that row of S with the rows of B at their column
+// indices, so the other rows of B are never read.
+template <typename T>
+void sparse_matmul_kernel(size_t m, size_t n, const uint32_t* row_offsets,
+                          const uint32_t* col_indices, const T* values,
+                          const T* b, size_t ldb, T beta, T* c, size_t ldc,
+                          const Epilogue<T>* epilogue) {
+  for (size_t i = 0; i < m; ++i) {
+    const size_t begin = row_offsets[i];
+    const size_t nnz = row_offsets[i + 1] - begin;
+    gemv_rows<T>(n, nnz, T(1), values + begin, 1,
+                 IndexedRows<T>{b, ldb, col_indices + begin}, beta,
+                 c + i * ldc, epilogue);
+  }
+}
+
+// The GEMM of every instruction set: a single row of A times a B with unit
+// column stride, i.e. batch size 1 inference, runs on the GEMV kernel,
+// everything else on packed_matmul. A and B are stored as T or, for float,
+// in one of the 16 bit formats.
+template <typename T, typename SA = T, typename SB = T>
+void gemm_kernel(size_t m, size_t n, size_t k, T alpha, const Operand<SA>& a,
+                 const Operand<SB>& b, T beta, T* c, size_t rsc,
+                 const Epilogue<T>* epilogue) {
+  if (m == 1 && b.col_stride == 1 && k > 0 && alpha != T(0)) {
+    gemv<T>(n, k, alpha, a.data, a.col_stride, b.data, b.row_stride, beta, c,
+            epilogue);
+    return;
+  }
+  packed_matmul<T>(m, n, k, alpha, a, b, beta, c, rsc, epilogue);
+}
+
+}  // namespace
+}  // namespace gemm
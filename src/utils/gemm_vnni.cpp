@@ -0,0 +1,17 @@
+// Compiled with the avx512 and VNNI flags, see CMakeLists.txt. Only called
+// on CPUs with AVX-512 VNNI, see cpu::avx512_vnni_supported.
+#include "qgemm_kernel.h"
+
+namespace gemm {
+namespace vnni {
+
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc) {
+  gemm::int8_matmul<64>(m, n, k, a, lda, b, ldb, scale, offset, activation,
+                        param, c, ldc);
+}
+
+}  // namespace vnni
+}  // namespace gemm
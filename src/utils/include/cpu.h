@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+
+// Instruction set selection for the SIMD and GEMM kernels.
+//
+// By default the kernels use the best instruction set the CPU supports
+// (detected once via CPUID). The choice can be overridden with force_isa() or
+// by setting the environment variable MLP_FORCE_ISA to one of "scalar",
+// "baseline", "avx2" or "avx512", e.g. to test every kernel path on one
+// machine.
+namespace cpu {
+
+// SCALAR: plain loops without explicit vectorization.
+// BASELINE: 128 bit vectors of the compilation target (SSE2 or NEON).
+// AVX2, AVX512: x86 only, compiled in when building for x86.
+enum class Isa { SCALAR, BASELINE, AVX2, AVX512 };
+
+Isa detected_isa();
+Isa active_isa();
+bool isa_supported(Isa isa);
+// Throws std::runtime_error if the CPU or the build does not support isa.
+void force_isa(Isa isa);
+// Go back to the default ISA (MLP_FORCE_ISA or detected_isa()).
+void reset_isa();
+std::string isa_name(Isa isa);
+// Whether the CPU has the AVX-512 VNNI int8 dot products, which the AVX512
+// path of gemm::matmul_u8s8 uses if so.
+bool avx512_vnni_supported();
+
+}  // namespace cpu
@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+template <class T>
+class Mat2D;
+
+// Lazy elementwise expressions over Mat2D.
+//
+// The arithmetic operators +, -, * and / on Mat2D and on expressions do not
+// compute anything, they build a small tree of expression nodes. The tree is
+// evaluated in a single loop once it is assigned to a Mat2D, e.g.
+//
+//   weights = weights - grad_weights * learning_rate;
+//
+// runs as one fused loop that writes straight into weights, without any
+// temporary Mat2D. Note that * is the elementwise (hadamard) product, use
+// Mat2D::dot_product for matrix multiplication. Broadcasting follows
+// Mat2D::add, a dimension of size 1 is repeated to match the other operand.
+//
+// Matrices passed as lvalues are referenced, so an expression must not
+// outlive its operands. Temporaries are moved into the expression.
+namespace expr {
+
+// Base class of all expression nodes. Every node provides value_type,
+// rows(), cols(), at(row, col), at_flat(idx) and is_flat(rows, cols). at_flat
+// may only be used if is_flat is true for the shape of the whole expression,
+// i.e. if no operand below the node needs broadcasting.
+template <typename E>
+struct Expression {};
+
+template <typename X>
+inline constexpr bool is_expression_v =
+    std::is_base_of_v<Expression<std::decay_t<X>>, std::decay_t<X>>;
+
+template <typename X>
+struct is_mat : std::false_type {};
+template <typename T>
+struct is_mat<Mat2D<T>> : std::true_type {};
+
+template <typename X>
+inline constexpr bool is_operand_v =
+    is_expression_v<X> || is_mat<std::decay_t<X>>::value;
+
+template <typename X>
+inline constexpr bool is_scalar_v = std::is_arithmetic_v<std::decay_t<X>>;
+
+template <typename L, typename R>
+inline constexpr bool are_operands_v =
+    (is_operand_v<L> && (is_operand_v<R> || is_scalar_v<R>)) ||
+    (is_scalar_v<L> && is_operand_v<R>);
+
+template <typename T>
+class MatRef : public Expression<MatRef<T>> {
+ public:
+  using value_type = T;
+  explicit MatRef(const Mat2D<T>& mat)
+      : data(mat.matrix_data.data()),
+        num_rows(mat.get_num_rows()),
+        num_cols(mat.get_num_cols()) {}
+  size_t rows() const { return num_rows; }
+  size_t cols() const { return num_cols; }
+  T at(size_t row, size_t col) const { return data[row * num_cols + col]; }
+  T at_flat(size_t idx) const { return data[idx]; }
+  bool is_flat(size_t rows, size_t cols) const {
+    return rows == num_rows && cols == num_cols;
+  }
+
+ private:
+  const T* data;
+  size_t num_rows;
+  size_t num_cols;
+};
+
+template <typename T>
+class MatOwned : public Expression<MatOwned<T>> {
+ public:
+  using value_type = T;
+  explicit MatOwned(Mat2D<T>&& mat) : mat(std::move(mat)) {}
+  size_t rows() const { return mat.get_num_rows(); }
+  size_t cols() const { return mat.get_num_cols(); }
+  T at(size_t row, size_t col) const {
+    return mat.matrix_data[row * mat.get_num_cols() + col];
+  }
+  T at_flat(size_t idx) const { return mat.matrix_data[idx]; }
+  bool is_flat(size_t rows, size_t cols) const {
+    return rows == mat.get_num_rows() && cols == mat.get_num_cols();
+  }
+
+ private:
+  Mat2D<T> mat;
+};
+
+template <typename T>
+class Scalar : public Expression<Scalar<T>> {
+ public:
+  using value_type = T;
+  explicit Scalar(T value) : value(value) {}
+  size_t rows() const { return 1; }
+  size_t cols() const { return 1; }
+  T at(size_t, size_t) const { return value; }
+  T at_flat(size_t) const { return value; }
+  bool is_flat(size_t, size_t) const { return true; }
+
+ private:
+  T value;
+};
+
+template <typename F, typename E>
+class Unary : public Expression<Unary<F, E>> {
+ public:
+  using value_type = typename E::value_type;
+  Unary(F func, E operand) : func(func), operand(std::move(operand)) {}
+  size_t rows() const { return operand.rows(); }
+  size_t cols() const { return operand.cols(); }
+  value_type at(size_t row, size_t col) const {
+    return func(operand.at(row, col));
+  }
+  value_type at_flat(size_t idx) const { return func(operand.at_flat(idx)); }
+  bool is_flat(size_t rows, size_t cols) const {
+    return operand.is_flat(rows, cols);
+  }
+
+ private:
+  F func;
+  E operand;
+};
+
+template <typename F, typename L, typename R>
+class Binary : public Expression<Binary<F, L, R>> {
+ public:
+  using value_type = typename L::value_type;
+  Binary(F func, L lhs, R rhs)
+      : func(func),
+        lhs(std::move(lhs)),
+        rhs(std::move(rhs)),
+        num_rows(std::max(this->lhs.rows(), this->rhs.rows())),
+        num_cols(std::max(this->lhs.cols(), this->rhs.cols())),
+        lhs_row_mask(broadcast_mask(this->lhs.rows(), num_rows)),
+        lhs_col_mask(broadcast_mask(this->lhs.cols(), num_cols)),
+        rhs_row_mask(broadcast_mask(this->rhs.rows(), num_rows)),
+        rhs_col_mask(broadcast_mask(this->rhs.cols(), num_cols)) {
+    const auto compatible = [](size_t a, size_t b) {
+      return a == b || a == 1 || b == 1;
+    };
+    if (!compatible(this->lhs.rows(), this->rhs.rows())) {
+      throw std::runtime_error("Add: Matrix Row dim incompatible.");
+    }
+    if (!compatible(this->lhs.cols(), this->rhs.cols())) {
+      throw std::runtime_error("Add: Matrix Cols dim incompatible.");
+    }
+  }
+  size_t rows() const { return num_rows; }
+  size_t cols() const { return num_cols; }
+  // a broadcast operand is always read at index 0 of that axis
+  value_type at(size_t row, size_t col) const {
+    return func(lhs.at(row & lhs_row_mask, col & lhs_col_mask),
+                rhs.at(row & rhs_row_mask, col & rhs_col_mask));
+  }
+  value_type at_flat(size_t idx) const {
+    return func(lhs.at_flat(idx), rhs.at_flat(idx));
+  }
+  bool is_flat(size_t rows, size_t cols) const {
+    return lhs.is_flat(rows, cols) && rhs.is_flat(rows, cols);
+  }
+
+ private:
+  static size_t broadcast_mask(size_t size, size_t result_size) {
+    return size == 1 && result_size != 1 ? 0 : ~size_t(0);
+  }
+
+  F func;
+  L lhs;
+  R rhs;
+  size_t num_rows;
+  size_t num_cols;
+  size_t lhs_row_mask;
+  size_t lhs_col_mask;
+  size_t rhs_row_mask;
+  size_t rhs_col_mask;
+};
+
+template <typename T>
+MatRef<T> as_node(const Mat2D<T>& mat) {
+  return MatRef<T>(mat);
+}
+
+template <typename T>
+MatOwned<T> as_node(Mat2D<T>&& mat) {
+  return MatOwned<T>(std::move(mat));
+}
+
+template <typename E, typename = std::enable_if_t<is_expression_v<E>>>
+std::decay_t<E> as_node(E&& expression) {
+  return std::forward<E>(expression);
+}
+
+template <typename X>
+using node_t = decltype(as_node(std::declval<X>()));
+
+// Scalars take the value type of the matrix operand.
+template <typename T, typename X>
+auto as_node_of(X&& x) {
+  if constexpr (is_scalar_v<X>) {
+    return Scalar<T>(static_cast<T>(x));
+  } else {
+    return as_node(std::forward<X>(x));
+  }
+}
+
+template <typename L, typename R>
+auto value_of() {
+  if constexpr (is_operand_v<L>) {
+    return typename node_t<L>::value_type();
+  } else {
+    return typename node_t<R>::value_type();
+  }
+}
+
+template <typename L, typename R>
+using value_t = decltype(value_of<L, R>());
+
+template <typename F, typename L, typename R>
+auto binary(F func, L&& lhs, R&& rhs) {
+  using T = value_t<L, R>;
+  auto lhs_node = as_node_of<T>(std::forward<L>(lhs));
+  auto rhs_node = as_node_of<T>(std::forward<R>(rhs));
+  return Binary<F, decltype(lhs_node), decltype(rhs_node)>(
+      func, std::move(lhs_node), std::move(rhs_node));
+}
+
+// Lazily applies func to every element.
+template <typename X, typename F,
+          typename = std::enable_if_t<is_operand_v<X>>>
+auto map(X&& x, F func) {
+  return Unary<F, node_t<X>>(func, as_node(std::forward<X>(x)));
+}
+
+// Evaluates the expression into out (rows() * cols() elements, row-major).
+// out may alias an operand of the same shape.
+template <typename E, typename T>
+void evaluate(const E& expression, T* out) {
+  const size_t rows = expression.rows();
+  const size_t cols = expression.cols();
+  if (expression.is_flat(rows, cols)) {
+    const size_t size = rows * cols;
+    for (size_t idx = 0; idx < size; ++idx) {
+      out[idx] = expression.at_flat(idx);
+    }
+  } else {
+    for (size_t row = 0; row < rows; ++row) {
+      for (size_t col = 0; col < cols; ++col) {
+        out[row * cols + col] = expression.at(row, col);
+      }
+    }
+  }
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<are_operands_v<L, R>>>
+auto operator+(L&& lhs, R&& rhs) {
+  return binary(std::plus<>(), std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<are_operands_v<L, R>>>
+auto operator-(L&& lhs, R&& rhs) {
+  return binary(std::minus<>(), std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<are_operands_v<L, R>>>
+auto operator*(L&& lhs, R&& rhs) {
+  return binary(std::multiplies<>(), std::forward<L>(lhs),
+                std::forward<R>(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<are_operands_v<L, R>>>
+auto operator/(L&& lhs, R&& rhs) {
+  return binary(std::divides<>(), std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+// Mat2D has its own (eager) unary minus.
+template <typename E, typename = std::enable_if_t<is_expression_v<E>>>
+auto operator-(E&& expression) {
+  return map(std::forward<E>(expression), std::negate<>());
+}
+
+}  // namespace expr
+
+// Mat2D lives in the global namespace, so this is where lookup of its
+// operators happens.
+using expr::operator+;
+using expr::operator-;
+using expr::operator*;
+using expr::operator/;
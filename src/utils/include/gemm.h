@@ -0,0 +1,134 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "half.h"
+#include "simd.h"
+
+// Packed, cache-blocked matrix multiplication kernels used by
+// Mat2D<float>::dot_product and Mat2D<double>::dot_product.
+//
+// The loop structure follows the well known Goto/BLIS scheme: B is packed in
+// KC x NC panels (kept in L3), A in MC x KC blocks (kept in L2) and a register
+// tiled MR x NR micro-kernel multiplies the packed slivers, which stay in L1.
+// All operands are row-major; transposed operands are read in place. A single
+// row of A (m == 1, e.g. inference of one sample) with a non-transposed B
+// skips the packing, a GEMV kernel streams B once instead.
+//
+// Builds configured with -DMLP_BLAS=openblas or -DMLP_BLAS=mkl can hand the
+// multiplications to cblas_sgemm / cblas_dgemm instead. The environment
+// variable MLP_GEMM_BACKEND ("builtin" or "blas") or set_backend() selects
+// the implementation at runtime, e.g. to measure the packed kernels against
+// the vendor library; the builtin kernels are the default. The library runs
+// on one thread, the thread pool splits its calls like those of the builtin
+// kernels. Deterministic mode (see parallel.h) and sizes beyond the int
+// range of cblas always use the builtin kernels.
+namespace gemm {
+
+enum class Backend { BUILTIN, BLAS };
+
+// Whether the library was built with a BLAS backend.
+bool blas_available();
+Backend active_backend();
+// Throws std::runtime_error if backend is BLAS and blas_available() is false.
+void set_backend(Backend backend);
+// Go back to the default backend (MLP_GEMM_BACKEND, otherwise BUILTIN).
+void reset_backend();
+std::string backend_name(Backend backend);
+
+enum class Transpose { NO, YES };
+
+// C (m x n) = alpha * op(A) * op(B) + beta * C, BLAS style. op(A) (m x k) is
+// A, or with trans_a the transpose of the k x m matrix A, likewise op(B)
+// (k x n). lda, ldb and ldc are the row strides of A, B and C as stored.
+// With beta == 0 C is only written, so it need not be initialized. C must not
+// overlap A or B.
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          float alpha, const float* a, size_t lda, const float* b, size_t ldb,
+          float beta, float* c, size_t ldc);
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          double alpha, const double* a, size_t lda, const double* b,
+          size_t ldb, double beta, double* c, size_t ldc);
+
+// C (m x n) = A (m x k) * B (k x n)
+void matmul(size_t m, size_t n, size_t k, const float* a, const float* b,
+            float* c);
+void matmul(size_t m, size_t n, size_t k, const double* a, const double* b,
+            double* c);
+
+// C (m x n) = act(A (m x k) * B (k x n) + bias) with the bias row (n values,
+// or nullptr for none) added to every row of C and param the slope of
+// LEAKY_RELU. The micro-kernel applies bias and activation to each finished
+// output tile while it is still in registers, so C is written only once.
+void matmul_bias_activation(size_t m, size_t n, size_t k, const float* a,
+                            const float* b, const float* bias,
+                            simd::Activation activation, float param,
+                            float* c);
+void matmul_bias_activation(size_t m, size_t n, size_t k, const double* a,
+                            const double* b, const double* bias,
+                            simd::Activation activation, double param,
+                            double* c);
+
+// Mixed precision versions of gemm and matmul_bias_activation, for A and/or B
+// stored as bfloat16 or float16 (see half.h) and a float C. The operands are
+// widened to float while they are packed, or while they stream through the
+// GEMV kernel, so the products are summed in float like in the float
+// version. Instantiated for A and B each float or bfloat16, or each float or
+// float16, but not both float.
+template <typename A, typename B>
+void gemm(Transpose trans_a, Transpose trans_b, size_t m, size_t n, size_t k,
+          float alpha, const A* a, size_t lda, const B* b, size_t ldb,
+          float beta, float* c, size_t ldc);
+template <typename A, typename B>
+void matmul_bias_activation(size_t m, size_t n, size_t k, const A* a,
+                            const B* b, const float* bias,
+                            simd::Activation activation, float param,
+                            float* c);
+
+// Sparse times dense, for inputs which are mostly zero. S (m x k) is in
+// compressed sparse row (CSR) form, see CsrMatrix in sparse.h: the nonzero
+// values of row i are values[row_offsets[i]..row_offsets[i + 1]), in the
+// columns col_indices[...] of the same range. row_offsets has m + 1 entries
+// and need not start at zero. C (m x n) = act(S * B (k x n) + beta * C +
+// bias) with bias one value per column or nullptr, like
+// matmul_bias_activation. Every row of C is summed in registers from only
+// the rows of B its nonzeros select.
+void sparse_matmul_bias_activation(size_t m, size_t n,
+                                   const uint32_t* row_offsets,
+                                   const uint32_t* col_indices,
+                                   const float* values, const float* b,
+                                   const float* bias,
+                                   simd::Activation activation, float param,
+                                   float* c, float beta = 0.0f);
+
+// int8 matrix multiplication for quantized inference. A holds uint8 values
+// with a zero point (asymmetric activations), B int8 values (symmetric
+// weights), products are summed exactly in int32.
+//
+// Rows of A are int8_depth(k) bytes apart, the bytes past k only need to be
+// readable. B is packed once by pack_int8: groups of four consecutive rows,
+// each column's four bytes next to each other, with the columns padded to
+// int8_width(n). This is the operand layout of the VNNI dot product
+// instruction, which the AVX-512 path uses where the CPU has it (see
+// cpu::avx512_vnni_supported).
+size_t int8_depth(size_t k);
+size_t int8_width(size_t n);
+// Size in bytes of the packed B (k x n).
+size_t int8_packed_size(size_t k, size_t n);
+// Packs the row-major int8 b (k x n) into packed (int8_packed_size bytes).
+void pack_int8(size_t k, size_t n, const int8_t* b, int8_t* packed);
+// Rows of x (m x k floats) as round(x / scale) + zero_point, clamped to
+// [0, 255], into a (m rows of int8_depth(k) bytes).
+void quantize_u8(size_t m, size_t k, const float* x, float scale,
+                 int32_t zero_point, uint8_t* a);
+// C (m x n) = act(scale * (A (m x k) * B (k x n)) + offset), with scale and
+// offset one value per column (int8_width(n) readable values each). The int32
+// results are dequantized and activated in registers, like the epilogue of
+// matmul_bias_activation.
+void matmul_u8s8(size_t m, size_t n, size_t k, const uint8_t* a,
+                 const int8_t* packed_b, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c);
+
+}  // namespace gemm
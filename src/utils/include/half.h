@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// 16 bit floating point storage formats. They only hold values, all
+// arithmetic happens in float: the GEMM and elementwise kernels widen them
+// while loading (see gemm.h and simd.h) and results are rounded back when
+// stored. Compared to float they halve the memory and bandwidth of weights
+// and activations.
+//
+// bfloat16 is the upper half of a float, the same range with an 8 bit
+// mantissa. float16 is IEEE 754 binary16, a 11 bit mantissa but a largest
+// value of 65504 and gradual underflow below 6.1e-5. Conversions from float
+// round to nearest even, NaNs stay NaNs.
+//
+// Mat2D<bfloat16> and Mat2D<float16> work as storage, e.g. for the buffers of
+// mixed precision training (see MLP::set_precision), simd::convert fills
+// them from float matrices.
+struct bfloat16 {
+  uint16_t bits;
+
+  // zero when value initialized, e.g. in a std::vector
+  bfloat16() = default;
+  explicit bfloat16(float value) {
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    if ((x & 0x7fffffffu) > 0x7f800000u) {
+      // quiet NaN, the rounding below could carry it into infinity
+      bits = static_cast<uint16_t>((x >> 16) | 0x40u);
+    } else {
+      bits = static_cast<uint16_t>((x + 0x7fffu + ((x >> 16) & 1u)) >> 16);
+    }
+  }
+  operator float() const {
+    const uint32_t x = static_cast<uint32_t>(bits) << 16;
+    float value;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+  }
+};
+
+struct float16 {
+  uint16_t bits;
+
+  // zero when value initialized, e.g. in a std::vector
+  float16() = default;
+  explicit float16(float value) {
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000u;
+    x &= 0x7fffffffu;
+    uint32_t result;
+    if (x >= 0x47800000u) {
+      // too large for float16 (2^16 and up), infinity or NaN
+      result = x > 0x7f800000u ? 0x7e00u : 0x7c00u;
+    } else if (x < 0x38800000u) {
+      // below 2^-14, a subnormal: adding 0.5 lets the float addition round
+      // the mantissa to the subnormal spacing of 2^-24
+      float scaled;
+      std::memcpy(&scaled, &x, sizeof(scaled));
+      scaled += 0.5f;
+      uint32_t y;
+      std::memcpy(&y, &scaled, sizeof(y));
+      result = y - 0x3f000000u;
+    } else {
+      // rebias the exponent and round the 13 dropped mantissa bits
+      const uint32_t odd = (x >> 13) & 1u;
+      result = (x - 0x38000000u + 0xfffu + odd) >> 13;
+    }
+    bits = static_cast<uint16_t>(result | sign);
+  }
+  operator float() const {
+    const uint32_t sign = static_cast<uint32_t>(bits & 0x8000u) << 16;
+    const uint32_t exponent = bits & 0x7c00u;
+    uint32_t x = static_cast<uint32_t>(bits & 0x7fffu) << 13;
+    float value;
+    if (exponent == 0x7c00u) {
+      x += 0x70000000u;  // infinity or NaN
+    } else if (exponent == 0) {
+      // zero or subnormal: m * 2^-24 as (2^-14 + m * 2^-24) - 2^-14
+      x += 0x38800000u;
+      std::memcpy(&value, &x, sizeof(value));
+      value -= 6.103515625e-05f;
+      std::memcpy(&x, &value, sizeof(x));
+    } else {
+      x += 0x38000000u;
+    }
+    x |= sign;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+  }
+};
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile(const std::string& filename);
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+  const uint8_t* data() const { return bytes; }
+  size_t size() const { return num_bytes; }
+
+ private:
+  const uint8_t* bytes = nullptr;
+  size_t num_bytes = 0;
+};
+
+// Creates or replaces filename with what write puts into the stream. The
+// stream goes to a temporary file next to it, unique per call, which is
+// renamed over filename once it is complete. Readers thus see the old or
+// the new file, never a partial one, and concurrent writers of one file do
+// not share a temporary file. Throws std::runtime_error if writing or
+// renaming fails, the temporary file is removed then.
+void write_file_atomically(const std::string& filename,
+                           const std::function<void(std::ostream&)>& write);
@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Persistent thread pool shared by the GEMM, elementwise and reduction
+// kernels.
+//
+// The number of threads defaults to the number of cores and can be changed
+// with set_num_threads() (or the MLP constructor) or the environment variable
+// MLP_NUM_THREADS. In deterministic mode (set_deterministic() or
+// MLP_DETERMINISTIC=1) every kernel produces bit for bit the same result for
+// any number of threads, otherwise full reductions may be split differently
+// depending on the thread count.
+namespace parallel {
+
+// Non-owning reference to a callable taking a [begin, end) range. Unlike
+// std::function it never allocates.
+class RangeFunction {
+ public:
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, RangeFunction>>>
+  RangeFunction(F& func)
+      : object(const_cast<void*>(static_cast<const void*>(&func))),
+        call([](void* object, size_t begin, size_t end) {
+          (*static_cast<F*>(object))(begin, end);
+        }) {}
+  RangeFunction() = default;
+  void operator()(size_t begin, size_t end) const { call(object, begin, end); }
+
+ private:
+  void* object = nullptr;
+  void (*call)(void*, size_t, size_t) = nullptr;
+};
+
+// Work stealing thread pool. parallel_for cuts the range into chunks, deals
+// them round robin to per-thread queues and every thread, the caller
+// included, works off its own queue before stealing from the others. Calls
+// from inside a running parallel_for (or while another thread is using the
+// pool) run serially on the calling thread.
+class ThreadPool {
+ public:
+  // num_threads includes the thread calling parallel_for.
+  explicit ThreadPool(size_t num_threads);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t num_threads() const { return workers.size() + 1; }
+
+  // Calls func(begin, end) for chunks covering [0, n) and blocks until all
+  // of them are done. Chunk sizes are multiples of grain, only the last one
+  // may be shorter. func must not throw.
+  template <typename F>
+  void parallel_for(size_t n, size_t grain, F&& func) {
+    run(n, grain, RangeFunction(func));
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::vector<size_t> chunks;
+    size_t head = 0;
+  };
+
+  void run(size_t n, size_t grain, RangeFunction func);
+  void worker_loop(size_t thread_idx);
+  void work_off_chunks(size_t thread_idx);
+  bool next_chunk(size_t thread_idx, size_t* chunk);
+
+  std::vector<std::thread> workers;
+  std::unique_ptr<Queue[]> queues;
+
+  std::mutex submit_mutex;
+  std::mutex job_mutex;
+  std::condition_variable job_started;
+  std::condition_variable job_finished;
+  uint64_t job_generation = 0;
+  bool stopping = false;
+
+  RangeFunction job_func;
+  size_t job_size = 0;
+  size_t job_chunk_size = 0;
+  std::atomic<size_t> job_remaining{0};
+};
+
+// The pool used by the kernels.
+ThreadPool& global_pool();
+size_t num_threads();
+// 0 picks MLP_NUM_THREADS or the number of cores. Must not be called while
+// kernels are running.
+void set_num_threads(size_t num_threads);
+
+bool deterministic();
+void set_deterministic(bool enabled);
+
+// global_pool().parallel_for(...)
+template <typename F>
+void parallel_for(size_t n, size_t grain, F&& func) {
+  global_pool().parallel_for(n, grain, std::forward<F>(func));
+}
+
+}  // namespace parallel
@@ -0,0 +1,81 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Scoped timers for the hot paths: MLP::train records the forward and
+// backward pass of every layer, the loss and the optimizer step, main the
+// data loading and validation. They only exist in builds configured with
+// -DMLP_PROFILE=ON, otherwise Scope is empty and compiles away.
+//
+// Every scope becomes an event on the recording thread with its duration,
+// the floating point operations its caller declares and the heap bytes
+// allocated while it ran (operator new is counted in profiling builds).
+// summary() adds them up per region, write_chrome_trace() exports all events
+// as Chrome trace event JSON, which Perfetto (ui.perfetto.dev) and
+// chrome://tracing display as a timeline per thread.
+namespace profile {
+
+#if defined(MLP_PROFILE)
+inline constexpr bool enabled = true;
+#else
+inline constexpr bool enabled = false;
+#endif
+
+// Times its lifetime as region name, e.g. "forward" of layer index (-1 for
+// none). name must be a string literal, only the pointer is kept.
+class Scope {
+ public:
+  explicit Scope(const char* name, const int32_t index = -1,
+                 const double flops = 0.0) {
+    if constexpr (enabled) {
+      this->begin(name, index, flops);
+    }
+  }
+  ~Scope() {
+    if constexpr (enabled) {
+      this->end();
+    }
+  }
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  void begin(const char* name, int32_t index, double flops);
+  void end();
+
+  const char* name;
+  int32_t index;
+  double flops;
+  std::chrono::steady_clock::time_point start;
+  uint64_t allocated_at_start;
+};
+
+// Totals of all events of one region, in order of first appearance.
+struct Region {
+  std::string name;
+  int32_t index;
+  size_t calls;
+  double seconds;
+  double flops;
+  uint64_t bytes_allocated;
+};
+
+// The functions below read the events of all threads. They must not run
+// while other threads record, e.g. between training steps.
+std::vector<Region> summary();
+// summary() as a table: calls, total and mean time, GFLOP/s and allocations
+// per region.
+void print_summary(std::ostream& stream);
+void write_chrome_trace(const std::string& filename);
+// Drops all events recorded so far.
+void reset();
+
+// Counts bytes as allocated by the calling thread. The operator new of
+// profiling builds calls it, a program replacing operator new itself must
+// call it to keep the counts. Does nothing in other builds.
+void record_allocation(size_t bytes);
+
+}  // namespace profile
@@ -0,0 +1,164 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "half.h"
+
+// Vectorized elementwise and reduction kernels used by Mat2D<float> and
+// Mat2D<double>. There is one implementation per instruction set, the one
+// selected by cpu::active_isa() is used (see cpu.h). All matrices are
+// row-major and dense unless a stride says otherwise.
+namespace simd {
+
+template <typename T>
+inline constexpr bool has_kernels_v =
+    std::is_same_v<T, float> || std::is_same_v<T, double>;
+
+enum class BinaryOp { ADD, SUB, MUL, DIV };
+
+// LEAKY_RELU: max(param * x, x), LEAKY_RELU_GRAD: x > 0 ? 1 : param.
+enum class UnaryOp { NEG, EXP, SIGMOID, LEAKY_RELU, LEAKY_RELU_GRAD };
+
+// Activations which other kernels apply on the fly, the GEMM epilogue (see
+// gemm.h) and activation_backward. NONE is the identity, the others compute
+// the UnaryOp of the same name.
+enum class Activation { NONE, LEAKY_RELU, SIGMOID };
+
+// Optimizer update rules, see update().
+enum class UpdateRule { SGD, MOMENTUM, NESTEROV, ADAM };
+
+template <typename T>
+struct UpdateParams {
+  UpdateRule rule;
+  T learning_rate;
+  // MOMENTUM and NESTEROV: momentum, ADAM: beta_1
+  T momentum;
+  T beta_2;
+  T epsilon;
+  // decoupled weight decay, variable *= 1 - learning_rate * weight_decay
+  T weight_decay;
+  // ADAM only: learning_rate / (1 - beta_1^t) and 1 / sqrt(1 - beta_2^t)
+  T step_size;
+  T inv_sqrt_bias_correction_2;
+};
+
+// Read-only strided operand, element (r, c) is data[r * row_stride + c *
+// col_stride]. A stride of zero broadcasts the operand along that axis.
+template <typename T>
+struct Strided {
+  const T* data;
+  size_t row_stride;
+  size_t col_stride;
+};
+
+// out (rows x cols, dense) = a op b
+void binary(BinaryOp op, size_t rows, size_t cols, Strided<float> a,
+            Strided<float> b, float* out);
+void binary(BinaryOp op, size_t rows, size_t cols, Strided<double> a,
+            Strided<double> b, double* out);
+
+// out[i] = op(in[i]), in and out may alias.
+void unary(UnaryOp op, size_t n, const float* in, float* out, float param);
+void unary(UnaryOp op, size_t n, const double* in, double* out, double param);
+
+// One fused, in place optimizer step over n variables:
+//   SGD:      variable -= learning_rate * gradient
+//   MOMENTUM: state_0 = momentum * state_0 + gradient
+//             variable -= learning_rate * state_0
+//   NESTEROV: like MOMENTUM, but variable -= learning_rate * (gradient +
+//             momentum * state_0)
+//   ADAM:     state_0 = beta_1 * state_0 + (1 - beta_1) * gradient
+//             state_1 = beta_2 * state_1 + (1 - beta_2) * gradient^2
+//             variable -= step_size * state_0 /
+//                         (sqrt(state_1) * inv_sqrt_bias_correction_2 + eps)
+// after the weight decay. State buffers start at zero and may be nullptr if
+// the rule does not use them.
+void update(const UpdateParams<float>& params, size_t n, float* variable,
+            const float* gradient, float* state_0, float* state_1);
+void update(const UpdateParams<double>& params, size_t n, double* variable,
+            const double* gradient, double* state_0, double* state_1);
+
+// Backward pass of out = act(z) over a rows x cols batch, in one sweep:
+// grad_z = grad_out * act'(z), with act'(z) derived from out (so LEAKY_RELU
+// needs param >= 0), and bias_grad (cols entries) = the column sums of
+// grad_z, i.e. the gradient of a bias added to z. grad_z may alias grad_out.
+// With accumulate_bias the column sums are added to bias_grad instead, e.g.
+// over the micro-batches of one batch.
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const float* out, const float* grad_out, float param,
+                         float* grad_z, float* bias_grad,
+                         bool accumulate_bias = false);
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const double* out, const double* grad_out,
+                         double param, double* grad_z, double* bias_grad,
+                         bool accumulate_bias = false);
+
+// The same with out stored in 16 bits (see half.h), e.g. the activations
+// mixed precision training keeps for the backward pass. out is widened to
+// float while it is read.
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const bfloat16* out, const float* grad_out,
+                         float param, float* grad_z, float* bias_grad,
+                         bool accumulate_bias = false);
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const float16* out, const float* grad_out,
+                         float param, float* grad_z, float* bias_grad,
+                         bool accumulate_bias = false);
+
+// n values between float and the 16 bit storage formats of half.h, rounded
+// to nearest even. Matches the conversions of the half.h types.
+void convert(size_t n, const float* in, bfloat16* out);
+void convert(size_t n, const float* in, float16* out);
+void convert(size_t n, const bfloat16* in, float* out);
+void convert(size_t n, const float16* in, float* out);
+
+// Softmax cross entropy of a rows x cols batch of logits, one sweep over
+// every row using log-sum-exp instead of materializing the probabilities:
+//   loss[r] = sum_c labels[r][c] * (log(sum_c' exp(logits[r][c'])) -
+//                                   logits[r][c])
+//   grad = grad_scale * (softmax(logits) - labels)
+// The labels are either given as one hot rows (classes == nullptr) or as one
+// class index in [0, cols) per row (one_hot == nullptr). loss (rows entries)
+// or grad (rows x cols) may be nullptr if they are not needed, grad may alias
+// logits.
+void softmax_cross_entropy(size_t rows, size_t cols, const float* logits,
+                           const float* one_hot, const int32_t* classes,
+                           float grad_scale, float* loss, float* grad);
+void softmax_cross_entropy(size_t rows, size_t cols, const double* logits,
+                           const double* one_hot, const int32_t* classes,
+                           double grad_scale, double* loss, double* grad);
+
+// Parses a csv text of numbers from 0 to 255, num_columns of them per line,
+// into one row of num_columns bytes per sample line. Lines which do not
+// start with a digit (a header, empty lines) are skipped, lines may end in
+// "\r\n" and the last one may lack its line break. As each sample line takes
+// at least 2 * num_columns - 1 bytes, rows needs room for at most
+// size / (2 * num_columns - 1) + 1 of them. Sets num_rows to the number of
+// sample lines, or returns false if one is invalid, the rows are undefined
+// then. Unlike the other kernels it runs on the calling thread only, callers
+// parsing a large text split it at line breaks themselves.
+bool parse_csv_bytes(size_t size, const char* text, size_t num_columns,
+                     uint8_t* rows, size_t* num_rows);
+
+float sum(size_t n, const float* in);
+double sum(size_t n, const double* in);
+
+// Reductions of a rows x cols matrix along axis 0 (out has cols entries) or
+// axis 1 (out has rows entries). max and argmax follow the scalar semantics
+// of Mat2D: the first maximum wins and NaNs are skipped. sum_axis adds to
+// out with accumulate.
+void sum_axis(size_t axis, size_t rows, size_t cols, const float* in,
+              float* out, bool accumulate = false);
+void sum_axis(size_t axis, size_t rows, size_t cols, const double* in,
+              double* out, bool accumulate = false);
+void max_axis(size_t axis, size_t rows, size_t cols, const float* in,
+              float* out);
+void max_axis(size_t axis, size_t rows, size_t cols, const double* in,
+              double* out);
+void argmax_axis(size_t axis, size_t rows, size_t cols, const float* in,
+                 size_t* out);
+void argmax_axis(size_t axis, size_t rows, size_t cols, const double* in,
+                 size_t* out);
+
+}  // namespace simd
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+
+// Matrix in compressed sparse row (CSR) form, for inputs which are mostly one
+// background value. MNIST rows are, but read_mnist_csv shifts the pixels to
+// [-0.5, 0.5), so the background is -0.5 rather than zero. Only the entries
+// that differ from it are stored, as their difference to it: entry (r, c) is
+// background + values[p] if col_indices[p] == c for a p in
+// [row_offsets[r], row_offsets[r + 1]), and background otherwise. A product
+// with the matrix therefore is the sparse product of the stored values (see
+// gemm::sparse_matmul_bias_activation) plus background times the column
+// sums of the other operand.
+struct CsrMatrix {
+  size_t num_rows = 0;
+  size_t num_cols = 0;
+  float background = 0.0f;
+  // num_rows + 1 entries
+  std::vector<uint32_t> row_offsets;
+  // ascending within every row
+  std::vector<uint32_t> col_indices;
+  std::vector<float> values;
+
+  // Fraction of the entries which are stored.
+  float density() const;
+};
+
+// Stores dense in csr, with the smallest value of dense as background, if at
+// most max_density of its entries differ from it, and returns whether it
+// did. csr keeps its memory, so converting batch after batch does not
+// allocate once it is large enough. A view must be contiguous, e.g. a row
+// slice, to be converted.
+bool to_sparse(const Mat2D<float>& dense, float max_density, CsrMatrix& csr);
+bool to_sparse(MatView<const float> dense, float max_density, CsrMatrix& csr);
+// out = in transposed, in CSR form again. Like to_sparse, out keeps its
+// memory.
+void transpose_into(const CsrMatrix& in, CsrMatrix& out);
+// The dense matrix, e.g. for tests.
+Mat2D<float> to_dense(const CsrMatrix& csr);
@@ -6,8 +6,14 @@
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include "expr.h"
+#include "gemm.h"
+#include "simd.h"
+#include "view.h"
+
 template <typename T>
 void print_vec(std::vector<T> const& vec) {
   std::cout << "[";
@@ -42,12 +48,23 @@ class Mat2D {
  public:
   Mat2D(const size_t rows, const size_t cols, Initializer = ZEROS);
   Mat2D(std::vector<std::vector<T>> data);
-  // Mat2D(const Mat2D<T> &other); // copy constructor
-  //~Mat2D();
   Mat2D(const size_t num_rows, const size_t num_cols, std::vector<T> data);
+  // Copies are deep, moves only hand over the buffer.
+  Mat2D(const Mat2D<T>& other) = default;
+  Mat2D(Mat2D<T>&& other) noexcept = default;
+  Mat2D<T>& operator=(const Mat2D<T>& other) = default;
+  Mat2D<T>& operator=(Mat2D<T>&& other) noexcept = default;
+  // Evaluates a lazy expression or copies a MatView, see expr.h.
+  template <typename E, typename = std::enable_if_t<expr::is_expression_v<E>>>
+  Mat2D(const E& expression);
+  // Evaluates a lazy expression, in place if the shape does not change.
+  template <typename E, typename = std::enable_if_t<expr::is_expression_v<E>>>
+  Mat2D<T>& operator=(const E& expression);
   T& operator()(size_t row_idx, size_t col_idx);
   T operator()(size_t row_idx, size_t col_idx) const;
   Mat2D<T> dot_product(const Mat2D<T>& other) const;
+  // Plain triple loop, kept as reference for the packed GEMM kernels.
+  Mat2D<T> dot_product_reference(const Mat2D<T>& other) const;
   Mat2D<T> add(const Mat2D<T>& other) const;
   Mat2D<T> divide_by(const Mat2D<T>& other) const;
   Mat2D<T> minus(const Mat2D<T>& other) const;
@@ -57,10 +74,57 @@ class Mat2D {
   Mat2D<T> minus(const T other) const;
   Mat2D<T> hadamard_product(const T other) const;
 
-
-  Mat2D<T> elementwise_combination_w_broadcast(
-      const Mat2D<T>& other, std::function<T(T, T)> modifier) const;
-  Mat2D<T> elementwise_operation(std::function<T(T)> modifier);
+  // Output parameter versions of the operations above. result is resized to
+  // the shape of the result and does not reallocate if it already has the
+  // memory, so buffers reused across training steps never allocate. The
+  // elementwise ones allow result to be this matrix or other (if it is not
+  // broadcast), dot_product_into and transpose_into do not.
+  void dot_product_into(const Mat2D<T>& other, Mat2D<T>& result) const;
+  void add_into(const Mat2D<T>& other, Mat2D<T>& result) const;
+  void minus_into(const Mat2D<T>& other, Mat2D<T>& result) const;
+  void hadamard_product_into(const Mat2D<T>& other, Mat2D<T>& result) const;
+  void divide_by_into(const Mat2D<T>& other, Mat2D<T>& result) const;
+  void elementwise_operation_into(simd::UnaryOp op, T param,
+                                  Mat2D<T>& result) const;
+  void reduce_sum_axis_into(const size_t axis, Mat2D<T>& result) const;
+  void transpose_into(Mat2D<T>& result) const;
+  // Changes the shape, the contents are unspecified afterwards. The memory is
+  // kept if it is large enough.
+  void resize(const size_t rows, const size_t cols);
+
+  // Non-owning views, see view.h. They are invalidated by resizing.
+  MatView<T> view();
+  MatView<const T> view() const;
+  // Rows [begin, end), e.g. part of a batch.
+  MatView<T> row_slice(const size_t begin, const size_t end);
+  MatView<const T> row_slice(const size_t begin, const size_t end) const;
+
+  // In place elementwise operations with a Mat2D, a scalar or a lazy
+  // expression, broadcast like add(). The shape of this matrix must not
+  // change. Matrices run through the SIMD kernels for float and double.
+  template <typename X>
+  Mat2D<T>& operator+=(X&& other);
+  template <typename X>
+  Mat2D<T>& operator-=(X&& other);
+  // elementwise (hadamard) product, like the binary *
+  template <typename X>
+  Mat2D<T>& operator*=(X&& other);
+  template <typename X>
+  Mat2D<T>& operator/=(X&& other);
+  // this += alpha * x, in one pass.
+  Mat2D<T>& axpy(const T alpha, const Mat2D<T>& x);
+
+  template <typename F>
+  Mat2D<T> elementwise_combination_w_broadcast(const Mat2D<T>& other,
+                                               F modifier) const;
+  template <typename F,
+            typename = std::enable_if_t<std::is_invocable_r_v<T, F&, T>>>
+  Mat2D<T> elementwise_operation(F modifier) const;
+  template <typename F,
+            typename = std::enable_if_t<std::is_invocable_r_v<T, F&, T>>>
+  Mat2D<T>& elementwise_operation_in_place(F modifier);
+  // SIMD kernel version for float and double, see simd::UnaryOp.
+  Mat2D<T> elementwise_operation(simd::UnaryOp op, T param = T(0)) const;
   T reduce_sum() const;
   Mat2D<T> reduce_sum_axis(const size_t axis) const;
   Mat2D<T> reduce_max_axis(const size_t axis) const;
@@ -73,67 +137,69 @@ class Mat2D {
 
   template <typename U>
   friend std::ostream& operator<<(std::ostream& os, const Mat2D<U>&);
-  // Mat2D<T> &operator=(const Mat2D<T> &other); // assignment operator
-  template <typename U>
-  Mat2D<T>& operator+(const Mat2D<U>& classObj);
-  template <typename U>
-  Mat2D<T>& operator-(const Mat2D<U>& classObj);
-  Mat2D<T> operator-();
+  // Binary +, -, * and / are lazy, see expr.h.
+  Mat2D<T> operator-() const;
 
   std::vector<T> matrix_data;
 
  private:
+  // Runs op through the SIMD kernels for float and double, other types use
+  // elementwise_combination_w_broadcast with the fallback functor.
+  template <typename Fallback>
+  Mat2D<T> elementwise_kernel_w_broadcast(const Mat2D<T>& other,
+                                          simd::BinaryOp op,
+                                          Fallback fallback) const;
+  template <typename Fallback>
+  void elementwise_kernel_w_broadcast_into(const Mat2D<T>& other,
+                                           simd::BinaryOp op, Fallback fallback,
+                                           Mat2D<T>& result) const;
+  template <typename F, typename X>
+  Mat2D<T>& compound_assign(simd::BinaryOp op, F func, X&& other);
+
   size_t num_rows;
   size_t num_cols;
 };
 
 template <class T>
-template <typename U>
-Mat2D<T>& Mat2D<T>::operator+(const Mat2D<U>& other) {
-  // ...
-  return this->add(other);
+Mat2D<T> Mat2D<T>::operator-() const {
+  if constexpr (simd::has_kernels_v<T>) {
+    return this->elementwise_operation(simd::UnaryOp::NEG);
+  } else {
+    return this->elementwise_operation(
+        [](T x) { return static_cast<T>(-1.0) * x; });
+  }
 }
 
 template <class T>
-Mat2D<T> Mat2D<T>::operator-() {
-  const auto result =
-      this->elementwise_operation([](T x) { return static_cast<T>(-1.0) * x; });
-  return result;
+template <typename E, typename>
+Mat2D<T>::Mat2D(const E& expression)
+    : matrix_data(expression.rows() * expression.cols()),
+      num_rows(expression.rows()),
+      num_cols(expression.cols()) {
+  expr::evaluate(expression, matrix_data.data());
 }
 
 template <class T>
-template <typename U>
-Mat2D<T>& Mat2D<T>::operator-(const Mat2D<U>& other) {
-  const Mat2D<T> minus_one(0, 0, std::vector({-1.0}));
-  return this->add(other);
+template <typename E, typename>
+Mat2D<T>& Mat2D<T>::operator=(const E& expression) {
+  if (expression.rows() == num_rows && expression.cols() == num_cols) {
+    expr::evaluate(expression, matrix_data.data());
+  } else {
+    // the expression might read from this matrix, so evaluate it first
+    Mat2D<T> result(expression);
+    *this = std::move(result);
+  }
+  return *this;
 }
 
 template <class T>
 Mat2D<T>::Mat2D(const size_t num_rows, const size_t num_cols,
                 std::vector<T> data)
-    : num_rows(num_rows), num_cols(num_cols) {
-  matrix_data.resize(num_rows * num_cols);
-  matrix_data = data;
-}
-
-/*
-template <class T>
-Mat2D<T>::Mat2D(const Mat2D<T> &other)
-    : num_rows(other.num_rows), num_cols(other.num_cols) {
-  this->matrix_data = other.matrix_data;
-}
-
-template <class T> Mat2D<T>::~Mat2D() {}
-
-template <class T> Mat2D<T> &Mat2D<T>::operator=(const Mat2D<T> &other) {
-  if (this != &other) {
-    this->num_cols = other.num_cols;
-    this->num_rows = other.num_rows;
-    this->matrix_data = other.matrix_data;
+    : matrix_data(std::move(data)), num_rows(num_rows), num_cols(num_cols) {
+  if (matrix_data.size() != num_rows * num_cols) {
+    throw std::runtime_error("Mat2D: Data size does not match the shape.");
   }
-  return *this;
 }
-*/
 template <class T>
 Mat2D<T>::Mat2D(const size_t num_rows, const size_t num_cols,
                 const Initializer init)
@@ -161,6 +227,119 @@ size_t Mat2D<T>::get_num_cols() const {
   return num_cols;
 }
 
+template <class T>
+void Mat2D<T>::resize(const size_t rows, const size_t cols) {
+  matrix_data.resize(rows * cols);
+  num_rows = rows;
+  num_cols = cols;
+}
+
+template <class T>
+MatView<T> Mat2D<T>::view() {
+  return MatView<T>(matrix_data.data(), num_rows, num_cols, num_cols);
+}
+
+template <class T>
+MatView<const T> Mat2D<T>::view() const {
+  return MatView<const T>(matrix_data.data(), num_rows, num_cols, num_cols);
+}
+
+template <class T>
+MatView<T> Mat2D<T>::row_slice(const size_t begin, const size_t end) {
+  return this->view().row_slice(begin, end);
+}
+
+template <class T>
+MatView<const T> Mat2D<T>::row_slice(const size_t begin,
+                                     const size_t end) const {
+  return this->view().row_slice(begin, end);
+}
+
+template <class T>
+template <typename X>
+Mat2D<T>& Mat2D<T>::operator+=(X&& other) {
+  return this->compound_assign(simd::BinaryOp::ADD, std::plus<T>(),
+                               std::forward<X>(other));
+}
+
+template <class T>
+template <typename X>
+Mat2D<T>& Mat2D<T>::operator-=(X&& other) {
+  return this->compound_assign(simd::BinaryOp::SUB, std::minus<T>(),
+                               std::forward<X>(other));
+}
+
+template <class T>
+template <typename X>
+Mat2D<T>& Mat2D<T>::operator*=(X&& other) {
+  return this->compound_assign(simd::BinaryOp::MUL, std::multiplies<T>(),
+                               std::forward<X>(other));
+}
+
+template <class T>
+template <typename X>
+Mat2D<T>& Mat2D<T>::operator/=(X&& other) {
+  return this->compound_assign(simd::BinaryOp::DIV, std::divides<T>(),
+                               std::forward<X>(other));
+}
+
+template <class T>
+template <typename F, typename X>
+Mat2D<T>& Mat2D<T>::compound_assign(simd::BinaryOp op, F func, X&& other) {
+  static_assert(expr::is_operand_v<X> || expr::is_scalar_v<X>,
+                "Compound assignment needs a matrix, expression or scalar.");
+  if constexpr (expr::is_scalar_v<X>) {
+    const T value = static_cast<T>(other);
+    if constexpr (simd::has_kernels_v<T>) {
+      const simd::Strided<T> lhs{matrix_data.data(), num_cols, 1};
+      simd::binary(op, num_rows, num_cols, lhs, {&value, 0, 0},
+                   matrix_data.data());
+    } else {
+      for (auto& element : matrix_data) {
+        element = func(element, value);
+      }
+    }
+  } else {
+    const auto check_shape = [this](size_t rows, size_t cols) {
+      if ((rows != num_rows && rows != 1) || (cols != num_cols && cols != 1)) {
+        throw std::runtime_error(
+            "Compound assignment: Operand dim incompatible, the shape of the "
+            "result must not change.");
+      }
+    };
+    if constexpr (simd::has_kernels_v<T> &&
+                  std::is_same_v<std::decay_t<X>, Mat2D<T>>) {
+      check_shape(other.num_rows, other.num_cols);
+      this->elementwise_kernel_w_broadcast_into(other, op, func, *this);
+    } else {
+      const auto node = expr::as_node(std::forward<X>(other));
+      check_shape(node.rows(), node.cols());
+      expr::evaluate(expr::binary(func, *this, node), matrix_data.data());
+    }
+  }
+  return *this;
+}
+
+template <class T>
+Mat2D<T>& Mat2D<T>::axpy(const T alpha, const Mat2D<T>& x) {
+  if (x.num_rows != num_rows || x.num_cols != num_cols) {
+    throw std::runtime_error("Axpy: Matrix dim incompatible.");
+  }
+  if constexpr (simd::has_kernels_v<T>) {
+    // the fused SGD update computes variable -= learning_rate * gradient
+    simd::UpdateParams<T> params{};
+    params.rule = simd::UpdateRule::SGD;
+    params.learning_rate = -alpha;
+    simd::update(params, matrix_data.size(), matrix_data.data(),
+                 x.matrix_data.data(), nullptr, nullptr);
+  } else {
+    for (size_t idx = 0; idx < matrix_data.size(); ++idx) {
+      matrix_data[idx] += alpha * x.matrix_data[idx];
+    }
+  }
+  return *this;
+}
+
 template <class T>
 Mat2D<T>::Mat2D(std::vector<std::vector<T>> data)
     : num_rows(data.size()), num_cols(data.at(0).size()) {
@@ -182,17 +361,70 @@ T Mat2D<T>::operator()(size_t row_idx, size_t col_idx) const {
   return matrix_data[row_idx * num_cols + col_idx];
 }
 template <class T>
-Mat2D<T> Mat2D<T>::elementwise_operation(std::function<T(T)> modifier) {
-  std::vector<T> result;
-  result.resize(this->matrix_data.size());
-  std::transform(std::begin(this->matrix_data), std::end(this->matrix_data),
-                 std::begin(result), [&](T x) { return modifier(x); });
-  this->matrix_data = result;
+template <typename F, typename>
+Mat2D<T> Mat2D<T>::elementwise_operation(F modifier) const {
+  Mat2D<T> result(num_rows, num_cols);
+  std::transform(this->matrix_data.begin(), this->matrix_data.end(),
+                 result.matrix_data.begin(), modifier);
+  return result;
+}
+
+template <class T>
+template <typename F, typename>
+Mat2D<T>& Mat2D<T>::elementwise_operation_in_place(F modifier) {
+  std::transform(this->matrix_data.begin(), this->matrix_data.end(),
+                 this->matrix_data.begin(), modifier);
   return *this;
 }
 
+template <class T>
+Mat2D<T> Mat2D<T>::elementwise_operation(simd::UnaryOp op, T param) const {
+  Mat2D<T> result(num_rows, num_cols);
+  this->elementwise_operation_into(op, param, result);
+  return result;
+}
+
+template <class T>
+void Mat2D<T>::elementwise_operation_into(simd::UnaryOp op, T param,
+                                          Mat2D<T>& result) const {
+  static_assert(simd::has_kernels_v<T>,
+                "SIMD elementwise operations need float or double.");
+  result.resize(num_rows, num_cols);
+  simd::unary(op, matrix_data.size(), matrix_data.data(),
+              result.matrix_data.data(), param);
+}
+
 template <class T>
 Mat2D<T> Mat2D<T>::dot_product(const Mat2D<T>& other) const {
+  if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+    Mat2D<T> result(num_rows, other.num_cols);
+    this->dot_product_into(other, result);
+    return result;
+  } else {
+    return this->dot_product_reference(other);
+  }
+}
+
+template <class T>
+void Mat2D<T>::dot_product_into(const Mat2D<T>& other,
+                                Mat2D<T>& result) const {
+  if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+    if (num_cols != other.num_rows) {
+      throw std::runtime_error("Dot Product: AxB=C -> A.num_cols (" +
+                               std::to_string(num_cols) + ") != B.num_rows (" +
+                               std::to_string(other.num_rows) +
+                               ") size mismatch).");
+    }
+    result.resize(num_rows, other.num_cols);
+    gemm::matmul(num_rows, other.num_cols, num_cols, matrix_data.data(),
+                 other.matrix_data.data(), result.matrix_data.data());
+  } else {
+    result = this->dot_product_reference(other);
+  }
+}
+
+template <class T>
+Mat2D<T> Mat2D<T>::dot_product_reference(const Mat2D<T>& other) const {
   if (num_cols != other.num_rows) {
     throw std::runtime_error("Dot Product: AxB=C -> A.num_cols (" +
                              std::to_string(num_cols) + ") != B.num_rows (" +
@@ -212,13 +444,81 @@ Mat2D<T> Mat2D<T>::dot_product(const Mat2D<T>& other) const {
 }
 
 
+namespace gemm {
+
+// c = alpha * op(a) * op(b) + beta * c on whole matrices, where op transposes
+// its operand if the flag is YES, e.g. the weight gradient of a dense layer
+// is gemm(Transpose::YES, Transpose::NO, 1.0f, input, grad_output, 0.0f, dw).
+// With beta == 0 c is resized to the result shape, otherwise it must already
+// have it, which accumulates e.g. gradients over several batches. c must not
+// be a or b. For float, a and b may also be stored as bfloat16 or float16,
+// see the mixed precision gemm of gemm.h.
+template <class T, class A = T, class B = T>
+void gemm(Transpose trans_a, Transpose trans_b, T alpha, const Mat2D<A>& a,
+          const Mat2D<B>& b, T beta, Mat2D<T>& c) {
+  static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>,
+                "gemm needs float or double.");
+  const bool t_a = trans_a == Transpose::YES;
+  const bool t_b = trans_b == Transpose::YES;
+  const size_t m = t_a ? a.get_num_cols() : a.get_num_rows();
+  const size_t k = t_a ? a.get_num_rows() : a.get_num_cols();
+  const size_t k_b = t_b ? b.get_num_cols() : b.get_num_rows();
+  const size_t n = t_b ? b.get_num_rows() : b.get_num_cols();
+  if (k != k_b) {
+    throw std::runtime_error("GEMM: op(A).num_cols (" + std::to_string(k) +
+                             ") != op(B).num_rows (" + std::to_string(k_b) +
+                             ") size mismatch.");
+  }
+  if (beta == T(0)) {
+    c.resize(m, n);
+  } else if (c.get_num_rows() != m || c.get_num_cols() != n) {
+    throw std::runtime_error("GEMM: C dim incompatible with op(A) * op(B).");
+  }
+  gemm(trans_a, trans_b, m, n, k, alpha, a.matrix_data.data(),
+       a.get_num_cols(), b.matrix_data.data(), b.get_num_cols(), beta,
+       c.matrix_data.data(), n);
+}
+
+}  // namespace gemm
+
+// out = in, converted from float to one of the 16 bit formats of half.h or
+// back (see simd::convert). Like the _into methods of Mat2D, out is resized
+// and keeps its memory if it is large enough.
+// The view must be contiguous, e.g. a row slice.
+template <class To, class From>
+void convert_into(const MatView<const From> in, Mat2D<To>& out) {
+  if (!in.is_contiguous()) {
+    throw std::runtime_error("convert_into: Input is not contiguous.");
+  }
+  out.resize(in.get_num_rows(), in.get_num_cols());
+  simd::convert(in.get_num_rows() * in.get_num_cols(), in.data(),
+                out.matrix_data.data());
+}
+template <class To, class From>
+void convert_into(const Mat2D<From>& in, Mat2D<To>& out) {
+  convert_into(in.view(), out);
+}
+
 template <class T>
 T Mat2D<T>::reduce_sum() const {
-  return std::accumulate(matrix_data.begin(), matrix_data.end(), T());
+  if constexpr (simd::has_kernels_v<T>) {
+    return simd::sum(matrix_data.size(), matrix_data.data());
+  } else {
+    return std::accumulate(matrix_data.begin(), matrix_data.end(), T());
+  }
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::reduce_max_axis(const size_t axis) const {
+  if constexpr (simd::has_kernels_v<T>) {
+    if (axis != 0 && axis != 1) {
+      throw std::runtime_error("Wrong axis for reduce_max, needs to be 0 or 1");
+    }
+    Mat2D<T> max_vals(axis == 0 ? 1 : num_rows, axis == 0 ? num_cols : 1);
+    simd::max_axis(axis, num_rows, num_cols, matrix_data.data(),
+                   max_vals.matrix_data.data());
+    return max_vals;
+  }
   const auto argmax_indices = this->argmax(axis);
   const auto num_result_rows = argmax_indices.get_num_rows();
   const auto num_result_cols = argmax_indices.get_num_cols();
@@ -245,6 +545,13 @@ Mat2D<size_t> Mat2D<T>::argmax(const size_t axis) const {
 
   Mat2D<size_t> argmax_indices(num_result_rows, num_result_cols);
 
+  if constexpr (simd::has_kernels_v<T>) {
+    if (axis == 0 || axis == 1) {
+      simd::argmax_axis(axis, num_rows, num_cols, matrix_data.data(),
+                        argmax_indices.matrix_data.data());
+      return argmax_indices;
+    }
+  }
   if (axis == 0) {
     for (size_t col_idx = 0; col_idx < this->get_num_cols(); ++col_idx) {
       T row_max = -std::numeric_limits<T>::infinity();
@@ -279,9 +586,24 @@ Mat2D<size_t> Mat2D<T>::argmax(const size_t axis) const {
 
 template <class T>
 Mat2D<T> Mat2D<T>::reduce_sum_axis(const size_t axis) const {
+  Mat2D<T> result(0, 0);
+  this->reduce_sum_axis_into(axis, result);
+  return result;
+}
+
+template <class T>
+void Mat2D<T>::reduce_sum_axis_into(const size_t axis,
+                                    Mat2D<T>& result) const {
   const auto num_result_rows = (axis == 0 ? 1 : this->get_num_rows());
   const auto num_result_cols = (axis == 1 ? 1 : this->get_num_cols());
-  Mat2D<T> result(num_result_rows, num_result_cols);
+  result.resize(num_result_rows, num_result_cols);
+  if constexpr (simd::has_kernels_v<T>) {
+    if (axis == 0 || axis == 1) {
+      simd::sum_axis(axis, num_rows, num_cols, matrix_data.data(),
+                     result.matrix_data.data());
+      return;
+    }
+  }
   if (axis == 0) {
     for (size_t col_idx = 0; col_idx < this->get_num_cols(); ++col_idx) {
       T col_sum = static_cast<T>(0);
@@ -301,7 +623,6 @@ Mat2D<T> Mat2D<T>::reduce_sum_axis(const size_t axis) const {
   } else {
     std::runtime_error("Reduce sum: Axis must be 0 or 1.");
   }
-  return result;
 }
 
 template <class T>
@@ -323,122 +644,147 @@ Mat2D<T> Mat2D<T>::reduce_mean_axis(const size_t axis) const {
 
 template <class T>
 Mat2D<T> Mat2D<T>::add(const Mat2D<T>& other) const {
-  return this->elementwise_combination_w_broadcast(other, std::plus<T>());
+  return this->elementwise_kernel_w_broadcast(other, simd::BinaryOp::ADD,
+                                              std::plus<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::minus(const Mat2D<T>& other) const {
-  return this->elementwise_combination_w_broadcast(other, std::minus<T>());
+  return this->elementwise_kernel_w_broadcast(other, simd::BinaryOp::SUB,
+                                              std::minus<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::divide_by(const Mat2D<T>& other) const {
-  return this->elementwise_combination_w_broadcast(other, std::divides<T>());
+  return this->elementwise_kernel_w_broadcast(other, simd::BinaryOp::DIV,
+                                              std::divides<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::hadamard_product(const Mat2D<T>& other) const {
-  return this->elementwise_combination_w_broadcast(other, std::multiplies<T>());
+  return this->elementwise_kernel_w_broadcast(other, simd::BinaryOp::MUL,
+                                              std::multiplies<T>());
+}
+
+template <class T>
+void Mat2D<T>::add_into(const Mat2D<T>& other, Mat2D<T>& result) const {
+  this->elementwise_kernel_w_broadcast_into(other, simd::BinaryOp::ADD,
+                                            std::plus<T>(), result);
+}
+
+template <class T>
+void Mat2D<T>::minus_into(const Mat2D<T>& other, Mat2D<T>& result) const {
+  this->elementwise_kernel_w_broadcast_into(other, simd::BinaryOp::SUB,
+                                            std::minus<T>(), result);
+}
+
+template <class T>
+void Mat2D<T>::divide_by_into(const Mat2D<T>& other,
+                              Mat2D<T>& result) const {
+  this->elementwise_kernel_w_broadcast_into(other, simd::BinaryOp::DIV,
+                                            std::divides<T>(), result);
+}
+
+template <class T>
+void Mat2D<T>::hadamard_product_into(const Mat2D<T>& other,
+                                     Mat2D<T>& result) const {
+  this->elementwise_kernel_w_broadcast_into(other, simd::BinaryOp::MUL,
+                                            std::multiplies<T>(), result);
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::add(const T other) const {
   const Mat2D mat_other(1,1,{other});
-  return this->elementwise_combination_w_broadcast(mat_other, std::plus<T>());
+  return this->elementwise_kernel_w_broadcast(mat_other, simd::BinaryOp::ADD,
+                                              std::plus<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::minus(const T other) const {
   const Mat2D mat_other(1,1,{other});
-  return this->elementwise_combination_w_broadcast(mat_other, std::minus<T>());
+  return this->elementwise_kernel_w_broadcast(mat_other, simd::BinaryOp::SUB,
+                                              std::minus<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::divide_by(const T other) const {
   const Mat2D mat_other(1,1,{other});
-  return this->elementwise_combination_w_broadcast(mat_other, std::divides<T>());
+  return this->elementwise_kernel_w_broadcast(mat_other, simd::BinaryOp::DIV,
+                                              std::divides<T>());
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::hadamard_product(const T other) const {
   const Mat2D mat_other(1,1,{other});
-  return this->elementwise_combination_w_broadcast(mat_other, std::multiplies<T>());
+  return this->elementwise_kernel_w_broadcast(mat_other, simd::BinaryOp::MUL,
+                                              std::multiplies<T>());
 }
 
 template <class T>
-Mat2D<T> Mat2D<T>::elementwise_combination_w_broadcast(
-    const Mat2D<T>& other, std::function<T(T, T)> modifier) const {
-  Mat2D<T> result(std::max(other.get_num_rows(), get_num_rows()),
-                  std::max(other.get_num_cols(), get_num_cols()));
-
-  bool rows_compatible = other.get_num_rows() == get_num_rows() ||
-                         other.get_num_rows() == 1 || get_num_rows() == 1;
-
-  bool cols_compatible = other.get_num_cols() == get_num_cols() ||
-                         other.get_num_cols() == 1 || get_num_cols() == 1;
-
-  if (!rows_compatible) {
-    throw std::runtime_error("Add: Matrix Row dim incompatible.");
-  }
-  if (!cols_compatible) {
-    throw std::runtime_error("Add: Matrix Cols dim incompatible.");
-  }
+template <typename Fallback>
+Mat2D<T> Mat2D<T>::elementwise_kernel_w_broadcast(const Mat2D<T>& other,
+                                                  simd::BinaryOp op,
+                                                  Fallback fallback) const {
+  Mat2D<T> result(0, 0);
+  this->elementwise_kernel_w_broadcast_into(other, op, fallback, result);
+  return result;
+}
 
-  if (other.get_num_rows() == get_num_rows() &&
-      other.get_num_cols() == get_num_cols()) {
-    for (size_t row_idx = 0; row_idx < get_num_rows(); ++row_idx) {
-      for (size_t col_idx = 0; col_idx < get_num_cols(); ++col_idx) {
-        result(row_idx, col_idx) = modifier(this->operator()(row_idx, col_idx),
-                                            other(row_idx, col_idx));
-      }
+template <class T>
+template <typename Fallback>
+void Mat2D<T>::elementwise_kernel_w_broadcast_into(const Mat2D<T>& other,
+                                                   simd::BinaryOp op,
+                                                   Fallback fallback,
+                                                   Mat2D<T>& result) const {
+  if constexpr (simd::has_kernels_v<T>) {
+    if (other.num_rows != num_rows && other.num_rows != 1 && num_rows != 1) {
+      throw std::runtime_error("Add: Matrix Row dim incompatible.");
     }
-  } else if (other.get_num_rows() == 1 || get_num_rows() == 1 ||
-             other.get_num_cols() == 1 || get_num_cols() == 1) {
-    const size_t one = 1;
-    const size_t zero = 0;
-    size_t max_rows = 0;
-    size_t max_rows_other = 0;
-    if (other.get_num_rows() == get_num_rows()) {
-      max_rows = get_num_rows();
-      max_rows_other = max_rows;
-    } else {
-      max_rows = std::max(get_num_rows(), one);
-      max_rows_other = std::max(other.get_num_rows(), one);
-    }
-    size_t max_cols = 0;
-    size_t max_cols_other = 0;
-    if (other.get_num_cols() == get_num_cols()) {
-      max_cols = get_num_cols();
-      max_cols_other = max_cols;
-    } else {
-      max_cols = std::max(get_num_cols(), one);
-      max_cols_other = std::max(other.get_num_cols(), one);
-    }
-
-    for (size_t row_idx = 0; row_idx < result.get_num_rows(); ++row_idx) {
-      for (size_t col_idx = 0; col_idx < result.get_num_cols(); ++col_idx) {
-        const T val_a =
-            this->operator()(std::clamp(row_idx, zero, max_rows - 1),
-                             std::clamp(col_idx, zero, max_cols - 1));
-        const T val_b = other(std::clamp(row_idx, zero, max_rows_other - 1),
-                              std::clamp(col_idx, zero, max_cols_other - 1));
-
-        result(row_idx, col_idx) = modifier(val_a, val_b);
-      }
+    if (other.num_cols != num_cols && other.num_cols != 1 && num_cols != 1) {
+      throw std::runtime_error("Add: Matrix Cols dim incompatible.");
     }
+    const size_t rows = std::max(other.num_rows, num_rows);
+    const size_t cols = std::max(other.num_cols, num_cols);
+    // a single row or column is broadcast by giving it a zero stride
+    const auto strided = [rows, cols](const Mat2D<T>& mat) {
+      return simd::Strided<T>{
+          mat.matrix_data.data(),
+          mat.num_rows == 1 && rows != 1 ? 0 : mat.num_cols,
+          mat.num_cols == 1 && cols != 1 ? 0 : size_t(1)};
+    };
+    const auto lhs = strided(*this);
+    const auto rhs = strided(other);
+    // an operand aliasing result has the result shape, so resizing keeps its
+    // data in place
+    result.resize(rows, cols);
+    simd::binary(op, rows, cols, lhs, rhs, result.matrix_data.data());
+  } else {
+    result = this->elementwise_combination_w_broadcast(other, fallback);
   }
-  return result;
+}
+
+template <class T>
+template <typename F>
+Mat2D<T> Mat2D<T>::elementwise_combination_w_broadcast(const Mat2D<T>& other,
+                                                       F modifier) const {
+  return expr::binary(modifier, *this, other);
 }
 
 template <class T>
 Mat2D<T> Mat2D<T>::transpose() const {
   Mat2D<T> result(num_cols, num_rows);
+  this->transpose_into(result);
+  return result;
+}
+
+template <class T>
+void Mat2D<T>::transpose_into(Mat2D<T>& result) const {
+  result.resize(num_cols, num_rows);
   for (size_t i = 0; i < num_rows; ++i) {
     for (size_t k = 0; k < num_cols; ++k) {
       result(k, i) = this->operator()(i, k);
     }
   }
-  return result;
 }
 
 template <typename T>
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "expr.h"
+
+// Non-owning view of a strided matrix, element (row, col) is
+// data[row * row_stride + col * col_stride]. Views select a range of rows of
+// a Mat2D (e.g. one shard of a batch) or read it transposed without copying
+// anything. MatView<const T> is read-only.
+//
+// A view does not keep the memory alive, it must not outlive the matrix it
+// points into and resizing that matrix invalidates it. Views are operands of
+// the lazy expressions in expr.h, and a Mat2D can be constructed from one:
+//
+//   Mat2D<float> shard = batch.row_slice(0, 32);
+//   out = batch.row_slice(32, 64) * 2.0f;
+template <typename T>
+class MatView : public expr::Expression<MatView<T>> {
+ public:
+  using value_type = std::remove_const_t<T>;
+
+  MatView(T* data, size_t rows, size_t cols, size_t row_stride,
+          size_t col_stride = 1)
+      : data_ptr(data),
+        num_rows(rows),
+        num_cols(cols),
+        row_step(row_stride),
+        col_step(col_stride) {}
+  // read-only view of a mutable one
+  template <typename U, typename = std::enable_if_t<
+                            std::is_same_v<const U, T> && !std::is_const_v<U>>>
+  MatView(const MatView<U>& other)
+      : MatView(other.data(), other.rows(), other.cols(), other.row_stride(),
+                other.col_stride()) {}
+
+  size_t rows() const { return num_rows; }
+  size_t cols() const { return num_cols; }
+  size_t get_num_rows() const { return num_rows; }
+  size_t get_num_cols() const { return num_cols; }
+  T* data() const { return data_ptr; }
+  size_t row_stride() const { return row_step; }
+  size_t col_stride() const { return col_step; }
+  // The elements form a dense row-major array of rows() * cols() values.
+  bool is_contiguous() const {
+    return col_step == 1 && (row_step == num_cols || num_rows <= 1);
+  }
+
+  T& operator()(size_t row, size_t col) const {
+    return data_ptr[row * row_step + col * col_step];
+  }
+
+  // Rows [begin, end).
+  MatView row_slice(size_t begin, size_t end) const {
+    if (begin > end || end > num_rows) {
+      throw std::runtime_error("MatView: Rows [" + std::to_string(begin) +
+                               ", " + std::to_string(end) +
+                               ") out of range for " +
+                               std::to_string(num_rows) + " rows.");
+    }
+    return MatView(data_ptr + begin * row_step, end - begin, num_cols,
+                   row_step, col_step);
+  }
+  MatView transpose() const {
+    return MatView(data_ptr, num_cols, num_rows, col_step, row_step);
+  }
+
+  // Writes a Mat2D, view or expression of the same shape into the viewed
+  // elements. The source must not read elements of this view other than
+  // the one being written.
+  template <typename X, typename U = T,
+            typename = std::enable_if_t<!std::is_const_v<U> &&
+                                        expr::is_operand_v<X>>>
+  void copy_from(X&& source) const {
+    const auto node = expr::as_node(std::forward<X>(source));
+    if (node.rows() != num_rows || node.cols() != num_cols) {
+      throw std::runtime_error("MatView: Source dim incompatible.");
+    }
+    if (this->is_contiguous() && node.is_flat(num_rows, num_cols)) {
+      expr::evaluate(node, data_ptr);
+      return;
+    }
+    for (size_t row = 0; row < num_rows; ++row) {
+      for (size_t col = 0; col < num_cols; ++col) {
+        (*this)(row, col) = node.at(row, col);
+      }
+    }
+  }
+
+  // expression interface, see expr.h
+  value_type at(size_t row, size_t col) const { return (*this)(row, col); }
+  value_type at_flat(size_t idx) const { return data_ptr[idx]; }
+  bool is_flat(size_t rows, size_t cols) const {
+    return rows == num_rows && cols == num_cols && this->is_contiguous();
+  }
+
+ private:
+  T* data_ptr;
+  size_t num_rows;
+  size_t num_cols;
+  size_t row_step;
+  size_t col_step;
+};
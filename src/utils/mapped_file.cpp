@@ -0,0 +1,83 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+MappedFile::MappedFile(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open " + filename + ".");
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat " + filename + ".");
+  }
+  num_bytes = static_cast<size_t>(info.st_size);
+  if (num_bytes > 0) {
+    void* mapping = mmap(nullptr, num_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Could not mmap " + filename + ".");
+    }
+    bytes = static_cast<const uint8_t*>(mapping);
+  }
+  close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : bytes(other.bytes), num_bytes(other.num_bytes) {
+  other.bytes = nullptr;
+  other.num_bytes = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    this->~MappedFile();
+    bytes = other.bytes;
+    num_bytes = other.num_bytes;
+    other.bytes = nullptr;
+    other.num_bytes = 0;
+  }
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  if (bytes != nullptr) {
+    munmap(const_cast<uint8_t*>(bytes), num_bytes);
+  }
+}
+
+void write_file_atomically(const std::string& filename,
+                           const std::function<void(std::ostream&)>& write) {
+  // the pid tells processes apart, the counter threads and calls
+  static std::atomic<uint64_t> counter{0};
+  const std::string temp_filename = filename + ".tmp." +
+                                    std::to_string(getpid()) + "." +
+                                    std::to_string(counter++);
+  std::ofstream out(temp_filename, std::ios::binary);
+  try {
+    write(out);
+  } catch (...) {
+    out.close();
+    std::remove(temp_filename.c_str());
+    throw;
+  }
+  out.close();
+  if (!out) {
+    std::remove(temp_filename.c_str());
+    throw std::runtime_error("Could not write " + filename + ".");
+  }
+  if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    std::remove(temp_filename.c_str());
+    throw std::runtime_error("Could not rename " + temp_filename + " to " +
+                             filename + ".");
+  }
+}
@@ -0,0 +1,183 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+namespace parallel {
+
+namespace {
+
+// Set on pool threads and on a caller while it runs a job, nested
+// parallel_for calls then run serially.
+thread_local bool inside_job = false;
+
+// Chunks per thread, more chunks balance better but cost more overhead.
+constexpr size_t CHUNKS_PER_THREAD = 4;
+
+size_t default_num_threads() {
+  const char* env = std::getenv("MLP_NUM_THREADS");
+  if (env != nullptr && *env != '\0') {
+    const long requested = std::strtol(env, nullptr, 10);
+    if (requested <= 0) {
+      throw std::runtime_error(
+          "MLP_NUM_THREADS must be a positive number, got '" +
+          std::string(env) + "'.");
+    }
+    return static_cast<size_t>(requested);
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool default_deterministic() {
+  const char* env = std::getenv("MLP_DETERMINISTIC");
+  return env != nullptr && std::string(env) == "1";
+}
+
+std::unique_ptr<ThreadPool>& pool_instance() {
+  static std::unique_ptr<ThreadPool> pool =
+      std::make_unique<ThreadPool>(default_num_threads());
+  return pool;
+}
+
+std::atomic<bool>& deterministic_flag() {
+  static std::atomic<bool> flag{default_deterministic()};
+  return flag;
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : queues(std::make_unique<Queue[]>(std::max<size_t>(num_threads, 1))) {
+  for (size_t i = 0; i < std::max<size_t>(num_threads, 1); ++i) {
+    queues[i].chunks.reserve(CHUNKS_PER_THREAD);
+  }
+  for (size_t i = 1; i < num_threads; ++i) {
+    workers.emplace_back([this, i]() { this->worker_loop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(job_mutex);
+    stopping = true;
+  }
+  job_started.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(size_t n, size_t grain, RangeFunction func) {
+  if (n == 0) {
+    return;
+  }
+  const size_t max_chunks = num_threads() * CHUNKS_PER_THREAD;
+  const size_t num_chunks =
+      std::min(max_chunks, (n + std::max<size_t>(grain, 1) - 1) /
+                               std::max<size_t>(grain, 1));
+  std::unique_lock<std::mutex> submit_lock(submit_mutex, std::defer_lock);
+  if (num_chunks <= 1 || inside_job || !submit_lock.try_lock()) {
+    func(0, n);
+    return;
+  }
+
+  // The job must be set up before the chunks are queued, workers see it
+  // through the queue mutex.
+  job_func = func;
+  job_size = n;
+  const size_t chunk_grain = std::max<size_t>(grain, 1);
+  job_chunk_size = ((n + num_chunks - 1) / num_chunks + chunk_grain - 1) /
+                   chunk_grain * chunk_grain;
+  const size_t chunks_used = (n + job_chunk_size - 1) / job_chunk_size;
+  job_remaining.store(chunks_used);
+  for (size_t t = 0; t < num_threads(); ++t) {
+    std::lock_guard<std::mutex> lock(queues[t].mutex);
+    queues[t].chunks.clear();
+    queues[t].head = 0;
+    for (size_t chunk = t; chunk < chunks_used; chunk += num_threads()) {
+      queues[t].chunks.push_back(chunk);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(job_mutex);
+    ++job_generation;
+  }
+  job_started.notify_all();
+
+  inside_job = true;
+  work_off_chunks(0);
+  inside_job = false;
+
+  std::unique_lock<std::mutex> lock(job_mutex);
+  job_finished.wait(lock, [this]() { return job_remaining.load() == 0; });
+}
+
+void ThreadPool::worker_loop(size_t thread_idx) {
+  inside_job = true;
+  uint64_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(job_mutex);
+      job_started.wait(lock, [&]() {
+        return stopping || job_generation != seen_generation;
+      });
+      if (stopping) {
+        return;
+      }
+      seen_generation = job_generation;
+    }
+    work_off_chunks(thread_idx);
+  }
+}
+
+void ThreadPool::work_off_chunks(size_t thread_idx) {
+  size_t chunk = 0;
+  while (next_chunk(thread_idx, &chunk)) {
+    const size_t begin = chunk * job_chunk_size;
+    const size_t end = std::min(job_size, begin + job_chunk_size);
+    job_func(begin, end);
+    if (job_remaining.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> lock(job_mutex);
+      job_finished.notify_all();
+    }
+  }
+}
+
+bool ThreadPool::next_chunk(size_t thread_idx, size_t* chunk) {
+  // own queue first, then steal from the others
+  for (size_t offset = 0; offset < num_threads(); ++offset) {
+    Queue& queue = queues[(thread_idx + offset) % num_threads()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.head < queue.chunks.size()) {
+      if (offset == 0) {
+        *chunk = queue.chunks.back();
+        queue.chunks.pop_back();
+      } else {
+        *chunk = queue.chunks[queue.head++];
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+ThreadPool& global_pool() { return *pool_instance(); }
+
+size_t num_threads() { return global_pool().num_threads(); }
+
+void set_num_threads(size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = default_num_threads();
+  }
+  if (num_threads != global_pool().num_threads()) {
+    pool_instance() = std::make_unique<ThreadPool>(num_threads);
+  }
+}
+
+bool deterministic() { return deterministic_flag().load(); }
+
+void set_deterministic(bool enabled) { deterministic_flag().store(enabled); }
+
+}  // namespace parallel
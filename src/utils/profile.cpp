@@ -0,0 +1,285 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+struct Event {
+  const char* name;
+  int32_t index;
+  double flops;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::duration duration;
+  uint64_t bytes_allocated;
+};
+
+// Events in blocks straight from malloc: recording neither copies the
+// earlier events nor goes through operator new, which profiling builds count
+// (and tests may as well).
+struct EventBlock {
+  static constexpr size_t CAPACITY = 4096;
+  EventBlock* next = nullptr;
+  size_t size = 0;
+  Event events[CAPACITY];
+};
+
+struct ThreadEvents {
+  size_t thread;
+  EventBlock* first = nullptr;
+  EventBlock* last = nullptr;
+
+  void push(const Event& event) {
+    if (this->last == nullptr || this->last->size == EventBlock::CAPACITY) {
+      void* memory = std::malloc(sizeof(EventBlock));
+      if (memory == nullptr) {
+        throw std::bad_alloc();
+      }
+      auto* block = new (memory) EventBlock();
+      (this->last == nullptr ? this->first : this->last->next) = block;
+      this->last = block;
+    }
+    this->last->events[this->last->size++] = event;
+  }
+  template <typename F>
+  void for_each(F&& func) const {
+    for (const auto* block = this->first; block != nullptr;
+         block = block->next) {
+      for (size_t idx = 0; idx < block->size; ++idx) {
+        func(block->events[idx]);
+      }
+    }
+  }
+  void clear() {
+    while (this->first != nullptr) {
+      auto* next = this->first->next;
+      std::free(this->first);
+      this->first = next;
+    }
+    this->last = nullptr;
+  }
+};
+
+// The heap bytes this thread allocated so far, except for registering it,
+// and its events, in one thread_local so a scope looks it up once.
+struct ThreadState {
+  uint64_t allocated_bytes = 0;
+  bool in_profiler = false;
+  ThreadEvents* events = nullptr;
+};
+thread_local ThreadState thread_state;
+
+std::mutex threads_mutex;
+// never destroyed, so threads still running at exit can record
+std::vector<std::unique_ptr<ThreadEvents>>& threads() {
+  static auto* threads = new std::vector<std::unique_ptr<ThreadEvents>>();
+  return *threads;
+}
+
+ThreadEvents& register_thread(ThreadState& state) {
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  state.in_profiler = true;
+  threads().push_back(std::make_unique<ThreadEvents>());
+  state.events = threads().back().get();
+  state.events->thread = threads().size() - 1;
+  state.in_profiler = false;
+  return *state.events;
+}
+
+std::string region_name(const char* name, const int32_t index) {
+  return index < 0 ? std::string(name)
+                   : "layer " + std::to_string(index) + " " + name;
+}
+
+}  // namespace
+
+#if defined(MLP_PROFILE)
+// Counts the bytes of every allocation for the scopes. Replacing the plain
+// and aligned forms is enough, the others (nothrow, sized delete) call them.
+void* operator new(std::size_t size) {
+  profile::record_allocation(size);
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  profile::record_allocation(size);
+  const auto align = static_cast<std::size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  void* ptr = std::aligned_alloc(
+      align, (std::max<std::size_t>(size, 1) + align - 1) / align * align);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+void* operator new[](std::size_t size) { return ::operator new(size); }
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return ::operator new(size, alignment);
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+#endif
+
+namespace profile {
+
+void Scope::begin(const char* name, const int32_t index, const double flops) {
+  this->name = name;
+  this->index = index;
+  this->flops = flops;
+  this->allocated_at_start = thread_state.allocated_bytes;
+  this->start = std::chrono::steady_clock::now();
+}
+
+void Scope::end() {
+  const auto end = std::chrono::steady_clock::now();
+  auto& state = thread_state;
+  const uint64_t bytes = state.allocated_bytes - this->allocated_at_start;
+  auto& events =
+      state.events != nullptr ? *state.events : register_thread(state);
+  events.push({this->name, this->index, this->flops, this->start,
+               end - this->start, bytes});
+}
+
+std::vector<Region> summary() {
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  std::vector<Region> regions;
+  // events are recorded when they end, the regions are sorted by the start
+  // of their first event, so enclosing regions come first
+  std::vector<std::chrono::steady_clock::time_point> first_start;
+  std::map<std::pair<std::string, int32_t>, size_t> region_idx;
+  for (const auto& thread : threads()) {
+    thread->for_each([&](const Event& event) {
+      const auto key = std::make_pair(std::string(event.name), event.index);
+      auto it = region_idx.find(key);
+      if (it == region_idx.end()) {
+        it = region_idx.emplace(key, regions.size()).first;
+        regions.push_back({key.first, key.second, 0, 0.0, 0.0, 0});
+        first_start.push_back(event.start);
+      }
+      first_start[it->second] = std::min(first_start[it->second], event.start);
+      auto& region = regions[it->second];
+      region.calls++;
+      region.seconds +=
+          std::chrono::duration<double>(event.duration).count();
+      region.flops += event.flops;
+      region.bytes_allocated += event.bytes_allocated;
+    });
+  }
+  std::vector<size_t> order(regions.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return first_start[lhs] < first_start[rhs];
+  });
+  std::vector<Region> sorted;
+  for (const size_t idx : order) {
+    sorted.push_back(regions[idx]);
+  }
+  return sorted;
+}
+
+void print_summary(std::ostream& stream) {
+  const auto regions = summary();
+  if (regions.empty()) {
+    stream << "No profiling events, configure with -DMLP_PROFILE=ON."
+           << std::endl;
+    return;
+  }
+  stream << std::left << std::setw(24) << "region" << std::right
+         << std::setw(10) << "calls" << std::setw(12) << "total ms"
+         << std::setw(12) << "mean us" << std::setw(10) << "GFLOP/s"
+         << std::setw(14) << "KB allocated" << std::endl;
+  for (const auto& region : regions) {
+    stream << std::left << std::setw(24)
+           << region_name(region.name.c_str(), region.index) << std::right
+           << std::setw(10) << region.calls << std::fixed
+           << std::setprecision(2) << std::setw(12) << 1.e3 * region.seconds
+           << std::setw(12)
+           << 1.e6 * region.seconds / static_cast<double>(region.calls)
+           << std::setw(10);
+    if (region.flops > 0.0) {
+      stream << 1.e-9 * region.flops / region.seconds;
+    } else {
+      stream << "-";
+    }
+    stream << std::setw(14) << std::setprecision(1)
+           << static_cast<double>(region.bytes_allocated) / 1024.0
+           << std::endl;
+  }
+}
+
+void write_chrome_trace(const std::string& filename) {
+  std::ofstream file(filename);
+  if (!file) {
+    throw std::runtime_error("Could not write " + filename + ".");
+  }
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  // timestamps start at the first event
+  auto origin = std::chrono::steady_clock::time_point::max();
+  for (const auto& thread : threads()) {
+    thread->for_each([&](const Event& event) {
+      origin = std::min(origin, event.start);
+    });
+  }
+  const auto microseconds = [](std::chrono::steady_clock::duration time) {
+    return std::chrono::duration<double, std::micro>(time).count();
+  };
+  file << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+  bool first = true;
+  for (const auto& thread : threads()) {
+    thread->for_each([&](const Event& event) {
+      file << (first ? "\n" : ",\n") << "{\"name\": \""
+           << region_name(event.name, event.index)
+           << "\", \"cat\": \"mlp\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+           << thread->thread << ", \"ts\": "
+           << microseconds(event.start - origin)
+           << ", \"dur\": " << microseconds(event.duration)
+           << ", \"args\": {\"flops\": " << std::setprecision(0)
+           << event.flops << ", \"bytes_allocated\": "
+           << event.bytes_allocated << "}}" << std::setprecision(3);
+      first = false;
+    });
+  }
+  file << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+void reset() {
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  for (auto& thread : threads()) {
+    thread->clear();
+  }
+}
+
+void record_allocation(const size_t bytes) {
+  if constexpr (enabled) {
+    auto& state = thread_state;
+    if (!state.in_profiler) {
+      state.allocated_bytes += bytes;
+    }
+  }
+}
+
+}  // namespace profile
@@ -0,0 +1,154 @@
+#pragma once
+// int8 GEMM kernel templates for quantized inference, see
+// gemm::matmul_u8s8. Like gemm_kernel.h this header is included by one
+// translation unit per instruction set (gemm.cpp, gemm_avx2.cpp,
+// gemm_avx512.cpp, gemm_vnni.cpp) and must not call out-of-line inline
+// functions of the standard library.
+//
+// The kernels are templates over the vector width in bytes, holding int32
+// lanes, a width of 4 gives the scalar fallback. Built with AVX-512 VNNI the
+// 64 byte kernel multiplies four byte pairs per lane with one vpdpbusd, the
+// others widen the bytes to int32. vpmaddubsw is not used: its int16 pair
+// sums saturate for full range uint8 activations and int8 weights, so the
+// results would differ between instruction sets.
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__AVX512VNNI__)
+#include <immintrin.h>
+#endif
+
+#include "simd_kernel.h"
+
+namespace gemm {
+namespace {
+
+// Register tile of the int8 kernel, rows x vectors of int32 accumulators.
+template <size_t Bytes>
+struct Int8Blocking {
+#if defined(__AVX512VNNI__)
+  static constexpr size_t MR = 4;
+  static constexpr size_t NV = 4;
+#else
+  static constexpr size_t MR = Bytes == 64 ? 4 : 2;
+  static constexpr size_t NV = Bytes == 4 ? 4 : 2;
+#endif
+};
+
+// Calls f(std::integral_constant<size_t, n>) for a runtime 1 <= n <= Max.
+template <size_t Max, typename F>
+void with_constant(size_t n, const F& f) {
+  if constexpr (Max > 1) {
+    if (n < Max) {
+      with_constant<Max - 1>(n, f);
+      return;
+    }
+  }
+  f(std::integral_constant<size_t, Max>{});
+}
+
+// acc plus, per lane, the dot product of the four unsigned bytes of a with
+// the four signed bytes of that lane of b.
+template <size_t Bytes>
+typename simd::VecTraits<float, Bytes>::ivec dot4(
+    const typename simd::VecTraits<float, Bytes>::ivec& acc, int32_t a,
+    const typename simd::VecTraits<float, Bytes>::ivec& b) {
+  using IVec = typename simd::VecTraits<float, Bytes>::ivec;
+#if defined(__AVX512VNNI__)
+  if constexpr (Bytes == 64) {
+    return (IVec)_mm512_dpbusd_epi32((__m512i)acc, _mm512_set1_epi32(a),
+                                     (__m512i)b);
+  }
+#endif
+  const uint32_t bytes = static_cast<uint32_t>(a);
+  const IVec b_0 = (b << 24) >> 24;
+  const IVec b_1 = (b << 16) >> 24;
+  const IVec b_2 = (b << 8) >> 24;
+  const IVec b_3 = b >> 24;
+  return acc + static_cast<int32_t>(bytes & 0xFF) * b_0 +
+         static_cast<int32_t>((bytes >> 8) & 0xFF) * b_1 +
+         static_cast<int32_t>((bytes >> 16) & 0xFF) * b_2 +
+         static_cast<int32_t>(bytes >> 24) * b_3;
+}
+
+// R rows x NV vectors of C, of which the first cols columns are stored. The
+// int32 sums are converted and dequantized (scale, offset) and activated in
+// registers.
+template <size_t Bytes, size_t R, size_t NV>
+void int8_tile(size_t groups, const uint8_t* a, size_t lda, const int8_t* b,
+               size_t ldb, const float* scale, const float* offset,
+               simd::Activation activation, float param, size_t cols,
+               float* c, size_t ldc) {
+  using IVec = typename simd::VecTraits<float, Bytes>::ivec;
+  using FVec = typename simd::VecTraits<float, Bytes>::vec;
+  constexpr size_t L = simd::VecTraits<float, Bytes>::lanes;
+
+  IVec acc[R][NV] = {};
+  for (size_t g = 0; g < groups; ++g) {
+    int32_t a_g[R];
+    for (size_t r = 0; r < R; ++r) {
+      std::memcpy(&a_g[r], a + r * lda + 4 * g, sizeof(int32_t));
+    }
+    const int8_t* b_g = b + g * ldb;
+    for (size_t v = 0; v < NV; ++v) {
+      const IVec b_v = simd::load<IVec>(b_g + v * 4 * L);
+      for (size_t r = 0; r < R; ++r) {
+        acc[r][v] = dot4<Bytes>(acc[r][v], a_g[r], b_v);
+      }
+    }
+  }
+
+  for (size_t v = 0; v < NV; ++v) {
+    const size_t col = v * L;
+    const FVec scale_v = simd::load<FVec>(scale + col);
+    const FVec offset_v = simd::load<FVec>(offset + col);
+    for (size_t r = 0; r < R; ++r) {
+      const FVec y = simd::activate<float, Bytes>(
+          activation,
+          __builtin_convertvector(acc[r][v], FVec) * scale_v + offset_v,
+          param);
+      float* out = c + r * ldc + col;
+      const size_t count = cols - col < L ? cols - col : L;
+      if (count == L) {
+        simd::store(out, y);
+      } else {
+        std::memcpy(out, &y, count * sizeof(float));
+      }
+    }
+  }
+}
+
+// C (m x n, row stride ldc) = act(scale * (A * B) + offset) for uint8 A
+// (m x k, row stride lda) and B packed by gemm::pack_int8 (groups of four
+// rows, row stride ldb bytes), see gemm::matmul_u8s8.
+template <size_t Bytes>
+void int8_matmul(size_t m, size_t n, size_t k, const uint8_t* a, size_t lda,
+                 const int8_t* b, size_t ldb, const float* scale,
+                 const float* offset, simd::Activation activation,
+                 float param, float* c, size_t ldc) {
+  constexpr size_t MR = Int8Blocking<Bytes>::MR;
+  constexpr size_t NV = Int8Blocking<Bytes>::NV;
+  constexpr size_t L = simd::VecTraits<float, Bytes>::lanes;
+  const size_t groups = (k + 3) / 4;
+
+  for (size_t row = 0; row < m; row += MR) {
+    const size_t rows = m - row < MR ? m - row : MR;
+    for (size_t col = 0; col < n; col += NV * L) {
+      const size_t cols = n - col < NV * L ? n - col : NV * L;
+      with_constant<MR>(rows, [&](auto tile_rows) {
+        with_constant<NV>((cols + L - 1) / L, [&](auto tile_vectors) {
+          int8_tile<Bytes, decltype(tile_rows)::value,
+                    decltype(tile_vectors)::value>(
+              groups, a + row * lda, lda, b + 4 * col, ldb, scale + col,
+              offset + col, activation, param, cols, c + row * ldc + col,
+              ldc);
+        });
+      });
+    }
+  }
+}
+
+}  // namespace
+}  // namespace gemm
@@ -0,0 +1,374 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "cpu.h"
+#include "parallel.h"
+#include "simd_kernel.h"
+
+namespace simd {
+
+namespace {
+
+const KernelTable<float> scalar_float_kernels =
+    make_kernel_table<float, sizeof(float)>();
+const KernelTable<double> scalar_double_kernels =
+    make_kernel_table<double, sizeof(double)>();
+const KernelTable<float> baseline_float_kernels =
+    make_kernel_table<float, 16>();
+const KernelTable<double> baseline_double_kernels =
+    make_kernel_table<double, 16>();
+const HalfKernelTable scalar_half_kernels =
+    make_half_kernel_table<sizeof(float)>();
+const HalfKernelTable baseline_half_kernels = make_half_kernel_table<16>();
+const TextKernelTable scalar_text_kernels = make_text_kernel_table<1>();
+const TextKernelTable baseline_text_kernels = make_text_kernel_table<16>();
+
+template <typename T>
+const KernelTable<T>& kernels();
+
+template <>
+const KernelTable<float>& kernels<float>() {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      return avx512::float_kernels;
+    case cpu::Isa::AVX2:
+      return avx2::float_kernels;
+#endif
+    case cpu::Isa::SCALAR:
+      return scalar_float_kernels;
+    default:
+      return baseline_float_kernels;
+  }
+}
+
+template <>
+const KernelTable<double>& kernels<double>() {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      return avx512::double_kernels;
+    case cpu::Isa::AVX2:
+      return avx2::double_kernels;
+#endif
+    case cpu::Isa::SCALAR:
+      return scalar_double_kernels;
+    default:
+      return baseline_double_kernels;
+  }
+}
+
+const HalfKernelTable& half_kernels() {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      return avx512::half_kernels;
+    case cpu::Isa::AVX2:
+      return avx2::half_kernels;
+#endif
+    case cpu::Isa::SCALAR:
+      return scalar_half_kernels;
+    default:
+      return baseline_half_kernels;
+  }
+}
+
+const TextKernelTable& text_kernels() {
+  switch (cpu::active_isa()) {
+#if defined(MLP_X86_KERNELS)
+    case cpu::Isa::AVX512:
+      return avx512::text_kernels;
+    case cpu::Isa::AVX2:
+      return avx2::text_kernels;
+#endif
+    case cpu::Isa::SCALAR:
+      return scalar_text_kernels;
+    default:
+      return baseline_text_kernels;
+  }
+}
+
+// Element counts below which a kernel call is not worth splitting up.
+constexpr size_t ELEMENTWISE_GRAIN = 16384;
+constexpr size_t REDUCTION_GRAIN = 16384;
+// Chunk size of full reductions in deterministic mode, fixed so the result
+// does not depend on the number of threads.
+constexpr size_t DETERMINISTIC_SUM_CHUNK = 4096;
+
+size_t rows_per_chunk(size_t cols, size_t grain) {
+  return std::max<size_t>(1, grain / std::max<size_t>(cols, 1));
+}
+
+template <typename T>
+void parallel_binary(BinaryOp op, size_t rows, size_t cols, Strided<T> a,
+                     Strided<T> b, T* out) {
+  const auto& k = kernels<T>();
+  parallel::parallel_for(
+      rows, rows_per_chunk(cols, ELEMENTWISE_GRAIN),
+      [&](size_t begin, size_t end) {
+        const Strided<T> a_part{a.data + begin * a.row_stride, a.row_stride,
+                                a.col_stride};
+        const Strided<T> b_part{b.data + begin * b.row_stride, b.row_stride,
+                                b.col_stride};
+        k.binary(op, end - begin, cols, a_part, b_part, out + begin * cols);
+      });
+}
+
+template <typename T>
+void parallel_unary(UnaryOp op, size_t n, const T* in, T* out, T param) {
+  const auto& k = kernels<T>();
+  parallel::parallel_for(n, ELEMENTWISE_GRAIN, [&](size_t begin, size_t end) {
+    k.unary(op, end - begin, in + begin, out + begin, param);
+  });
+}
+
+template <typename T>
+void parallel_update(const UpdateParams<T>& params, size_t n, T* variable,
+                     const T* gradient, T* state_0, T* state_1) {
+  const auto& k = kernels<T>();
+  parallel::parallel_for(n, ELEMENTWISE_GRAIN, [&](size_t begin, size_t end) {
+    k.update(params, end - begin, variable + begin, gradient + begin,
+             state_0 != nullptr ? state_0 + begin : nullptr,
+             state_1 != nullptr ? state_1 + begin : nullptr);
+  });
+}
+
+template <typename T>
+T parallel_sum(size_t n, const T* in) {
+  const auto& k = kernels<T>();
+  size_t chunk_size = DETERMINISTIC_SUM_CHUNK;
+  if (!parallel::deterministic()) {
+    if (n < REDUCTION_GRAIN || parallel::num_threads() == 1) {
+      return k.sum(n, in);
+    }
+    chunk_size = (n + parallel::num_threads() - 1) / parallel::num_threads();
+  }
+  const size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+  if (num_chunks <= 1) {
+    return k.sum(n, in);
+  }
+  thread_local std::vector<T> partial_sums;
+  partial_sums.resize(num_chunks);
+  T* partial = partial_sums.data();
+  parallel::parallel_for(num_chunks, 1, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      const size_t offset = chunk * chunk_size;
+      partial[chunk] = k.sum(std::min(chunk_size, n - offset), in + offset);
+    }
+  });
+  T result = T(0);
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+    result += partial[chunk];
+  }
+  return result;
+}
+
+// Axis reductions are split along the axis which is kept, so every output is
+// computed exactly like in the serial kernel.
+// args are passed on to the kernel after out.
+template <typename T, typename Kernel, typename Out, typename... Args>
+void parallel_axis_reduction(Kernel kernel, size_t axis, size_t rows,
+                             size_t cols, const T* in, Out* out,
+                             Args... args) {
+  if (axis == 0) {
+    parallel::parallel_for(cols, rows_per_chunk(rows, REDUCTION_GRAIN),
+                           [&](size_t begin, size_t end) {
+                             kernel(0, rows, end - begin, cols, in + begin,
+                                    out + begin, args...);
+                           });
+  } else {
+    parallel::parallel_for(rows, rows_per_chunk(cols, REDUCTION_GRAIN),
+                           [&](size_t begin, size_t end) {
+                             kernel(1, end - begin, cols, cols,
+                                    in + begin * cols, out + begin, args...);
+                           });
+  }
+}
+
+// Split along the columns, so every bias gradient is summed over the rows in
+// the same order as in the serial kernel.
+template <typename T, typename Out, typename Kernel>
+void parallel_activation_backward(Kernel kernel, Activation activation,
+                                  size_t rows, size_t cols, const Out* out,
+                                  const T* grad_out, T param, T* grad_z,
+                                  T* bias_grad, bool accumulate_bias) {
+  parallel::parallel_for(
+      cols, rows_per_chunk(rows, ELEMENTWISE_GRAIN),
+      [&](size_t begin, size_t end) {
+        kernel(activation, rows, end - begin, cols, out + begin,
+               grad_out + begin, param, grad_z + begin, bias_grad + begin,
+               accumulate_bias);
+      });
+}
+
+template <typename In, typename Out, typename Kernel>
+void parallel_convert(Kernel kernel, size_t n, const In* in, Out* out) {
+  parallel::parallel_for(n, ELEMENTWISE_GRAIN, [&](size_t begin, size_t end) {
+    kernel(end - begin, in + begin, out + begin);
+  });
+}
+
+// Rows are independent, so the split does not change any result.
+template <typename T>
+void parallel_softmax_cross_entropy(size_t rows, size_t cols, const T* logits,
+                                    const T* one_hot, const int32_t* classes,
+                                    T grad_scale, T* loss, T* grad) {
+  const auto& k = kernels<T>();
+  parallel::parallel_for(
+      rows, rows_per_chunk(cols, ELEMENTWISE_GRAIN),
+      [&](size_t begin, size_t end) {
+        k.softmax_cross_entropy(
+            end - begin, cols, cols, logits + begin * cols,
+            one_hot != nullptr ? one_hot + begin * cols : nullptr,
+            classes != nullptr ? classes + begin : nullptr, grad_scale,
+            loss != nullptr ? loss + begin : nullptr,
+            grad != nullptr ? grad + begin * cols : nullptr);
+      });
+}
+
+}  // namespace
+
+void binary(BinaryOp op, size_t rows, size_t cols, Strided<float> a,
+            Strided<float> b, float* out) {
+  parallel_binary(op, rows, cols, a, b, out);
+}
+
+void binary(BinaryOp op, size_t rows, size_t cols, Strided<double> a,
+            Strided<double> b, double* out) {
+  parallel_binary(op, rows, cols, a, b, out);
+}
+
+void unary(UnaryOp op, size_t n, const float* in, float* out, float param) {
+  parallel_unary(op, n, in, out, param);
+}
+
+void unary(UnaryOp op, size_t n, const double* in, double* out,
+           double param) {
+  parallel_unary(op, n, in, out, param);
+}
+
+void update(const UpdateParams<float>& params, size_t n, float* variable,
+            const float* gradient, float* state_0, float* state_1) {
+  parallel_update(params, n, variable, gradient, state_0, state_1);
+}
+
+void update(const UpdateParams<double>& params, size_t n, double* variable,
+            const double* gradient, double* state_0, double* state_1) {
+  parallel_update(params, n, variable, gradient, state_0, state_1);
+}
+
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const float* out, const float* grad_out, float param,
+                         float* grad_z, float* bias_grad,
+                         bool accumulate_bias) {
+  parallel_activation_backward(kernels<float>().activation_backward,
+                               activation, rows, cols, out, grad_out, param,
+                               grad_z, bias_grad, accumulate_bias);
+}
+
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const double* out, const double* grad_out,
+                         double param, double* grad_z, double* bias_grad,
+                         bool accumulate_bias) {
+  parallel_activation_backward(kernels<double>().activation_backward,
+                               activation, rows, cols, out, grad_out, param,
+                               grad_z, bias_grad, accumulate_bias);
+}
+
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const bfloat16* out, const float* grad_out,
+                         float param, float* grad_z, float* bias_grad,
+                         bool accumulate_bias) {
+  parallel_activation_backward(half_kernels().activation_backward_bfloat16,
+                               activation, rows, cols, out, grad_out, param,
+                               grad_z, bias_grad, accumulate_bias);
+}
+
+void activation_backward(Activation activation, size_t rows, size_t cols,
+                         const float16* out, const float* grad_out,
+                         float param, float* grad_z, float* bias_grad,
+                         bool accumulate_bias) {
+  parallel_activation_backward(half_kernels().activation_backward_float16,
+                               activation, rows, cols, out, grad_out, param,
+                               grad_z, bias_grad, accumulate_bias);
+}
+
+void convert(size_t n, const float* in, bfloat16* out) {
+  parallel_convert(half_kernels().to_bfloat16, n, in, out);
+}
+
+void convert(size_t n, const float* in, float16* out) {
+  parallel_convert(half_kernels().to_float16, n, in, out);
+}
+
+void convert(size_t n, const bfloat16* in, float* out) {
+  parallel_convert(half_kernels().from_bfloat16, n, in, out);
+}
+
+void convert(size_t n, const float16* in, float* out) {
+  parallel_convert(half_kernels().from_float16, n, in, out);
+}
+
+void softmax_cross_entropy(size_t rows, size_t cols, const float* logits,
+                           const float* one_hot, const int32_t* classes,
+                           float grad_scale, float* loss, float* grad) {
+  parallel_softmax_cross_entropy(rows, cols, logits, one_hot, classes,
+                                 grad_scale, loss, grad);
+}
+
+void softmax_cross_entropy(size_t rows, size_t cols, const double* logits,
+                           const double* one_hot, const int32_t* classes,
+                           double grad_scale, double* loss, double* grad) {
+  parallel_softmax_cross_entropy(rows, cols, logits, one_hot, classes,
+                                 grad_scale, loss, grad);
+}
+
+bool parse_csv_bytes(size_t size, const char* text, size_t num_columns,
+                     uint8_t* rows, size_t* num_rows) {
+  return text_kernels().parse_csv_bytes(size, text, num_columns, rows,
+                                        num_rows);
+}
+
+float sum(size_t n, const float* in) { return parallel_sum(n, in); }
+
+double sum(size_t n, const double* in) { return parallel_sum(n, in); }
+
+void sum_axis(size_t axis, size_t rows, size_t cols, const float* in,
+              float* out, bool accumulate) {
+  parallel_axis_reduction(kernels<float>().sum_axis, axis, rows, cols, in,
+                          out, accumulate);
+}
+
+void sum_axis(size_t axis, size_t rows, size_t cols, const double* in,
+              double* out, bool accumulate) {
+  parallel_axis_reduction(kernels<double>().sum_axis, axis, rows, cols, in,
+                          out, accumulate);
+}
+
+void max_axis(size_t axis, size_t rows, size_t cols, const float* in,
+              float* out) {
+  parallel_axis_reduction(kernels<float>().max_axis, axis, rows, cols, in,
+                          out);
+}
+
+void max_axis(size_t axis, size_t rows, size_t cols, const double* in,
+              double* out) {
+  parallel_axis_reduction(kernels<double>().max_axis, axis, rows, cols, in,
+                          out);
+}
+
+void argmax_axis(size_t axis, size_t rows, size_t cols, const float* in,
+                 size_t* out) {
+  parallel_axis_reduction(kernels<float>().argmax_axis, axis, rows, cols, in,
+                          out);
+}
+
+void argmax_axis(size_t axis, size_t rows, size_t cols, const double* in,
+                 size_t* out) {
+  parallel_axis_reduction(kernels<double>().argmax_axis, axis, rows, cols, in,
+                          out);
+}
+
+}  // namespace simd
@@ -0,0 +1,13 @@
+// Compiled with the avx2 flags, see CMakeLists.txt.
+#include "simd_kernel.h"
+
+namespace simd {
+namespace avx2 {
+
+const KernelTable<float> float_kernels = make_kernel_table<float, 32>();
+const KernelTable<double> double_kernels = make_kernel_table<double, 32>();
+const HalfKernelTable half_kernels = make_half_kernel_table<32>();
+const TextKernelTable text_kernels = make_text_kernel_table<32>();
+
+}  // namespace avx2
+}  // namespace simd
@@ -0,0 +1,13 @@
+// Compiled with the avx512 flags, see CMakeLists.txt.
+#include "simd_kernel.h"
+
+namespace simd {
+namespace avx512 {
+
+const KernelTable<float> float_kernels = make_kernel_table<float, 64>();
+const KernelTable<double> double_kernels = make_kernel_table<double, 64>();
+const HalfKernelTable half_kernels = make_half_kernel_table<64>();
+const TextKernelTable text_kernels = make_text_kernel_table<64>();
+
+}  // namespace avx512
+}  // namespace simd
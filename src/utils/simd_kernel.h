@@ -0,0 +1,1229 @@
+#pragma once
+// Elementwise and reduction kernel templates. Like gemm_kernel.h this header
+// is included by one translation unit per instruction set (simd.cpp,
+// simd_avx2.cpp, simd_avx512.cpp) and must not call out-of-line inline
+// functions of the standard library, see the note in gemm_kernel.h.
+//
+// Every kernel is a template over the vector width in bytes and written with
+// GCC vector extensions, so one source serves SSE, NEON, AVX2 and AVX-512. A
+// width of sizeof(T) gives one lane vectors, i.e. the scalar fallback.
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "half.h"
+#include "simd.h"
+
+namespace simd {
+
+// Kernels of one instruction set, see simd.h for the semantics.
+template <typename T>
+struct KernelTable {
+  void (*binary)(BinaryOp, size_t, size_t, Strided<T>, Strided<T>, T*);
+  void (*unary)(UnaryOp, size_t, const T*, T*, T);
+  T (*sum)(size_t, const T*);
+  // axis reductions take the row stride of the input as fourth argument
+  void (*sum_axis)(size_t, size_t, size_t, size_t, const T*, T*, bool);
+  void (*max_axis)(size_t, size_t, size_t, size_t, const T*, T*);
+  void (*argmax_axis)(size_t, size_t, size_t, size_t, const T*, size_t*);
+  void (*update)(const UpdateParams<T>&, size_t, T*, const T*, T*, T*);
+  // takes the row stride of the batch as fourth argument
+  void (*activation_backward)(Activation, size_t, size_t, size_t, const T*,
+                              const T*, T, T*, T*, bool);
+  // takes the row stride of the batch as third argument
+  void (*softmax_cross_entropy)(size_t, size_t, size_t, const T*, const T*,
+                                const int32_t*, T, T*, T*);
+};
+
+// Conversion kernels of one instruction set for the 16 bit formats of
+// half.h, see simd::convert.
+struct HalfKernelTable {
+  void (*to_bfloat16)(size_t, const float*, bfloat16*);
+  void (*to_float16)(size_t, const float*, float16*);
+  void (*from_bfloat16)(size_t, const bfloat16*, float*);
+  void (*from_float16)(size_t, const float16*, float*);
+  // activation_backward of KernelTable<float> with out in 16 bits
+  void (*activation_backward_bfloat16)(Activation, size_t, size_t, size_t,
+                                       const bfloat16*, const float*, float,
+                                       float*, float*, bool);
+  void (*activation_backward_float16)(Activation, size_t, size_t, size_t,
+                                      const float16*, const float*, float,
+                                      float*, float*, bool);
+};
+
+// Text kernels of one instruction set, see simd::parse_csv_bytes.
+struct TextKernelTable {
+  bool (*parse_csv_bytes)(size_t, const char*, size_t, uint8_t*, size_t*);
+};
+
+#if defined(MLP_X86_KERNELS)
+namespace avx2 {
+extern const KernelTable<float> float_kernels;
+extern const KernelTable<double> double_kernels;
+extern const HalfKernelTable half_kernels;
+extern const TextKernelTable text_kernels;
+}  // namespace avx2
+namespace avx512 {
+extern const KernelTable<float> float_kernels;
+extern const KernelTable<double> double_kernels;
+extern const HalfKernelTable half_kernels;
+extern const TextKernelTable text_kernels;
+}  // namespace avx512
+#endif
+
+namespace {
+
+template <typename T>
+struct IntOf;
+template <>
+struct IntOf<float> {
+  typedef int32_t type;
+};
+template <>
+struct IntOf<double> {
+  typedef int64_t type;
+};
+template <>
+struct IntOf<int8_t> {
+  typedef int8_t type;
+};
+template <>
+struct IntOf<uint8_t> {
+  typedef int8_t type;
+};
+
+// vec holds Bytes / sizeof(T) lanes, ivec is the matching integer vector,
+// which is also the type of comparison results.
+template <typename T, size_t Bytes>
+struct VecTraits {
+  typedef T vec __attribute__((vector_size(Bytes)));
+  typedef typename IntOf<T>::type ivec __attribute__((vector_size(Bytes)));
+  static constexpr size_t lanes = Bytes / sizeof(T);
+};
+
+template <typename V, typename T>
+V load(const T* src) {
+  V v;
+  std::memcpy(&v, src, sizeof(V));
+  return v;
+}
+
+template <typename V, typename T>
+void store(T* dst, const V& v) {
+  std::memcpy(dst, &v, sizeof(V));
+}
+
+template <typename T>
+constexpr T infinity() {
+  return static_cast<T>(__builtin_inf());
+}
+
+// The 16 bit formats of half.h in vectors: hvec holds as many lanes as a
+// float vector of Bytes, in half the bytes, uvec is the unsigned integer
+// vector of the float one. The conversions follow the scalar ones of half.h,
+// which kernels must not call (they are out-of-line inline functions, see
+// the note in gemm_kernel.h). F16C and AVX-512 have instructions for
+// float16, everything else runs on integer vector operations.
+template <size_t Bytes>
+struct HalfTraits {
+  typedef uint16_t hvec __attribute__((vector_size(Bytes / 2)));
+  typedef uint32_t uvec __attribute__((vector_size(Bytes)));
+};
+
+template <typename V, typename U>
+V bit_cast_vec(const U& u) {
+  static_assert(sizeof(V) == sizeof(U), "bit_cast_vec: Size mismatch.");
+  V v;
+  std::memcpy(&v, &u, sizeof(V));
+  return v;
+}
+
+// Bytes / sizeof(float) values from src as float.
+template <size_t Bytes>
+typename VecTraits<float, Bytes>::vec widen(const bfloat16* src) {
+  using H = HalfTraits<Bytes>;
+  const auto x =
+      __builtin_convertvector(load<typename H::hvec>(src), typename H::uvec);
+  return bit_cast_vec<typename VecTraits<float, Bytes>::vec>(x << 16);
+}
+
+template <size_t Bytes>
+typename VecTraits<float, Bytes>::vec widen(const float16* src) {
+  using Vec = typename VecTraits<float, Bytes>::vec;
+#if defined(__AVX512F__)
+  if constexpr (Bytes == 64) {
+    // the zero masked forms, the plain ones trip -Wmaybe-uninitialized
+    return bit_cast_vec<Vec>(
+        _mm512_maskz_cvtph_ps(0xffff, load<__m256i>(src)));
+  }
+#endif
+#if defined(__F16C__)
+  if constexpr (Bytes == 32) {
+    return bit_cast_vec<Vec>(_mm256_cvtph_ps(load<__m128i>(src)));
+  }
+#endif
+  using H = HalfTraits<Bytes>;
+  using UVec = typename H::uvec;
+  const UVec h =
+      __builtin_convertvector(load<typename H::hvec>(src), UVec);
+  const UVec exponent = h & 0x7c00u;
+  const UVec x = (h & 0x7fffu) << 13;
+  // zero or subnormal: m * 2^-24 as (2^-14 + m * 2^-24) - 2^-14
+  const UVec subnormal = bit_cast_vec<UVec>(
+      bit_cast_vec<Vec>(x + 0x38800000u) - 6.103515625e-05f);
+  const UVec result =
+      exponent == 0x7c00u ? x + 0x70000000u
+                          : (exponent == 0u ? subnormal : x + 0x38000000u);
+  return bit_cast_vec<Vec>(result | ((h & 0x8000u) << 16));
+}
+
+// A plain load, for kernels over several storage types.
+template <size_t Bytes>
+typename VecTraits<float, Bytes>::vec widen(const float* src) {
+  return load<typename VecTraits<float, Bytes>::vec>(src);
+}
+
+// Rounds the lanes of v to nearest even into dst.
+template <size_t Bytes>
+void narrow(const typename VecTraits<float, Bytes>::vec& v, bfloat16* dst) {
+  using H = HalfTraits<Bytes>;
+  using UVec = typename H::uvec;
+  const UVec x = bit_cast_vec<UVec>(v);
+  const UVec rounded = (x + 0x7fffu + ((x >> 16) & 1u)) >> 16;
+  // quiet NaN, the rounding could carry it into infinity
+  const UVec result =
+      (x & 0x7fffffffu) > 0x7f800000u ? (x >> 16) | 0x40u : rounded;
+  store(dst, __builtin_convertvector(result, typename H::hvec));
+}
+
+template <size_t Bytes>
+void narrow(const typename VecTraits<float, Bytes>::vec& v, float16* dst) {
+#if defined(__AVX512F__)
+  if constexpr (Bytes == 64) {
+    store(dst, _mm512_maskz_cvtps_ph(0xffff, bit_cast_vec<__m512>(v),
+                                     _MM_FROUND_TO_NEAREST_INT));
+    return;
+  }
+#endif
+#if defined(__F16C__)
+  if constexpr (Bytes == 32) {
+    store(dst, _mm256_cvtps_ph(bit_cast_vec<__m256>(v),
+                               _MM_FROUND_TO_NEAREST_INT));
+    return;
+  }
+#endif
+  using Vec = typename VecTraits<float, Bytes>::vec;
+  using H = HalfTraits<Bytes>;
+  using UVec = typename H::uvec;
+  const UVec bits = bit_cast_vec<UVec>(v);
+  const UVec x = bits & 0x7fffffffu;
+  // 2^16 and up: infinity, or NaN
+  const UVec too_large = x > 0x7f800000u ? UVec{} + 0x7e00u : UVec{} + 0x7c00u;
+  // below 2^-14: adding 0.5 rounds the mantissa to the subnormal spacing
+  const UVec subnormal =
+      bit_cast_vec<UVec>(bit_cast_vec<Vec>(x) + 0.5f) - 0x3f000000u;
+  // rebias the exponent and round the 13 dropped mantissa bits
+  const UVec normal = (x - 0x38000000u + 0xfffu + ((x >> 13) & 1u)) >> 13;
+  const UVec result =
+      x >= 0x47800000u ? too_large
+                       : (x < 0x38800000u ? subnormal : normal);
+  store(dst, __builtin_convertvector(result | ((bits >> 16) & 0x8000u),
+                                     typename H::hvec));
+}
+
+// exp(x) = 2^n * exp(r) with n = round(x / ln2), |r| <= ln2 / 2. exp(r) is
+// approximated by 1 + r + r^2 * p(r). The float polynomial is the one of
+// Cephes expf, the double one a plain Taylor series up to r^13.
+template <typename T>
+struct ExpConstants;
+
+template <>
+struct ExpConstants<float> {
+  static constexpr float max_x = 88.3762626647949f;
+  static constexpr float min_x = -87.3365447504019f;
+  static constexpr float ln2_hi = 0.693359375f;
+  static constexpr float ln2_lo = -2.12194440e-4f;
+  static constexpr int32_t exponent_bias = 127;
+  static constexpr int32_t mantissa_bits = 23;
+  static constexpr size_t degree = 6;
+  static constexpr float poly[degree] = {
+      1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+      4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+};
+
+template <>
+struct ExpConstants<double> {
+  static constexpr double max_x = 709.43;
+  static constexpr double min_x = -708.39641853226408;
+  static constexpr double ln2_hi = 6.93145751953125e-1;
+  static constexpr double ln2_lo = 1.42860682030941723212e-6;
+  static constexpr int64_t exponent_bias = 1023;
+  static constexpr int64_t mantissa_bits = 52;
+  static constexpr size_t degree = 12;
+  static constexpr double poly[degree] = {
+      1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0,
+      1.0 / 3628800.0,    1.0 / 362880.0,    1.0 / 40320.0,
+      1.0 / 5040.0,       1.0 / 720.0,       1.0 / 120.0,
+      1.0 / 24.0,         1.0 / 6.0,         1.0 / 2.0};
+};
+
+// Results outside [min_x, max_x] saturate to 0 and inf, NaN stays NaN.
+template <typename T, size_t Bytes>
+typename VecTraits<T, Bytes>::vec exp_vec(typename VecTraits<T, Bytes>::vec x) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  using IVec = typename VecTraits<T, Bytes>::ivec;
+  using C = ExpConstants<T>;
+  const Vec zero = Vec{};
+  const Vec one = zero + T(1);
+  const Vec max_x = zero + C::max_x;
+  const Vec min_x = zero + C::min_x;
+
+  Vec xc = x > max_x ? max_x : x;
+  xc = xc < min_x ? min_x : xc;
+
+  // n = floor(x * log2(e) + 0.5), conversion truncates towards zero
+  const Vec t = xc * T(1.44269504088896341) + T(0.5);
+  Vec n = __builtin_convertvector(__builtin_convertvector(t, IVec), Vec);
+  n = n > t ? n - one : n;
+  const Vec r = xc - n * C::ln2_hi - n * C::ln2_lo;
+
+  Vec p = zero + C::poly[0];
+  for (size_t i = 1; i < C::degree; ++i) {
+    p = p * r + C::poly[i];
+  }
+  Vec y = p * r * r + r + one;
+
+  const IVec bits = (__builtin_convertvector(n, IVec) + C::exponent_bias)
+                    << C::mantissa_bits;
+  Vec scale;
+  std::memcpy(&scale, &bits, sizeof(Vec));
+  y = y * scale;
+
+  y = x > max_x ? zero + infinity<T>() : y;
+  y = x < min_x ? zero : y;
+  return x != x ? x : y;
+}
+
+struct Add {
+  template <typename V>
+  V operator()(const V& a, const V& b) const {
+    return a + b;
+  }
+};
+struct Sub {
+  template <typename V>
+  V operator()(const V& a, const V& b) const {
+    return a - b;
+  }
+};
+struct Mul {
+  template <typename V>
+  V operator()(const V& a, const V& b) const {
+    return a * b;
+  }
+};
+struct Div {
+  template <typename V>
+  V operator()(const V& a, const V& b) const {
+    return a / b;
+  }
+};
+
+template <typename T, size_t Bytes, typename Op>
+void binary_rows(size_t rows, size_t cols, Strided<T> a, Strided<T> b, T* out,
+                 Op op) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  for (size_t r = 0; r < rows; ++r) {
+    const T* a_row = a.data + r * a.row_stride;
+    const T* b_row = b.data + r * b.row_stride;
+    T* out_row = out + r * cols;
+    size_t c = 0;
+    if (a.col_stride == 1 && b.col_stride == 1) {
+      for (; c + L <= cols; c += L) {
+        store(out_row + c, op(load<Vec>(a_row + c), load<Vec>(b_row + c)));
+      }
+    } else if (a.col_stride == 1 && b.col_stride == 0) {
+      const Vec b_val = Vec{} + *b_row;
+      for (; c + L <= cols; c += L) {
+        store(out_row + c, op(load<Vec>(a_row + c), b_val));
+      }
+    } else if (a.col_stride == 0 && b.col_stride == 1) {
+      const Vec a_val = Vec{} + *a_row;
+      for (; c + L <= cols; c += L) {
+        store(out_row + c, op(a_val, load<Vec>(b_row + c)));
+      }
+    } else if (a.col_stride == 0 && b.col_stride == 0) {
+      const Vec val = op(Vec{} + *a_row, Vec{} + *b_row);
+      for (; c + L <= cols; c += L) {
+        store(out_row + c, val);
+      }
+    }
+    for (; c < cols; ++c) {
+      out_row[c] = op(a_row[c * a.col_stride], b_row[c * b.col_stride]);
+    }
+  }
+}
+
+template <typename T, size_t Bytes>
+void binary_kernel(BinaryOp op, size_t rows, size_t cols, Strided<T> a,
+                   Strided<T> b, T* out) {
+  switch (op) {
+    case BinaryOp::ADD:
+      binary_rows<T, Bytes>(rows, cols, a, b, out, Add());
+      return;
+    case BinaryOp::SUB:
+      binary_rows<T, Bytes>(rows, cols, a, b, out, Sub());
+      return;
+    case BinaryOp::MUL:
+      binary_rows<T, Bytes>(rows, cols, a, b, out, Mul());
+      return;
+    case BinaryOp::DIV:
+      binary_rows<T, Bytes>(rows, cols, a, b, out, Div());
+      return;
+  }
+}
+
+// The tail is run through a zero padded vector as well, so every unary op
+// only needs a vector implementation.
+template <typename T, size_t Bytes, typename Op>
+void unary_map(size_t n, const T* in, T* out, Op op) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  size_t i = 0;
+  for (; i + L <= n; i += L) {
+    store(out + i, op(load<Vec>(in + i)));
+  }
+  if (i < n) {
+    Vec tail = Vec{};
+    std::memcpy(&tail, in + i, (n - i) * sizeof(T));
+    tail = op(tail);
+    std::memcpy(out + i, &tail, (n - i) * sizeof(T));
+  }
+}
+
+// act(x) on a whole vector, shared with the GEMM epilogue (gemm_kernel.h).
+template <typename T, size_t Bytes>
+typename VecTraits<T, Bytes>::vec activate(
+    Activation activation, const typename VecTraits<T, Bytes>::vec& x,
+    T param) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  switch (activation) {
+    case Activation::LEAKY_RELU: {
+      const Vec scaled = x * param;
+      return scaled < x ? x : scaled;
+    }
+    case Activation::SIGMOID:
+      return T(1) / (T(1) + exp_vec<T, Bytes>(-x));
+    case Activation::NONE:
+      break;
+  }
+  return x;
+}
+
+template <typename T, size_t Bytes>
+void unary_kernel(UnaryOp op, size_t n, const T* in, T* out, T param) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  switch (op) {
+    case UnaryOp::NEG:
+      unary_map<T, Bytes>(n, in, out, [](const Vec& x) { return -x; });
+      return;
+    case UnaryOp::EXP:
+      unary_map<T, Bytes>(n, in, out,
+                          [](const Vec& x) { return exp_vec<T, Bytes>(x); });
+      return;
+    case UnaryOp::SIGMOID:
+      unary_map<T, Bytes>(n, in, out, [](const Vec& x) {
+        return activate<T, Bytes>(Activation::SIGMOID, x, T(0));
+      });
+      return;
+    case UnaryOp::LEAKY_RELU:
+      unary_map<T, Bytes>(n, in, out, [param](const Vec& x) {
+        return activate<T, Bytes>(Activation::LEAKY_RELU, x, param);
+      });
+      return;
+    case UnaryOp::LEAKY_RELU_GRAD:
+      unary_map<T, Bytes>(n, in, out, [param](const Vec& x) {
+        return x > T(0) ? Vec{} + T(1) : Vec{} + param;
+      });
+      return;
+  }
+}
+
+// Calls f(c, width) for consecutive vectors which cover the columns
+// [c, cols): vectors of Bytes first, then ever narrower ones down to a single
+// lane. width is a std::integral_constant holding the vector size in bytes.
+template <typename T, size_t Bytes, typename F>
+void for_each_vector(size_t c, size_t cols, const F& f) {
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  for (; c + L <= cols; c += L) {
+    f(c, std::integral_constant<size_t, Bytes>{});
+  }
+  if constexpr (L > 1) {
+    for_each_vector<T, Bytes / 2>(c, cols, f);
+  }
+}
+
+// grad(out) is act'(z) for out = act(z). The tail of a row runs on narrower
+// vectors, so grad needs nothing but a generic vector implementation. out is
+// stored as T or, for float, in one of the 16 bit formats.
+template <typename T, size_t Bytes, typename Out, typename Grad>
+void activation_backward_rows(size_t rows, size_t cols, size_t ld,
+                              const Out* out, const T* grad_out, T* grad_z,
+                              T* bias_grad, bool accumulate_bias, Grad grad) {
+  if (!accumulate_bias) {
+    for (size_t c = 0; c < cols; ++c) {
+      bias_grad[c] = T(0);
+    }
+  }
+  for (size_t r = 0; r < rows; ++r) {
+    const Out* out_row = out + r * ld;
+    const T* grad_out_row = grad_out + r * ld;
+    T* grad_z_row = grad_z + r * ld;
+    for_each_vector<T, Bytes>(0, cols, [&](size_t c, auto width) {
+      constexpr size_t W = decltype(width)::value;
+      using Vec = typename VecTraits<T, W>::vec;
+      Vec y;
+      if constexpr (std::is_same_v<Out, T>) {
+        y = load<Vec>(out_row + c);
+      } else {
+        y = widen<W>(out_row + c);
+      }
+      const Vec g = load<Vec>(grad_out_row + c) * grad(y);
+      store(grad_z_row + c, g);
+      store(bias_grad + c, load<Vec>(bias_grad + c) + g);
+    });
+  }
+}
+
+template <typename T, size_t Bytes, typename Out = T>
+void activation_backward_kernel(Activation activation, size_t rows,
+                                size_t cols, size_t ld, const Out* out,
+                                const T* grad_out, T param, T* grad_z,
+                                T* bias_grad, bool accumulate_bias) {
+  switch (activation) {
+    case Activation::LEAKY_RELU:
+      activation_backward_rows<T, Bytes>(
+          rows, cols, ld, out, grad_out, grad_z, bias_grad, accumulate_bias,
+          [param](const auto& y) {
+            using V = std::decay_t<decltype(y)>;
+            return y > T(0) ? V{} + T(1) : V{} + param;
+          });
+      return;
+    case Activation::SIGMOID:
+      activation_backward_rows<T, Bytes>(
+          rows, cols, ld, out, grad_out, grad_z, bias_grad, accumulate_bias,
+          [](const auto& y) { return y * (T(1) - y); });
+      return;
+    case Activation::NONE:
+      activation_backward_rows<T, Bytes>(
+          rows, cols, ld, out, grad_out, grad_z, bias_grad, accumulate_bias,
+          [](const auto& y) { return std::decay_t<decltype(y)>{} + T(1); });
+      return;
+  }
+}
+
+template <typename T, size_t Bytes>
+T sum_kernel(size_t n, const T* in) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  Vec acc_0 = Vec{};
+  Vec acc_1 = Vec{};
+  size_t i = 0;
+  for (; i + 2 * L <= n; i += 2 * L) {
+    acc_0 += load<Vec>(in + i);
+    acc_1 += load<Vec>(in + i + L);
+  }
+  for (; i + L <= n; i += L) {
+    acc_0 += load<Vec>(in + i);
+  }
+  acc_0 += acc_1;
+  T result = T(0);
+  for (size_t l = 0; l < L; ++l) {
+    result += acc_0[l];
+  }
+  for (; i < n; ++i) {
+    result += in[i];
+  }
+  return result;
+}
+
+template <typename T, size_t Bytes>
+void sum_axis_kernel(size_t axis, size_t rows, size_t cols, size_t ld,
+                     const T* in, T* out, bool accumulate) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  if (axis == 0) {
+    if (!accumulate) {
+      for (size_t c = 0; c < cols; ++c) {
+        out[c] = T(0);
+      }
+    }
+    for (size_t r = 0; r < rows; ++r) {
+      const T* row = in + r * ld;
+      size_t c = 0;
+      for (; c + L <= cols; c += L) {
+        store(out + c, load<Vec>(out + c) + load<Vec>(row + c));
+      }
+      for (; c < cols; ++c) {
+        out[c] += row[c];
+      }
+    }
+  } else {
+    for (size_t r = 0; r < rows; ++r) {
+      const T sum = sum_kernel<T, Bytes>(cols, in + r * ld);
+      out[r] = accumulate ? out[r] + sum : sum;
+    }
+  }
+}
+
+// Like the scalar argmax, a result which stays at -inf (all entries -inf or
+// NaN) falls back to the first entry.
+template <typename T, size_t Bytes>
+void max_axis_kernel(size_t axis, size_t rows, size_t cols, size_t ld,
+                     const T* in, T* out) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  if (rows == 0 || cols == 0) {
+    return;
+  }
+  if (axis == 0) {
+    for (size_t c = 0; c < cols; ++c) {
+      out[c] = -infinity<T>();
+    }
+    for (size_t r = 0; r < rows; ++r) {
+      const T* row = in + r * ld;
+      size_t c = 0;
+      for (; c + L <= cols; c += L) {
+        const Vec v = load<Vec>(row + c);
+        const Vec m = load<Vec>(out + c);
+        store(out + c, v > m ? v : m);
+      }
+      for (; c < cols; ++c) {
+        out[c] = row[c] > out[c] ? row[c] : out[c];
+      }
+    }
+    for (size_t c = 0; c < cols; ++c) {
+      out[c] = out[c] == -infinity<T>() ? in[c] : out[c];
+    }
+  } else {
+    for (size_t r = 0; r < rows; ++r) {
+      const T* row = in + r * ld;
+      Vec m = Vec{} - infinity<T>();
+      size_t c = 0;
+      for (; c + L <= cols; c += L) {
+        const Vec v = load<Vec>(row + c);
+        m = v > m ? v : m;
+      }
+      T best = -infinity<T>();
+      for (size_t l = 0; l < L; ++l) {
+        best = m[l] > best ? m[l] : best;
+      }
+      for (; c < cols; ++c) {
+        best = row[c] > best ? row[c] : best;
+      }
+      out[r] = best == -infinity<T>() ? row[0] : best;
+    }
+  }
+}
+
+template <typename T, size_t Bytes>
+void argmax_axis_kernel(size_t axis, size_t rows, size_t cols, size_t ld,
+                        const T* in, size_t* out) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  using IVec = typename VecTraits<T, Bytes>::ivec;
+  using Int = typename IntOf<T>::type;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  if (axis == 0) {
+    size_t c = 0;
+    for (; c + L <= cols; c += L) {
+      Vec m = Vec{} - infinity<T>();
+      IVec idx = IVec{};
+      for (size_t r = 0; r < rows; ++r) {
+        const Vec v = load<Vec>(in + r * ld + c);
+        const IVec greater = v > m;
+        m = greater ? v : m;
+        idx = greater ? IVec{} + static_cast<Int>(r) : idx;
+      }
+      for (size_t l = 0; l < L; ++l) {
+        out[c + l] = static_cast<size_t>(idx[l]);
+      }
+    }
+    for (; c < cols; ++c) {
+      T m = -infinity<T>();
+      size_t idx = 0;
+      for (size_t r = 0; r < rows; ++r) {
+        if (in[r * ld + c] > m) {
+          m = in[r * ld + c];
+          idx = r;
+        }
+      }
+      out[c] = idx;
+    }
+  } else {
+    IVec lane_offsets = IVec{};
+    for (size_t l = 0; l < L; ++l) {
+      lane_offsets[l] = static_cast<Int>(l);
+    }
+    for (size_t r = 0; r < rows; ++r) {
+      const T* row = in + r * ld;
+      Vec m = Vec{} - infinity<T>();
+      IVec idx = IVec{};
+      size_t c = 0;
+      for (; c + L <= cols; c += L) {
+        const Vec v = load<Vec>(row + c);
+        const IVec greater = v > m;
+        m = greater ? v : m;
+        idx = greater ? lane_offsets + static_cast<Int>(c) : idx;
+      }
+      // lanes hold the first maximum of their column subset, the overall
+      // first maximum is the largest value with the smallest index
+      T best = -infinity<T>();
+      size_t best_idx = 0;
+      for (size_t l = 0; l < L; ++l) {
+        const size_t lane_idx = static_cast<size_t>(idx[l]);
+        if (m[l] > best || (m[l] == best && m[l] > -infinity<T>() &&
+                            lane_idx < best_idx)) {
+          best = m[l];
+          best_idx = lane_idx;
+        }
+      }
+      for (; c < cols; ++c) {
+        if (row[c] > best) {
+          best = row[c];
+          best_idx = c;
+        }
+      }
+      out[r] = best_idx;
+    }
+  }
+}
+
+inline float log_scalar(float x) { return __builtin_logf(x); }
+inline double log_scalar(double x) { return __builtin_log(x); }
+
+// One row at a time, which stays in L1 across the three sweeps: the row
+// maximum, exp(logits - max) into grad together with its sum and the label
+// terms, and the normalization of grad. With w = sum(labels) and
+// d = sum(labels * (logits - max)) the loss is w * log(sum) - d.
+template <typename T, size_t Bytes>
+void softmax_cross_entropy_kernel(size_t rows, size_t cols, size_t ld,
+                                  const T* logits, const T* one_hot,
+                                  const int32_t* classes, T grad_scale,
+                                  T* loss, T* grad) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  for (size_t r = 0; r < rows; ++r) {
+    const T* x = logits + r * ld;
+    const T* y = one_hot != nullptr ? one_hot + r * ld : nullptr;
+    T* g = grad != nullptr ? grad + r * ld : nullptr;
+
+    // NaNs are skipped like in max_axis_kernel and show up in the loss
+    Vec max_acc = Vec{} - infinity<T>();
+    T row_max = -infinity<T>();
+    for_each_vector<T, Bytes>(0, cols, [&](size_t c, auto width) {
+      using V = typename VecTraits<T, decltype(width)::value>::vec;
+      const V v = load<V>(x + c);
+      if constexpr (decltype(width)::value == Bytes) {
+        max_acc = v > max_acc ? v : max_acc;
+      } else {
+        for (size_t l = 0; l < sizeof(V) / sizeof(T); ++l) {
+          row_max = v[l] > row_max ? v[l] : row_max;
+        }
+      }
+    });
+    for (size_t l = 0; l < L; ++l) {
+      row_max = max_acc[l] > row_max ? max_acc[l] : row_max;
+    }
+
+    Vec sum_acc = Vec{};
+    Vec dot_acc = Vec{};
+    Vec weight_acc = Vec{};
+    T exp_sum = T(0);
+    T dot = T(0);
+    T weight = T(0);
+    // read before grad, which may alias logits, is written
+    if (classes != nullptr) {
+      dot = x[classes[r]] - row_max;
+      weight = T(1);
+    }
+    for_each_vector<T, Bytes>(0, cols, [&](size_t c, auto width) {
+      constexpr size_t W = decltype(width)::value;
+      using V = typename VecTraits<T, W>::vec;
+      const V z = load<V>(x + c) - row_max;
+      const V e = exp_vec<T, W>(z);
+      if (g != nullptr) {
+        store(g + c, e);
+      }
+      V d = V{};
+      V w = V{};
+      if (y != nullptr) {
+        w = load<V>(y + c);
+        d = w * z;
+      }
+      if constexpr (W == Bytes) {
+        sum_acc += e;
+        dot_acc += d;
+        weight_acc += w;
+      } else {
+        for (size_t l = 0; l < W / sizeof(T); ++l) {
+          exp_sum += e[l];
+          dot += d[l];
+          weight += w[l];
+        }
+      }
+    });
+    for (size_t l = 0; l < L; ++l) {
+      exp_sum += sum_acc[l];
+      dot += dot_acc[l];
+      weight += weight_acc[l];
+    }
+    if (loss != nullptr) {
+      loss[r] = weight * log_scalar(exp_sum) - dot;
+    }
+
+    if (g == nullptr) {
+      continue;
+    }
+    const T scale = grad_scale / exp_sum;
+    for_each_vector<T, Bytes>(0, cols, [&](size_t c, auto width) {
+      using V = typename VecTraits<T, decltype(width)::value>::vec;
+      V v = load<V>(g + c) * scale;
+      if (y != nullptr) {
+        v -= load<V>(y + c) * grad_scale;
+      }
+      store(g + c, v);
+    });
+    if (classes != nullptr) {
+      g[classes[r]] -= grad_scale;
+    }
+  }
+}
+
+inline float sqrt_scalar(float x) { return __builtin_sqrtf(x); }
+inline double sqrt_scalar(double x) { return __builtin_sqrt(x); }
+
+template <typename T, size_t Bytes>
+typename VecTraits<T, Bytes>::vec sqrt_vec(
+    typename VecTraits<T, Bytes>::vec x) {
+  for (size_t l = 0; l < VecTraits<T, Bytes>::lanes; ++l) {
+    x[l] = sqrt_scalar(x[l]);
+  }
+  return x;
+}
+
+// Like unary_map, the tail goes through zero padded vectors. op updates the
+// variable and state vectors in place.
+template <typename T, size_t Bytes, typename Op>
+void update_map(size_t n, T* variable, const T* gradient, T* state_0,
+                T* state_1, Op op) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  constexpr size_t L = VecTraits<T, Bytes>::lanes;
+  size_t i = 0;
+  for (; i + L <= n; i += L) {
+    Vec v = load<Vec>(variable + i);
+    Vec s_0 = state_0 != nullptr ? load<Vec>(state_0 + i) : Vec{};
+    Vec s_1 = state_1 != nullptr ? load<Vec>(state_1 + i) : Vec{};
+    op(v, load<Vec>(gradient + i), s_0, s_1);
+    store(variable + i, v);
+    if (state_0 != nullptr) {
+      store(state_0 + i, s_0);
+    }
+    if (state_1 != nullptr) {
+      store(state_1 + i, s_1);
+    }
+  }
+  if (i < n) {
+    const size_t bytes = (n - i) * sizeof(T);
+    Vec v = Vec{};
+    Vec g = Vec{};
+    Vec s_0 = Vec{};
+    Vec s_1 = Vec{};
+    std::memcpy(&v, variable + i, bytes);
+    std::memcpy(&g, gradient + i, bytes);
+    if (state_0 != nullptr) {
+      std::memcpy(&s_0, state_0 + i, bytes);
+    }
+    if (state_1 != nullptr) {
+      std::memcpy(&s_1, state_1 + i, bytes);
+    }
+    op(v, g, s_0, s_1);
+    std::memcpy(variable + i, &v, bytes);
+    if (state_0 != nullptr) {
+      std::memcpy(state_0 + i, &s_0, bytes);
+    }
+    if (state_1 != nullptr) {
+      std::memcpy(state_1 + i, &s_1, bytes);
+    }
+  }
+}
+
+template <typename T, size_t Bytes>
+void update_kernel(const UpdateParams<T>& params, size_t n, T* variable,
+                   const T* gradient, T* state_0, T* state_1) {
+  using Vec = typename VecTraits<T, Bytes>::vec;
+  const T lr = params.learning_rate;
+  const T mu = params.momentum;
+  const T decay = T(1) - params.learning_rate * params.weight_decay;
+  switch (params.rule) {
+    case UpdateRule::SGD:
+      update_map<T, Bytes>(n, variable, gradient, nullptr, nullptr,
+                           [=](Vec& v, const Vec& g, Vec&, Vec&) {
+                             v = v * decay - lr * g;
+                           });
+      return;
+    case UpdateRule::MOMENTUM:
+      update_map<T, Bytes>(n, variable, gradient, state_0, nullptr,
+                           [=](Vec& v, const Vec& g, Vec& s_0, Vec&) {
+                             s_0 = mu * s_0 + g;
+                             v = v * decay - lr * s_0;
+                           });
+      return;
+    case UpdateRule::NESTEROV:
+      update_map<T, Bytes>(n, variable, gradient, state_0, nullptr,
+                           [=](Vec& v, const Vec& g, Vec& s_0, Vec&) {
+                             s_0 = mu * s_0 + g;
+                             v = v * decay - lr * (g + mu * s_0);
+                           });
+      return;
+    case UpdateRule::ADAM: {
+      const T beta_2 = params.beta_2;
+      const T eps = params.epsilon;
+      const T step_size = params.step_size;
+      const T inv_sqrt_bc_2 = params.inv_sqrt_bias_correction_2;
+      update_map<T, Bytes>(
+          n, variable, gradient, state_0, state_1,
+          [=](Vec& v, const Vec& g, Vec& s_0, Vec& s_1) {
+            s_0 = mu * s_0 + (T(1) - mu) * g;
+            s_1 = beta_2 * s_1 + (T(1) - beta_2) * g * g;
+            const Vec denom = sqrt_vec<T, Bytes>(s_1) * inv_sqrt_bc_2 + eps;
+            v = v * decay - step_size * s_0 / denom;
+          });
+      return;
+    }
+  }
+}
+
+template <typename T, size_t Bytes>
+constexpr KernelTable<T> make_kernel_table() {
+  return {&binary_kernel<T, Bytes>,   &unary_kernel<T, Bytes>,
+          &sum_kernel<T, Bytes>,      &sum_axis_kernel<T, Bytes>,
+          &max_axis_kernel<T, Bytes>, &argmax_axis_kernel<T, Bytes>,
+          &update_kernel<T, Bytes>,   &activation_backward_kernel<T, Bytes>,
+          &softmax_cross_entropy_kernel<T, Bytes>};
+}
+
+template <size_t Bytes, typename Half>
+void to_half_kernel(size_t n, const float* in, Half* out) {
+  for_each_vector<float, Bytes>(0, n, [&](size_t i, auto width) {
+    constexpr size_t W = decltype(width)::value;
+    narrow<W>(load<typename VecTraits<float, W>::vec>(in + i), out + i);
+  });
+}
+
+template <size_t Bytes, typename Half>
+void from_half_kernel(size_t n, const Half* in, float* out) {
+  for_each_vector<float, Bytes>(0, n, [&](size_t i, auto width) {
+    store(out + i, widen<decltype(width)::value>(in + i));
+  });
+}
+
+template <size_t Bytes>
+constexpr HalfKernelTable make_half_kernel_table() {
+  return {&to_half_kernel<Bytes, bfloat16>,
+          &to_half_kernel<Bytes, float16>,
+          &from_half_kernel<Bytes, bfloat16>,
+          &from_half_kernel<Bytes, float16>,
+          &activation_backward_kernel<float, Bytes, bfloat16>,
+          &activation_backward_kernel<float, Bytes, float16>};
+}
+
+// Bit i of the result is the top bit of byte i of v, i.e. whether lane i of
+// a comparison result is true.
+template <size_t Bytes>
+uint64_t byte_mask(const typename VecTraits<int8_t, Bytes>::vec& v) {
+#if defined(__AVX2__)
+  if constexpr (Bytes == 32) {
+    return static_cast<uint32_t>(
+        _mm256_movemask_epi8(bit_cast_vec<__m256i>(v)));
+  }
+#endif
+#if defined(__SSE2__)
+  if constexpr (Bytes == 16) {
+    return static_cast<uint32_t>(_mm_movemask_epi8(bit_cast_vec<__m128i>(v)));
+  }
+#endif
+  uint64_t bits = 0;
+  for (size_t lane = 0; lane < Bytes; ++lane) {
+    bits |= static_cast<uint64_t>(v[lane] < 0) << lane;
+  }
+  return bits;
+}
+
+// 64 bytes of csv text: bit masks, bit i stands for byte i, and the value
+// of the number starting at each byte.
+struct CsvBlock {
+  // bytes below '0' as signed char: ',', line breaks and anything else
+  // that ends a number, bytes from 128 on too
+  uint64_t delimiters;
+  uint64_t commas;
+  // bytes above '9' and numbers with more than three digits or above 255,
+  // which no valid line has. The suffixes of valid numbers have at most two
+  // digits, so they are never marked; delimiters may be and are masked out.
+  uint64_t invalid;
+  uint8_t values[64];
+};
+
+// 10 * v in four additions, SSE and AVX2 have no byte multiplication.
+template <typename V>
+V times_ten(const V& v) {
+  const V twice = v + v;
+  const V eight_times = (twice + twice) + (twice + twice);
+  return eight_times + twice;
+}
+
+// Scans 64 bytes at a time with one comparison per class and vector, the
+// numbers of one to three digits starting at every byte of a vector are
+// computed from loads of the three bytes after it. The last block and the
+// three bytes after it are read from a copy padded with '\n', the bytes past
+// size are line breaks.
+template <size_t Bytes>
+void scan_csv(size_t size, const char* text, CsvBlock* blocks) {
+  // AVX-512F has no byte compares, GCC would compare 64 byte vectors lane
+  // by lane, two AVX2 vectors are compared instead
+  constexpr size_t Width = Bytes > 32 ? 32 : Bytes;
+  using Vec = typename VecTraits<uint8_t, Width>::vec;
+  // signed compares are single instructions, the unsigned ones are not
+  using SignedVec = typename VecTraits<int8_t, Width>::vec;
+  static_assert(64 % Width == 0, "64 bytes take whole vectors");
+  for (size_t block = 0; block * 64 < size; ++block) {
+    const char* bytes = text + block * 64;
+    char padded[64 + 3];
+    if (size - block * 64 < sizeof(padded)) {
+      std::memset(padded, '\n', sizeof(padded));
+      std::memcpy(padded, bytes, size - block * 64);
+      bytes = padded;
+    }
+    CsvBlock& out = blocks[block];
+    out.delimiters = out.commas = out.invalid = 0;
+    for (size_t part = 0; part < 64; part += Width) {
+      const Vec v = load<Vec>(bytes + part);
+      const SignedVec chars = bit_cast_vec<SignedVec>(v);
+      out.delimiters |= byte_mask<Width>(chars < '0') << part;
+      out.commas |= byte_mask<Width>(chars == ',') << part;
+      // digit values, anything else is above 9
+      const Vec d0 = v - '0';
+      const Vec d1 = load<Vec>(bytes + part + 1) - '0';
+      const Vec d2 = load<Vec>(bytes + part + 2) - '0';
+      const Vec d3 = load<Vec>(bytes + part + 3) - '0';
+      const Vec two = times_ten(d0) + d1;
+      const Vec three = times_ten(two) + d2;
+      const auto has_two = d1 <= 9;
+      const auto has_three = has_two & (d2 <= 9);
+      store(out.values + part, has_three ? three : has_two ? two : d0);
+      // above 255 if the first two digits are above 25, the bytes wrap.
+      // two and d2 are below 100 where has_three holds.
+      const auto large =
+          has_three & ((d3 <= 9) | (bit_cast_vec<SignedVec>(two) > 25) |
+                       ((two == 25) & (bit_cast_vec<SignedVec>(d2) > 5)));
+      out.invalid |= byte_mask<Width>((chars > '9') | large) << part;
+    }
+  }
+}
+
+// Number of set bits. Baseline x86 has no popcnt instruction, there
+// __builtin_popcountll would call libgcc.
+inline uint64_t count_bits(uint64_t bits) {
+#if defined(__POPCNT__) || !defined(__x86_64__)
+  return static_cast<uint64_t>(__builtin_popcountll(bits));
+#else
+  bits -= (bits >> 1) & 0x5555555555555555ull;
+  bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+  bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (bits * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+inline size_t min_size(size_t a, size_t b) { return a < b ? a : b; }
+
+// The bits up to and including the lowest set bit of bits, all if none is.
+inline uint64_t up_to_lowest(uint64_t bits) { return bits ^ (bits - 1); }
+
+// The positions of the set bits of every byte value, lowest first, and
+// their number.
+struct BytePositions {
+  uint8_t positions[256][8];
+  uint8_t counts[256];
+};
+
+constexpr BytePositions make_byte_positions() {
+  BytePositions table{};
+  for (size_t byte = 0; byte < 256; ++byte) {
+    for (size_t bit = 0; bit < 8; ++bit) {
+      if ((byte >> bit) & 1) {
+        table.positions[byte][table.counts[byte]++] = bit;
+      }
+    }
+  }
+  return table;
+}
+
+constexpr BytePositions BYTE_POSITIONS = make_byte_positions();
+
+// Stores the values at the set bits of bits to out in order. Each group of
+// 8 bits stores 8 bytes, with one shuffle where SSSE3 has it, the ones past
+// the selected values are overwritten by the next group. Only the selected
+// values are stored where 64 bytes would not end before limit.
+inline void compress_bytes(const uint8_t* values, uint64_t bits,
+                           uint8_t* out, const uint8_t* limit) {
+  if (out + 64 > limit) {
+    for (size_t group = 0; group < 64; group += 8) {
+      const size_t byte = (bits >> group) & 0xff;
+      for (size_t index = 0; index < BYTE_POSITIONS.counts[byte]; ++index) {
+        out[index] = values[group + BYTE_POSITIONS.positions[byte][index]];
+      }
+      out += BYTE_POSITIONS.counts[byte];
+    }
+    return;
+  }
+  for (size_t group = 0; group < 64; group += 8) {
+    const size_t byte = (bits >> group) & 0xff;
+    const uint8_t* positions = BYTE_POSITIONS.positions[byte];
+#if defined(__SSSE3__)
+    const __m128i group_values =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values + group));
+    const __m128i shuffle =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(positions));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out),
+                     _mm_shuffle_epi8(group_values, shuffle));
+#else
+    for (size_t index = 0; index < 8; ++index) {
+      out[index] = values[group + positions[index]];
+    }
+#endif
+    out += BYTE_POSITIONS.counts[byte];
+  }
+}
+
+// Blocks of 64 bytes scanned at a time, one more is scanned to look ahead
+// at the three bytes after the last one.
+constexpr size_t CSV_WINDOW_BLOCKS = 64;
+
+// See simd::parse_csv_bytes. A number starts at every byte after a
+// delimiter which is none itself, the numbers of a block go to the row in
+// order at once. Numbers, delimiters and line breaks are counted per line
+// and checked at its end, which also finds empty fields: a valid line has
+// one delimiter after each number and the '\r' of "\r\n".
+template <size_t Bytes>
+bool parse_csv_bytes_kernel(size_t size, const char* text, size_t num_columns,
+                            uint8_t* rows, size_t* num_rows) {
+  const char* end = text + size;
+  CsvBlock blocks[CSV_WINDOW_BLOCKS + 1];
+  // the numbers of sample lines go to row, other lines are skipped
+  uint8_t* row = rows;
+  size_t num_samples = 0;
+  bool is_sample = false;
+  // counts of the line so far: numbers, delimiters and those other than
+  // ',', and the bits of invalid bytes and numbers
+  size_t num_numbers = 0;
+  size_t num_delimiters = 0;
+  size_t num_breaks = 0;
+  uint64_t invalid = 0;
+  const char* line = text;
+  const auto begin_line = [&](const char* pos) {
+    line = pos;
+    is_sample = pos < end && *pos >= '0' && *pos <= '9';
+    num_numbers = num_delimiters = num_breaks = 0;
+    invalid = 0;
+  };
+  // ends the line at the '\n' at newline, or at the end of the text
+  const auto end_line = [&](const char* newline) {
+    if (is_sample) {
+      // "\r\n" is one more delimiter and line break
+      const size_t crlf = newline[-1] == '\r';
+      if (num_numbers != num_columns ||
+          num_delimiters != num_columns + crlf || num_breaks != 1 + crlf ||
+          invalid != 0) {
+        return false;
+      }
+      row += num_columns;
+      ++num_samples;
+    }
+    begin_line(newline + 1);
+    return true;
+  };
+
+  begin_line(text);
+  // bit 0: the byte before the next block is a delimiter, as is the start
+  uint64_t carry = 1;
+  for (const char* window = text; window < end;
+       window += 64 * CSV_WINDOW_BLOCKS) {
+    const size_t window_size = min_size(64 * (CSV_WINDOW_BLOCKS + 1),
+                                        static_cast<size_t>(end - window));
+    scan_csv<Bytes>(window_size, window, blocks);
+    const size_t num_blocks = (window_size + 63) / 64;
+    for (size_t index = 0; index < min_size(num_blocks, CSV_WINDOW_BLOCKS);
+         ++index) {
+      const CsvBlock& block = blocks[index];
+      const char* bytes = window + 64 * index;
+      const uint64_t in_text = end - bytes >= 64
+                                   ? ~uint64_t(0)
+                                   : (uint64_t(1) << (end - bytes)) - 1;
+      const uint64_t delimiters = block.delimiters;
+      const uint64_t starts =
+          ~delimiters & ((delimiters << 1) | carry) & in_text;
+      const uint64_t breaks = delimiters & ~block.commas;
+      carry = delimiters >> 63;
+
+      // segments of the block ending at a line break or the block's end
+      for (uint64_t rest = in_text; rest != 0;) {
+        const uint64_t segment_breaks = breaks & rest;
+        const uint64_t segment = rest & up_to_lowest(segment_breaks);
+        const uint64_t numbers = starts & segment;
+        const size_t count = count_bits(numbers);
+        if (is_sample) {
+          if (num_numbers + count > num_columns) {
+            return false;
+          }
+          compress_bytes(block.values, numbers, row + num_numbers,
+                         row + num_columns);
+        }
+        num_numbers += count;
+        num_delimiters += count_bits(delimiters & segment);
+        invalid |= block.invalid & ~delimiters & segment;
+        rest &= ~segment;
+        if (segment_breaks != 0) {
+          // a segment ends at its only line break
+          ++num_breaks;
+          const char* newline = bytes + __builtin_ctzll(segment_breaks);
+          if (*newline == '\n' && !end_line(newline)) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+  // the end of the text ends a last line without '\n'
+  if (line < end) {
+    num_delimiters += 1;
+    num_breaks += 1;
+    if (!end_line(end)) {
+      return false;
+    }
+  }
+  *num_rows = num_samples;
+  return true;
+}
+
+template <size_t Bytes>
+constexpr TextKernelTable make_text_kernel_table() {
+  return {&parse_csv_bytes_kernel<Bytes>};
+}
+
+}  // namespace
+}  // namespace simd
@@ -0,0 +1,119 @@
+#include "sparse.h"
+
+#include <algorithm>
+#include <limits>
+
+float CsrMatrix::density() const {
+  const size_t size = this->num_rows * this->num_cols;
+  return size == 0 ? 0.0f
+                   : static_cast<float>(this->values.size()) /
+                         static_cast<float>(size);
+}
+
+bool to_sparse(const Mat2D<float>& dense, const float max_density,
+               CsrMatrix& csr) {
+  return to_sparse(dense.view(), max_density, csr);
+}
+
+bool to_sparse(const MatView<const float> dense, const float max_density,
+               CsrMatrix& csr) {
+  const size_t size = dense.rows() * dense.cols();
+  if (size == 0 || size > std::numeric_limits<uint32_t>::max() ||
+      !dense.is_contiguous()) {
+    return false;
+  }
+  const float* data = dense.data();
+  // independent minima of 16 lanes, so the loop vectorizes
+  constexpr size_t LANES = 16;
+  float minima[LANES];
+  std::fill(minima, minima + LANES, data[0]);
+  size_t idx = 0;
+  for (; idx + LANES <= size; idx += LANES) {
+    for (size_t lane = 0; lane < LANES; ++lane) {
+      const float value = data[idx + lane];
+      minima[lane] = value < minima[lane] ? value : minima[lane];
+    }
+  }
+  for (; idx < size; ++idx) {
+    minima[0] = data[idx] < minima[0] ? data[idx] : minima[0];
+  }
+  const float background = *std::min_element(minima, minima + LANES);
+
+  // one pass, which gives up once more than max_nnz entries differ. The
+  // stores are unconditional and only advance past entries to keep, so there
+  // is no branch to mispredict on random patterns, which needs one slot
+  // more than the entries kept.
+  const size_t rows = dense.get_num_rows();
+  const size_t cols = dense.get_num_cols();
+  const size_t max_nnz = static_cast<size_t>(
+      max_density * static_cast<float>(size));
+  csr.row_offsets.resize(rows + 1);
+  csr.col_indices.resize(max_nnz + cols + 1);
+  csr.values.resize(max_nnz + cols + 1);
+  uint32_t* indices = csr.col_indices.data();
+  float* values = csr.values.data();
+  size_t p = 0;
+  for (size_t row = 0; row < rows; ++row) {
+    if (p > max_nnz) {
+      return false;
+    }
+    csr.row_offsets[row] = static_cast<uint32_t>(p);
+    const float* in = data + row * cols;
+    for (size_t col = 0; col < cols; ++col) {
+      indices[p] = static_cast<uint32_t>(col);
+      values[p] = in[col] - background;
+      p += in[col] != background;
+    }
+  }
+  if (p > max_nnz) {
+    return false;
+  }
+  csr.row_offsets[rows] = static_cast<uint32_t>(p);
+  csr.col_indices.resize(p);
+  csr.values.resize(p);
+  csr.num_rows = rows;
+  csr.num_cols = cols;
+  csr.background = background;
+  return true;
+}
+
+void transpose_into(const CsrMatrix& in, CsrMatrix& out) {
+  out.num_rows = in.num_cols;
+  out.num_cols = in.num_rows;
+  out.background = in.background;
+  out.col_indices.resize(in.values.size());
+  out.values.resize(in.values.size());
+  // counting sort by column: row_offsets[c + 1] counts column c, after the
+  // prefix sum row_offsets[c + 1] is the next free slot of column c, and
+  // once every entry is placed it is the end of column c
+  auto& offsets = out.row_offsets;
+  offsets.assign(in.num_cols + 2, 0);
+  for (const uint32_t col : in.col_indices) {
+    offsets[col + 2]++;
+  }
+  for (size_t col = 2; col < offsets.size(); ++col) {
+    offsets[col] += offsets[col - 1];
+  }
+  for (size_t row = 0; row < in.num_rows; ++row) {
+    for (uint32_t p = in.row_offsets[row]; p < in.row_offsets[row + 1];
+         ++p) {
+      const uint32_t dst = offsets[in.col_indices[p] + 1]++;
+      out.col_indices[dst] = static_cast<uint32_t>(row);
+      out.values[dst] = in.values[p];
+    }
+  }
+  offsets.pop_back();
+}
+
+Mat2D<float> to_dense(const CsrMatrix& csr) {
+  Mat2D<float> dense(csr.num_rows, csr.num_cols);
+  std::fill(dense.matrix_data.begin(), dense.matrix_data.end(),
+            csr.background);
+  for (size_t row = 0; row < csr.num_rows; ++row) {
+    for (uint32_t p = csr.row_offsets[row]; p < csr.row_offsets[row + 1];
+         ++p) {
+      dense(row, csr.col_indices[p]) += csr.values[p];
+    }
+  }
+  return dense;
+}
@@ -1,9 +1,121 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "cpu.h"
+#include "inference_session.h"
 #include "layer.h"
+#include "mlp.h"
+#include "mnist.h"
+#include "model_file.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "quantization.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "sparse.h"
+#include "static_mlp.h"
 #include "utils.h"
 
+// Heap allocations of all threads, replaces every form of the global
+// operator new and delete. Profiling builds replace them in the utils
+// library as well, the bytes are passed on to keep their counts.
+std::atomic<size_t> num_allocations{0};
+
+namespace {
+
+void* allocate(std::size_t size, std::size_t alignment) noexcept {
+  num_allocations++;
+  profile::record_allocation(size);
+  size = size == 0 ? 1 : size;
+  if (alignment <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+  // aligned_alloc wants a multiple of the alignment
+  return std::aligned_alloc(alignment,
+                            (size + alignment - 1) / alignment * alignment);
+}
+
+// Not inlined into the callers of delete, where GCC would see free called on
+// the result of operator new.
+[[gnu::noinline]] void deallocate(void* ptr) noexcept { std::free(ptr); }
+
+void* allocate_or_throw(std::size_t size, std::size_t alignment) {
+  if (void* ptr = allocate(size, alignment)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) { return allocate_or_throw(size, 0); }
+void* operator new[](std::size_t size) { return allocate_or_throw(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, 0);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+
 int factorial(int foo) {
   int result = 1;
   for (int i = 1; i <= foo; ++i) {
@@ -53,6 +165,1344 @@ TEST_CASE("Mat2D Tests dot_product", "dot_product") {
   REQUIRE_THAT(B.matrix_data, Catch::Approx(B_exp.matrix_data).epsilon(1.e-5));
 }
 
+TEST_CASE("Packed GEMM matches reference", "dot_product") {
+  // shapes straddle the register tile and cache block sizes
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {1, 1, 1}, {3, 5, 7}, {17, 33, 9}, {64, 784, 50}, {130, 300, 70}};
+  for (const auto& [m, k, n] : shapes) {
+    const auto A = Mat2D<float>(m, k, RANDOM_UNIFORM);
+    const auto B = Mat2D<float>(k, n, RANDOM_UNIFORM);
+    const auto C = A.dot_product(B);
+    const auto C_ref = A.dot_product_reference(B);
+    REQUIRE(C.get_num_rows() == m);
+    REQUIRE(C.get_num_cols() == n);
+    REQUIRE_THAT(C.matrix_data,
+                 Catch::Approx(C_ref.matrix_data).margin(1.e-5));
+
+    const auto A_d = Mat2D<double>(m, k, RANDOM_UNIFORM);
+    const auto B_d = Mat2D<double>(k, n, RANDOM_UNIFORM);
+    REQUIRE_THAT(A_d.dot_product(B_d).matrix_data,
+                 Catch::Approx(A_d.dot_product_reference(B_d).matrix_data)
+                     .margin(1.e-12));
+  }
+}
+
+TEST_CASE("GEMM with transposed operands, alpha and beta", "dot_product") {
+  using gemm::Transpose;
+  // the last two shapes are split over rows resp. columns between threads,
+  // single rows of A run on the GEMV kernel with its narrower tail vectors
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {1, 1, 1},  {3, 5, 7},      {17, 33, 9},    {1, 784, 50},
+      {1, 9, 77}, {1, 300, 1000}, {130, 300, 70}, {20, 300, 200}};
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    for (const auto& [m, k, n] : shapes) {
+      const auto A = Mat2D<float>(m, k, RANDOM_UNIFORM);
+      const auto B = Mat2D<float>(k, n, RANDOM_UNIFORM);
+      const auto C_0 = Mat2D<float>(m, n, RANDOM_UNIFORM);
+      const auto AB = A.dot_product_reference(B);
+      const Mat2D<float> scaled_AB_plus_C = AB * -0.5f + C_0 * 2.0f;
+      for (const auto trans_a : {Transpose::NO, Transpose::YES}) {
+        for (const auto trans_b : {Transpose::NO, Transpose::YES}) {
+          // stored such that op(a) == A and op(b) == B
+          const auto a = trans_a == Transpose::YES ? A.transpose() : A;
+          const auto b = trans_b == Transpose::YES ? B.transpose() : B;
+
+          Mat2D<float> C(0, 0);
+          gemm::gemm(trans_a, trans_b, 1.0f, a, b, 0.0f, C);
+          REQUIRE(C.get_num_rows() == m);
+          REQUIRE(C.get_num_cols() == n);
+          REQUIRE_THAT(C.matrix_data,
+                       Catch::Approx(AB.matrix_data).margin(1.e-5));
+
+          C = C_0;
+          gemm::gemm(trans_a, trans_b, -0.5f, a, b, 2.0f, C);
+          REQUIRE_THAT(C.matrix_data,
+                       Catch::Approx(scaled_AB_plus_C.matrix_data)
+                           .margin(1.e-5));
+        }
+      }
+    }
+  }
+  cpu::reset_isa();
+
+  // beta = 1 accumulates the weight gradients of two half batches
+  const auto X = Mat2D<double>(64, 20, RANDOM_UNIFORM);
+  const auto dY = Mat2D<double>(64, 10, RANDOM_UNIFORM);
+  Mat2D<double> dW(0, 0);
+  gemm::gemm(Transpose::YES, Transpose::NO, 1.0,
+             Mat2D<double>(X.row_slice(0, 32)),
+             Mat2D<double>(dY.row_slice(0, 32)), 0.0, dW);
+  gemm::gemm(Transpose::YES, Transpose::NO, 1.0,
+             Mat2D<double>(X.row_slice(32, 64)),
+             Mat2D<double>(dY.row_slice(32, 64)), 1.0, dW);
+  const auto dW_full = X.transpose().dot_product_reference(dY);
+  REQUIRE_THAT(dW.matrix_data,
+               Catch::Approx(dW_full.matrix_data).margin(1.e-12));
+  // dL/dX = dL/dY * W^T, W^T packed in blocks of the vector length
+  const auto W = Mat2D<double>(200, 300, RANDOM_UNIFORM);
+  const auto dY_wide = Mat2D<double>(20, 300, RANDOM_UNIFORM);
+  Mat2D<double> dX(0, 0);
+  gemm::gemm(Transpose::NO, Transpose::YES, 1.0, dY_wide, W, 0.0, dX);
+  REQUIRE_THAT(
+      dX.matrix_data,
+      Catch::Approx(dY_wide.dot_product_reference(W.transpose()).matrix_data)
+          .margin(1.e-12));
+
+  Mat2D<float> wrong_shape(3, 3);
+  REQUIRE_THROWS(gemm::gemm(Transpose::NO, Transpose::NO, 1.0f,
+                            Mat2D<float>(2, 4), Mat2D<float>(4, 2), 1.0f,
+                            wrong_shape));
+  REQUIRE_THROWS(gemm::gemm(Transpose::YES, Transpose::NO, 1.0f,
+                            Mat2D<float>(2, 4), Mat2D<float>(4, 2), 0.0f,
+                            wrong_shape));
+}
+
+TEST_CASE("GEMM backends agree", "dot_product") {
+  using gemm::Backend;
+  using gemm::Transpose;
+  // BLAS only runs when asked for
+  if (std::getenv("MLP_GEMM_BACKEND") == nullptr) {
+    REQUIRE(gemm::active_backend() == Backend::BUILTIN);
+  }
+  if (!gemm::blas_available()) {
+    REQUIRE_THROWS(gemm::set_backend(Backend::BLAS));
+    return;
+  }
+  const auto A = Mat2D<float>(130, 300, RANDOM_UNIFORM);
+  const auto B = Mat2D<float>(300, 70, RANDOM_UNIFORM);
+  const auto B_t = B.transpose();
+  Mat2D<float> C_builtin(130, 70, RANDOM_UNIFORM);
+  Mat2D<float> C_blas = C_builtin;
+
+  gemm::set_backend(Backend::BUILTIN);
+  REQUIRE(gemm::active_backend() == Backend::BUILTIN);
+  gemm::gemm(Transpose::NO, Transpose::YES, 0.5f, A, B_t, 2.0f, C_builtin);
+  gemm::set_backend(Backend::BLAS);
+  REQUIRE(gemm::active_backend() == Backend::BLAS);
+  gemm::gemm(Transpose::NO, Transpose::YES, 0.5f, A, B_t, 2.0f, C_blas);
+  REQUIRE_THAT(C_blas.matrix_data,
+               Catch::Approx(C_builtin.matrix_data).margin(1.e-5));
+  REQUIRE_THAT(A.dot_product(B).matrix_data,
+               Catch::Approx(A.dot_product_reference(B).matrix_data)
+                   .margin(1.e-5));
+  // split over the pool, and the builtin kernels in deterministic mode
+  parallel::set_num_threads(4);
+  REQUIRE_THAT(A.dot_product(B).matrix_data,
+               Catch::Approx(A.dot_product_reference(B).matrix_data)
+                   .margin(1.e-5));
+  parallel::set_deterministic(true);
+  const auto deterministic = A.dot_product(B);
+  gemm::set_backend(Backend::BUILTIN);
+  REQUIRE(A.dot_product(B).matrix_data == deterministic.matrix_data);
+  parallel::set_deterministic(false);
+  parallel::set_num_threads(1);
+  gemm::reset_backend();
+}
+
+TEST_CASE("SIMD kernels match scalar loops on every ISA", "simd") {
+  // odd shapes so every kernel also runs its remainder loop
+  const auto A = Mat2D<float>(7, 37, RANDOM_UNIFORM);
+  const auto B = Mat2D<float>(7, 37, RANDOM_UNIFORM).add(1.0f);
+  const auto row = Mat2D<float>(1, 37, RANDOM_UNIFORM).add(2.0f);
+  const auto col = Mat2D<float>(7, 1, RANDOM_UNIFORM);
+  auto ties = Mat2D<float>(7, 37);
+  ties(3, 30) = 1.0f;
+  ties(5, 2) = 1.0f;
+  ties(5, 20) = 1.0f;
+
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+
+    for (const auto& other : {B, row, col}) {
+      REQUIRE_THAT(A.add(other).matrix_data,
+                   Catch::Approx(A.elementwise_combination_w_broadcast(
+                                      other, std::plus<float>())
+                                     .matrix_data)
+                       .epsilon(1.e-6));
+      REQUIRE_THAT(other.minus(A).matrix_data,
+                   Catch::Approx(other.elementwise_combination_w_broadcast(
+                                          A, std::minus<float>())
+                                     .matrix_data)
+                       .epsilon(1.e-6));
+      REQUIRE_THAT(A.divide_by(other).matrix_data,
+                   Catch::Approx(A.elementwise_combination_w_broadcast(
+                                      other, std::divides<float>())
+                                     .matrix_data)
+                       .epsilon(1.e-6));
+    }
+    REQUIRE_THAT(A.hadamard_product(0.5f).matrix_data,
+                 Catch::Approx(A.elementwise_combination_w_broadcast(
+                                    Mat2D<float>(1, 1, {0.5f}),
+                                    std::multiplies<float>())
+                                   .matrix_data)
+                     .epsilon(1.e-6));
+
+    const auto logits = A.hadamard_product(400.0f);
+    const auto exp = logits.elementwise_operation(simd::UnaryOp::EXP);
+    const auto sigmoid = logits.elementwise_operation(simd::UnaryOp::SIGMOID);
+    const auto lrelu =
+        A.elementwise_operation(simd::UnaryOp::LEAKY_RELU, 0.1f);
+    for (size_t i = 0; i < A.matrix_data.size(); ++i) {
+      const float x = logits.matrix_data[i];
+      REQUIRE(exp.matrix_data[i] == Approx(std::exp(x)).epsilon(1.e-6));
+      REQUIRE(sigmoid.matrix_data[i] ==
+              Approx(1.0 / (1.0 + std::exp(-x))).epsilon(1.e-6));
+      REQUIRE(lrelu.matrix_data[i] ==
+              Approx(std::max(0.1f * A.matrix_data[i], A.matrix_data[i])));
+    }
+    const auto exp_d = Mat2D<double>(1, 3, {-700.0, 0.5, 700.0})
+                           .elementwise_operation(simd::UnaryOp::EXP);
+    REQUIRE(exp_d(0, 0) == Approx(std::exp(-700.0)).epsilon(1.e-12));
+    REQUIRE(exp_d(0, 1) == Approx(std::exp(0.5)).epsilon(1.e-12));
+    REQUIRE(exp_d(0, 2) == Approx(std::exp(700.0)).epsilon(1.e-12));
+
+    REQUIRE(A.reduce_sum() == Approx(std::accumulate(
+                                  A.matrix_data.begin(), A.matrix_data.end(),
+                                  0.0)).margin(1.e-5));
+    for (size_t axis = 0; axis < 2; ++axis) {
+      const auto sums = A.reduce_sum_axis(axis);
+      const auto maxs = A.reduce_max_axis(axis);
+      const auto argmax = A.argmax(axis);
+      const size_t outer = axis == 0 ? A.get_num_cols() : A.get_num_rows();
+      const size_t inner = axis == 0 ? A.get_num_rows() : A.get_num_cols();
+      for (size_t o = 0; o < outer; ++o) {
+        float sum = 0.0f;
+        float max = -std::numeric_limits<float>::infinity();
+        size_t max_idx = 0;
+        for (size_t i = 0; i < inner; ++i) {
+          const float val = axis == 0 ? A(i, o) : A(o, i);
+          sum += val;
+          if (val > max) {
+            max = val;
+            max_idx = i;
+          }
+        }
+        REQUIRE(sums.matrix_data[o] == Approx(sum).margin(1.e-6));
+        REQUIRE(maxs.matrix_data[o] == max);
+        REQUIRE(argmax.matrix_data[o] == max_idx);
+      }
+    }
+    // first maximum wins
+    REQUIRE(ties.argmax(1)(5, 0) == 2);
+    REQUIRE(ties.argmax(1)(0, 0) == 0);
+    REQUIRE(ties.argmax(0)(0, 30) == 3);
+    REQUIRE(ties.argmax(0)(0, 31) == 0);
+  }
+  cpu::reset_isa();
+}
+
+TEST_CASE("Optimizers match their update rules on every ISA", "optimizer") {
+  // 7 x 37 so the kernels also run their remainder loop
+  const auto initial = Mat2D<float>(7, 37, RANDOM_UNIFORM);
+  const auto gradient = Mat2D<float>(7, 37, RANDOM_UNIFORM).minus(0.5f);
+  const float lr = 0.1f;
+  const float mu = 0.9f;
+  const float b_1 = 0.9f;
+  const float b_2 = 0.999f;
+  const float eps = 1e-8f;
+  const float wd = 0.01f;
+
+  // two steps with the same gradient, written out per element
+  auto expected_sgd = initial;
+  auto expected_momentum = initial;
+  auto expected_nesterov = initial;
+  auto expected_adamw = initial;
+  for (size_t idx = 0; idx < initial.matrix_data.size(); ++idx) {
+    const float g = gradient.matrix_data[idx];
+    float v = 0.0f;
+    float m = 0.0f;
+    float s = 0.0f;
+    for (int t = 1; t <= 2; ++t) {
+      expected_sgd.matrix_data[idx] -= lr * g;
+      v = mu * v + g;
+      expected_momentum.matrix_data[idx] -= lr * v;
+      expected_nesterov.matrix_data[idx] -= lr * (g + mu * v);
+      m = b_1 * m + (1 - b_1) * g;
+      s = b_2 * s + (1 - b_2) * g * g;
+      const float m_hat = m / (1 - std::pow(b_1, t));
+      const float s_hat = s / (1 - std::pow(b_2, t));
+      float& w = expected_adamw.matrix_data[idx];
+      w -= lr * wd * w + lr * m_hat / (std::sqrt(s_hat) + eps);
+    }
+  }
+
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+
+    SGDOptimizer sgd(lr);
+    SGDOptimizer momentum(lr, mu);
+    SGDOptimizer nesterov(lr, mu, true);
+    AdamWOptimizer adamw(lr, wd, b_1, b_2, eps);
+    const std::array<std::pair<Optimizer*, const Mat2D<float>*>, 4> cases = {
+        {{&sgd, &expected_sgd},
+         {&momentum, &expected_momentum},
+         {&nesterov, &expected_nesterov},
+         {&adamw, &expected_adamw}}};
+    for (const auto& [optimizer, expected] : cases) {
+      auto variable = initial;
+      auto grad = gradient;
+      for (int t = 0; t < 2; ++t) {
+        optimizer->step({&variable}, {&grad});
+      }
+      REQUIRE_THAT(variable.matrix_data,
+                   Catch::Approx(expected->matrix_data).epsilon(1.e-5));
+    }
+  }
+  cpu::reset_isa();
+
+  SGDOptimizer sgd(lr, mu);
+  auto variable = initial;
+  auto grad = gradient;
+  sgd.step({&variable}, {&grad});
+  auto other = Mat2D<float>(3, 3);
+  REQUIRE_THROWS(sgd.step({&variable, &other}, {&grad, &other}));
+  REQUIRE_THROWS(sgd.step({&variable}, {&other}));
+}
+
+TEST_CASE("Lazy expressions", "expr") {
+  const auto A = Mat2D<float>(2, 3, {1., 2., 3., 4., 5., 6.});
+  const auto row = Mat2D<float>(1, 3, {1., 10., 100.});
+  const auto col = Mat2D<float>(2, 1, {2., 4.});
+
+  const Mat2D<float> fused = (A - row) * 2.0f / col + 1.0f;
+  const auto eager =
+      A.minus(row).hadamard_product(2.0f).divide_by(col).add(1.0f);
+  REQUIRE(fused.get_num_rows() == 2);
+  REQUIRE(fused.get_num_cols() == 3);
+  REQUIRE_THAT(fused.matrix_data,
+               Catch::Approx(eager.matrix_data).epsilon(1.e-6));
+
+  // in place update may read the matrix it writes to
+  auto B = A;
+  const auto* storage = B.matrix_data.data();
+  B = B - A * 0.5f;
+  REQUIRE(B.matrix_data.data() == storage);
+  REQUIRE_THAT(B.matrix_data,
+               Catch::Approx(A.hadamard_product(0.5f).matrix_data));
+
+  // shape changes reallocate, temporaries are moved into the expression
+  B = row + A.transpose().transpose();
+  REQUIRE(B.get_num_rows() == 2);
+  REQUIRE_THAT(B.matrix_data, Catch::Approx(A.add(row).matrix_data));
+
+  const Mat2D<float> squared =
+      expr::map(-(A * 1.0f), [](float x) { return x * x; });
+  REQUIRE_THAT(squared.matrix_data,
+               Catch::Approx(A.hadamard_product(A).matrix_data));
+
+  REQUIRE_THROWS(Mat2D<float>(A + Mat2D<float>(3, 3)));
+}
+
+TEST_CASE("Views and in place operators", "view") {
+  auto A = Mat2D<float>(3, 2, {1., 2., 3., 4., 5., 6.});
+  const auto row = Mat2D<float>(1, 2, {10., 100.});
+
+  // views share the memory of the matrix
+  const auto middle = A.row_slice(1, 3);
+  REQUIRE(middle.rows() == 2);
+  REQUIRE(middle(0, 1) == 4.0f);
+  middle(1, 0) = 50.0f;
+  REQUIRE(A(2, 0) == 50.0f);
+  const Mat2D<float> copy = middle;
+  REQUIRE(copy.matrix_data == std::vector<float>({3., 4., 50., 6.}));
+  const Mat2D<float> transposed = A.view().transpose();
+  REQUIRE(transposed.matrix_data == A.transpose().matrix_data);
+  const MatView<const float> read_only = A.row_slice(0, 1);
+  const Mat2D<float> scaled = read_only * 2.0f + row;
+  REQUIRE(scaled.matrix_data == std::vector<float>({12., 104.}));
+  A.row_slice(0, 2).copy_from(Mat2D<float>(2, 2, {-1., -2., -3., -4.}));
+  // column 1 through a transposed view
+  A.view().transpose().row_slice(1, 2).copy_from(
+      Mat2D<float>(1, 3, {10., 100., 0.}));
+  REQUIRE(A.matrix_data == std::vector<float>({-1., 10., -3., 100., 50., 0.}));
+  REQUIRE_THROWS(A.row_slice(2, 4));
+  REQUIRE_THROWS(A.row_slice(0, 1).copy_from(A));
+
+  // compound operators work in place, with broadcasting of the operand
+  auto B = Mat2D<float>(2, 2, {1., 2., 3., 4.});
+  const auto* storage = B.matrix_data.data();
+  B += row;
+  B -= 1.0f;
+  B *= Mat2D<float>(2, 1, {2., -1.});
+  // the operand must not read other elements of B, so copy the row first
+  B /= Mat2D<float>(B.row_slice(0, 1)) * 0.5f;
+  REQUIRE(B.matrix_data.data() == storage);
+  REQUIRE_THAT(B.matrix_data, Catch::Approx(std::vector<float>(
+                                   {2., 2., -12. / 10., -103. / 101.})));
+  auto single_row = row;
+  REQUIRE_THROWS(single_row += B);
+  B.axpy(2.0f, Mat2D<float>(2, 2, {1., 1., 1., 1.}));
+  REQUIRE(B(0, 0) == Approx(4.0f));
+  REQUIRE_THROWS(B.axpy(1.0f, row));
+
+  // negation and elementwise functions leave their operand alone
+  const auto negated = -B;
+  REQUIRE(negated(0, 0) == Approx(-4.0f));
+  REQUIRE(B(0, 0) == Approx(4.0f));
+  B.elementwise_operation([](float x) { return x * 0.0f; });
+  REQUIRE(B(0, 0) == Approx(4.0f));
+  B.elementwise_operation_in_place([](float x) { return x * 0.0f; });
+  REQUIRE(B.reduce_sum() == 0.0f);
+
+  // moving hands over the buffer
+  const auto moved = std::move(B);
+  REQUIRE(moved.matrix_data.data() == storage);
+}
+
+TEST_CASE("Deterministic mode matches the single threaded run", "parallel") {
+  parallel::set_deterministic(true);
+  // big enough to be split up by the GEMM, elementwise and reduction kernels
+  const auto input = Mat2D<float>(256, 784, RANDOM_UNIFORM);
+  auto target = Mat2D<float>(256, 10);
+  for (size_t row = 0; row < 256; ++row) {
+    target(row, row % 10) = 1.0f;
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  const auto long_vec = Mat2D<float>(1, 100000, RANDOM_UNIFORM);
+
+  std::vector<std::vector<float>> results;
+  for (const size_t num_threads : {1, 4}) {
+    auto mlp = MLP({64}, 784, 10, RANDOM_UNIFORM, ZEROS, num_threads);
+    REQUIRE(parallel::num_threads() == num_threads);
+    std::vector<float> result;
+    for (size_t step = 0; step < 3; ++step) {
+      result.push_back(mlp.train(input, target, loss_obj, 0.1f));
+    }
+    const auto activations = mlp.forward(input);
+    result.insert(result.end(), activations.back().matrix_data.begin(),
+                  activations.back().matrix_data.end());
+    result.push_back(long_vec.reduce_sum());
+    results.push_back(result);
+  }
+  REQUIRE(results[0] == results[1]);
+
+  parallel::set_deterministic(false);
+  parallel::set_num_threads(1);
+}
+
+TEST_CASE("Thread pool covers the range once", "parallel") {
+  parallel::ThreadPool pool(3);
+  std::vector<int> hits(1000, 0);
+  std::atomic<bool> aligned{true};
+  pool.parallel_for(hits.size(), 7, [&](size_t begin, size_t end) {
+    // Catch2 assertions are not thread safe
+    aligned = aligned && begin % 7 == 0;
+    for (size_t idx = begin; idx < end; ++idx) {
+      hits[idx]++;
+    }
+    // nested calls run inline
+    pool.parallel_for(10, 1, [](size_t, size_t) {});
+  });
+  REQUIRE(aligned);
+  REQUIRE(hits == std::vector<int>(1000, 1));
+}
+
+TEST_CASE("Data parallel training matches single worker training",
+          "parallel") {
+  // 50 rows do not split evenly across the workers
+  const auto input = Mat2D<float>(50, 20, RANDOM_UNIFORM);
+  auto target = Mat2D<float>(50, 4);
+  for (size_t row = 0; row < 50; ++row) {
+    target(row, row % 4) = 1.0f;
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  // both start from the same (default seeded) weights
+  auto reference = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 4);
+  auto data_parallel = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 4);
+
+  for (size_t step = 0; step < 5; ++step) {
+    const float loss = reference.train(input, target, loss_obj, 0.1f);
+    // a train() call in between refreshes the worker copies
+    const float parallel_loss =
+        step == 2 ? data_parallel.train(input, target, loss_obj, 0.1f)
+                  : data_parallel.train_data_parallel(input, target, loss_obj,
+                                                      0.1f, 3);
+    REQUIRE(parallel_loss == Approx(loss).epsilon(1e-4));
+  }
+  const auto expected = reference.forward(input).back();
+  const auto actual = data_parallel.forward(input).back();
+  for (size_t idx = 0; idx < expected.matrix_data.size(); ++idx) {
+    REQUIRE(actual.matrix_data[idx] ==
+            Approx(expected.matrix_data[idx]).epsilon(1e-4).margin(1e-5));
+  }
+
+  parallel::set_num_threads(1);
+}
+
+TEST_CASE("Training steps do not allocate after the first one",
+          "workspace") {
+  const auto input = Mat2D<float>(32, 20, RANDOM_UNIFORM);
+  auto target = Mat2D<float>(32, 4);
+  auto target_classes = Mat2D<int32_t>(32, 1);
+  for (size_t row = 0; row < 32; ++row) {
+    target(row, row % 4) = 1.0f;
+    target_classes(row, 0) = static_cast<int32_t>(row % 4);
+  }
+  // a smaller last batch fits into the buffers of the full ones
+  const auto small_input = Mat2D<float>(
+      8, 20, std::vector<float>(input.matrix_data.begin(),
+                                input.matrix_data.begin() + 8 * 20));
+  const auto small_target = Mat2D<float>(
+      8, 4, std::vector<float>(target.matrix_data.begin(),
+                               target.matrix_data.begin() + 8 * 4));
+  const auto cross_entropy = SoftmaxCrossEntropyWithLogitsLoss();
+  const auto mse = MSELoss();
+  auto mlp = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+  AdamOptimizer adam(0.01f);
+  SGDOptimizer momentum(0.01f, 0.9f);
+
+  auto micro_batched = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+  micro_batched.set_micro_batch_size(12);
+
+  float first_loss = mlp.train(input, target, cross_entropy, adam);
+  mlp.train(input, target, mse, momentum);
+  mlp.train(input, target_classes, mse, momentum);
+  micro_batched.train(input, target, cross_entropy, momentum);
+  micro_batched.train(input, target_classes, cross_entropy, momentum);
+  const size_t allocations = num_allocations;
+  float loss = first_loss;
+  for (size_t step = 0; step < 5; ++step) {
+    loss = mlp.train(input, target, cross_entropy, adam);
+    mlp.train(small_input, small_target, cross_entropy, adam);
+    mlp.train(input, target, mse, momentum);
+    mlp.train(input, target, cross_entropy, 0.01f);
+    mlp.train(input, target_classes, cross_entropy, adam);
+    mlp.train(input, target_classes, mse, momentum);
+    micro_batched.train(input, target, cross_entropy, momentum);
+    micro_batched.train(input, target_classes, cross_entropy, momentum);
+  }
+  REQUIRE(num_allocations == allocations);
+  REQUIRE(loss < first_loss);
+}
+
+template <size_t Batch, typename Network>
+void require_static_forward_matches(const Network& network, const MLP& mlp,
+                                    const Mat2D<float>& input) {
+  const auto rows = input.row_slice(0, Batch);
+  const auto expected = mlp.forward(rows).back();
+  std::vector<float> logits(Batch * Network::num_outputs);
+  network.template forward<Batch>(input.matrix_data.data(), logits.data());
+  REQUIRE_THAT(logits, Catch::Approx(expected.matrix_data).margin(1.e-4));
+}
+
+TEST_CASE("StaticMLP matches MLP", "static_mlp") {
+  // 300 neurons need several column blocks on the narrower ISAs, the
+  // batches several row blocks plus a remainder
+  const auto input = Mat2D<float>(16, 30, RANDOM_UNIFORM);
+  auto target_classes = Mat2D<int32_t>(16, 1);
+  for (size_t row = 0; row < 16; ++row) {
+    target_classes(row, 0) = static_cast<int32_t>(row % 4);
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  AdamOptimizer adam(0.01f);
+  auto mlp = MLP({300, 7}, 30, 4, RANDOM_UNIFORM, RANDOM_UNIFORM, 1);
+  // a few steps, so no bias is still zero
+  for (size_t step = 0; step < 3; ++step) {
+    mlp.train(input, target_classes, loss_obj, adam);
+  }
+  const auto network = std::make_unique<StaticMLP<30, 300, 7, 4>>(mlp);
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    require_static_forward_matches<1>(*network, mlp, input);
+    require_static_forward_matches<3>(*network, mlp, input);
+    require_static_forward_matches<16>(*network, mlp, input);
+    const auto logits = mlp.forward(input.row_slice(0, 1)).back();
+    REQUIRE(network->predict(input.matrix_data.data()) ==
+            logits.argmax(1)(0, 0));
+  }
+  cpu::reset_isa();
+
+  REQUIRE_THROWS(StaticMLP<30, 300, 4>(mlp));
+  REQUIRE_THROWS(StaticMLP<30, 300, 8, 4>(mlp));
+}
+
+TEST_CASE("Inference sessions share one model across threads", "inference") {
+  const auto input = Mat2D<float>(16, 30, RANDOM_UNIFORM);
+  const auto mlp = MLP({40, 7}, 30, 4, RANDOM_UNIFORM, RANDOM_UNIFORM, 1);
+  const auto expected = mlp.forward(input).back();
+  const auto expected_classes = mlp.predict(input);
+
+  InferenceSession batch_session(mlp, 16);
+  REQUIRE(batch_session.num_inputs() == 30);
+  REQUIRE(batch_session.num_outputs() == 4);
+  REQUIRE_THAT(batch_session.logits(input).matrix_data,
+               Catch::Approx(expected.matrix_data).margin(1.e-5));
+  REQUIRE(batch_session.predict(input).matrix_data ==
+          expected_classes.matrix_data);
+  REQUIRE_THROWS(batch_session.logits(Mat2D<float>(1, 31)));
+
+  // every thread scores all samples one at a time with its own session
+  constexpr size_t num_threads = 4;
+  std::vector<std::vector<float>> logits(num_threads);
+  std::vector<std::vector<size_t>> classes(num_threads);
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < num_threads; ++thread) {
+    threads.emplace_back([&, thread]() {
+      InferenceSession session(mlp);
+      for (size_t repeat = 0; repeat < 50; ++repeat) {
+        logits[thread].clear();
+        classes[thread].clear();
+        for (size_t row = 0; row < input.get_num_rows(); ++row) {
+          const float* sample = input.matrix_data.data() + row * 30;
+          const auto& sample_logits = session.logits(sample).matrix_data;
+          logits[thread].insert(logits[thread].end(), sample_logits.begin(),
+                                sample_logits.end());
+          classes[thread].push_back(session.predict(sample));
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t thread = 0; thread < num_threads; ++thread) {
+    REQUIRE_THAT(logits[thread],
+                 Catch::Approx(expected.matrix_data).margin(1.e-5));
+    REQUIRE(classes[thread] == expected_classes.matrix_data);
+  }
+}
+
+TEST_CASE("Profile scopes add up per layer", "profile") {
+  const auto input = Mat2D<float>(32, 20, RANDOM_UNIFORM);
+  auto target = Mat2D<int32_t>(32, 1);
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  auto mlp = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+  AdamOptimizer optimizer(0.01f);
+  profile::reset();
+  for (size_t step = 0; step < 3; ++step) {
+    mlp.train(input, target, loss_obj, optimizer);
+  }
+  const auto regions = profile::summary();
+  if constexpr (!profile::enabled) {
+    REQUIRE(regions.empty());
+    return;
+  }
+  // the enclosing region comes first
+  REQUIRE(regions.front().name == "train step");
+  REQUIRE(regions.front().calls == 3);
+  // the first step sizes the workspace, counted through the operator new
+  // of the tests
+  REQUIRE(regions.front().bytes_allocated > 0);
+  const std::vector<size_t> sizes = {20, 16, 8, 4};
+  for (const std::string name : {"forward", "backward"}) {
+    for (int32_t layer_idx = 0; layer_idx < 3; ++layer_idx) {
+      const auto region = std::find_if(
+          regions.begin(), regions.end(), [&](const profile::Region& region) {
+            return region.name == name && region.index == layer_idx;
+          });
+      REQUIRE(region != regions.end());
+      REQUIRE(region->calls == 3);
+      REQUIRE(region->seconds > 0.0);
+      const double flops =
+          3 * 2.0 * 32 * sizes[layer_idx] * sizes[layer_idx + 1];
+      REQUIRE(region->flops == Approx(name == "forward" ? flops : 2 * flops));
+    }
+  }
+
+  const std::string trace_path =
+      (std::filesystem::temp_directory_path() / "mlp_test_trace.json")
+          .string();
+  profile::write_chrome_trace(trace_path);
+  std::ifstream file(trace_path);
+  const std::string trace((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+  REQUIRE(trace.rfind("{\"traceEvents\": [", 0) == 0);
+  REQUIRE(trace.find("\"name\": \"layer 2 backward\"") != std::string::npos);
+  std::remove(trace_path.c_str());
+  profile::reset();
+}
+
+// Temporary files write_file_atomically left next to path.
+size_t leftover_temp_files(const std::string& path) {
+  const std::filesystem::path file(path);
+  const std::string prefix = file.filename().string() + ".tmp";
+  size_t count = 0;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(file.parent_path())) {
+    count += entry.path().filename().string().rfind(prefix, 0) == 0;
+  }
+  return count;
+}
+
+TEST_CASE("Model files round trip", "model_file") {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string model_path = (dir / "mlp_test_model.bin").string();
+  const std::string broken_path = (dir / "mlp_test_broken.bin").string();
+
+  const auto input = Mat2D<float>(8, 30, RANDOM_UNIFORM);
+  const auto mlp = MLP({40, 7}, 30, 4, RANDOM_UNIFORM, RANDOM_UNIFORM, 1);
+  const auto expected = mlp.forward(input).back();
+  mlp.save(model_path);
+  REQUIRE(leftover_temp_files(model_path) == 0);
+  // so do concurrent saves to one path
+  {
+    std::atomic<size_t> failures{0};
+    std::vector<std::thread> writers;
+    for (size_t writer = 0; writer < 4; ++writer) {
+      writers.emplace_back([&]() {
+        for (size_t run = 0; run < 5; ++run) {
+          try {
+            mlp.save(model_path);
+          } catch (const std::runtime_error&) {
+            ++failures;
+          }
+        }
+      });
+    }
+    for (auto& writer : writers) {
+      writer.join();
+    }
+    REQUIRE(failures == 0);
+    REQUIRE(leftover_temp_files(model_path) == 0);
+  }
+
+  const auto loaded = MLP::load(model_path);
+  const auto variables = mlp.trainable_variables();
+  const auto loaded_variables = loaded.trainable_variables();
+  REQUIRE(loaded_variables.size() == variables.size());
+  for (size_t idx = 0; idx < variables.size(); ++idx) {
+    REQUIRE(loaded_variables[idx]->get_num_rows() ==
+            variables[idx]->get_num_rows());
+    REQUIRE(loaded_variables[idx]->matrix_data ==
+            variables[idx]->matrix_data);
+  }
+  REQUIRE(loaded.forward(input).back().matrix_data == expected.matrix_data);
+
+  {
+    const ModelFile model(model_path);
+    REQUIRE(model.layers().size() == 3);
+    for (const auto& layer : model.layers()) {
+      REQUIRE(reinterpret_cast<uintptr_t>(layer.weights.data()) % 64 == 0);
+      REQUIRE(reinterpret_cast<uintptr_t>(layer.biases.data()) % 64 == 0);
+    }
+    REQUIRE(model.layers()[1].activation == simd::Activation::LEAKY_RELU);
+    REQUIRE(model.layers()[2].activation == simd::Activation::NONE);
+    InferenceSession session(model, 8);
+    REQUIRE(session.logits(input).matrix_data == expected.matrix_data);
+  }
+
+  // other activations can be stored and run, but are no MLP
+  FusedDenseLayer sigmoid(30, 5, simd::Activation::SIGMOID, 0.0f,
+                          RANDOM_UNIFORM, RANDOM_UNIFORM);
+  write_model_file({sigmoid.view()}, broken_path);
+  {
+    const ModelFile model(broken_path);
+    InferenceSession session(model, 8);
+    REQUIRE_THAT(session.logits(input).matrix_data,
+                 Catch::Approx(sigmoid.forward(input).matrix_data)
+                     .margin(1.e-6));
+  }
+  REQUIRE_THROWS(MLP::load(broken_path));
+
+  std::vector<char> bytes;
+  {
+    std::ifstream file(model_path, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(file), {});
+  }
+  REQUIRE(bytes.size() % 64 == 0);
+  const auto write_broken = [&](const std::vector<char>& content) {
+    std::ofstream out(broken_path, std::ios::binary);
+    out.write(content.data(), content.size());
+  };
+  write_broken({bytes.begin(), bytes.end() - 64});
+  REQUIRE_THROWS(ModelFile(broken_path));
+  auto other_version = bytes;
+  other_version[8] = 2;
+  write_broken(other_version);
+  REQUIRE_THROWS(ModelFile(broken_path));
+  auto other_magic = bytes;
+  other_magic[0] = 'X';
+  write_broken(other_magic);
+  REQUIRE_THROWS(ModelFile(broken_path));
+
+  std::remove(model_path.c_str());
+  std::remove(broken_path.c_str());
+}
+
+TEST_CASE("int8 GEMM matches an integer reference on every ISA",
+          "quantization") {
+  // the last two shapes are split over columns resp. rows between threads,
+  // 784 inputs sum up to beyond the 24 bit float mantissa
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {1, 9, 77},    {5, 300, 70},   {1, 784, 50},
+      {33, 30, 40},  {64, 300, 100}, {300, 100, 20}};
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  parallel::set_num_threads(4);
+  for (const auto& [m, k, n] : shapes) {
+    std::vector<uint8_t> a(m * gemm::int8_depth(k));
+    std::vector<int8_t> b(k * n);
+    std::vector<float> scale(gemm::int8_width(n));
+    std::vector<float> offset(gemm::int8_width(n));
+    for (auto& value : a) {
+      value = static_cast<uint8_t>(byte(generator));
+    }
+    for (auto& value : b) {
+      value = static_cast<int8_t>(byte(generator) - 128);
+    }
+    for (size_t j = 0; j < n; ++j) {
+      scale[j] = 1.e-4f * uniform(generator);
+      offset[j] = uniform(generator);
+    }
+    std::vector<int8_t> packed(gemm::int8_packed_size(k, n));
+    gemm::pack_int8(k, n, b.data(), packed.data());
+
+    for (const auto activation :
+         {simd::Activation::NONE, simd::Activation::LEAKY_RELU}) {
+      std::vector<float> expected(m * n);
+      for (size_t i = 0; i < m; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+          int32_t sum = 0;
+          for (size_t p = 0; p < k; ++p) {
+            sum += a[i * gemm::int8_depth(k) + p] * b[p * n + j];
+          }
+          const float y = static_cast<float>(sum) * scale[j] + offset[j];
+          expected[i * n + j] =
+              activation == simd::Activation::NONE || y > 0.0f ? y
+                                                                : 0.1f * y;
+        }
+      }
+      for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                             cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+        if (!cpu::isa_supported(isa)) {
+          continue;
+        }
+        INFO("ISA: " << cpu::isa_name(isa) << ", shape: " << m << " x " << k
+                     << " x " << n);
+        cpu::force_isa(isa);
+        std::vector<float> c(m * n);
+        gemm::matmul_u8s8(m, n, k, a.data(), packed.data(), scale.data(),
+                          offset.data(), activation, 0.1f, c.data());
+        REQUIRE_THAT(c, Catch::Approx(expected).epsilon(1.e-5).margin(1.e-6));
+      }
+      cpu::reset_isa();
+    }
+  }
+  parallel::set_num_threads(1);
+
+  // round to nearest, clamped to the range
+  const float x[5] = {-1.0f, 0.0f, 0.26f, 0.74f, 200.0f};
+  uint8_t quantized[8];
+  gemm::quantize_u8(1, 5, x, 0.5f, 2, quantized);
+  REQUIRE(std::vector<uint8_t>(quantized, quantized + 5) ==
+          std::vector<uint8_t>{0, 2, 3, 3, 255});
+}
+
+TEST_CASE("Quantized MLP stays close to the float model", "quantization") {
+  std::mt19937 generator(7);
+  std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+  auto calibration = Mat2D<float>(256, 30);
+  auto input = Mat2D<float>(32, 30);
+  for (auto* samples : {&calibration, &input}) {
+    for (auto& value : samples->matrix_data) {
+      value = uniform(generator);
+    }
+  }
+  const auto mlp = MLP({40, 7}, 30, 4, RANDOM_UNIFORM, RANDOM_UNIFORM, 1);
+  const auto expected = mlp.forward(input).back();
+  const float largest_logit = std::abs(*std::max_element(
+      expected.matrix_data.begin(), expected.matrix_data.end(),
+      [](float a, float b) { return std::abs(a) < std::abs(b); }));
+
+  const QuantizedMLP quantized(mlp, calibration);
+  REQUIRE(quantized.layers().size() == 3);
+  REQUIRE(quantized.layers()[0].input_zero_point > 0);
+  cpu::force_isa(cpu::Isa::SCALAR);
+  const auto scalar_logits = InferenceSession(quantized, 32).logits(input);
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    InferenceSession session(quantized, 32);
+    const auto& logits = session.logits(input);
+    REQUIRE_THAT(logits.matrix_data,
+                 Catch::Approx(expected.matrix_data)
+                     .margin(0.02f * largest_logit));
+    REQUIRE_THAT(logits.matrix_data,
+                 Catch::Approx(scalar_logits.matrix_data).margin(1.e-6));
+    // single samples take the same path
+    const auto& sample_logits = session.logits(input.matrix_data.data());
+    REQUIRE_THAT(sample_logits.matrix_data,
+                 Catch::Approx(std::vector<float>(
+                                   scalar_logits.matrix_data.begin(),
+                                   scalar_logits.matrix_data.begin() + 4))
+                     .margin(1.e-6));
+  }
+  cpu::reset_isa();
+  REQUIRE_THROWS(QuantizedMLP(mlp, Mat2D<float>(4, 31)));
+}
+
+// Values of a 16 bit format as float, e.g. as reference for the mixed
+// precision kernels.
+template <typename Half>
+Mat2D<float> widened(const Mat2D<Half>& half) {
+  Mat2D<float> result(0, 0);
+  convert_into(half, result);
+  return result;
+}
+
+template <typename Half>
+void check_half_kernels(const std::string& format) {
+  using gemm::Transpose;
+  // round to nearest even, the largest finite values, NaN and subnormals
+  const std::vector<float> edge_cases = {
+      0.0f,    -0.0f,     1.0f,     -2.5f,     1.0f / 3.0f,
+      65504.f, 65520.f,   1.e30f,   3.4e38f,   -INFINITY,
+      NAN,     1.e-5f,    -3.e-8f,  6.1e-5f,   1.e-40f};
+  const auto random = Mat2D<float>(1, 1001, RANDOM_UNIFORM);
+  std::vector<float> values = edge_cases;
+  values.insert(values.end(), random.matrix_data.begin(),
+                random.matrix_data.end());
+  std::vector<Half> expected;
+  for (const float value : values) {
+    expected.push_back(Half(value));
+  }
+
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {1, 9, 77}, {1, 300, 100}, {17, 33, 9}, {130, 300, 70}};
+  const auto grad_out = Mat2D<float>(7, 37, RANDOM_UNIFORM);
+  const auto out = Mat2D<float>(7, 37, RANDOM_UNIFORM);
+  Mat2D<Half> half_out(0, 0);
+  convert_into(out, half_out);
+  parallel::set_num_threads(4);
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("Format: " << format << ", ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    std::vector<Half> rounded(values.size());
+    simd::convert(values.size(), values.data(), rounded.data());
+    std::vector<float> back(values.size());
+    simd::convert(values.size(), rounded.data(), back.data());
+    for (size_t idx = 0; idx < values.size(); ++idx) {
+      INFO("Value: " << values[idx]);
+      REQUIRE(rounded[idx].bits == expected[idx].bits);
+      REQUIRE((std::isnan(back[idx]) ? std::isnan(values[idx])
+                                     : back[idx] == float(expected[idx])));
+    }
+
+    // the same sums as float GEMMs of the widened operands
+    for (const auto& [m, k, n] : shapes) {
+      INFO("Shape: " << m << " x " << k << " x " << n);
+      Mat2D<Half> a(0, 0);
+      Mat2D<Half> b(0, 0);
+      convert_into(Mat2D<float>(m, k, RANDOM_UNIFORM), a);
+      convert_into(Mat2D<float>(k, n, RANDOM_UNIFORM), b);
+      const auto a_t = widened(a).transpose();
+      Mat2D<Half> half_a_t(0, 0);
+      convert_into(a_t, half_a_t);
+      const auto C_0 = Mat2D<float>(m, n, RANDOM_UNIFORM);
+      Mat2D<float> expected_c = C_0;
+      gemm::gemm(Transpose::NO, Transpose::NO, 0.5f, widened(a), widened(b),
+                 2.0f, expected_c);
+
+      Mat2D<float> c = C_0;
+      gemm::gemm(Transpose::NO, Transpose::NO, 0.5f, a, b, 2.0f, c);
+      REQUIRE_THAT(c.matrix_data,
+                   Catch::Approx(expected_c.matrix_data).margin(1.e-5));
+      c = C_0;
+      gemm::gemm(Transpose::YES, Transpose::NO, 0.5f, half_a_t, widened(b),
+                 2.0f, c);
+      REQUIRE_THAT(c.matrix_data,
+                   Catch::Approx(expected_c.matrix_data).margin(1.e-5));
+      Mat2D<Half> half_b_t(0, 0);
+      convert_into(widened(b).transpose(), half_b_t);
+      c = C_0;
+      gemm::gemm(Transpose::NO, Transpose::YES, 0.5f, widened(a), half_b_t,
+                 2.0f, c);
+      REQUIRE_THAT(c.matrix_data,
+                   Catch::Approx(expected_c.matrix_data).margin(1.e-5));
+
+      const auto bias = Mat2D<float>(1, n, RANDOM_UNIFORM);
+      std::vector<float> expected_y(m * n);
+      gemm::matmul_bias_activation(
+          m, n, k, widened(a).matrix_data.data(),
+          widened(b).matrix_data.data(), bias.matrix_data.data(),
+          simd::Activation::LEAKY_RELU, 0.1f, expected_y.data());
+      std::vector<float> y(m * n);
+      gemm::matmul_bias_activation(m, n, k, a.matrix_data.data(),
+                                   b.matrix_data.data(),
+                                   bias.matrix_data.data(),
+                                   simd::Activation::LEAKY_RELU, 0.1f,
+                                   y.data());
+      REQUIRE_THAT(y, Catch::Approx(expected_y).margin(1.e-5));
+    }
+
+    // the output kept for the backward pass is widened while it is read
+    const auto widened_out = widened(half_out);
+    for (const auto activation :
+         {simd::Activation::LEAKY_RELU, simd::Activation::SIGMOID}) {
+      std::vector<float> expected_grad_z(7 * 37);
+      std::vector<float> expected_bias_grad(37);
+      simd::activation_backward(
+          activation, 7, 37, widened_out.matrix_data.data(),
+          grad_out.matrix_data.data(), 0.1f, expected_grad_z.data(),
+          expected_bias_grad.data());
+      std::vector<float> grad_z(7 * 37);
+      std::vector<float> bias_grad(37);
+      simd::activation_backward(activation, 7, 37,
+                                half_out.matrix_data.data(),
+                                grad_out.matrix_data.data(), 0.1f,
+                                grad_z.data(), bias_grad.data());
+      REQUIRE_THAT(grad_z, Catch::Approx(expected_grad_z).margin(1.e-6));
+      REQUIRE_THAT(bias_grad,
+                   Catch::Approx(expected_bias_grad).margin(1.e-5));
+    }
+  }
+  cpu::reset_isa();
+  parallel::set_num_threads(1);
+}
+
+TEST_CASE("16 bit formats round and widen on every ISA", "half") {
+  // exactly halfway cases round to the even neighbour
+  REQUIRE(bfloat16(1.0f + 0x1p-8f).bits == 0x3f80);
+  REQUIRE(bfloat16(1.0f + 0x3p-8f).bits == 0x3f82);
+  REQUIRE(float16(1.0f + 0x1p-11f).bits == 0x3c00);
+  REQUIRE(float16(1.0f + 0x3p-11f).bits == 0x3c02);
+  // 65520 is halfway to 2^16 and rounds to infinity
+  REQUIRE(float16(65504.0f).bits == 0x7bff);
+  REQUIRE(float16(65520.0f).bits == 0x7c00);
+  REQUIRE(float(float16(0x1p-24f)) == 0x1p-24f);
+  REQUIRE(float16(0x1p-26f).bits == 0);
+  REQUIRE(std::isnan(float(bfloat16(NAN))));
+  REQUIRE(std::isnan(float(float16(NAN))));
+  REQUIRE(float(bfloat16(-INFINITY)) == -INFINITY);
+
+  check_half_kernels<bfloat16>("bfloat16");
+  check_half_kernels<float16>("float16");
+}
+
+TEST_CASE("Mixed precision training stays close to FP32 training", "half") {
+  const auto input = Mat2D<float>(64, 20, RANDOM_UNIFORM);
+  // the largest of the first four inputs, so there is something to learn
+  auto target = Mat2D<int32_t>(64, 1);
+  for (size_t row = 0; row < 64; ++row) {
+    for (size_t col = 1; col < 4; ++col) {
+      target(row, 0) = input(row, col) > input(row, target(row, 0))
+                           ? static_cast<int32_t>(col)
+                           : target(row, 0);
+    }
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  // all start from the same (default seeded) weights
+  auto reference = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+  AdamOptimizer reference_optimizer(0.03f);
+  std::vector<float> reference_losses;
+  for (size_t step = 0; step < 40; ++step) {
+    reference_losses.push_back(
+        reference.train(input, target, loss_obj, reference_optimizer));
+  }
+  REQUIRE(reference_losses.back() < 0.5f * reference_losses.front());
+  const auto expected = reference.predict(input);
+  const auto count_equal = [](const Mat2D<size_t>& a,
+                              const Mat2D<size_t>& b) {
+    size_t count = 0;
+    for (size_t idx = 0; idx < a.matrix_data.size(); ++idx) {
+      count += a.matrix_data[idx] == b.matrix_data[idx];
+    }
+    return count;
+  };
+
+  for (const auto precision : {Precision::BF16, Precision::FP16}) {
+    INFO("Precision: " << (precision == Precision::BF16 ? "BF16" : "FP16"));
+    auto mlp = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+    mlp.set_precision(precision);
+    REQUIRE(mlp.get_precision() == precision);
+    AdamOptimizer optimizer(0.03f);
+    for (size_t step = 0; step < 40; ++step) {
+      const float loss = mlp.train(input, target, loss_obj, optimizer);
+      REQUIRE(loss == Approx(reference_losses[step]).epsilon(0.05));
+    }
+    // forward and predict multiply with the rounded weights
+    const auto predictions = mlp.predict(input);
+    REQUIRE(count_equal(predictions, expected) >= 60);
+    // the float master weights take over again
+    mlp.set_precision(Precision::FP32);
+    REQUIRE(mlp.get_precision() == Precision::FP32);
+    REQUIRE(count_equal(mlp.predict(input), expected) >= 60);
+  }
+
+  // a NaN input shows up in the dumped hidden activations, which mixed
+  // precision keeps in 16 bits
+  auto mlp = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+  mlp.set_precision(Precision::BF16);
+  auto nan_input = input;
+  nan_input(0, 0) = NAN;
+  SGDOptimizer optimizer(0.01f);
+  std::stringstream dump;
+  auto* const cout_buffer = std::cout.rdbuf(dump.rdbuf());
+  REQUIRE_THROWS_AS(mlp.train(nan_input, target, loss_obj, optimizer),
+                    std::runtime_error);
+  std::cout.rdbuf(cout_buffer);
+  const std::string text = dump.str();
+  const size_t first = text.find("Layer: 1 activation:");
+  const size_t end = text.find("Layer: 1 trainable variables:");
+  REQUIRE(first != std::string::npos);
+  REQUIRE(text.substr(first, end - first).find("nan") != std::string::npos);
+}
+
+// rows x cols of background with about density of the entries set to
+// background + [0, 1), like MNIST images
+Mat2D<float> mostly_background(const size_t rows, const size_t cols,
+                               const float density, const float background,
+                               std::mt19937& generator) {
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  Mat2D<float> result(rows, cols);
+  for (auto& value : result.matrix_data) {
+    value = uniform(generator) < density
+                ? background + 1.0f - uniform(generator)
+                : background;
+  }
+  return result;
+}
+
+TEST_CASE("Sparse matrices and products on every ISA", "sparse") {
+  std::mt19937 generator(5);
+  // more rows resp. more columns than the other side, split between threads
+  // along that side
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {1, 9, 77}, {7, 37, 3}, {64, 784, 50}, {784, 64, 50}, {5, 300, 400}};
+  parallel::set_num_threads(4);
+  for (const auto& [m, k, n] : shapes) {
+    INFO("Shape: " << m << " x " << k << " x " << n);
+    const auto x = mostly_background(m, k, 0.2f, -0.5f, generator);
+    CsrMatrix csr;
+    REQUIRE_FALSE(to_sparse(x, 0.05f, csr));
+    REQUIRE(to_sparse(x, 0.5f, csr));
+    REQUIRE(csr.background == -0.5f);
+    REQUIRE(csr.density() < 0.5f);
+    REQUIRE_THAT(to_dense(csr).matrix_data,
+                 Catch::Approx(x.matrix_data).margin(1.e-6));
+    CsrMatrix csr_t;
+    transpose_into(csr, csr_t);
+    REQUIRE(csr_t.row_offsets.size() == k + 1);
+    REQUIRE_THAT(to_dense(csr_t).matrix_data,
+                 Catch::Approx(x.transpose().matrix_data).margin(1.e-6));
+
+    // the products of the stored values, without the background
+    const Mat2D<float> s = x + 0.5f;
+    const auto b = Mat2D<float>(k, n, RANDOM_UNIFORM);
+    const auto bias = Mat2D<float>(1, n, RANDOM_UNIFORM);
+    std::vector<float> expected(m * n);
+    gemm::matmul_bias_activation(m, n, k, s.matrix_data.data(),
+                                 b.matrix_data.data(), bias.matrix_data.data(),
+                                 simd::Activation::LEAKY_RELU, 0.1f,
+                                 expected.data());
+    for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                           cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+      if (!cpu::isa_supported(isa)) {
+        continue;
+      }
+      INFO("ISA: " << cpu::isa_name(isa));
+      cpu::force_isa(isa);
+      std::vector<float> c(m * n);
+      gemm::sparse_matmul_bias_activation(
+          m, n, csr.row_offsets.data(), csr.col_indices.data(),
+          csr.values.data(), b.matrix_data.data(), bias.matrix_data.data(),
+          simd::Activation::LEAKY_RELU, 0.1f, c.data());
+      REQUIRE_THAT(c, Catch::Approx(expected).margin(1.e-4));
+    }
+    cpu::reset_isa();
+  }
+  parallel::set_num_threads(1);
+
+  // rows without any stored entry hold the activated bias
+  const auto empty_rows = Mat2D<float>(3, 20);
+  CsrMatrix csr;
+  REQUIRE(to_sparse(empty_rows, 0.0f, csr));
+  REQUIRE(csr.values.empty());
+  std::vector<float> c(3 * 2);
+  const float bias[2] = {-1.0f, 2.0f};
+  gemm::sparse_matmul_bias_activation(
+      3, 2, csr.row_offsets.data(), csr.col_indices.data(),
+      csr.values.data(), Mat2D<float>(20, 2).matrix_data.data(), bias,
+      simd::Activation::LEAKY_RELU, 0.1f, c.data());
+  REQUIRE_THAT(c, Catch::Approx(std::vector<float>{-0.1f, 2.0f, -0.1f, 2.0f,
+                                                   -0.1f, 2.0f}));
+}
+
+TEST_CASE("Sparse input path matches dense training", "sparse") {
+  std::mt19937 generator(11);
+  const auto input = mostly_background(50, 40, 0.2f, -0.5f, generator);
+  auto target = Mat2D<int32_t>(50, 1);
+  for (size_t row = 0; row < 50; ++row) {
+    target(row, 0) = static_cast<int32_t>(row % 4);
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  // both start from the same (default seeded) weights
+  auto dense = MLP({16, 8}, 40, 4, RANDOM_UNIFORM, ZEROS, 1);
+  dense.set_max_input_density(0.0f);
+  auto sparse = MLP({16, 8}, 40, 4, RANDOM_UNIFORM, ZEROS, 1);
+  AdamOptimizer dense_optimizer(0.01f);
+  AdamOptimizer sparse_optimizer(0.01f);
+  for (size_t step = 0; step < 5; ++step) {
+    const float loss = dense.train(input, target, loss_obj, dense_optimizer);
+    REQUIRE(sparse.train(input, target, loss_obj, sparse_optimizer) ==
+            Approx(loss).epsilon(1e-5));
+  }
+  const auto dense_variables = dense.trainable_variables();
+  const auto sparse_variables = sparse.trainable_variables();
+  for (size_t idx = 0; idx < dense_variables.size(); ++idx) {
+    REQUIRE_THAT(sparse_variables[idx]->matrix_data,
+                 Catch::Approx(dense_variables[idx]->matrix_data)
+                     .margin(1.e-5));
+  }
+
+  // the background is folded into the bias of the first layer
+  auto layer = FusedDenseLayer(40, 16, simd::Activation::LEAKY_RELU, 0.1f,
+                               RANDOM_UNIFORM, RANDOM_UNIFORM);
+  CsrMatrix csr;
+  REQUIRE(to_sparse(input, 0.3f, csr));
+  Mat2D<float> output(0, 0);
+  layer.forward_sparse_into(csr, output);
+  REQUIRE_THAT(output.matrix_data,
+               Catch::Approx(layer.forward(input).matrix_data).margin(1.e-5));
+  layer.set_precision(Precision::BF16);
+  REQUIRE_THROWS(layer.forward_sparse_into(csr, output));
+}
+
+TEST_CASE("Checkpointing recomputes the same training steps", "checkpoint") {
+  std::mt19937 generator(5);
+  const auto dense_input = Mat2D<float>(24, 12, RANDOM_UNIFORM);
+  const auto sparse_input = mostly_background(24, 12, 0.2f, -0.5f, generator);
+  auto target = Mat2D<int32_t>(24, 1);
+  for (size_t row = 0; row < 24; ++row) {
+    target(row, 0) = static_cast<int32_t>(row % 3);
+  }
+  const auto loss_obj = SoftmaxCrossEntropyWithLogitsLoss();
+  // eight layers, so the last segment is incomplete for some intervals
+  const std::vector<size_t> hidden(7, 16);
+  for (const auto* input : {&dense_input, &sparse_input}) {
+    for (const size_t interval : {2, 3, 4, 8, 20}) {
+      auto reference = MLP(hidden, 12, 3, RANDOM_UNIFORM, ZEROS, 1);
+      auto checkpointed = MLP(hidden, 12, 3, RANDOM_UNIFORM, ZEROS, 1);
+      checkpointed.set_checkpoint_interval(interval);
+      AdamOptimizer reference_optimizer(0.01f);
+      AdamOptimizer checkpointed_optimizer(0.01f);
+      for (size_t step = 0; step < 3; ++step) {
+        const float loss =
+            reference.train(*input, target, loss_obj, reference_optimizer);
+        REQUIRE(checkpointed.train(*input, target, loss_obj,
+                                   checkpointed_optimizer) == loss);
+      }
+      const auto expected = reference.trainable_variables();
+      const auto actual = checkpointed.trainable_variables();
+      for (size_t idx = 0; idx < expected.size(); ++idx) {
+        REQUIRE(actual[idx]->matrix_data == expected[idx]->matrix_data);
+      }
+      if (interval < hidden.size()) {
+        REQUIRE(checkpointed.activation_bytes() <
+                reference.activation_bytes());
+      } else {
+        REQUIRE(checkpointed.activation_bytes() <=
+                reference.activation_bytes());
+      }
+    }
+  }
+}
+
+TEST_CASE("LeakyReLU backward from a bit mask", "checkpoint") {
+  // not a multiple of 64 elements, with exact zeros
+  auto input = Mat2D<float>(7, 13, RANDOM_UNIFORM);
+  input(0, 0) = 0.0f;
+  input(6, 12) = 0.0f;
+  const auto gradients_output = Mat2D<float>(7, 13, RANDOM_UNIFORM);
+  const auto layer = LeakyRELUActivationLayer(0.1f);
+  Mat2D<float> output(0, 0);
+  PositiveMask mask;
+  layer.forward_into(input, output, mask);
+  REQUIRE(output.matrix_data == layer.forward(input).matrix_data);
+  REQUIRE(mask.bits.size() == 2);
+  for (size_t idx = 0; idx < input.matrix_data.size(); ++idx) {
+    REQUIRE(mask[idx] == (input.matrix_data[idx] > 0.0f));
+  }
+
+  Mat2D<float> expected(0, 0);
+  auto reference = LeakyRELUActivationLayer(0.1f);
+  reference.compute_gradients_into(input, gradients_output, expected);
+  Mat2D<float> actual(0, 0);
+  layer.compute_gradients_from_mask_into(mask, gradients_output, actual);
+  REQUIRE(actual.matrix_data == expected.matrix_data);
+  REQUIRE_THROWS(layer.compute_gradients_from_mask_into(
+      mask, Mat2D<float>(13, 7), actual));
+}
+TEST_CASE("Micro-batches accumulate the gradients of the whole batch",
+          "micro_batch") {
+  // 30 rows do not split evenly into micro-batches of 8
+  const auto input = Mat2D<float>(30, 20, RANDOM_UNIFORM);
+  auto target = Mat2D<float>(30, 4);
+  auto target_classes = Mat2D<int32_t>(30, 1);
+  for (size_t row = 0; row < 30; ++row) {
+    target(row, row % 4) = 1.0f;
+    target_classes(row, 0) = static_cast<int32_t>(row % 4);
+  }
+  const auto cross_entropy = SoftmaxCrossEntropyWithLogitsLoss();
+  const auto mse = MSELoss();
+  // the mean (cross entropy) and the sum (mse) over the batch, both labels
+  const std::vector<std::pair<const Loss*, bool>> cases = {
+      {&cross_entropy, true}, {&cross_entropy, false}, {&mse, false}};
+  for (const auto& [loss_obj, classes] : cases) {
+    for (const size_t micro_batch_size : {1, 8, 15, 30, 64}) {
+      INFO("Micro-batch size: " << micro_batch_size);
+      // both start from the same (default seeded) weights
+      auto reference = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+      auto micro_batched = MLP({16, 8}, 20, 4, RANDOM_UNIFORM, ZEROS, 1);
+      micro_batched.set_micro_batch_size(micro_batch_size);
+      SGDOptimizer reference_optimizer(0.05f, 0.9f);
+      SGDOptimizer micro_batched_optimizer(0.05f, 0.9f);
+      for (size_t step = 0; step < 3; ++step) {
+        const auto train = [&](MLP& mlp, Optimizer& optimizer) {
+          return classes
+                     ? mlp.train(input, target_classes, *loss_obj, optimizer)
+                     : mlp.train(input, target, *loss_obj, optimizer);
+        };
+        const float loss = train(reference, reference_optimizer);
+        REQUIRE(train(micro_batched, micro_batched_optimizer) ==
+                Approx(loss).epsilon(1e-5));
+      }
+      const auto expected = reference.trainable_variables();
+      const auto actual = micro_batched.trainable_variables();
+      for (size_t idx = 0; idx < expected.size(); ++idx) {
+        REQUIRE_THAT(actual[idx]->matrix_data,
+                     Catch::Approx(expected[idx]->matrix_data)
+                         .epsilon(1e-4)
+                         .margin(1e-6));
+      }
+      if (micro_batch_size < 15) {
+        REQUIRE(micro_batched.activation_bytes() <
+                reference.activation_bytes());
+      }
+    }
+  }
+}
+
 TEST_CASE("Reduce axis", "reduce_(max|sum)_axis") {
   // MAX
   const auto A = Mat2D<float>(
@@ -314,6 +1764,93 @@ TEST_CASE("SoftmaxCEWithLogitsGradient", "SoftmaxCEWithLogitsGradient") {
                Catch::Approx(dL_dz.matrix_data).epsilon(1.e-5));
 }
 
+TEST_CASE("Fused softmax cross entropy matches the two pass version",
+          "SoftmaxCEWithLogits") {
+  // 10 classes end in a partial vector on every ISA, 1000 take several
+  // full ones, and the logits are large enough to overflow a plain exp
+  const std::vector<std::array<size_t, 2>> shapes = {
+      {1, 1}, {5, 10}, {64, 10}, {3, 37}, {40, 1000}};
+  const auto cross_entropy = SoftmaxCrossEntropyWithLogitsLoss();
+  parallel::set_num_threads(4);
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    for (const auto& [batch, classes] : shapes) {
+      auto logits = Mat2D<float>(batch, classes, RANDOM_UNIFORM);
+      logits *= 200.0f;
+      auto labels = Mat2D<int32_t>(batch, 1);
+      for (size_t row = 0; row < batch; ++row) {
+        labels(row, 0) = static_cast<int32_t>((row * 7) % classes);
+      }
+      const auto labels_one_hot = one_hot(labels, classes);
+
+      // softmax, then log and the mean over the batch
+      const auto probs = softmax(logits);
+      std::vector<float> expected_loss(batch);
+      auto expected_grad = Mat2D<float>(batch, classes);
+      for (size_t row = 0; row < batch; ++row) {
+        double log_sum = 0.0;
+        const double row_max = logits.reduce_max_axis(1)(row, 0);
+        for (size_t col = 0; col < classes; ++col) {
+          log_sum += std::exp(static_cast<double>(logits(row, col)) - row_max);
+        }
+        log_sum = row_max + std::log(log_sum);
+        expected_loss[row] =
+            static_cast<float>(log_sum - logits(row, labels(row, 0)));
+        for (size_t col = 0; col < classes; ++col) {
+          expected_grad(row, col) =
+              (probs(row, col) - labels_one_hot(row, col)) /
+              static_cast<float>(batch);
+        }
+      }
+
+      Mat2D<float> loss(0, 0);
+      Mat2D<float> grad(0, 0);
+      cross_entropy.loss_and_grad_into(logits, labels_one_hot, loss, grad);
+      REQUIRE_THAT(loss.matrix_data,
+                   Catch::Approx(expected_loss).epsilon(1.e-5).margin(1.e-4));
+      REQUIRE_THAT(grad.matrix_data,
+                   Catch::Approx(expected_grad.matrix_data).margin(1.e-6));
+      REQUIRE(cross_entropy.loss(logits, labels_one_hot).matrix_data ==
+              loss.matrix_data);
+      REQUIRE(cross_entropy.loss_grad(logits, labels_one_hot).matrix_data ==
+              grad.matrix_data);
+
+      Mat2D<float> class_loss(0, 0);
+      Mat2D<float> class_grad(0, 0);
+      cross_entropy.loss_and_grad_into(logits, labels, class_loss,
+                                       class_grad);
+      REQUIRE_THAT(class_loss.matrix_data,
+                   Catch::Approx(loss.matrix_data).margin(1.e-4));
+      REQUIRE_THAT(class_grad.matrix_data,
+                   Catch::Approx(grad.matrix_data).margin(1.e-7));
+      // mse reads the classes in place, the same as their one hot rows
+      const auto mse = MSELoss();
+      mse.loss_and_grad_into(logits, labels, class_loss, class_grad);
+      REQUIRE(class_grad.matrix_data ==
+              mse.loss_grad(logits, labels_one_hot).matrix_data);
+      REQUIRE(class_loss.matrix_data ==
+              mse.loss(logits, labels_one_hot).matrix_data);
+    }
+  }
+  cpu::reset_isa();
+  parallel::set_num_threads(1);
+
+  const auto logits = Mat2D<float>(2, 3, RANDOM_UNIFORM);
+  Mat2D<float> loss(0, 0);
+  Mat2D<float> grad(0, 0);
+  REQUIRE_THROWS(cross_entropy.loss_and_grad_into(
+      logits, Mat2D<int32_t>(2, 1, std::vector<int32_t>{0, 3}), loss, grad));
+  REQUIRE_THROWS(cross_entropy.loss_and_grad_into(
+      logits, Mat2D<int32_t>(2, 1, std::vector<int32_t>{-1, 0}), loss, grad));
+  REQUIRE_THROWS(cross_entropy.loss_and_grad_into(
+      logits, Mat2D<int32_t>(3, 1), loss, grad));
+}
+
 TEST_CASE("LeakyReluGradient", "LeakyReluGradient") {
   LeakyRELUActivationLayer lrelu(0.1f);
   const auto activations = Mat2D<float>(
@@ -341,9 +1878,378 @@ TEST_CASE("LeakyReluGradient", "LeakyReluGradient") {
                Catch::Approx(gradients_exp.matrix_data).epsilon(1.e-5));
 }
 
+TEST_CASE("Fused dense layer matches dense and activation layers", "fused") {
+  // 300 inputs take two k-blocks of the GEMM, 70 neurons end in a partial
+  // tile and the 20 x 600 output is split over columns between threads. A
+  // batch of one runs on the GEMV kernel.
+  const std::vector<std::array<size_t, 3>> shapes = {
+      {3, 4, 2}, {1, 300, 70}, {5, 300, 70}, {20, 300, 600}};
+  parallel::set_num_threads(4);
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+    for (const auto& [batch, inputs, neurons] : shapes) {
+      const auto input = Mat2D<float>(batch, inputs, RANDOM_UNIFORM);
+      const auto grad_output = Mat2D<float>(batch, neurons, RANDOM_UNIFORM);
+      for (const auto activation :
+           {simd::Activation::LEAKY_RELU, simd::Activation::SIGMOID}) {
+        FusedDenseLayer fused(inputs, neurons, activation, 0.1f,
+                              RANDOM_UNIFORM, RANDOM_UNIFORM);
+        DenseLayer dense = fused;
+        std::unique_ptr<Layer> separate_activation;
+        if (activation == simd::Activation::LEAKY_RELU) {
+          separate_activation =
+              std::make_unique<LeakyRELUActivationLayer>(0.1f);
+        } else {
+          separate_activation = std::make_unique<SigmoidActivationLayer>();
+        }
+
+        const auto pre_activation = dense.forward(input);
+        const auto expected = separate_activation->forward(pre_activation);
+        const auto output = fused.forward(input);
+        REQUIRE_THAT(output.matrix_data,
+                     Catch::Approx(expected.matrix_data).margin(1.e-4));
+
+        const auto expected_grad_input = dense.compute_gradients(
+            input, separate_activation->compute_gradients(pre_activation,
+                                                          grad_output));
+        Mat2D<float> grad_input(0, 0);
+        fused.compute_gradients_with_output_into(input, output, grad_output,
+                                                 grad_input);
+        REQUIRE_THAT(grad_input.matrix_data,
+                     Catch::Approx(expected_grad_input.matrix_data)
+                         .margin(1.e-4));
+        REQUIRE_THAT(fused.grad_weights.matrix_data,
+                     Catch::Approx(dense.grad_weights.matrix_data)
+                         .margin(1.e-4));
+        REQUIRE_THAT(fused.grad_biases.matrix_data,
+                     Catch::Approx(dense.grad_biases.matrix_data)
+                         .margin(1.e-4));
+        // without the output at hand the forward pass runs again
+        REQUIRE_THAT(fused.compute_gradients(input, grad_output).matrix_data,
+                     Catch::Approx(expected_grad_input.matrix_data)
+                         .margin(1.e-4));
+      }
+    }
+  }
+  cpu::reset_isa();
+  parallel::set_num_threads(1);
+  REQUIRE_THROWS(FusedDenseLayer(4, 2, simd::Activation::LEAKY_RELU, -0.1f));
+}
+
 TEST_CASE("BiasInit", "BiasInit") {
   DenseLayer layer(10, 5);
   std::vector<float> zeros(5, 0.0);
 
   REQUIRE_THAT(layer.biases.matrix_data, Catch::Approx(zeros).epsilon(1.e-5));
-}
\ No newline at end of file
+}
+
+TEST_CASE("MNIST binary and IDX loaders", "mnist") {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string csv_path = (dir / "mlp_test_mnist.csv").string();
+  const std::string bin_path = (dir / "mlp_test_mnist.bin").string();
+  const std::string images_path = (dir / "mlp_test-images-idx3-ubyte").string();
+  const std::string labels_path = (dir / "mlp_test-labels-idx1-ubyte").string();
+
+  // 3 samples, pixel p of sample s is (s * 7 + p) % 256
+  const size_t num_samples = 3;
+  const uint8_t labels[num_samples] = {7, 0, 9};
+  std::vector<uint8_t> pixels(num_samples * 784);
+  for (size_t idx = 0; idx < pixels.size(); ++idx) {
+    pixels[idx] = static_cast<uint8_t>((idx / 784 * 7 + idx % 784) % 256);
+  }
+  {
+    std::ofstream csv(csv_path);
+    csv << "label";
+    for (size_t pixel = 0; pixel < 784; ++pixel) {
+      csv << ",pixel" << pixel;
+    }
+    for (size_t sample = 0; sample < num_samples; ++sample) {
+      csv << "\n" << static_cast<int>(labels[sample]);
+      for (size_t pixel = 0; pixel < 784; ++pixel) {
+        csv << "," << static_cast<int>(pixels[sample * 784 + pixel]);
+      }
+    }
+    csv << "\n";
+
+    const auto write_be = [](std::ofstream& out, uint32_t value) {
+      const char bytes[4] = {static_cast<char>(value >> 24),
+                             static_cast<char>(value >> 16),
+                             static_cast<char>(value >> 8),
+                             static_cast<char>(value)};
+      out.write(bytes, 4);
+    };
+    std::ofstream images(images_path, std::ios::binary);
+    for (const uint32_t value : {0x803u, 3u, 28u, 28u}) {
+      write_be(images, value);
+    }
+    images.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+    std::ofstream labels_file(labels_path, std::ios::binary);
+    write_be(labels_file, 0x801u);
+    write_be(labels_file, 3u);
+    labels_file.write(reinterpret_cast<const char*>(labels), num_samples);
+  }
+  write_mnist_binary(csv_path, bin_path);
+  REQUIRE(read_mnist(csv_path, 1, -1).size() == num_samples);
+  REQUIRE(leftover_temp_files(csv_path + ".bin") == 0);
+  // concurrent runs converting one csv each write their own temporary file
+  {
+    std::atomic<size_t> failures{0};
+    std::vector<std::thread> writers;
+    for (size_t writer = 0; writer < 4; ++writer) {
+      writers.emplace_back([&]() {
+        for (size_t run = 0; run < 5; ++run) {
+          try {
+            write_mnist_binary(csv_path, bin_path);
+          } catch (const std::runtime_error&) {
+            ++failures;
+          }
+        }
+      });
+    }
+    for (auto& writer : writers) {
+      writer.join();
+    }
+    REQUIRE(failures == 0);
+    REQUIRE(MnistDataset::open_binary(bin_path).label(2) == 9);
+    REQUIRE(leftover_temp_files(bin_path) == 0);
+  }
+  // a truncated cache, e.g. of an interrupted run, is written again
+  std::ofstream(csv_path + ".bin", std::ios::binary) << "MLPMNST2";
+  REQUIRE(open_mnist(csv_path).size() == num_samples);
+
+  for (const auto& dataset : {MnistDataset::open_binary(bin_path),
+                              MnistDataset::open_idx(images_path,
+                                                     labels_path)}) {
+    REQUIRE(dataset.size() == num_samples);
+    REQUIRE(dataset.image_size() == 784);
+    REQUIRE(dataset.label(2) == 9);
+    REQUIRE(dataset.image(1)[5] == pixels[784 + 5]);
+
+    auto images = Mat2D<float>(2, 784);
+    auto labels_one_hot = Mat2D<float>(2, 10);
+    const size_t order[2] = {2, 0};
+    dataset.fill_batch(order, 2, images, labels_one_hot);
+    for (size_t row = 0; row < 2; ++row) {
+      for (size_t pixel = 0; pixel < 784; ++pixel) {
+        REQUIRE(images(row, pixel) ==
+                Approx(pixels[order[row] * 784 + pixel] / 256.0 - 0.5));
+      }
+      for (size_t label = 0; label < 10; ++label) {
+        REQUIRE(labels_one_hot(row, label) ==
+                (label == labels[order[row]] ? 1.0f : 0.0f));
+      }
+    }
+    REQUIRE_THROWS(dataset.fill_batch(2, 2, images, labels_one_hot));
+    REQUIRE(dataset.to_batches(2, -1).size() == 1);
+  }
+  REQUIRE(read_mnist(images_path, 1, 2).size() == 2);
+  REQUIRE_THROWS(MnistDataset::open_binary(csv_path));
+  // so is the cache of a changed csv, here one more sample
+  {
+    std::ofstream csv(csv_path, std::ios::app);
+    csv << static_cast<int>(labels[0]);
+    for (size_t pixel = 0; pixel < 784; ++pixel) {
+      csv << "," << static_cast<int>(pixels[pixel]);
+    }
+    csv << "\n";
+  }
+  REQUIRE(open_mnist(csv_path).size() == num_samples + 1);
+
+  // a csv in a read-only directory is kept in memory. Root may write there
+  // anyway, the directory in place of the cache stops the rename then.
+  const auto read_only_dir = dir / "mlp_test_read_only";
+  const std::string read_only_csv = (read_only_dir / "mnist.csv").string();
+  std::filesystem::create_directory(read_only_dir);
+  std::filesystem::copy_file(
+      csv_path, read_only_csv,
+      std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::create_directory(read_only_csv + ".bin");
+  std::filesystem::permissions(read_only_dir,
+                               std::filesystem::perms::owner_write,
+                               std::filesystem::perm_options::remove);
+  {
+    const auto dataset = open_mnist(read_only_csv);
+    REQUIRE(dataset.size() == num_samples + 1);
+    REQUIRE(dataset.label(3) == labels[0]);
+    REQUIRE(dataset.image(2)[5] == pixels[2 * 784 + 5]);
+    REQUIRE(read_mnist(read_only_csv, 2, -1).size() == 2);
+    REQUIRE(leftover_temp_files(read_only_csv + ".bin") == 0);
+  }
+  std::filesystem::permissions(read_only_dir,
+                               std::filesystem::perms::owner_write,
+                               std::filesystem::perm_options::add);
+  std::filesystem::remove_all(read_only_dir);
+
+  for (const auto& path : {csv_path, csv_path + ".bin", bin_path, images_path,
+                           labels_path}) {
+    std::remove(path.c_str());
+  }
+}
+
+TEST_CASE("MNIST csv parser", "mnist") {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string csv_path = (dir / "mlp_test_parser.csv").string();
+  const std::string bin_path = (dir / "mlp_test_parser.bin").string();
+  // runs of zeros between numbers of every length, the last pixel of sample
+  // s is s
+  const auto pixel_value = [](size_t sample, size_t pixel) -> int {
+    if (pixel == 783) {
+      return static_cast<int>(sample);
+    }
+    return pixel % 11 < 6 ? 0 : static_cast<int>((pixel * 37 + sample) % 256);
+  };
+  const auto write_csv = [&](const std::string& line_end,
+                             const std::string& corrupt_pixel) {
+    std::ofstream csv(csv_path, std::ios::binary);
+    csv << "label,pixels" << line_end << line_end;
+    for (size_t sample = 0; sample < 3; ++sample) {
+      csv << sample + 2;
+      for (size_t pixel = 0; pixel < 784; ++pixel) {
+        if (sample == 1 && pixel == 500 && !corrupt_pixel.empty()) {
+          csv << "," << corrupt_pixel;
+        } else {
+          csv << "," << pixel_value(sample, pixel);
+        }
+      }
+      // no line end after the last sample
+      csv << (sample < 2 ? line_end : "");
+    }
+  };
+
+  for (const std::string line_end : {"\n", "\r\n"}) {
+    write_csv(line_end, "");
+    write_mnist_binary(csv_path, bin_path);
+    const auto dataset = MnistDataset::open_binary(bin_path);
+    REQUIRE(dataset.size() == 3);
+    for (size_t sample = 0; sample < 3; ++sample) {
+      REQUIRE(dataset.label(sample) == sample + 2);
+      for (size_t pixel = 0; pixel < 784; ++pixel) {
+        REQUIRE(dataset.image(sample)[pixel] == pixel_value(sample, pixel));
+      }
+    }
+  }
+  for (const std::string corrupt_pixel : {"256", "1a", "", "1234", "-1"}) {
+    write_csv("\n", corrupt_pixel);
+    if (corrupt_pixel.empty()) {
+      // an extra column
+      std::ofstream(csv_path, std::ios::app) << ",";
+    }
+    REQUIRE_THROWS(write_mnist_binary(csv_path, bin_path));
+  }
+
+  std::remove(csv_path.c_str());
+  std::remove(bin_path.c_str());
+}
+
+TEST_CASE("CSV byte parser on every ISA", "simd") {
+  // lines long enough to cross the 64 byte blocks and the windows of them,
+  // line 20 column 150 is replaced by corrupt if it is given
+  constexpr size_t num_columns = 300;
+  constexpr size_t num_lines = 40;
+  std::vector<uint8_t> expected;
+  const auto make_text = [&](const char* corrupt) {
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> value(0, 255);
+    expected.clear();
+    std::string text = "label,pixels\n\n";
+    for (size_t line = 0; line < num_lines; ++line) {
+      for (size_t column = 0; column < num_columns; ++column) {
+        const int number = column % 3 == 0 ? 0 : value(gen);
+        expected.push_back(static_cast<uint8_t>(number));
+        text += column == 0 ? "" : ",";
+        text += line == 20 && column == 150 && corrupt != nullptr
+                    ? std::string(corrupt)
+                    : std::to_string(number);
+      }
+      text += line % 2 == 0 ? "\n" : "\r\n";
+    }
+    return text;
+  };
+  // rows as large as simd.h asks for
+  std::vector<uint8_t> rows;
+  size_t num_rows = 0;
+  const auto parse = [&](const std::string& text, size_t columns) {
+    rows.assign((text.size() / (2 * columns - 1) + 1) * columns, 0);
+    return simd::parse_csv_bytes(text.size(), text.data(), columns,
+                                 rows.data(), &num_rows);
+  };
+
+  for (const auto isa : {cpu::Isa::SCALAR, cpu::Isa::BASELINE,
+                         cpu::Isa::AVX2, cpu::Isa::AVX512}) {
+    if (!cpu::isa_supported(isa)) {
+      continue;
+    }
+    INFO("ISA: " << cpu::isa_name(isa));
+    cpu::force_isa(isa);
+
+    std::string text = make_text(nullptr);
+    REQUIRE(parse(text, num_columns));
+    REQUIRE(num_rows == num_lines);
+    REQUIRE(std::equal(expected.begin(), expected.end(), rows.begin()));
+    // without the last line break
+    text.resize(text.size() - 2);
+    REQUIRE(parse(text, num_columns));
+    REQUIRE(num_rows == num_lines);
+    REQUIRE(std::equal(expected.begin(), expected.end(), rows.begin()));
+    REQUIRE_FALSE(parse(text, num_columns + 1));
+    REQUIRE_FALSE(parse(text, num_columns - 1));
+
+    for (const char* corrupt :
+         {"256", "300", "1000", "0255", "1a", "", "1,2", " 1", "\xff"}) {
+      INFO("corrupt: " << corrupt);
+      REQUIRE_FALSE(parse(make_text(corrupt), num_columns));
+    }
+  }
+  cpu::reset_isa();
+}
+
+TEST_CASE("Data pipeline reshuffles every epoch", "mnist") {
+  const std::string path =
+      (std::filesystem::temp_directory_path() / "mlp_test_pipeline.csv")
+          .string();
+  {
+    // the first pixel holds the sample index
+    std::ofstream csv(path);
+    for (size_t sample = 0; sample < 50; ++sample) {
+      csv << sample % 10 << "," << sample;
+      for (size_t pixel = 1; pixel < 784; ++pixel) {
+        csv << ",0";
+      }
+      csv << "\n";
+    }
+  }
+  const auto dataset = open_mnist(path);
+  // samples 5 to 46 in batches of 4, two buffers
+  DataPipeline pipeline(dataset, 4, 2, 5, 42, /*seed=*/1);
+  REQUIRE(pipeline.batches_per_epoch() == 10);
+
+  std::vector<std::vector<size_t>> epochs;
+  for (size_t epoch = 0; epoch < 3; ++epoch) {
+    std::vector<size_t> samples;
+    while (const Batch* batch = pipeline.next()) {
+      for (size_t row = 0; row < 4; ++row) {
+        const auto sample = static_cast<size_t>(
+            std::lround((batch->images(row, 0) + 0.5f) * 256.0f));
+        REQUIRE(batch->labels(row, 0) == static_cast<int32_t>(sample % 10));
+        samples.push_back(sample);
+      }
+    }
+    REQUIRE(samples.size() == 40);
+    epochs.push_back(samples);
+    std::sort(samples.begin(), samples.end());
+    REQUIRE(std::adjacent_find(samples.begin(), samples.end()) ==
+            samples.end());
+    REQUIRE(samples.front() >= 5);
+    REQUIRE(samples.back() < 47);
+  }
+  REQUIRE(epochs[0] != epochs[1]);
+  REQUIRE(epochs[1] != epochs[2]);
+
+  std::remove(path.c_str());
+  std::remove((path + ".bin").c_str());
+}